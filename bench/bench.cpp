@@ -0,0 +1,516 @@
+/**
+ * @file bench.cpp
+ * @brief Benchmark for each phase of JIT compiling and calling a stub
+ *
+ * HOW IT WORKS:
+ * 1. For every message size, run each phase `count` times in isolation
+ * 2. Time every single run with a steady clock
+ * 3. Report p50 / p99 latency and operations per second per phase
+ *
+ * PHASES:
+ * - build:      build_machine_code() - emit into a new std::vector
+ * - emit:       emit_machine_code() into a preallocated buffer
+ * - mmap:       mmap + munmap of one page (the old per-function allocation)
+ * - allocate:   CodeArena::allocate() (the bump allocator)
+ * - mprotect:   flip one page from read/write to read/execute
+ * - copy:       copy finished machine code into a fresh mapping (includes
+ *               the first-touch page fault, as in the original main())
+ * - first_call: first call of freshly installed code
+ * - call:       steady-state call of the same stub
+ * - site_call:  the same call through a patchable call site (one more
+ *               direct jump, see call_site.hpp)
+ * - retarget:   pointing a call site at another stub
+ * - write_fn:   steady-state call of the one compiled write function, the
+ *               message passed as arguments instead of baked in
+ * - copy_fn:    steady-state call of a compiled copy of message_size bytes
+ *               (the vector moves of this CPU, see cpu_features.hpp)
+ * - counted:    same call, with an atomic call counter in the stub
+ * - timed:      same call, with call counter and tick timing
+ * - locked_mt:  `threads` threads compiling into one CodeArena behind a mutex
+ * - slab_mt:    `threads` threads compiling into their own ThreadArena
+ *               (for the *_mt phases ops/sec is the total over all threads)
+ * - submit:     JitService::submit() - what the request path pays
+ * - ready:      from submit() until the background compile is callable
+ *
+ * USAGE:
+ *   mijit_bench [--sizes=16,256,4096] [--count=10000] [--threads=4] [--json]
+ *
+ * Stubs print to stdout, so stdout is pointed at /dev/null while measuring
+ * and restored for the report. The table ends with the JIT statistics of
+ * the whole run (jit_stats.hpp).
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "call_site.hpp"
+#include "codegen.hpp"
+#include "compiler.hpp"
+#include "cpu_features.hpp"
+#include "jit_stats.hpp"
+#include "jit_function.hpp"
+#include "jit_memory.hpp"
+#include "jit_service.hpp"
+#include "slab_pool.hpp"
+#include "stub_profile.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  std::vector<size_t> sizes{16, 256, 4096};
+  size_t count = 10000;
+  size_t threads = 4;
+  bool json = false;
+};
+
+struct Result {
+  std::string_view phase;
+  size_t message_size = 0;
+  size_t count = 0;
+  double p50_ns = 0;
+  double p99_ns = 0;
+  double ops_per_sec = 0;
+};
+
+/**
+ * HELPER FUNCTION: Read command line options
+ */
+[[nodiscard]] auto parse_options(int argc, char** argv) -> Options
+{
+  auto options = Options{};
+  for (auto i = 1; i < argc; ++i) {
+    const auto arg = std::string_view{argv[i]};
+    if (arg == "--json") {
+      options.json = true;
+    }
+    else if (arg.starts_with("--count=")) {
+      options.count = std::stoul(std::string{arg.substr(8)});
+    }
+    else if (arg.starts_with("--threads=")) {
+      options.threads = std::stoul(std::string{arg.substr(10)});
+    }
+    else if (arg.starts_with("--sizes=")) {
+      options.sizes.clear();
+      auto list = arg.substr(8);
+      while (!list.empty()) {
+        const auto comma = list.find(',');
+        options.sizes.push_back(
+            std::stoul(std::string{list.substr(0, comma)}));
+        list = comma == std::string_view::npos ? std::string_view{}
+                                               : list.substr(comma + 1);
+      }
+    }
+    else {
+      throw std::runtime_error("Unknown option: " + std::string{arg});
+    }
+  }
+  if (options.count == 0 || options.threads == 0 || options.sizes.empty()) {
+    throw std::runtime_error(
+        "Need at least one size, and a count and threads above 0");
+  }
+  return options;
+}
+
+/**
+ * HELPER FUNCTION: Turn raw timings into one result line
+ */
+[[nodiscard]] auto summarize(std::string_view phase, size_t message_size,
+                             std::vector<int64_t>& samples) -> Result
+{
+  std::sort(samples.begin(), samples.end());
+  auto total = int64_t{0};
+  for (const auto sample : samples) {
+    total += sample;
+  }
+  const auto percentile = [&](double p) {
+    const auto index = static_cast<size_t>(p * (samples.size() - 1));
+    return static_cast<double>(samples[index]);
+  };
+  return Result{phase,
+                message_size,
+                samples.size(),
+                percentile(0.50),
+                percentile(0.99),
+                total > 0 ? samples.size() * 1e9 / total : 0.0};
+}
+
+/**
+ * HELPER FUNCTION: Time one operation
+ */
+template <typename Operation>
+[[nodiscard]] auto time_ns(Operation&& operation) -> int64_t
+{
+  const auto start = Clock::now();
+  operation();
+  const auto stop = Clock::now();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
+      .count();
+}
+
+/**
+ * HELPER FUNCTION: Map one fresh read/write page (not timed)
+ */
+[[nodiscard]] auto map_page(size_t size) -> uint8_t*
+{
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    throw std::runtime_error("Failed to allocate memory for machine code");
+  }
+  return static_cast<uint8_t*>(memory);
+}
+
+/**
+ * HELPER FUNCTION: Run compile(thread, samples) on every thread at once
+ *
+ * ops/sec is over the wall time of all threads together, so it shows how
+ * well compiling scales with more threads
+ */
+template <typename Compile>
+[[nodiscard]] auto time_threads(std::string_view phase, size_t message_size,
+                                size_t count, size_t threads,
+                                Compile&& compile) -> Result
+{
+  std::vector<std::vector<int64_t>> samples(threads,
+                                            std::vector<int64_t>(count));
+  std::vector<std::thread> workers;
+  const auto start = Clock::now();
+  for (size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] { compile(samples[t]); });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  const auto wall = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        Clock::now() - start)
+                        .count();
+
+  std::vector<int64_t> all;
+  for (const auto& thread_samples : samples) {
+    all.insert(all.end(), thread_samples.begin(), thread_samples.end());
+  }
+  auto result = summarize(phase, message_size, all);
+  result.ops_per_sec = wall > 0 ? all.size() * 1e9 / wall : 0.0;
+  return result;
+}
+
+/**
+ * Compile from several threads: one shared arena with a mutex versus one
+ * ThreadArena per thread
+ */
+auto run_threaded_phases(size_t message_size, size_t count, size_t threads,
+                         std::vector<Result>& out) -> void
+{
+  const auto hello_name = "Hello, " + std::string(message_size, 'x') + "!\n";
+  const auto bound = mijit::machine_code_size_bound(hello_name);
+  const auto capacity = threads * count * (bound + mijit::kStubAlignment) +
+                        threads * mijit::SlabPool::kDefaultSlabSize * 2;
+
+  {
+    mijit::CodeArena arena{capacity, mijit::SlabPool::kDefaultBackend};
+    std::mutex lock;
+    out.push_back(time_threads(
+        "locked_mt", message_size, count, threads, [&](auto& samples) {
+          for (auto& sample : samples) {
+            sample = time_ns([&] {
+              const auto guard = std::lock_guard{lock};
+              const auto slot = mijit::compile_stub(arena, hello_name);
+              asm volatile("" : : "r"(slot.executable) : "memory");
+            });
+          }
+        }));
+  }
+
+  {
+    mijit::SlabPool pool{capacity};
+    out.push_back(time_threads(
+        "slab_mt", message_size, count, threads, [&](auto& samples) {
+          mijit::ThreadArena arena{pool};
+          for (auto& sample : samples) {
+            sample = time_ns([&] {
+              const auto slot = mijit::compile_stub(arena, hello_name);
+              asm volatile("" : : "r"(slot.executable) : "memory");
+            });
+          }
+          arena.publish();
+        }));
+  }
+}
+
+/**
+ * Run every phase for one message size
+ */
+auto run_phases(size_t message_size, size_t count, std::vector<Result>& out)
+    -> void
+{
+  const auto hello_name = "Hello, " + std::string(message_size, 'x') + "!\n";
+  const auto bound = mijit::machine_code_size_bound(hello_name);
+  const auto page_size = mijit::estimate_memory_size(bound);
+  std::vector<int64_t> samples(count);
+
+  // build: the vector-based path
+  for (auto& sample : samples) {
+    sample = time_ns([&] {
+      const auto code = mijit::build_machine_code(hello_name);
+      asm volatile("" : : "r"(code.data()) : "memory");
+    });
+  }
+  out.push_back(summarize("build", message_size, samples));
+
+  // emit: the in-place path
+  std::vector<uint8_t> buffer(bound);
+  for (auto& sample : samples) {
+    sample = time_ns([&] {
+      const auto size = mijit::emit_machine_code(buffer, hello_name);
+      asm volatile("" : : "r"(size), "r"(buffer.data()) : "memory");
+    });
+  }
+  out.push_back(summarize("emit", message_size, samples));
+
+  // mmap: one mapping per function, like the original main()
+  for (auto& sample : samples) {
+    sample = time_ns([&] { munmap(map_page(page_size), page_size); });
+  }
+  out.push_back(summarize("mmap", message_size, samples));
+
+  // allocate: bump allocation from the arena
+  {
+    mijit::CodeArena arena{count * (bound + mijit::kStubAlignment)};
+    for (auto& sample : samples) {
+      sample = time_ns([&] {
+        const auto slot = arena.allocate(bound, mijit::kStubAlignment);
+        asm volatile("" : : "r"(slot.writable.data()) : "memory");
+      });
+    }
+  }
+  out.push_back(summarize("allocate", message_size, samples));
+
+  // mprotect and copy: measured on fresh pages
+  const auto code = mijit::build_machine_code(hello_name);
+  std::vector<int64_t> copy_samples(count);
+  for (size_t i = 0; i < count; ++i) {
+    auto* page = map_page(page_size);
+    copy_samples[i] =
+        time_ns([&] { std::memcpy(page, code.data(), code.size()); });
+    samples[i] = time_ns([&] {
+      if (mprotect(page, page_size, PROT_READ | PROT_EXEC) == -1) {
+        throw std::runtime_error("Failed to make memory executable");
+      }
+    });
+    munmap(page, page_size);
+  }
+  out.push_back(summarize("mprotect", message_size, samples));
+  out.push_back(summarize("copy", message_size, copy_samples));
+
+  // first_call: every stub is called once, right after it is installed
+  {
+    mijit::CodeArena arena{count * (bound + mijit::kStubAlignment),
+                           mijit::ArenaBackend::kDualMapped};
+    for (auto& sample : samples) {
+      const auto slot = mijit::compile_stub(arena, hello_name);
+      arena.publish();
+      const auto function = mijit::as_function(slot.executable);
+      sample = time_ns([&] { function(); });
+    }
+  }
+  out.push_back(summarize("first_call", message_size, samples));
+
+  // call: the same stub over and over
+  {
+    mijit::CodeArena arena;
+    const auto slot = mijit::compile_stub(arena, hello_name);
+    arena.publish();
+    const auto function = mijit::as_function(slot.executable);
+    function(); // Warm up
+    for (auto& sample : samples) {
+      sample = time_ns([&] { function(); });
+    }
+  }
+  out.push_back(summarize("call", message_size, samples));
+
+  // site_call and retarget: through a trampoline slot
+  {
+    mijit::CodeArena arena{mijit::CodeArena::kDefaultCapacity,
+                           mijit::ArenaBackend::kDualMapped};
+    const auto first = mijit::compile_stub(arena, hello_name);
+    const auto second = mijit::compile_stub(arena, hello_name);
+    arena.publish();
+    mijit::TrampolineTable table{1};
+    auto site = table.add(first.executable);
+    const auto function = site.as<mijit::StubFunction>();
+    function(); // Warm up
+    for (auto& sample : samples) {
+      sample = time_ns([&] { function(); });
+    }
+    out.push_back(summarize("site_call", message_size, samples));
+
+    for (size_t i = 0; i < samples.size(); ++i) {
+      const auto* target = (i % 2 == 0 ? second : first).executable;
+      samples[i] = time_ns([&] { site.retarget(target); });
+    }
+    out.push_back(summarize("retarget", message_size, samples));
+  }
+
+  // write_fn: no per-message code at all
+  {
+    mijit::CodeArena arena;
+    const auto write = mijit::compile_write_function(arena);
+    arena.publish();
+    write(hello_name.data(), hello_name.size(), 1); // Warm up
+    for (auto& sample : samples) {
+      sample = time_ns(
+          [&] { write(hello_name.data(), hello_name.size(), 1); });
+    }
+  }
+  out.push_back(summarize("write_fn", message_size, samples));
+
+  // copy_fn: generated vector copy of the message into a buffer
+  if (message_size <= mijit::ir::kMaxCopySize) {
+    mijit::CodeArena arena;
+    const auto copy = mijit::compile_copy_function(
+        arena, static_cast<uint32_t>(message_size));
+    arena.publish();
+    auto destination = std::string(message_size, '\0');
+    copy(destination.data(), hello_name.data()); // Warm up
+    for (auto& sample : samples) {
+      sample = time_ns([&] { copy(destination.data(), hello_name.data()); });
+    }
+    out.push_back(summarize("copy_fn", message_size, samples));
+  }
+
+  // counted and timed: the same stub, instrumented
+  {
+    mijit::StubProfile profile{2};
+    auto counted = mijit::CodegenOptions{};
+    counted.counters = &profile.at(0);
+    auto timed = mijit::CodegenOptions{};
+    timed.counters = &profile.at(1);
+    timed.time_calls = true;
+    mijit::CodeArena arena;
+    const auto counted_slot = mijit::compile_stub(arena, hello_name, counted);
+    const auto timed_slot = mijit::compile_stub(arena, hello_name, timed);
+    arena.publish();
+    for (const auto& [phase, slot] :
+         {std::pair{"counted", counted_slot},
+          std::pair{"timed", timed_slot}}) {
+      const auto function = mijit::as_function(slot.executable);
+      function(); // Warm up
+      for (auto& sample : samples) {
+        sample = time_ns([&] { function(); });
+      }
+      out.push_back(summarize(phase, message_size, samples));
+    }
+  }
+
+  // submit and ready: background compilation by a JitService
+  {
+    mijit::JitService service{1};
+    std::vector<int64_t> ready_samples(count);
+    for (size_t i = 0; i < count; ++i) {
+      std::shared_future<mijit::StubFunction> stub;
+      const auto start = Clock::now();
+      samples[i] = time_ns([&] { stub = service.submit(hello_name); });
+      stub.wait();
+      ready_samples[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             Clock::now() - start)
+                             .count();
+    }
+    out.push_back(summarize("submit", message_size, samples));
+    out.push_back(summarize("ready", message_size, ready_samples));
+  }
+}
+
+/**
+ * HELPER FUNCTION: Print the results as a table or as JSON
+ */
+auto report(const std::vector<Result>& results, bool json) -> void
+{
+  if (json) {
+    std::cout << "{\"platform\": \"" << mijit::platform_name()
+              << "\", \"cpu\": \""
+              << mijit::describe_cpu_features(mijit::host_cpu_features())
+              << "\", \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+      const auto& r = results[i];
+      std::cout << (i == 0 ? "" : ",") << "\n  {\"phase\": \"" << r.phase
+                << "\", \"message_size\": " << r.message_size
+                << ", \"count\": " << r.count << ", \"p50_ns\": " << r.p50_ns
+                << ", \"p99_ns\": " << r.p99_ns
+                << ", \"ops_per_sec\": " << r.ops_per_sec << "}";
+    }
+    std::cout << "\n]}\n";
+    return;
+  }
+
+  std::cout << "Platform: " << mijit::platform_name() << "\n";
+  std::cout << "CPU features: "
+            << mijit::describe_cpu_features(mijit::host_cpu_features())
+            << "\n\n";
+  std::cout << "phase        size     count      p50 ns      p99 ns"
+               "     ops/sec\n";
+  for (const auto& r : results) {
+    std::cout.width(10);
+    std::cout << std::left << r.phase << std::right;
+    std::cout.width(7);
+    std::cout << r.message_size;
+    std::cout.width(10);
+    std::cout << r.count;
+    std::cout.width(12);
+    std::cout << r.p50_ns;
+    std::cout.width(12);
+    std::cout << r.p99_ns;
+    std::cout.width(12);
+    std::cout << static_cast<uint64_t>(r.ops_per_sec) << '\n';
+  }
+  std::cout << '\n' << mijit::describe_jit_stats(mijit::jit_stats());
+}
+
+} // namespace
+
+auto main(int argc, char** argv) -> int
+{
+  try {
+    const auto options = parse_options(argc, argv);
+
+    // Send what the stubs print to /dev/null while measuring
+    std::cout.flush();
+    const auto saved_stdout = dup(STDOUT_FILENO);
+    const auto null_fd = open("/dev/null", O_WRONLY);
+    if (saved_stdout == -1 || null_fd == -1) {
+      throw std::runtime_error("Failed to redirect stdout");
+    }
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    std::vector<Result> results;
+    for (const auto size : options.sizes) {
+      run_phases(size, options.count, results);
+      run_threaded_phases(size, options.count, options.threads, results);
+    }
+
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    report(results, options.json);
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << '\n';
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
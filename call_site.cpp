@@ -0,0 +1,154 @@
+/**
+ * @file call_site.cpp
+ * @brief Trampoline slots and the branch encodings that retarget them
+ */
+
+#include "call_site.hpp"
+
+#if defined(__APPLE__) && defined(__aarch64__)
+#include <pthread.h>
+#endif
+
+#include <cstring>
+#include <stdexcept>
+
+namespace mijit {
+
+namespace {
+
+constexpr size_t kTargetOffset = 16; // The 8-byte target pointer
+
+#if defined(__x86_64__)
+using BranchWord = uint64_t;          // jmp rel32 and 3 bytes of int3
+constexpr size_t kFarOffset = 8;      // jmp [rip + disp32]
+constexpr uint64_t kPadding = uint64_t{0xCCCCCC} << 40;
+
+/**
+ * HELPER FUNCTION: The first 8 bytes of a slot at from going to to
+ */
+[[nodiscard]] auto branch_word(const uint8_t* from, uintptr_t to) noexcept
+    -> BranchWord
+{
+  const auto next = reinterpret_cast<uintptr_t>(from) + 5;
+  const auto delta = static_cast<int64_t>(to - next);
+  const auto direct = delta >= INT32_MIN && delta <= INT32_MAX;
+  const auto rel =
+      direct ? static_cast<uint32_t>(delta) : uint32_t{kFarOffset - 5};
+  return 0xE9 | (uint64_t{rel} << 8) | kPadding;
+}
+
+/**
+ * HELPER FUNCTION: The instructions after the first word (fixed forever)
+ */
+auto write_fixed_part(uint8_t* slot) noexcept -> void
+{
+  // jmp [rip + 2]: rip is +14 after it, the pointer is at +16
+  constexpr uint8_t kFarJump[] = {0xFF, 0x25, 0x02, 0x00, 0x00, 0x00};
+  std::memset(slot, 0xCC, TrampolineTable::kSlotSize);
+  std::memcpy(slot + kFarOffset, kFarJump, sizeof(kFarJump));
+}
+#elif defined(__aarch64__)
+using BranchWord = uint32_t;          // b imm26
+constexpr size_t kFarOffset = 4;      // ldr x16, [pc + 12]; br x16
+constexpr uint32_t kBranch = 0x14000000;
+
+[[nodiscard]] auto branch_word(const uint8_t* from, uintptr_t to) noexcept
+    -> BranchWord
+{
+  const auto delta =
+      static_cast<int64_t>(to - reinterpret_cast<uintptr_t>(from));
+  const auto direct =
+      (delta & 3) == 0 && delta >= -(int64_t{1} << 27) &&
+      delta < (int64_t{1} << 27);
+  const auto words = direct ? static_cast<uint32_t>(delta >> 2)
+                            : static_cast<uint32_t>(kFarOffset >> 2);
+  return kBranch | (words & 0x03FFFFFF);
+}
+
+auto write_fixed_part(uint8_t* slot) noexcept -> void
+{
+  constexpr uint32_t kLoadTarget = 0x58000070; // ldr x16, [pc + 12]
+  constexpr uint32_t kBranchX16 = 0xD61F0200;  // br x16
+  constexpr uint32_t kTrap = 0xD4200000;       // brk #0
+  const uint32_t words[] = {kTrap, kLoadTarget, kBranchX16, kTrap};
+  std::memset(slot, 0, TrampolineTable::kSlotSize);
+  std::memcpy(slot, words, sizeof(words));
+}
+#endif
+
+[[nodiscard]] auto word_at(uint8_t* slot) noexcept
+    -> std::atomic_ref<BranchWord>
+{
+  return std::atomic_ref<BranchWord>{*reinterpret_cast<BranchWord*>(slot)};
+}
+
+[[nodiscard]] auto target_at(uint8_t* slot) noexcept
+    -> std::atomic_ref<uint64_t>
+{
+  return std::atomic_ref<uint64_t>{
+      *reinterpret_cast<uint64_t*>(slot + kTargetOffset)};
+}
+
+} // namespace
+
+/**
+ * STEP BY STEP:
+ * 1. The pointer first, so a thread that still takes the far path (or
+ *    switches to it now) finds the new target
+ * 2. The branch, with a release store
+ * 3. Flush the slot, so other cores fetch the new branch
+ */
+auto CallSite::retarget(const void* target) noexcept -> void
+{
+  const auto address = reinterpret_cast<uintptr_t>(target);
+#if defined(__APPLE__) && defined(__aarch64__)
+  pthread_jit_write_protect_np(0); // MAP_JIT pages writable for this thread
+#endif
+  target_at(writable_).store(address, std::memory_order_relaxed);
+  word_at(writable_).store(branch_word(executable_, address),
+                           std::memory_order_release);
+#if defined(__APPLE__) && defined(__aarch64__)
+  pthread_jit_write_protect_np(1); // Back to executable for this thread
+#endif
+  flush_instruction_cache(writable_, executable_, TrampolineTable::kSlotSize);
+}
+
+[[nodiscard]] auto CallSite::target() const noexcept -> const void*
+{
+  return reinterpret_cast<const void*>(
+      target_at(writable_).load(std::memory_order_relaxed));
+}
+
+[[nodiscard]] auto CallSite::is_direct() const noexcept -> bool
+{
+  const auto far = branch_word(executable_,
+                               reinterpret_cast<uintptr_t>(executable_) +
+                                   kFarOffset);
+  return word_at(writable_).load(std::memory_order_relaxed) != far;
+}
+
+TrampolineTable::TrampolineTable(size_t slots)
+    : arena_{slots * kSlotSize, ArenaBackend::kDualMapped},
+      capacity_{arena_.capacity() / kSlotSize}
+{
+}
+
+[[nodiscard]] auto TrampolineTable::add(const void* target) -> CallSite
+{
+  const std::lock_guard lock{mutex_};
+  if (size_.load(std::memory_order_relaxed) == capacity_) {
+    throw std::runtime_error("Trampoline table is full");
+  }
+  auto slot = arena_.allocate(kSlotSize, kSlotSize);
+  write_fixed_part(slot.writable.data());
+  auto site = CallSite{slot.writable.data(), slot.executable};
+  const auto address = reinterpret_cast<uintptr_t>(target);
+  target_at(site.writable_).store(address, std::memory_order_relaxed);
+  word_at(site.writable_).store(branch_word(site.executable_, address),
+                                std::memory_order_relaxed);
+  arena_.publish();
+  size_.fetch_add(1, std::memory_order_relaxed);
+  return site;
+}
+
+} // namespace mijit
@@ -0,0 +1,155 @@
+/**
+ * @file call_site.hpp
+ * @brief Call sites that can be pointed at new code with one store
+ *
+ * HOW IT WORKS:
+ * 1. A TrampolineTable is a dual-mapped region of 32-byte slots; add()
+ *    gives out one slot, a CallSite, going to a target
+ * 2. Callers call (or JIT code jumps to) the slot's executable address,
+ *    which never changes; the first instruction of the slot is a direct
+ *    branch to the target
+ * 3. retarget() rewrites that branch: one aligned atomic store through the
+ *    writable view, then an instruction cache flush of the slot
+ *
+ * THE SLOT (x86-64 / AArch64):
+ *   +0   jmp rel32, padded to 8 bytes   b imm26
+ *   +4                                   ldr x16, +16
+ *   +8   jmp [rip + (+16)]               br x16
+ *   +16  the target, 8 bytes             the target, 8 bytes
+ * Only +0 and +16 ever change. A target out of reach of the direct branch
+ * (2 GiB / 128 MiB) is reached through the pointer: the branch at +0 then
+ * goes to +8 (x86-64) or +4 (AArch64).
+ *
+ * WHY WE NEED THIS:
+ * - Calling through a function pointer that can change (an EntryPoint, or
+ *   the func variable in main()) is a load and an indirect branch on every
+ *   call, plus an ISB on AArch64 whenever new code was published
+ * - A call site is a direct branch: predicted like any other, and callers
+ *   keep one address forever while tiering, cache eviction or
+ *   recompilation move the code behind it
+ *
+ * NOTES:
+ * - Changing the branch at +0 is safe while other threads run through it:
+ *   an aligned 8-byte store on x86-64, and on AArch64 a B replaced by
+ *   another B, which the architecture allows without stopping anybody
+ * - A thread may still reach the old target for a moment after retarget()
+ *   returns: old code must stay valid until no thread can be in it (a
+ *   bump arena never frees; with a CodeHeap, retire it through the epochs)
+ * - One thread at a time should retarget a given site
+ * - The slot does not touch the stack or any register the callee reads
+ *   (AArch64 uses x16, the register veneers are allowed to clobber), so
+ *   calling a site is the same as calling its target
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include "jit_memory.hpp"
+
+namespace mijit {
+
+class TrampolineTable;
+
+/**
+ * One slot of a TrampolineTable (a handle: copies refer to the same slot,
+ * and it is valid as long as the table)
+ */
+class CallSite {
+public:
+  CallSite() = default;
+
+  /**
+   * The address to call - the same for the whole life of the site
+   */
+  [[nodiscard]] auto entry() const noexcept -> const uint8_t*
+  {
+    return executable_;
+  }
+
+  /**
+   * The entry as a function pointer of the target's type
+   */
+  template <typename Function>
+  [[nodiscard]] auto as() const noexcept -> Function
+  {
+    return reinterpret_cast<Function>(executable_);
+  }
+
+  [[nodiscard]] auto valid() const noexcept -> bool
+  {
+    return executable_ != nullptr;
+  }
+
+  /**
+   * Send every later call to target (one atomic store and a flush of this
+   * slot; no system call, no lock)
+   */
+  auto retarget(const void* target) noexcept -> void;
+
+  /**
+   * Where calls go now
+   */
+  [[nodiscard]] auto target() const noexcept -> const void*;
+
+  /**
+   * True when the slot branches straight to its target, false when the
+   * target is out of reach and goes through the pointer
+   */
+  [[nodiscard]] auto is_direct() const noexcept -> bool;
+
+private:
+  friend class TrampolineTable;
+
+  CallSite(uint8_t* writable, const uint8_t* executable) noexcept
+      : writable_{writable}, executable_{executable}
+  {
+  }
+
+  uint8_t* writable_ = nullptr;
+  const uint8_t* executable_ = nullptr;
+};
+
+class TrampolineTable {
+public:
+  static constexpr size_t kSlotSize = 32;
+  static constexpr size_t kDefaultSlots = 1024;
+
+  /**
+   * Reserve room for slots call sites (needs the dual-mapped backend, the
+   * slots stay executable while they are rewritten)
+   */
+  explicit TrampolineTable(size_t slots = kDefaultSlots);
+
+  TrampolineTable(const TrampolineTable&) = delete;
+  auto operator=(const TrampolineTable&) -> TrampolineTable& = delete;
+
+  /**
+   * A new call site going to target (thread-safe; throws when the table is
+   * full)
+   */
+  [[nodiscard]] auto add(const void* target) -> CallSite;
+
+  /**
+   * Call sites handed out so far
+   */
+  [[nodiscard]] auto size() const noexcept -> size_t
+  {
+    return size_.load(std::memory_order_relaxed);
+  }
+  [[nodiscard]] auto capacity() const noexcept -> size_t
+  {
+    return capacity_;
+  }
+
+private:
+  std::mutex mutex_; // Guards arena_ and size_ (add() only)
+  CodeArena arena_;
+  size_t capacity_;
+  std::atomic<size_t> size_{0};
+};
+
+} // namespace mijit
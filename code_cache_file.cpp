@@ -0,0 +1,431 @@
+/**
+ * @file code_cache_file.cpp
+ * @brief Writing, mapping and checking persistent code cache files
+ */
+
+#include "code_cache_file.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "codegen.hpp"
+#include "compiler.hpp"
+#include "jit_memory.hpp"
+#include "jit_stats.hpp"
+#include "stub_cache.hpp"
+
+namespace mijit {
+
+namespace {
+
+constexpr char kMagic[8] = {'M', 'I', 'J', 'I', 'T', 'C', 'C', '\0'};
+
+[[nodiscard]] constexpr auto align_up(size_t value, size_t alignment) noexcept
+    -> size_t
+{
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+/**
+ * HELPER FUNCTION: FNV-1a over a block of bytes (continues from hash)
+ */
+[[nodiscard]] auto fnv1a(const uint8_t* bytes, size_t size,
+                         uint64_t hash = 14695981039346656037ULL) noexcept
+    -> uint64_t
+{
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * HELPER FUNCTION: Where a RIP/PC-relative reference in code points to
+ */
+[[nodiscard]] auto relocation_target(const uint8_t* code,
+                                     const CodeCacheRelocation& relocation)
+    -> int64_t
+{
+  uint32_t field = 0;
+  std::memcpy(&field, code + relocation.position, sizeof(field));
+  switch (static_cast<EmitterBase::FixupKind>(relocation.kind)) {
+  case EmitterBase::FixupKind::kRel32:
+    // Displacement counts from the end of the 4-byte field
+    return int64_t{relocation.position} + 4 + static_cast<int32_t>(field);
+  case EmitterBase::FixupKind::kAdr21: {
+    // adr: immlo in bits 29-30, immhi in bits 5-23, 21-bit signed
+    const auto imm = ((field >> 5) & 0x7FFFF) << 2 | ((field >> 29) & 3);
+    const auto offset = static_cast<int32_t>(imm << 11) >> 11;
+    return int64_t{relocation.position} + offset;
+  }
+  case EmitterBase::FixupKind::kLdr19: {
+    // ldr (literal): word offset in bits 5-23, 19-bit signed
+    const auto imm = (field >> 5) & 0x7FFFF;
+    const auto offset = static_cast<int32_t>(imm << 13) >> 11;
+    return int64_t{relocation.position} + offset;
+  }
+  case EmitterBase::FixupKind::kBranch26: {
+    // b: word offset in bits 0-25, 26-bit signed
+    const auto offset = static_cast<int32_t>(field << 6) >> 4;
+    return int64_t{relocation.position} + offset;
+  }
+  }
+  throw std::runtime_error("Code cache has an unknown relocation kind");
+}
+
+/**
+ * HELPER FUNCTION: write(2) all of data (retrying short writes)
+ */
+auto write_all(int fd, const void* data, size_t size) -> void
+{
+  const auto* bytes = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    const auto written = ::write(fd, bytes, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Failed to write the code cache file");
+    }
+    bytes += written;
+    size -= static_cast<size_t>(written);
+  }
+}
+
+} // namespace
+
+/**
+ * Build the whole file in memory, then write it in one go
+ *
+ * STEP BY STEP:
+ * 1. Emit every stub into the code section, recording its label references
+ * 2. Lay out index, relocations and strings after the header
+ * 3. Pad to a page boundary so the code section can be mapped on its own
+ * 4. Hash and write it
+ */
+auto write_code_cache(int fd, std::span<const std::string_view> messages)
+    -> void
+{
+  const CompileTimer timer; // The whole image counts as one compile
+  // Sorted by key, so find() can binary search
+  std::vector<std::string_view> sorted(messages.begin(), messages.end());
+  std::sort(sorted.begin(), sorted.end(), [](auto a, auto b) {
+    return stub_cache_key(a) < stub_cache_key(b);
+  });
+
+  // STEP 1: Code section and relocations
+  std::vector<CodeCacheEntry> entries;
+  std::vector<CodeCacheRelocation> relocations;
+  std::vector<uint8_t> code;
+  std::string strings;
+  for (const auto message : sorted) {
+    const auto offset = align_up(code.size(), kStubAlignment);
+    code.resize(offset + machine_code_size_bound(message));
+    NativeEmitter emitter{std::span<uint8_t>{code}.subspan(offset)};
+    emit_greeting(emitter, MessagePieces{&message, 1});
+    const auto size = emitter.finish();
+    code.resize(offset + size);
+
+    auto entry = CodeCacheEntry{};
+    entry.key = stub_cache_key(message);
+    entry.message_offset = strings.size();
+    entry.message_size = static_cast<uint32_t>(message.size());
+    entry.code_offset = static_cast<uint32_t>(offset);
+    entry.code_size = static_cast<uint32_t>(size);
+    entry.first_relocation = static_cast<uint32_t>(relocations.size());
+    for (const auto& fixup : emitter.fixups()) {
+      auto relocation = CodeCacheRelocation{};
+      relocation.position = fixup.position;
+      relocation.target = static_cast<uint32_t>(
+          emitter.label_offset(Label{fixup.label}));
+      relocation.kind = static_cast<uint8_t>(fixup.kind);
+      relocations.push_back(relocation);
+    }
+    entry.relocation_count =
+        static_cast<uint32_t>(relocations.size()) - entry.first_relocation;
+    entries.push_back(entry);
+    strings.append(message);
+  }
+
+  // STEPS 2-3: Layout
+  const auto page_size = jit_memory_info().page_size;
+  auto header = CodeCacheHeader{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kCodeCacheVersion;
+  header.platform_tag = platform_tag();
+  header.page_size = static_cast<uint32_t>(page_size);
+  header.entry_count = static_cast<uint32_t>(entries.size());
+  header.relocation_count = static_cast<uint32_t>(relocations.size());
+  const auto entries_bytes = entries.size() * sizeof(CodeCacheEntry);
+  const auto relocation_bytes =
+      relocations.size() * sizeof(CodeCacheRelocation);
+  header.strings_offset =
+      sizeof(CodeCacheHeader) + entries_bytes + relocation_bytes;
+  header.strings_size = strings.size();
+  header.code_offset =
+      align_up(header.strings_offset + header.strings_size, page_size);
+  header.code_size = code.size();
+
+  std::vector<uint8_t> file(header.code_offset + code.size());
+  auto* out = file.data() + sizeof(CodeCacheHeader);
+  std::memcpy(out, entries.data(), entries_bytes);
+  std::memcpy(out + entries_bytes, relocations.data(), relocation_bytes);
+  std::memcpy(file.data() + header.strings_offset, strings.data(),
+              strings.size());
+  std::memcpy(file.data() + header.code_offset, code.data(), code.size());
+
+  // STEP 4: Hash, then write
+  header.content_hash = fnv1a(file.data() + sizeof(CodeCacheHeader),
+                              file.size() - sizeof(CodeCacheHeader));
+  std::memcpy(file.data(), &header, sizeof(header));
+  write_all(fd, file.data(), file.size());
+}
+
+/**
+ * Write to a temporary file and rename it over the old one
+ */
+auto write_code_cache(const std::string& path,
+                      std::span<const std::string_view> messages) -> void
+{
+  const auto temporary = path + ".tmp." + std::to_string(getpid());
+  const int fd =
+      open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    throw std::runtime_error("Failed to create the code cache file");
+  }
+  try {
+    write_code_cache(fd, messages);
+  } catch (...) {
+    close(fd);
+    unlink(temporary.c_str());
+    throw;
+  }
+  close(fd);
+  if (rename(temporary.c_str(), path.c_str()) == -1) {
+    unlink(temporary.c_str());
+    throw std::runtime_error("Failed to install the code cache file");
+  }
+}
+
+CodeCacheFile::CodeCacheFile(const std::string& path)
+{
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error("No code cache file");
+  }
+  try {
+    map(fd);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd); // The mappings keep the file alive
+}
+
+CodeCacheFile::CodeCacheFile(int fd)
+{
+  map(fd);
+}
+
+/**
+ * Map the file in two parts
+ *
+ * - Header, index and strings: read-only data
+ * - Code section: read/execute, straight from the page cache (nothing is
+ *   ever writable, so W^X holds without any mprotect)
+ */
+auto CodeCacheFile::map(int fd) -> void
+{
+  struct stat status {};
+  if (fstat(fd, &status) == -1 ||
+      static_cast<size_t>(status.st_size) < sizeof(CodeCacheHeader)) {
+    throw std::runtime_error("Code cache file is too small");
+  }
+  const auto file_size = static_cast<size_t>(status.st_size);
+
+  // Read the header first to know where the code section starts
+  auto header = CodeCacheHeader{};
+  if (pread(fd, &header, sizeof(header), 0) !=
+          static_cast<ssize_t>(sizeof(header)) ||
+      header.page_size != jit_memory_info().page_size ||
+      header.code_offset < sizeof(CodeCacheHeader) ||
+      header.code_offset % header.page_size != 0 ||
+      header.code_offset > file_size ||
+      header.code_size != file_size - header.code_offset) {
+    throw std::runtime_error("Code cache file has a bad layout");
+  }
+
+  void* meta =
+      mmap(nullptr, header.code_offset, PROT_READ, MAP_PRIVATE, fd, 0);
+  void* code = header.code_size == 0
+                   ? nullptr
+                   : mmap(nullptr, header.code_size, PROT_READ | PROT_EXEC,
+                          MAP_PRIVATE, fd,
+                          static_cast<off_t>(header.code_offset));
+  count_jit(JitCounter::kMmapCalls, code == nullptr ? 1 : 2);
+  if (meta != MAP_FAILED) {
+    meta_ = static_cast<const uint8_t*>(meta);
+    meta_size_ = header.code_offset;
+    count_jit(JitCounter::kBytesMapped, meta_size_);
+  }
+  if (code != MAP_FAILED) {
+    code_ = static_cast<const uint8_t*>(code);
+    code_size_ = header.code_size;
+    count_jit(JitCounter::kBytesMapped, code_size_);
+  }
+  if (meta == MAP_FAILED || code == MAP_FAILED) {
+    release();
+    throw std::runtime_error("Failed to map the code cache file");
+  }
+
+  try {
+    validate(file_size);
+  } catch (...) {
+    release();
+    throw;
+  }
+}
+
+/**
+ * Check that the file is for us and undamaged before running any of it
+ */
+auto CodeCacheFile::validate(size_t file_size) const -> void
+{
+  const auto& head = header();
+  if (std::memcmp(head.magic, kMagic, sizeof(kMagic)) != 0 ||
+      head.version != kCodeCacheVersion ||
+      head.platform_tag != platform_tag()) {
+    throw std::runtime_error("Code cache file is for another build");
+  }
+  const auto tables =
+      sizeof(CodeCacheHeader) + head.entry_count * sizeof(CodeCacheEntry) +
+      head.relocation_count * sizeof(CodeCacheRelocation);
+  if (tables != head.strings_offset ||
+      head.strings_offset + head.strings_size > head.code_offset) {
+    throw std::runtime_error("Code cache file has a bad layout");
+  }
+
+  auto hash = fnv1a(meta_ + sizeof(CodeCacheHeader),
+                    meta_size_ - sizeof(CodeCacheHeader));
+  hash = fnv1a(code_, code_size_, hash);
+  if (hash != head.content_hash || meta_size_ + code_size_ != file_size) {
+    throw std::runtime_error("Code cache file is damaged");
+  }
+
+  // Every stub and every relocation must stay inside its own stub
+  const auto* relocations = reinterpret_cast<const CodeCacheRelocation*>(
+      meta_ + sizeof(CodeCacheHeader) +
+      head.entry_count * sizeof(CodeCacheEntry));
+  for (const auto& entry : entries()) {
+    if (entry.code_offset + uint64_t{entry.code_size} > code_size_ ||
+        entry.message_offset + entry.message_size > head.strings_size ||
+        entry.first_relocation + uint64_t{entry.relocation_count} >
+            head.relocation_count) {
+      throw std::runtime_error("Code cache entry out of range");
+    }
+    const auto* stub = code_ + entry.code_offset;
+    for (uint32_t i = 0; i < entry.relocation_count; ++i) {
+      const auto& relocation = relocations[entry.first_relocation + i];
+      if (relocation.position + uint64_t{4} > entry.code_size ||
+          relocation.target > entry.code_size ||
+          relocation_target(stub, relocation) != relocation.target) {
+        throw std::runtime_error("Code cache relocation does not match");
+      }
+    }
+  }
+}
+
+[[nodiscard]] auto CodeCacheFile::try_open(const std::string& path) noexcept
+    -> std::optional<CodeCacheFile>
+{
+  try {
+    return std::optional<CodeCacheFile>{std::in_place, path};
+  } catch (const std::exception&) {
+    return std::nullopt; // Missing or stale: regenerate the code
+  }
+}
+
+CodeCacheFile::~CodeCacheFile()
+{
+  release();
+}
+
+CodeCacheFile::CodeCacheFile(CodeCacheFile&& other) noexcept
+    : meta_{std::exchange(other.meta_, nullptr)},
+      meta_size_{std::exchange(other.meta_size_, 0)},
+      code_{std::exchange(other.code_, nullptr)},
+      code_size_{std::exchange(other.code_size_, 0)}
+{
+}
+
+auto CodeCacheFile::operator=(CodeCacheFile&& other) noexcept
+    -> CodeCacheFile&
+{
+  if (this != &other) {
+    release();
+    meta_ = std::exchange(other.meta_, nullptr);
+    meta_size_ = std::exchange(other.meta_size_, 0);
+    code_ = std::exchange(other.code_, nullptr);
+    code_size_ = std::exchange(other.code_size_, 0);
+  }
+  return *this;
+}
+
+auto CodeCacheFile::release() noexcept -> void
+{
+  if (meta_ != nullptr) {
+    munmap(const_cast<uint8_t*>(meta_), meta_size_);
+    count_jit(JitCounter::kMunmapCalls);
+    count_jit(JitCounter::kBytesUnmapped, meta_size_);
+    meta_ = nullptr;
+  }
+  if (code_ != nullptr) {
+    munmap(const_cast<uint8_t*>(code_), code_size_);
+    count_jit(JitCounter::kMunmapCalls);
+    count_jit(JitCounter::kBytesUnmapped, code_size_);
+    code_ = nullptr;
+  }
+}
+
+[[nodiscard]] auto CodeCacheFile::entries() const noexcept
+    -> std::span<const CodeCacheEntry>
+{
+  return {reinterpret_cast<const CodeCacheEntry*>(meta_ +
+                                                  sizeof(CodeCacheHeader)),
+          header().entry_count};
+}
+
+/**
+ * Binary search by key, then compare the stored message
+ */
+[[nodiscard]] auto CodeCacheFile::find(
+    std::string_view hello_name) const noexcept -> const uint8_t*
+{
+  const auto key = stub_cache_key(hello_name);
+  const auto all = entries();
+  auto entry = std::lower_bound(
+      all.begin(), all.end(), key,
+      [](const CodeCacheEntry& e, uint64_t k) { return e.key < k; });
+  const auto* strings =
+      reinterpret_cast<const char*>(meta_ + header().strings_offset);
+  for (; entry != all.end() && entry->key == key; ++entry) {
+    const auto message = std::string_view{strings + entry->message_offset,
+                                          entry->message_size};
+    if (message == hello_name) {
+      return code_ + entry->code_offset;
+    }
+  }
+  return nullptr;
+}
+
+} // namespace mijit
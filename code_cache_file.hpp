@@ -0,0 +1,156 @@
+/**
+ * @file code_cache_file.hpp
+ * @brief Compiled stubs saved to disk and mapped straight back in
+ *
+ * HOW IT WORKS:
+ * 1. write_code_cache() compiles messages into one blob and writes it to a
+ *    file, together with a header, an index and a content hash
+ * 2. On the next start CodeCacheFile maps the code part of that file
+ *    read/execute (PROT_READ | PROT_EXEC, file-backed)
+ * 3. find() returns the entry point of a message: no codegen, no copy
+ *
+ * WHY WE NEED THIS:
+ * - Every start used to regenerate the same machine code
+ * - File-backed pages come from the page cache, so every process on the
+ *   host that maps the file shares one physical copy
+ *
+ * FILE LAYOUT (native byte order):
+ * - CodeCacheHeader: magic, version, platform tag, page size, counts,
+ *   section offsets and an FNV-1a hash of everything after the header
+ * - Index: one CodeCacheEntry per message, sorted by stub_cache_key()
+ * - Relocations: every RIP/PC-relative reference from a stub to its text
+ * - Strings: the messages (to tell hash collisions apart)
+ * - Code: page-aligned, the stubs back to back, 16-byte aligned each
+ *
+ * RELOCATIONS:
+ * - Stubs only refer to their own text with RIP/PC-relative addressing, so
+ *   the code is position independent and needs no patching when mapped -
+ *   which is what makes a read-only, shared mapping possible
+ * - The loader still checks every recorded reference decodes to its target
+ * - Only kUnbuffered stubs can be cached: buffered and io_uring stubs
+ *   contain absolute addresses of this process
+ *
+ * NOTE: mapping a file as executable runs whatever is in it. Only use cache
+ * files in a directory other users cannot write to.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace mijit {
+
+inline constexpr uint32_t kCodeCacheVersion = 1;
+
+struct CodeCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t platform_tag;
+  uint32_t page_size;    // Alignment of the code section in the file
+  uint32_t entry_count;
+  uint32_t relocation_count;
+  uint32_t reserved;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+  uint64_t code_offset;
+  uint64_t code_size;
+  uint64_t content_hash; // FNV-1a of the file after the header
+};
+
+struct CodeCacheEntry {
+  uint64_t key;            // stub_cache_key(message)
+  uint64_t message_offset; // In the strings section
+  uint32_t message_size;
+  uint32_t code_offset;    // In the code section
+  uint32_t code_size;
+  uint32_t first_relocation;
+  uint32_t relocation_count;
+  uint32_t reserved;
+};
+
+struct CodeCacheRelocation {
+  uint32_t position; // Field (x86-64) or instruction (AArch64), in the stub
+  uint32_t target;   // What it must point at, in the stub
+  uint8_t kind;      // EmitterBase::FixupKind
+  uint8_t reserved[3];
+};
+
+/**
+ * Compile every message and write the cache file
+ *
+ * Written to a temporary file first and renamed over path, so processes
+ * reading the old file never see a half-written one.
+ */
+auto write_code_cache(const std::string& path,
+                      std::span<const std::string_view> messages) -> void;
+
+/**
+ * Same, written to an open file (at its current offset, which should be
+ * the start)
+ */
+auto write_code_cache(int fd, std::span<const std::string_view> messages)
+    -> void;
+
+/**
+ * A mapped cache file (move-only; unmaps on destruction)
+ */
+class CodeCacheFile {
+public:
+  /**
+   * Map and check a cache file; throws if it is missing, damaged, or for
+   * another platform or format version
+   */
+  explicit CodeCacheFile(const std::string& path);
+
+  /**
+   * Same, from an open file (fd stays open and is still the caller's; the
+   * mappings do not need it)
+   */
+  explicit CodeCacheFile(int fd);
+
+  /**
+   * Same, but returns nothing instead of throwing (a cold start)
+   */
+  [[nodiscard]] static auto try_open(const std::string& path) noexcept
+      -> std::optional<CodeCacheFile>;
+
+  ~CodeCacheFile();
+  CodeCacheFile(const CodeCacheFile&) = delete;
+  auto operator=(const CodeCacheFile&) -> CodeCacheFile& = delete;
+  CodeCacheFile(CodeCacheFile&& other) noexcept;
+  auto operator=(CodeCacheFile&& other) noexcept -> CodeCacheFile&;
+
+  /**
+   * Executable entry point of a message, nullptr if it is not in the file
+   */
+  [[nodiscard]] auto find(std::string_view hello_name) const noexcept
+      -> const uint8_t*;
+
+  [[nodiscard]] auto size() const noexcept -> size_t
+  {
+    return header().entry_count;
+  }
+
+private:
+  [[nodiscard]] auto header() const noexcept -> const CodeCacheHeader&
+  {
+    return *reinterpret_cast<const CodeCacheHeader*>(meta_);
+  }
+  [[nodiscard]] auto entries() const noexcept
+      -> std::span<const CodeCacheEntry>;
+  auto map(int fd) -> void;
+  auto validate(size_t file_size) const -> void;
+  auto release() noexcept -> void;
+
+  const uint8_t* meta_ = nullptr; // Header to strings, read-only
+  size_t meta_size_ = 0;
+  const uint8_t* code_ = nullptr; // Code section, read/execute
+  size_t code_size_ = 0;
+};
+
+} // namespace mijit
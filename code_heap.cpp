@@ -0,0 +1,215 @@
+/**
+ * @file code_heap.cpp
+ * @brief Size-class free lists, epoch-delayed frees and bulk page release
+ */
+
+#include "code_heap.hpp"
+
+#include <sys/mman.h>
+
+#if defined(__APPLE__) && defined(__aarch64__)
+#include <pthread.h>
+#endif
+
+#include <algorithm>
+#include <bit>
+#include <stdexcept>
+
+#include "jit_stats.hpp"
+
+namespace mijit {
+
+CodeHeap::CodeHeap(EpochDomain& epochs, size_t capacity)
+    : epochs_{epochs},
+      arena_{capacity, ArenaBackend::kDualMapped},
+      page_size_{jit_memory_info().page_size},
+      pages_(arena_.capacity() / page_size_)
+{
+}
+
+/**
+ * HELPER FUNCTION: Get count neighbouring pages - a released page if one
+ * will do, otherwise fresh pages from the end of the region
+ */
+[[nodiscard]] auto CodeHeap::take_pages(size_t count) -> size_t
+{
+  if (count == 1 && !empty_.empty()) {
+    const auto index = empty_.back();
+    empty_.pop_back();
+    return index;
+  }
+  if (count > pages_.size() - top_page_) {
+    throw std::runtime_error("Code heap is out of memory");
+  }
+  const auto index = top_page_;
+  top_page_ += count;
+  return index;
+}
+
+[[nodiscard]] auto CodeHeap::allocate(size_t size) -> CodeSlot
+{
+#if defined(__APPLE__) && defined(__aarch64__)
+  pthread_jit_write_protect_np(0); // MAP_JIT pages writable for this thread
+#endif
+  size = size == 0 ? 1 : size;
+
+  // Bigger than a page: whole pages of its own
+  if (size > page_size_) {
+    const auto count = (size + page_size_ - 1) / page_size_;
+    const auto index = take_pages(count);
+    for (size_t i = 0; i < count; ++i) {
+      pages_[index + i] = Page{0, kLarge, 1, 0, false};
+    }
+    pages_[index].run = static_cast<uint32_t>(count);
+    live_bytes_ += count * page_size_;
+    count_jit(JitCounter::kBytesReserved, size);
+    count_jit(JitCounter::kBytesPadding, count * page_size_ - size);
+    return arena_.slot_at(index * page_size_, size);
+  }
+
+  // Smallest size class that fits
+  auto size_class = size_t{0};
+  while (slot_size(size_class) < size) {
+    ++size_class;
+  }
+  auto& partial = partial_[size_class];
+  if (partial.empty()) {
+    const auto index = take_pages(1);
+    const auto slots = size_t{64} >> size_class;
+    const auto all_free =
+        slots == 64 ? ~uint64_t{0} : (uint64_t{1} << slots) - 1;
+    pages_[index] =
+        Page{all_free, static_cast<uint16_t>(size_class), 0, 0, true};
+    partial.push_back(static_cast<uint32_t>(index));
+  }
+
+  // Lowest free slot of the most recently used page with room
+  const auto index = partial.back();
+  auto& page = pages_[index];
+  const auto slot = static_cast<size_t>(std::countr_zero(page.free_mask));
+  page.free_mask &= page.free_mask - 1;
+  ++page.live;
+  if (page.free_mask == 0) {
+    partial.pop_back(); // Full
+    page.partial = false;
+  }
+  live_bytes_ += slot_size(size_class);
+  count_jit(JitCounter::kBytesReserved, size);
+  count_jit(JitCounter::kBytesPadding, slot_size(size_class) - size);
+  return arena_.slot_at(index * page_size_ + slot * slot_size(size_class),
+                        size);
+}
+
+auto CodeHeap::publish(const CodeSlot& slot) noexcept -> void
+{
+#if defined(__APPLE__) && defined(__aarch64__)
+  pthread_jit_write_protect_np(1); // Back to executable for this thread
+#endif
+  flush_instruction_cache(slot.writable.data(), slot.executable,
+                          slot.writable.size());
+}
+
+[[nodiscard]] auto CodeHeap::offset_of(const CodeSlot& slot) const -> size_t
+{
+  const auto* base = arena_.slot_at(0, 0).executable;
+  return static_cast<size_t>(slot.executable - base);
+}
+
+auto CodeHeap::retire(const CodeSlot& slot) -> void
+{
+  retired_.push_back(Retired{offset_of(slot), epochs_.current()});
+}
+
+/**
+ * HELPER FUNCTION: Put one slot back on its size class (returns its size)
+ */
+auto CodeHeap::free_slot(size_t offset) -> size_t
+{
+  const auto index = static_cast<uint32_t>(offset / page_size_);
+  auto& page = pages_[index];
+
+  if (page.size_class == kLarge) {
+    const auto count = page.run;
+    for (size_t i = 0; i < count; ++i) {
+      pages_[index + i] = Page{};
+      to_release_.push_back(static_cast<uint32_t>(index + i));
+    }
+    live_bytes_ -= count * page_size_;
+    return count * page_size_;
+  }
+
+  const auto size = slot_size(page.size_class);
+  page.free_mask |= uint64_t{1} << ((offset % page_size_) / size);
+  --page.live;
+  live_bytes_ -= size;
+  auto& partial = partial_[page.size_class];
+  if (page.live == 0) {
+    // Completely empty: off the partial list, back to the OS soon
+    if (page.partial) {
+      partial.erase(std::find(partial.begin(), partial.end(), index));
+    }
+    page = Page{};
+    to_release_.push_back(index);
+  }
+  else if (!page.partial) {
+    page.partial = true;
+    partial.push_back(index);
+  }
+  return size;
+}
+
+/**
+ * HELPER FUNCTION: Give empty pages back, one madvise per run of
+ * neighbouring pages
+ *
+ * - MADV_REMOVE frees the memfd pages behind both views (MADV_DONTNEED
+ *   would only drop this mapping's references to the shared pages)
+ * - The address range stays mapped; touching it again gives zeroed pages
+ */
+auto CodeHeap::release_pages() noexcept -> void
+{
+  if (to_release_.empty()) {
+    return;
+  }
+  std::sort(to_release_.begin(), to_release_.end());
+  const auto base = arena_.slot_at(0, 0).writable.data();
+  for (size_t first = 0; first < to_release_.size();) {
+    auto last = first + 1;
+    while (last < to_release_.size() &&
+           to_release_[last] == to_release_[last - 1] + 1) {
+      ++last;
+    }
+    auto* begin = base + size_t{to_release_[first]} * page_size_;
+    const auto size = (last - first) * page_size_;
+#if defined(MADV_REMOVE)
+    madvise(begin, size, MADV_REMOVE);
+#else
+    madvise(begin, size, MADV_DONTNEED);
+#endif
+    count_jit(JitCounter::kMadviseCalls);
+    count_jit(JitCounter::kBytesReleased, size);
+    first = last;
+  }
+  released_pages_ += to_release_.size();
+  empty_.insert(empty_.end(), to_release_.begin(), to_release_.end());
+  to_release_.clear();
+}
+
+auto CodeHeap::collect() -> size_t
+{
+  epochs_.try_advance();
+
+  // Retired slots are in epoch order: free the prefix that is safe now
+  auto freed = size_t{0};
+  auto safe = retired_.begin();
+  while (safe != retired_.end() && epochs_.is_safe(safe->epoch)) {
+    freed += free_slot(safe->offset);
+    ++safe;
+  }
+  retired_.erase(retired_.begin(), safe);
+
+  release_pages();
+  return freed;
+}
+
+} // namespace mijit
@@ -0,0 +1,141 @@
+/**
+ * @file code_heap.hpp
+ * @brief Code memory that can be freed and reused while other threads run
+ *
+ * HOW IT WORKS:
+ * 1. Memory comes from one dual-mapped region, page by page
+ * 2. Each page holds slots of one size class (page/64, page/32, ... page),
+ *    with a 64-bit mask saying which slots are free
+ * 3. retire() does not free anything yet: the slot waits until the epoch
+ *    domain says no thread can still be running it
+ * 4. collect() frees those slots into their size class; pages that end up
+ *    completely empty are given back to the OS together, one madvise for
+ *    each run of neighbouring pages
+ *
+ * WHY WE NEED THIS:
+ * - A bump arena never frees anything, so a long-running process that keeps
+ *   replacing code grows without limit
+ * - munmap per function would cost a system call per free and would crash
+ *   any thread still inside the code
+ * - With free lists, RSS stays bounded by the code that is really live
+ *
+ * NOTES:
+ * - Dual mapping is required: reused slots are rewritten through the
+ *   writable view, so no executable page ever becomes writable (W^X)
+ * - A CodeHeap is not thread-safe (one owner allocates, retires and
+ *   collects); any number of threads may run its code, as long as they pin
+ *   the epoch while they do
+ * - Code bigger than a page gets whole pages of its own, always fresh ones
+ *   from the end of the region. Once collect() finds it safe (two epochs
+ *   after retire()), its pages are released with the other empty pages and
+ *   join the empty list, from which single-page allocations reuse them;
+ *   they are never reused for another multi-page slot
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "epoch.hpp"
+#include "jit_memory.hpp"
+
+namespace mijit {
+
+class CodeHeap {
+public:
+  static constexpr size_t kSizeClasses = 7; // page/64 up to a whole page
+
+  explicit CodeHeap(EpochDomain& epochs,
+                    size_t capacity = CodeArena::kDefaultCapacity);
+
+  CodeHeap(const CodeHeap&) = delete;
+  auto operator=(const CodeHeap&) -> CodeHeap& = delete;
+
+  /**
+   * A slot of at least size bytes, reused from the free lists when possible
+   * (throws when the region is used up)
+   */
+  [[nodiscard]] auto allocate(size_t size) -> CodeSlot;
+
+  /**
+   * Make one slot's new code visible to instruction fetch (see
+   * flush_instruction_cache)
+   */
+  auto publish(const CodeSlot& slot) noexcept -> void;
+
+  /**
+   * The slot's code is no longer reachable: free it once no pinned thread
+   * can still be running it
+   */
+  auto retire(const CodeSlot& slot) -> void;
+
+  /**
+   * Try to advance the epoch, free every slot that became safe and give
+   * empty pages back to the OS; returns the number of bytes freed
+   */
+  auto collect() -> size_t;
+
+  /**
+   * Pages that currently hold memory (in use, or freed but not released)
+   */
+  [[nodiscard]] auto resident_pages() const noexcept -> size_t
+  {
+    return top_page_ - empty_.size();
+  }
+  [[nodiscard]] auto released_pages() const noexcept -> size_t
+  {
+    return released_pages_;
+  }
+  [[nodiscard]] auto retired_slots() const noexcept -> size_t
+  {
+    return retired_.size();
+  }
+  [[nodiscard]] auto live_bytes() const noexcept -> size_t
+  {
+    return live_bytes_;
+  }
+
+private:
+  static constexpr uint16_t kUnused = 0xFFFF; // Page holds no slots
+  static constexpr uint16_t kLarge = 0xFFFE;  // Page of a multi-page slot
+
+  struct Page {
+    uint64_t free_mask = 0; // Bit i set: slot i is free
+    uint16_t size_class = kUnused;
+    uint16_t live = 0;      // Slots handed out
+    uint32_t run = 0;       // kLarge: pages in the allocation (first page)
+    bool partial = false;   // On the partial list of its size class
+  };
+
+  struct Retired {
+    size_t offset;
+    uint64_t epoch;
+  };
+
+  [[nodiscard]] auto slot_size(size_t size_class) const noexcept -> size_t
+  {
+    return (page_size_ / 64) << size_class;
+  }
+  [[nodiscard]] auto take_pages(size_t count) -> size_t;
+  [[nodiscard]] auto offset_of(const CodeSlot& slot) const -> size_t;
+  auto free_slot(size_t offset) -> size_t;
+  auto release_pages() noexcept -> void;
+
+  EpochDomain& epochs_;
+  CodeArena arena_;
+  size_t page_size_;
+  std::vector<Page> pages_; // One per page of the region
+  // Per size class: pages with at least one free slot
+  std::array<std::vector<uint32_t>, kSizeClasses> partial_;
+  std::vector<uint32_t> empty_;      // Released, ready to be used again
+  std::vector<uint32_t> to_release_; // Empty, released by the next collect()
+  std::vector<Retired> retired_;     // Oldest first
+  size_t top_page_ = 0;              // Pages ever taken from the region
+  size_t released_pages_ = 0;
+  size_t live_bytes_ = 0;
+};
+
+} // namespace mijit
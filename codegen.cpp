@@ -0,0 +1,438 @@
+/**
+ * @file codegen.cpp
+ * @brief Per-platform greeting program and debugging helpers
+ */
+
+#include "codegen.hpp"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <iostream>
+#include <stdexcept>
+
+#include "cpu_features.hpp"
+#include "output_buffer.hpp"
+#include "stub_profile.hpp"
+#include "uring_output.hpp"
+
+namespace mijit {
+
+namespace {
+
+static_assert(offsetof(StubCounters, calls) == 0);
+constexpr auto kTicksOffset = offsetof(StubCounters, ticks);
+
+#if defined(__aarch64__)
+/**
+ * HELPER FUNCTION: [base] += value
+ *
+ * - Not atomic: load, add, store
+ * - Atomic: stadd when the CPU has it (cpu_features.hpp), otherwise
+ *   load-exclusive / store-exclusive until no other core got in between
+ * - x11 and w12 are scratch
+ */
+auto emit_counter_add(A64Emitter& emitter, A64Emitter::Reg base,
+                      A64Emitter::Reg value, bool atomic) -> void
+{
+  using Reg = A64Emitter::Reg;
+  if (!atomic) {
+    emitter.ldr_imm(Reg::x11, base, 0);         // ldr x11, [base]
+    emitter.add_reg(Reg::x11, Reg::x11, value); // add x11, x11, value
+    emitter.str_imm(Reg::x11, base, 0);         // str x11, [base]
+    return;
+  }
+  if (host_cpu_features().lse) {
+    emitter.stadd(value, base); // stadd value, [base]
+    return;
+  }
+  const auto retry = emitter.new_label();
+  emitter.bind(retry);
+  emitter.ldxr(Reg::x11, base);              // ldxr x11, [base]
+  emitter.add_reg(Reg::x11, Reg::x11, value); // add x11, x11, value
+  emitter.stxr(Reg::x12, Reg::x11, base);    // stxr w12, x11, [base]
+  emitter.cbnz_w(Reg::x12, retry);           // Lost the line: again
+}
+#endif
+
+/**
+ * HELPER FUNCTION: Instrumentation at the start of a stub
+ *
+ * THE GENERATED CODE DOES THIS:
+ * - Keep the address of the stub's StubCounters in a register that
+ *   survives the system call (r10 / x15)
+ * - Add 1 to its call count (atomically unless atomic_counters is false:
+ *   a locked add costs a few nanoseconds, a plain one well under one, but
+ *   loses counts when two threads run the stub at the same time)
+ * - With time_calls: remember the tick counter (r8 / x13)
+ *
+ * Emits nothing without counters, so uninstrumented stubs cost nothing.
+ */
+auto emit_profile_entry(NativeEmitter& emitter, const CodegenOptions& options)
+    -> void
+{
+  if (options.counters == nullptr) {
+    if (options.time_calls) {
+      throw std::runtime_error("Call timing needs CodegenOptions::counters");
+    }
+    return;
+  }
+  if (options.time_calls && options.output != OutputMode::kUnbuffered) {
+    throw std::runtime_error("Call timing needs OutputMode::kUnbuffered");
+  }
+  const auto address = reinterpret_cast<uintptr_t>(options.counters);
+#if defined(__aarch64__)
+  using Reg = A64Emitter::Reg;
+  emitter.mov_imm(Reg::x15, address);    // x15 = &counters
+  emitter.mov_imm(Reg::x14, 1);          // mov x14, #1
+  emit_counter_add(emitter, Reg::x15, Reg::x14, // calls += 1
+                   options.atomic_counters);
+  if (options.time_calls) {
+    emitter.mrs_cntvct(Reg::x13); // mrs x13, cntvct_el0 - Start
+  }
+#else
+  using Reg = X86Emitter::Reg;
+  emitter.mov_imm(Reg::r10, address); // movabs r10, &counters
+  emitter.inc_mem(Reg::r10, 0, // [lock] inc qword [r10] - calls
+                  options.atomic_counters);
+  if (options.time_calls) {
+    emitter.rdtsc();                    // edx:eax = ticks
+    emitter.shl_imm(Reg::rdx, 32);      // shl rdx, 32
+    emitter.or_reg(Reg::rax, Reg::rdx); // or rax, rdx
+    emitter.mov_reg(Reg::r8, Reg::rax); // mov r8, rax - Start
+  }
+#endif
+}
+
+/**
+ * HELPER FUNCTION: Instrumentation right before the stub returns
+ *
+ * - With time_calls: add (ticks now - start) to the tick total
+ */
+auto emit_profile_exit(NativeEmitter& emitter, const CodegenOptions& options)
+    -> void
+{
+  if (!options.time_calls) {
+    return;
+  }
+#if defined(__aarch64__)
+  using Reg = A64Emitter::Reg;
+  emitter.mrs_cntvct(Reg::x14);                // mrs x14, cntvct_el0
+  emitter.sub_reg(Reg::x14, Reg::x14, Reg::x13); // x14 = ticks spent
+  emitter.add_imm(Reg::x15, Reg::x15, // x15 = &ticks
+                  static_cast<uint16_t>(kTicksOffset));
+  emit_counter_add(emitter, Reg::x15, Reg::x14, // ticks += x14
+                   options.atomic_counters);
+#else
+  using Reg = X86Emitter::Reg;
+  emitter.rdtsc();                    // edx:eax = ticks
+  emitter.shl_imm(Reg::rdx, 32);      // shl rdx, 32
+  emitter.or_reg(Reg::rax, Reg::rdx); // or rax, rdx
+  emitter.sub_reg(Reg::rax, Reg::r8); // sub rax, r8 - Ticks spent
+  emitter.add_mem(Reg::r10, static_cast<int8_t>(kTicksOffset), Reg::rax,
+                  options.atomic_counters); // [lock] add [r10 + 8], rax
+#endif
+}
+
+#if !defined(__APPLE__) || !defined(__aarch64__)
+/**
+ * HELPER FUNCTION: Emit a greeting stub that hands its text to host code
+ *
+ * THE GENERATED PROGRAM DOES THIS:
+ * - Load (context, text address, text length) into the first three
+ *   argument registers
+ * - Jump to the host function - a tail call, so the host function returns
+ *   straight to whoever called the stub
+ *
+ * Returns the offset right after the instruction that loads the length.
+ */
+auto emit_host_call_greeting(NativeEmitter& emitter, size_t length, Label text,
+                             const void* context, uintptr_t function)
+    -> size_t
+{
+  auto length_end = size_t{0};
+#if defined(__aarch64__)
+  using Reg = A64Emitter::Reg;
+  emitter.mov_imm(Reg::x0, reinterpret_cast<uintptr_t>(context)); // Context
+  emitter.adr(Reg::x1, text);                     // adr x1, text
+  emitter.mov_imm(Reg::x2, length);               // Length
+  length_end = emitter.size();
+  emitter.mov_imm(Reg::x16, function); // x16 = scratch register for calls
+  emitter.br(Reg::x16);                // br x16 - tail call
+#else
+  using Reg = X86Emitter::Reg;
+  emitter.mov_imm(Reg::rdi, reinterpret_cast<uintptr_t>(context)); // Context
+  emitter.lea_rip(Reg::rsi, text);                 // lea rsi, [rip+text]
+  emitter.mov_imm(Reg::rdx, length);               // mov edx, len
+  length_end = emitter.size();
+  emitter.mov_imm(Reg::rax, function); // movabs rax, function
+  emitter.jmp_reg(Reg::rax);           // jmp rax - tail call
+#endif
+  return length_end;
+}
+#endif
+
+} // namespace
+
+/**
+ * HELPER FUNCTION: Emit the machine code for different processors
+ *
+ * WHAT IS MACHINE CODE?
+ * - Machine code is the raw binary instructions that processors understand
+ * - Different processors (x86-64 vs ARM64) use different instruction sets
+ * - We're creating a small program that calls the "write" system call to
+ *   print text
+ *
+ * THE GENERATED PROGRAM DOES THIS:
+ * - Set up registers with: file descriptor=1 (stdout), message address,
+ *   message length
+ * - Call the operating system to write the message
+ * - Return to our main program
+ * - The text label can be bound anywhere the emitter can reach: right after
+ *   the code (emit_greeting) or in a separate data section (split batches),
+ *   so the RIP/PC-relative address is always right
+ */
+auto emit_greeting_code(NativeEmitter& emitter, size_t length, Label text,
+                        const CodegenOptions& options) -> size_t
+{
+  emit_profile_entry(emitter, options); // Nothing unless instrumented
+#if defined(__APPLE__) && defined(__aarch64__)
+  // APPLE SILICON: Apple Silicon has strict security, so we just return a
+  // success code (the host prints the message, buffered or not)
+  using Reg = A64Emitter::Reg;
+  (void)length;
+  (void)text;
+  emitter.mov_imm(Reg::x0, 0); // mov x0, #0 - Put success code (0) in x0
+  emit_profile_exit(emitter, options);
+  emitter.ret();               // ret        - Return to main program
+  return 0;                    // No length in the code
+#else
+  if (options.output == OutputMode::kBuffered) {
+    if (options.buffer == nullptr) {
+      throw std::runtime_error("Buffered output needs an OutputBuffer");
+    }
+    return emit_host_call_greeting(
+        emitter, length, text, options.buffer,
+        reinterpret_cast<uintptr_t>(&mijit_output_append));
+  }
+  if (options.output == OutputMode::kUring) {
+    if (options.uring == nullptr) {
+      throw std::runtime_error("io_uring output needs a UringOutput");
+    }
+    return emit_host_call_greeting(
+        emitter, length, text, options.uring,
+        reinterpret_cast<uintptr_t>(&mijit_uring_write));
+  }
+  const auto length_end = emit_write_call(emitter, length, text);
+  emit_profile_exit(emitter, options);
+  emitter.ret(); // ret - Return to our main program
+  return length_end;
+#endif
+}
+
+/**
+ * HELPER FUNCTION: Emit the greeting once and remember where the two values
+ * that differ between stubs are
+ *
+ * HOW IT WORKS:
+ * - A length of 1 picks the encoding every length in [min_length,
+ *   max_length] shares: mov r32, imm32 on x86-64 (the immediate is the last
+ *   4 bytes of the instruction), a single movz on AArch64
+ * - The text label gets its own fixup; where it points does not matter,
+ *   stamp_greeting() rewrites it for every copy
+ * - The rest of the buffer is filled with trap instructions (int3 / udf)
+ */
+[[nodiscard]] auto make_greeting_template(const CodegenOptions& options)
+    -> GreetingTemplate
+{
+  if (options.counters != nullptr) {
+    throw std::runtime_error("Instrumented stubs have no template");
+  }
+  auto result = GreetingTemplate{};
+#if defined(__x86_64__)
+  result.code.fill(0xCC); // int3
+#endif
+  NativeEmitter emitter{result.code};
+  const auto text = emitter.new_label();
+  const auto length_end = emit_greeting_code(emitter, 1, text, options);
+  for (const auto& fixup : emitter.fixups()) {
+    if (fixup.label == text.id) {
+      result.text_at = fixup.position;
+    }
+  }
+  emitter.bind_at(text, emitter.size());
+  result.size = emitter.finish();
+  if (length_end != 0) {
+    result.length_at = length_end - 4;
+#if defined(__aarch64__)
+    result.min_length = 0; // movz x2, #0 is still one movz
+    result.max_length = 0xFFFF;
+#else
+    result.min_length = 1; // 0 would become xor edx, edx
+    result.max_length = UINT32_MAX;
+#endif
+  }
+  return result;
+}
+
+auto interpret_greeting(std::string_view text, const CodegenOptions& options)
+    -> void
+{
+#if defined(__APPLE__) && defined(__aarch64__)
+  (void)options;
+  std::cout << text << std::flush; // What main prints after the stub
+#else
+  if (options.output == OutputMode::kBuffered && options.buffer != nullptr) {
+    mijit_output_append(options.buffer, text.data(), text.size());
+    return;
+  }
+  if (options.output == OutputMode::kUring && options.uring != nullptr) {
+    mijit_uring_write(options.uring, text.data(), text.size());
+    return;
+  }
+  // Unbuffered: the write system call, like the stub
+  while (!text.empty()) {
+    const auto written = ::write(1, text.data(), text.size());
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return; // The stub ignores write errors too
+    }
+    text.remove_prefix(static_cast<size_t>(written));
+  }
+#endif
+}
+
+/**
+ * The greeting with its text right after the code
+ */
+auto emit_greeting(NativeEmitter& emitter, MessagePieces pieces,
+                   const CodegenOptions& options) -> void
+{
+  const auto text = emitter.new_label();
+  emit_greeting_code(emitter, message_size(pieces), text, options);
+#if !defined(__APPLE__) || !defined(__aarch64__) // Apple: the host prints
+  emitter.bind(text);
+  for (const auto piece : pieces) { // The text itself, right after the code
+    emitter.emit_bytes(piece);
+  }
+#endif
+}
+
+/**
+ * Same program as the greeting, but the text stays where it is: the stub
+ * only holds its address and length in a literal pool
+ */
+auto emit_far_write(NativeEmitter& emitter, std::span<const char> data)
+    -> void
+{
+  if (data.size() > kMaxSingleWrite) {
+    throw std::runtime_error("Far data is too big for one write call");
+  }
+  const auto address = reinterpret_cast<uintptr_t>(data.data());
+#if defined(__APPLE__) && defined(__aarch64__)
+  // APPLE SILICON: no system calls from generated code (the host prints)
+  using Reg = A64Emitter::Reg;
+  (void)address;
+  emitter.mov_imm(Reg::x0, 0); // mov x0, #0 - Success code
+  emitter.ret();               // ret
+#elif defined(__aarch64__)
+  using Reg = A64Emitter::Reg;
+  const auto text = emitter.new_label();
+  const auto length = emitter.new_label();
+  emitter.mov_imm(Reg::x0, 1);          // mov x0, #1       - stdout
+  emitter.ldr_literal(Reg::x1, text);   // ldr x1, =address - Far text
+  emitter.ldr_literal(Reg::x2, length); // ldr x2, =length  - Any length
+  emitter.mov_imm(Reg::x8, 64);         // mov x8, #64      - write
+  emitter.svc(0);                       // svc #0
+  emitter.ret();                        // ret
+  emitter.emit_literal64(text, address);       // Literal pool
+  emitter.emit_literal64(length, data.size());
+#else
+  using Reg = X86Emitter::Reg;
+#if defined(__APPLE__)
+  constexpr auto write_syscall = uint64_t{0x02000004}; // macOS write
+#else
+  constexpr auto write_syscall = uint64_t{1}; // Linux write
+#endif
+  const auto text = emitter.new_label();
+  const auto length = emitter.new_label();
+  emitter.mov_imm(Reg::rax, write_syscall); // mov eax, n - System call
+  emitter.mov_imm(Reg::rdi, 1);             // mov edi, 1 - stdout
+  emitter.load_rip(Reg::rsi, text);   // mov rsi, [rip+text]   - Far text
+  emitter.load_rip(Reg::rdx, length); // mov rdx, [rip+length] - Any length
+  emitter.syscall();                  // syscall
+  emitter.ret();                      // ret
+  emitter.align(8, 0xCC);             // int3 padding before the literals
+  emitter.emit_literal64(text, address); // Literal pool
+  emitter.emit_literal64(length, data.size());
+#endif
+}
+
+/**
+ * HELPER FUNCTION: Emit the machine code for a message in place
+ *
+ * - The emitter writes straight into destination: no vector, no copy
+ */
+[[nodiscard]] auto emit_machine_code(std::span<uint8_t> destination,
+                                     MessagePieces pieces,
+                                     const CodegenOptions& options) -> size_t
+{
+  NativeEmitter emitter{destination};
+  emit_greeting(emitter, pieces, options);
+  return emitter.finish();
+}
+
+[[nodiscard]] auto emit_machine_code(std::span<uint8_t> destination,
+                                     std::string_view hello_name,
+                                     const CodegenOptions& options) -> size_t
+{
+  return emit_machine_code(destination, MessagePieces{&hello_name, 1},
+                           options);
+}
+
+/**
+ * HELPER FUNCTION: Build the finished machine code for one message
+ *
+ * - The buffer is sized up front, so the emitter never reallocates
+ */
+[[nodiscard]] auto build_machine_code(std::string_view hello_name)
+    -> std::vector<uint8_t>
+{
+  std::vector<uint8_t> machine_code(machine_code_size_bound(hello_name));
+  machine_code.resize(emit_machine_code(machine_code, hello_name));
+  return machine_code;
+}
+
+/**
+ * HELPER FUNCTION: Display machine code for debugging
+ *
+ * WHAT THIS DOES:
+ * - Takes our machine code bytes and prints them in hexadecimal
+ * - Shows 7 bytes per line for easy reading
+ * - Helps us see exactly what machine code we generated
+ */
+auto show_machine_code(std::span<const uint8_t> machine_code) -> void
+{
+  auto counter =
+      0; // Keep track of how many bytes we've printed on current line
+  std::cout << "\nMachine code generated:\n"
+            << std::hex; // Print header and switch to hex mode
+
+  // Loop through each byte in our machine code
+  for (const auto byte : machine_code) {
+    std::cout << static_cast<int>(byte)
+              << " ";       // Print byte as hexadecimal number
+    ++counter;              // Count this byte
+    if (counter % 7 == 0) { // After every 7 bytes...
+      std::cout << '\n';    // ...start a new line for readability
+    }
+  }
+
+  std::cout << std::dec
+            << "\n\n"; // Switch back to decimal mode and add blank line
+}
+
+} // namespace mijit
@@ -0,0 +1,360 @@
+/**
+ * @file codegen.hpp
+ * @brief Machine code for the "print a message" program
+ *
+ * WHAT LIVES HERE:
+ * - The per-platform greeting program (write system call + ret, or a tail
+ *   call into an OutputBuffer / UringOutput), written with the emitters from
+ *   emitter.hpp
+ * - A stub that writes a buffer living outside the code (far data)
+ * - A helper that shows the generated bytes
+ * - The platform tag used to key cached machine code
+ * - Optional call counters and tick timing in each stub (stub_profile.hpp)
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include "emitter.hpp"
+
+namespace mijit {
+
+/**
+ * Human readable name of the platform we generate code for
+ */
+[[nodiscard]] constexpr auto platform_name() noexcept -> std::string_view
+{
+#if defined(__linux__) && defined(__x86_64__)
+  return "Linux x86-64";
+#elif defined(__APPLE__) && defined(__x86_64__)
+  return "macOS x86-64";
+#elif defined(__linux__) && defined(__aarch64__)
+  return "Linux ARM64";
+#elif defined(__APPLE__) && defined(__aarch64__)
+  return "Apple Silicon ARM64";
+#else
+#error \
+    "Unsupported platform: This code only works on Linux/macOS with x86-64/ARM64 processors"
+#endif
+}
+
+/**
+ * Small number identifying the platform (part of every cache key, so code
+ * generated for one platform is never reused on another)
+ */
+[[nodiscard]] constexpr auto platform_tag() noexcept -> uint32_t
+{
+#if defined(__linux__) && defined(__x86_64__)
+  return 1;
+#elif defined(__APPLE__) && defined(__x86_64__)
+  return 2;
+#elif defined(__linux__) && defined(__aarch64__)
+  return 3;
+#else
+  return 4;
+#endif
+}
+
+/**
+ * Type of the generated function
+ *
+ * - Apple Silicon stubs only return a status code (the host prints)
+ * - Everywhere else the stub prints the message itself
+ */
+#if defined(__APPLE__) && defined(__aarch64__)
+using StubFunction = int (*)();
+#else
+using StubFunction = void (*)();
+#endif
+
+/**
+ * Treat executable machine code as a callable function
+ */
+[[nodiscard]] inline auto as_function(const uint8_t* code) noexcept
+    -> StubFunction
+{
+  return reinterpret_cast<StubFunction>(code);
+}
+
+/**
+ * A message made of pieces that are written back to back
+ * (for example "Hello, " + name + "!\n" without building a std::string)
+ */
+using MessagePieces = std::span<const std::string_view>;
+
+/**
+ * The three pieces of the greeting for a name
+ */
+[[nodiscard]] constexpr auto greeting_pieces(std::string_view name) noexcept
+    -> std::array<std::string_view, 3>
+{
+  return {"Hello, ", name, "!\n"};
+}
+
+/**
+ * Total length of a message made of pieces
+ */
+[[nodiscard]] constexpr auto message_size(MessagePieces pieces) noexcept
+    -> size_t
+{
+  auto size = size_t{0};
+  for (const auto piece : pieces) {
+    size += piece.size();
+  }
+  return size;
+}
+
+class OutputBuffer;
+class UringOutput;
+struct StubCounters;
+
+/**
+ * How a generated stub gets its text out
+ *
+ * - kUnbuffered: the stub makes the write system call itself (one system
+ *                call per call of the stub)
+ * - kBuffered:   the stub tail-calls mijit_output_append(), which copies the
+ *                text into an OutputBuffer and only writes when the buffer
+ *                fills up or is flushed
+ * - kUring:      the stub tail-calls mijit_uring_write(), which queues the
+ *                write on an io_uring (falls back to write(2) without one)
+ */
+enum class OutputMode {
+  kUnbuffered,
+  kBuffered,
+  kUring,
+};
+
+/**
+ * Options that change the code emitted for a stub
+ */
+struct CodegenOptions {
+  OutputMode output = OutputMode::kUnbuffered;
+  OutputBuffer* buffer = nullptr; // Required for OutputMode::kBuffered
+  UringOutput* uring = nullptr;   // Required for OutputMode::kUring
+  StubCounters* counters = nullptr; // Count calls here (see stub_profile.hpp)
+  bool time_calls = false;          // Also add up ticks (needs counters)
+  bool atomic_counters = true;      // false: plain adds (one thread per stub)
+};
+
+/**
+ * Longest machine code a greeting stub needs, not counting the text
+ * (instrumented stubs included)
+ */
+inline constexpr size_t kMaxStubCodeSize = 128;
+
+/**
+ * Upper bound on the bytes emitted for a message
+ */
+[[nodiscard]] constexpr auto machine_code_size_bound(
+    MessagePieces pieces) noexcept -> size_t
+{
+  return kMaxStubCodeSize + message_size(pieces);
+}
+[[nodiscard]] constexpr auto machine_code_size_bound(
+    std::string_view hello_name) noexcept -> size_t
+{
+  return kMaxStubCodeSize + hello_name.size();
+}
+
+#if !defined(__APPLE__) || !defined(__aarch64__)
+/**
+ * Emit the write system call of the unbuffered greeting: length bytes at
+ * text to stdout (everything but the ret)
+ *
+ * Returns the offset right after the instruction that loads the length.
+ * constexpr, so static_stub.hpp builds the same code at compile time.
+ */
+constexpr auto emit_write_call(NativeEmitter& emitter, size_t length,
+                               Label text) -> size_t
+{
+#if defined(__aarch64__)
+  // LINUX ARM64: x0 = fd, x1 = text, x2 = length, x8 = system call number
+  using Reg = A64Emitter::Reg;
+  emitter.mov_imm(Reg::x0, 1);  // mov x0, #1     - File descriptor (stdout)
+  emitter.adr(Reg::x1, text);   // adr x1, text   - Address of our text
+  emitter.mov_imm(Reg::x2, length); // movz/movk x2 - Length
+  const auto length_end = emitter.size();
+  emitter.mov_imm(Reg::x8, 64); // mov x8, #64    - write system call number
+  emitter.svc(0);               // svc #0         - Ask Linux to write
+  return length_end;
+#else
+  // x86-64: rax = system call number, rdi = fd, rsi = text, rdx = length
+  using Reg = X86Emitter::Reg;
+#if defined(__APPLE__)
+  constexpr auto write_syscall = uint64_t{0x02000004}; // macOS write
+#else
+  constexpr auto write_syscall = uint64_t{1}; // Linux write
+#endif
+  emitter.mov_imm(Reg::rax, write_syscall); // mov eax, n - System call
+  emitter.mov_imm(Reg::rdi, 1);             // mov edi, 1 - stdout
+  emitter.lea_rip(Reg::rsi, text); // lea rsi, [rip+text] - Address of text
+  emitter.mov_imm(Reg::rdx, length); // mov edx, len - Length
+  const auto length_end = emitter.size();
+  emitter.syscall(); // syscall - Ask the operating system to write the text
+  return length_end;
+#endif
+}
+#endif
+
+/**
+ * Emit the greeting program (write system call + ret, then the text)
+ */
+auto emit_greeting(NativeEmitter& emitter, MessagePieces pieces,
+                   const CodegenOptions& options = {}) -> void;
+
+/**
+ * Emit only the instructions of the greeting; they print length bytes at
+ * text, which the caller binds wherever the text lives
+ *
+ * Returns the offset right after the instruction that loads the length (0
+ * if the code has no length in it, as on Apple Silicon).
+ */
+auto emit_greeting_code(NativeEmitter& emitter, size_t length, Label text,
+                        const CodegenOptions& options = {}) -> size_t;
+
+/**
+ * The greeting code of one CodegenOptions, finished once and copied for
+ * every stub of a batch
+ *
+ * WHY WE NEED THIS:
+ * - The stubs of a batch are the same instructions; only the length
+ *   immediate and the distance to the text differ
+ * - Copying a fixed kSize block is a couple of vector stores (AVX/NEON),
+ *   and then two 4-byte fields are patched: no encoder runs per stub
+ * - Instrumented stubs (CodegenOptions::counters) each have their own
+ *   counter address, so they have no template
+ */
+struct GreetingTemplate {
+  static constexpr size_t kNone = SIZE_MAX;
+  static constexpr size_t kSize = 64; // Any uninstrumented greeting fits
+
+  std::array<uint8_t, kSize> code{}; // Padded with traps
+  size_t size = 0;           // Bytes of real code
+  size_t length_at = kNone;  // imm32 (x86-64) or movz (AArch64) of the length
+  size_t text_at = kNone;    // rel32 (x86-64) or adr (AArch64) of the text
+  size_t min_length = 0;     // Lengths that keep the template's encoding
+  size_t max_length = SIZE_MAX;
+
+  [[nodiscard]] constexpr auto fits(size_t length) const noexcept -> bool
+  {
+    return length >= min_length && length <= max_length;
+  }
+};
+
+/**
+ * Finish the greeting for options once (throws for instrumented options)
+ */
+[[nodiscard]] auto make_greeting_template(const CodegenOptions& options = {})
+    -> GreetingTemplate;
+
+/**
+ * Copy the template to stub and fill in length and where the text is
+ * (text_offset bytes from the start of stub)
+ *
+ * - Writes all GreetingTemplate::kSize bytes (the tail is traps, and the
+ *   next stub or the text may overwrite it), so stub needs that much room
+ * - length must fit the template
+ */
+inline auto stamp_greeting(uint8_t* stub, const GreetingTemplate& stamp,
+                           size_t length, int64_t text_offset) -> void
+{
+  std::memcpy(stub, stamp.code.data(), GreetingTemplate::kSize); // Vectors
+  if (stamp.length_at != GreetingTemplate::kNone) {
+#if defined(__aarch64__)
+    auto movz = uint32_t{0};
+    std::memcpy(&movz, stub + stamp.length_at, 4);
+    movz = (movz & ~(0xFFFFu << 5)) | (static_cast<uint32_t>(length) << 5);
+    std::memcpy(stub + stamp.length_at, &movz, 4);
+#else
+    const auto imm = static_cast<uint32_t>(length);
+    std::memcpy(stub + stamp.length_at, &imm, 4);
+#endif
+  }
+  if (stamp.text_at != GreetingTemplate::kNone) {
+#if defined(__aarch64__)
+    auto adr = uint32_t{0};
+    std::memcpy(&adr, stub + stamp.text_at, 4);
+    adr = A64Emitter::with_pc_offset(adr, EmitterBase::FixupKind::kAdr21,
+                                     text_offset -
+                                         static_cast<int64_t>(stamp.text_at));
+    std::memcpy(stub + stamp.text_at, &adr, 4);
+#else
+    const auto displacement =
+        text_offset - static_cast<int64_t>(stamp.text_at + 4);
+    if (displacement < INT32_MIN || displacement > INT32_MAX) {
+      throw std::runtime_error("RIP-relative target out of range");
+    }
+    const auto rel32 = static_cast<int32_t>(displacement);
+    std::memcpy(stub + stamp.text_at, &rel32, 4);
+#endif
+  }
+}
+
+/**
+ * The greeting run by host code instead of generated code (the portable
+ * tier): the same output, through the same OutputMode, as the stub
+ * compiled with these options - no code memory needed
+ *
+ * - On Apple Silicon this is also what prints after a stub returns (see
+ *   main)
+ * - Counters in options are not touched (only generated code counts)
+ */
+auto interpret_greeting(std::string_view text,
+                        const CodegenOptions& options = {}) -> void;
+
+/**
+ * Largest write(2) Linux does in one call (bigger writes come back short)
+ */
+inline constexpr size_t kMaxSingleWrite = 0x7FFFF000;
+
+/**
+ * Emit a stub that writes data with ONE write system call, without copying
+ * data into the code
+ *
+ * - data's address and length are 64-bit literals after the code, loaded
+ *   PC-relative (ldr x1/x2, literal on ARM64, mov rsi/rdx, [rip+literal] on
+ *   x86-64), so the buffer may be anywhere and any size up to
+ *   kMaxSingleWrite (multi-MB log blobs, precomputed responses)
+ * - data must stay valid for as long as the stub can be called
+ * - Fits in kMaxStubCodeSize bytes
+ */
+auto emit_far_write(NativeEmitter& emitter, std::span<const char> data)
+    -> void;
+
+/**
+ * Emit the finished machine code for a message straight into destination
+ *
+ * - destination can be the writable view of an arena slot, so nothing is
+ *   allocated and nothing is copied afterwards
+ * - Returns the number of bytes written (throws if destination is too small)
+ */
+[[nodiscard]] auto emit_machine_code(std::span<uint8_t> destination,
+                                     MessagePieces pieces,
+                                     const CodegenOptions& options = {})
+    -> size_t;
+[[nodiscard]] auto emit_machine_code(std::span<uint8_t> destination,
+                                     std::string_view hello_name,
+                                     const CodegenOptions& options = {})
+    -> size_t;
+
+/**
+ * Build the finished machine code for one message in a new vector
+ */
+[[nodiscard]] auto build_machine_code(std::string_view hello_name)
+    -> std::vector<uint8_t>;
+
+/**
+ * Print machine code bytes in hexadecimal (for debugging)
+ */
+auto show_machine_code(std::span<const uint8_t> machine_code) -> void;
+
+} // namespace mijit
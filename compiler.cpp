@@ -0,0 +1,283 @@
+/**
+ * @file compiler.cpp
+ * @brief Single-stub and batch compilation into the code arena
+ */
+
+#include "compiler.hpp"
+
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+
+#include "ir.hpp"
+#include "jit_stats.hpp"
+#include "stub_profile.hpp"
+
+namespace mijit {
+
+namespace {
+
+#if defined(__aarch64__)
+constexpr size_t kAdrReach = size_t{1} << 20; // adr: +/-1 MiB
+#endif
+
+[[nodiscard]] constexpr auto align_up(size_t value, size_t alignment) noexcept
+    -> size_t
+{
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+/**
+ * HELPER FUNCTION: The template every stub of the batch can be a copy of,
+ * if there is one (not for instrumented stubs or lengths it cannot hold)
+ */
+[[nodiscard]] auto batch_template(const CodegenOptions& options,
+                                  std::span<const std::string_view> messages)
+    -> std::optional<GreetingTemplate>
+{
+  if (options.counters != nullptr) {
+    return std::nullopt;
+  }
+  auto stamp = make_greeting_template(options);
+  for (const auto message : messages) {
+    if (!stamp.fits(message.size())) {
+      return std::nullopt;
+    }
+  }
+  return stamp;
+}
+
+/**
+ * HELPER FUNCTION: Options of stub index of a batch (each instrumented stub
+ * counts into its own entry, counters[index])
+ */
+[[nodiscard]] auto stub_options(const CodegenOptions& options, size_t index)
+    -> CodegenOptions
+{
+  auto result = options;
+  if (result.counters != nullptr) {
+    result.counters += index;
+  }
+  return result;
+}
+
+/**
+ * HELPER FUNCTION: A batch with code and text in separate pages
+ *
+ * STEP BY STEP:
+ * 1. Worst-case code size decides where the data pages start
+ * 2. One slot: code pages, then data pages
+ * 3. Write each stub's instructions into the code pages - stamped from the
+ *    template when every length fits it (the stubs are then all the same
+ *    size, back to back), emitted otherwise - pointing at where its text
+ *    goes in the data pages, and copy the text there
+ * 4. Publish (seal and flush everything written since the last publish,
+ *    so stubs compiled before the batch and not published yet are covered
+ *    too), then take execute permission away from the data pages
+ *
+ * AArch64: adr reaches 1 MiB, so the text of the last stub must start less
+ * than that after its code. Huge-page arenas never allow it (the data
+ * pages start a whole 2 MiB page after the code) and are refused before
+ * anything is allocated, like batches too big for the reach.
+ */
+auto compile_split_batch(CodeArena& arena,
+                         std::span<const std::string_view> messages,
+                         std::span<StubFunction> entries,
+                         const CodegenOptions& options) -> void
+{
+  const auto stamp = batch_template(options, messages);
+
+  // STEP 1: Sizes of both sections
+  const auto granule = arena.granule();
+  auto code_bound = size_t{0};
+  auto data_size = size_t{0};
+  for (const auto message : messages) {
+    code_bound = align_up(code_bound, kStubAlignment) + kMaxStubCodeSize;
+    data_size += message.size();
+  }
+  const auto data_offset = align_up(code_bound, granule);
+  const auto data_pages = align_up(data_size, granule);
+#if defined(__aarch64__)
+  if (arena.uses_huge_pages()) {
+    throw std::runtime_error(
+        "Split batches need an arena without huge pages on AArch64 (adr "
+        "reaches 1 MiB, the data pages start a huge page after the code)");
+  }
+  if (data_offset + data_size > kAdrReach) {
+    throw std::runtime_error(
+        "Split batch too big: text beyond the 1 MiB reach of adr");
+  }
+#endif
+
+  // STEP 2: Code pages followed by data pages
+  auto slot = arena.allocate(data_offset + data_pages, granule);
+
+  // STEP 3: Instructions here, text there
+  auto code = size_t{0};
+  auto data = data_offset;
+  for (size_t i = 0; i < messages.size(); ++i) {
+    code = align_up(code, kStubAlignment);
+    entries[i] = as_function(slot.executable + code); // Callable after seal
+    if (stamp) {
+      stamp_greeting(slot.writable.data() + code, *stamp, messages[i].size(),
+                     static_cast<int64_t>(data - code));
+      code += stamp->size;
+    }
+    else {
+      NativeEmitter emitter{slot.writable.subspan(code)};
+      const auto text = emitter.new_label();
+      emit_greeting_code(emitter, messages[i].size(), text,
+                         stub_options(options, i));
+      emitter.bind_at(text, data - code);
+      code += emitter.finish();
+    }
+    if (!messages[i].empty()) {
+      std::memcpy(slot.writable.data() + data, messages[i].data(),
+                  messages[i].size());
+    }
+    data += messages[i].size();
+  }
+
+  // Never written: the gap after the code and the tail of the data pages
+  const auto unused = (data_offset - code) + (data_pages - data_size);
+  count_jit(JitCounter::kBytesTrimmed, unused);
+  count_jit(JitCounter::kBytesPadding, unused);
+
+  // STEP 4: Code executable, text read-only (the flush covers the text
+  // too: that costs a few cache maintenance steps, it does not load it)
+  arena.publish();
+  arena.make_read_only(slot.executable + data_offset, data_pages);
+}
+
+} // namespace
+
+[[nodiscard]] auto compile_stub(CodeArena& arena, MessagePieces pieces,
+                                const CodegenOptions& options) -> CodeSlot
+{
+  const CompileTimer timer;
+  auto slot = arena.allocate(machine_code_size_bound(pieces), kStubAlignment);
+  const auto size = emit_machine_code(slot.writable, pieces, options);
+  arena.trim(slot, size); // Keep only what the emitter wrote
+  return slot;
+}
+
+[[nodiscard]] auto compile_stub(CodeArena& arena, std::string_view hello_name,
+                                const CodegenOptions& options) -> CodeSlot
+{
+  return compile_stub(arena, MessagePieces{&hello_name, 1}, options);
+}
+
+[[nodiscard]] auto compile_far_write(CodeArena& arena,
+                                     std::span<const char> data) -> CodeSlot
+{
+  const CompileTimer timer;
+  auto slot = arena.allocate(kMaxStubCodeSize, kStubAlignment);
+  NativeEmitter emitter{slot.writable};
+  emit_far_write(emitter, data);
+  arena.trim(slot, emitter.finish());
+  return slot;
+}
+
+[[nodiscard]] auto compile_function(CodeArena& arena,
+                                    const ir::Function& function) -> CodeSlot
+{
+  const CompileTimer timer;
+  auto slot = arena.allocate(ir::code_size_bound(function), kStubAlignment);
+  NativeEmitter emitter{slot.writable};
+  arena.trim(slot, ir::lower(emitter, function));
+  return slot;
+}
+
+[[nodiscard]] auto compile_stub(ThreadArena& arena, MessagePieces pieces,
+                                const CodegenOptions& options) -> CodeSlot
+{
+  auto& slab = arena.reserve(machine_code_size_bound(pieces), kStubAlignment);
+  return compile_stub(slab, pieces, options);
+}
+
+[[nodiscard]] auto compile_stub(ThreadArena& arena,
+                                std::string_view hello_name,
+                                const CodegenOptions& options) -> CodeSlot
+{
+  return compile_stub(arena, MessagePieces{&hello_name, 1}, options);
+}
+
+[[nodiscard]] auto compile_stub(CodeHeap& heap, std::string_view hello_name,
+                                const CodegenOptions& options) -> CodeSlot
+{
+  const CompileTimer timer;
+  auto slot = heap.allocate(machine_code_size_bound(hello_name));
+  const auto size = emit_machine_code(slot.writable, hello_name, options);
+  count_jit(JitCounter::kBytesTrimmed, slot.writable.size() - size);
+  count_jit(JitCounter::kBytesPadding, slot.writable.size() - size);
+  slot.writable = slot.writable.first(size);
+  return slot;
+}
+
+auto compile_batch(CodeArena& arena, std::span<const std::string_view> messages,
+                   std::span<StubFunction> entries,
+                   const CodegenOptions& options, BatchLayout layout) -> void
+{
+  if (entries.size() < messages.size()) {
+    throw std::runtime_error("Not enough room for the batch entry points");
+  }
+  if (messages.empty()) {
+    return;
+  }
+  const CompileTimer timer;
+  if (layout == BatchLayout::kSplit) {
+    compile_split_batch(arena, messages, entries, options);
+    return;
+  }
+
+  // STEP 1: Worst-case size of the whole batch
+  auto bound = size_t{0};
+  for (const auto message : messages) {
+    bound = align_up(bound, kStubAlignment) + machine_code_size_bound(message);
+  }
+
+  // STEP 2: One slot for the whole batch
+  auto slot = arena.allocate(bound, kStubAlignment);
+
+  // STEP 3: Write each stub in place (its text follows it, so the RIP/PC-
+  // relative address inside the stub stays valid wherever the stub lands):
+  // a copy of the template when every length fits it, emitted otherwise
+  const auto stamp = batch_template(options, messages);
+  auto offset = size_t{0};
+  for (size_t i = 0; i < messages.size(); ++i) {
+    offset = align_up(offset, kStubAlignment);
+    entries[i] = as_function(slot.executable + offset); // Callable after seal
+    if (!stamp) {
+      offset += emit_machine_code(slot.writable.subspan(offset), messages[i],
+                                  stub_options(options, i));
+      continue;
+    }
+    auto* stub = slot.writable.data() + offset;
+    const auto size = messages[i].size();
+    stamp_greeting(stub, *stamp, size, static_cast<int64_t>(stamp->size));
+#if !defined(__APPLE__) || !defined(__aarch64__) // Apple: the host prints
+    if (size != 0) {
+      std::memcpy(stub + stamp->size, messages[i].data(), size);
+    }
+    offset += size;
+#endif
+    offset += stamp->size;
+  }
+  arena.trim(slot, offset);
+
+  // STEP 4: One mprotect and one instruction cache flush for everything
+  arena.publish();
+}
+
+[[nodiscard]] auto compile_batch(CodeArena& arena,
+                                 std::span<const std::string_view> messages,
+                                 const CodegenOptions& options,
+                                 BatchLayout layout)
+    -> std::vector<StubFunction>
+{
+  std::vector<StubFunction> entries(messages.size());
+  compile_batch(arena, messages, entries, options, layout);
+  return entries;
+}
+
+} // namespace mijit
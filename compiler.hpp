@@ -0,0 +1,141 @@
+/**
+ * @file compiler.hpp
+ * @brief Compile messages straight into the code arena
+ *
+ * HOW A BATCH WORKS:
+ * 1. Add up how much space every message needs (code + text)
+ * 2. Take ONE slot from the code arena big enough for all of them
+ * 3. Emit the stubs back to back straight into that slot, each followed by
+ *    its own text, so the RIP/PC-relative address in each stub points at the
+ *    right text
+ * 4. Publish once (seal + instruction cache flush) for the whole batch
+ *
+ * WHY WE NEED THIS:
+ * - Compiling stubs one at a time costs one mprotect (and one cache flush)
+ *   per stub; a batch pays for them once
+ * - Emitting in place means no std::vector and no extra copy per stub
+ * - The stubs of a batch share one GreetingTemplate: the code is encoded
+ *   once and each stub is a block copy plus two patched fields (lengths
+ *   the template's encoding cannot hold make the batch use the emitter)
+ *
+ * SPLIT LAYOUT (BatchLayout::kSplit):
+ * - All instructions packed together in code pages, all text in separate
+ *   data pages of the same slot, made read-only and not executable
+ * - Hot code is dense (fewer icache lines and iTLB entries) and the text
+ *   can never be executed
+ * - Each stub reaches its text with the same RIP/PC-relative fixup, just
+ *   with the label bound in the data pages
+ * - LIMIT on AArch64: adr reaches +/-1 MiB, so code + text of a split batch
+ *   must stay below that, and the arena must not use huge pages (its data
+ *   pages would start 2 MiB after the code); compile_batch throws before
+ *   allocating anything when either is not met. x86-64 reaches 2 GiB
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "code_heap.hpp"
+#include "codegen.hpp"
+#include "jit_memory.hpp"
+#include "slab_pool.hpp"
+
+namespace mijit {
+
+namespace ir {
+class Function;
+} // namespace ir
+
+/**
+ * Alignment of each stub inside a batch (keeps entry points on fetch
+ * boundaries)
+ */
+inline constexpr size_t kStubAlignment = 16;
+
+/**
+ * Where a batch puts the text of its stubs
+ *
+ * - kInline: right after each stub (one region, smallest)
+ * - kSplit:  in separate read-only data pages after all the code
+ */
+enum class BatchLayout {
+  kInline,
+  kSplit,
+};
+
+/**
+ * Emit one stub straight into the arena
+ *
+ * The arena is NOT published here, so several stubs can share one
+ * publish().
+ * Returns the slot, trimmed to the bytes actually written.
+ */
+[[nodiscard]] auto compile_stub(CodeArena& arena, MessagePieces pieces,
+                                const CodegenOptions& options = {})
+    -> CodeSlot;
+[[nodiscard]] auto compile_stub(CodeArena& arena, std::string_view hello_name,
+                                const CodegenOptions& options = {})
+    -> CodeSlot;
+
+/**
+ * Emit a stub that writes data (which stays where it is) with one system
+ * call - see emit_far_write; not published
+ */
+[[nodiscard]] auto compile_far_write(CodeArena& arena,
+                                     std::span<const char> data) -> CodeSlot;
+
+/**
+ * Emit an IR function (see ir.hpp; run ir::optimize first) as native code;
+ * not published
+ */
+[[nodiscard]] auto compile_function(CodeArena& arena,
+                                    const ir::Function& function) -> CodeSlot;
+
+/**
+ * Emit one stub into this thread's arena (takes a new slab when the current
+ * one is full; not published either)
+ */
+[[nodiscard]] auto compile_stub(ThreadArena& arena, MessagePieces pieces,
+                                const CodegenOptions& options = {})
+    -> CodeSlot;
+[[nodiscard]] auto compile_stub(ThreadArena& arena,
+                                std::string_view hello_name,
+                                const CodegenOptions& options = {})
+    -> CodeSlot;
+
+/**
+ * Emit one stub into a reusable slot of the code heap (call
+ * CodeHeap::publish before running it, CodeHeap::retire when done)
+ */
+[[nodiscard]] auto compile_stub(CodeHeap& heap, std::string_view hello_name,
+                                const CodegenOptions& options = {})
+    -> CodeSlot;
+
+/**
+ * Compile every message into one contiguous block of code
+ *
+ * Writes the entry point of each stub to entries (same order as messages,
+ * entries.size() must be at least messages.size()). Does not allocate.
+ * With options.counters, stub i counts into options.counters[i].
+ * Publishes the arena, which also covers stubs compiled into it earlier
+ * and not published yet. BatchLayout::kSplit has a limit on AArch64 (see
+ * SPLIT LAYOUT above) and throws when the batch breaks it.
+ */
+auto compile_batch(CodeArena& arena, std::span<const std::string_view> messages,
+                   std::span<StubFunction> entries,
+                   const CodegenOptions& options = {},
+                   BatchLayout layout = BatchLayout::kInline) -> void;
+
+/**
+ * Same as above, returning the entry points in a new vector
+ */
+[[nodiscard]] auto compile_batch(CodeArena& arena,
+                                 std::span<const std::string_view> messages,
+                                 const CodegenOptions& options = {},
+                                 BatchLayout layout = BatchLayout::kInline)
+    -> std::vector<StubFunction>;
+
+} // namespace mijit
@@ -0,0 +1,144 @@
+/**
+ * @file cpu_features.cpp
+ * @brief cpuid / getauxval probing and the MIJIT_CPU_DISABLE override
+ */
+
+#include "cpu_features.hpp"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#if defined(__linux__) && defined(__aarch64__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace mijit {
+
+namespace {
+
+/**
+ * Name and member of every feature, for parsing and printing
+ */
+struct FeatureName {
+  std::string_view name;
+  bool CpuFeatures::* flag;
+};
+
+constexpr FeatureName kFeatureNames[] = {
+    {"avx2", &CpuFeatures::avx2},
+    {"avx512f", &CpuFeatures::avx512f},
+    {"lse", &CpuFeatures::lse},
+    {"sve", &CpuFeatures::sve},
+};
+
+#if defined(__x86_64__)
+/**
+ * HELPER FUNCTION: Which register states the OS saves (XCR0)
+ *
+ * Only valid when cpuid reports OSXSAVE.
+ */
+[[nodiscard]] auto xgetbv0() noexcept -> uint64_t
+{
+  uint32_t low = 0;
+  uint32_t high = 0;
+  __asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+  return (uint64_t{high} << 32) | low;
+}
+
+auto detect_x86(CpuFeatures& features) noexcept -> void
+{
+  constexpr auto kOsxsave = 1u << 27; // cpuid 1, ecx
+  constexpr auto kAvx = 1u << 28;     // cpuid 1, ecx
+  constexpr auto kAvx2 = 1u << 5;     // cpuid 7, ebx
+  constexpr auto kAvx512f = 1u << 16; // cpuid 7, ebx
+  constexpr auto kYmmState = uint64_t{0x06};  // XCR0: SSE + AVX
+  constexpr auto kZmmState = uint64_t{0xE6};  // ... + opmask, ZMM
+
+  unsigned eax = 0;
+  unsigned ebx = 0;
+  unsigned ecx = 0;
+  unsigned edx = 0;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0 ||
+      (ecx & (kOsxsave | kAvx)) != (kOsxsave | kAvx)) {
+    return; // No AVX at all, or an OS that does not save ymm
+  }
+  const auto xcr0 = xgetbv0();
+  if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) == 0) {
+    return;
+  }
+  features.avx2 = (ebx & kAvx2) != 0 && (xcr0 & kYmmState) == kYmmState;
+  features.avx512f =
+      (ebx & kAvx512f) != 0 && (xcr0 & kZmmState) == kZmmState;
+}
+#endif
+
+} // namespace
+
+auto detect_cpu_features() noexcept -> CpuFeatures
+{
+  auto features = CpuFeatures{};
+#if defined(__x86_64__)
+  detect_x86(features);
+#elif defined(__APPLE__) && defined(__aarch64__)
+  features.lse = true; // Every Apple Silicon core has them, none has SVE
+#elif defined(__linux__) && defined(__aarch64__)
+  const auto hwcap = getauxval(AT_HWCAP);
+  features.lse = (hwcap & HWCAP_ATOMICS) != 0;
+  features.sve = (hwcap & HWCAP_SVE) != 0;
+#endif
+  return features;
+}
+
+auto disable_cpu_features(CpuFeatures& features, std::string_view list)
+    -> void
+{
+  while (!list.empty()) {
+    const auto comma = list.find(',');
+    const auto name = list.substr(0, comma);
+    auto known = name.empty();
+    for (const auto& feature : kFeatureNames) {
+      if (name == feature.name || name == "all") {
+        features.*feature.flag = false;
+        known = true;
+      }
+    }
+    if (!known) {
+      throw std::runtime_error("Unknown CPU feature: " + std::string{name});
+    }
+    list = comma == std::string_view::npos ? std::string_view{}
+                                           : list.substr(comma + 1);
+  }
+}
+
+auto host_cpu_features() -> const CpuFeatures&
+{
+  static const auto features = [] {
+    auto detected = detect_cpu_features();
+    if (const auto* disabled = std::getenv("MIJIT_CPU_DISABLE")) {
+      disable_cpu_features(detected, disabled);
+    }
+    return detected;
+  }();
+  return features;
+}
+
+auto describe_cpu_features(const CpuFeatures& features) -> std::string
+{
+  auto description = std::string{};
+  for (const auto& feature : kFeatureNames) {
+    if (features.*feature.flag) {
+      if (!description.empty()) {
+        description += ' ';
+      }
+      description += feature.name;
+    }
+  }
+  return description.empty() ? "baseline" : description;
+}
+
+} // namespace mijit
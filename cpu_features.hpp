@@ -0,0 +1,73 @@
+/**
+ * @file cpu_features.hpp
+ * @brief What the processor we run on can do, probed at startup
+ *
+ * HOW IT WORKS:
+ * - x86-64: cpuid for the instruction sets, xgetbv for whether the OS
+ *   saves the wider registers on a context switch (without that the
+ *   instructions exist but must not be used)
+ * - AArch64 Linux: getauxval(AT_HWCAP), the kernel's view of the CPU
+ * - host_cpu_features() probes once; code generators ask it which
+ *   instruction variant to emit
+ *
+ * WHY WE NEED THIS:
+ * - The build only fixes the architecture: one binary runs on a whole fleet
+ *   of different machines, and #if cannot know whether this one has AVX-512
+ *   or SVE. Picking when the code is generated gives every box the fastest
+ *   code it supports
+ *
+ * THE FEATURES:
+ * - avx2:    32-byte vector copies (ymm)
+ * - avx512f: 64-byte vector copies (zmm)
+ * - lse:     ARMv8.1 atomics, stadd for stub counters
+ * - sve:     scalable vector copies (whatever vector length the CPU has)
+ *
+ * NOTES:
+ * - MIJIT_CPU_DISABLE=avx512f,sve (or "all") switches features off before
+ *   anything is generated: to test the fallback paths, or to match the
+ *   oldest machine when generated code is shared with others
+ * - A feature of the other architecture is always false, so code emitted
+ *   for it (see ir::lower()) uses the baseline variant
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace mijit {
+
+struct CpuFeatures {
+  // x86-64
+  bool avx2 = false;
+  bool avx512f = false;
+  // AArch64
+  bool lse = false;
+  bool sve = false;
+};
+
+/**
+ * Probe the processor now (no MIJIT_CPU_DISABLE)
+ */
+[[nodiscard]] auto detect_cpu_features() noexcept -> CpuFeatures;
+
+/**
+ * Switch off the features in a comma-separated list of names (or "all");
+ * throws on an unknown name
+ */
+auto disable_cpu_features(CpuFeatures& features, std::string_view list)
+    -> void;
+
+/**
+ * The features of this machine minus MIJIT_CPU_DISABLE, probed on the
+ * first call (thread-safe); throws if the variable names an unknown feature
+ */
+[[nodiscard]] auto host_cpu_features() -> const CpuFeatures&;
+
+/**
+ * "avx2 avx512f", or "baseline" when there are none
+ */
+[[nodiscard]] auto describe_cpu_features(const CpuFeatures& features)
+    -> std::string;
+
+} // namespace mijit
@@ -0,0 +1,1219 @@
+/**
+ * @file emitter.hpp
+ * @brief Tiny typed assemblers for x86-64 and AArch64
+ *
+ * HOW IT WORKS:
+ * - An emitter writes instructions straight into a buffer you give it
+ *   (it never allocates or grows the buffer)
+ * - Each instruction helper picks the shortest encoding for its operands
+ * - Labels mark positions (for example where the message text starts);
+ *   instructions that refer to a label are recorded as "fixups" and patched
+ *   with the real distance in finish()
+ * - Constants that don't fit in an instruction (far addresses, 64-bit
+ *   lengths) can go in a literal pool after the code: a PC-relative load
+ *   of a label, then emit_literal64() with that label
+ *
+ * WHY WE NEED THIS:
+ * - Hand-patching bytes at fixed offsets breaks as soon as an instruction
+ *   changes size, and silently truncates values that don't fit
+ * - Generating code becomes "one call per instruction"
+ *
+ * Everything here is constexpr, so the same emitters can also run at
+ * compile time.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+
+namespace mijit {
+
+/**
+ * A position in the generated code, created by new_label() and placed with
+ * bind()
+ */
+struct Label {
+  uint16_t id = 0;
+};
+
+/**
+ * COMMON PART OF BOTH EMITTERS: buffer, labels and fixups
+ *
+ * Labels and fixups live in fixed-size arrays so emitting never touches the
+ * heap.
+ */
+class EmitterBase {
+public:
+  static constexpr size_t kMaxLabels = 64;
+  static constexpr size_t kMaxFixups = 128;
+
+  enum class FixupKind : uint8_t {
+    kRel32, // x86-64: 32-bit displacement from the end of the field
+    kAdr21, // AArch64: adr immediate, relative to the instruction
+    kLdr19, // AArch64: ldr (literal) / cbnz word offset, from the instruction
+    kBranch26, // AArch64: b word offset, from the instruction
+  };
+
+  struct Fixup {
+    uint32_t position = 0; // Where the field (or instruction) starts
+    uint16_t label = 0;
+    FixupKind kind = FixupKind::kRel32;
+  };
+
+  constexpr explicit EmitterBase(std::span<uint8_t> buffer) noexcept
+      : buffer_{buffer}
+  {
+  }
+
+  /**
+   * Create a label that is not placed anywhere yet
+   */
+  [[nodiscard]] constexpr auto new_label() -> Label
+  {
+    if (label_count_ == kMaxLabels) {
+      throw std::runtime_error("Emitter ran out of labels");
+    }
+    label_positions_[label_count_] = kUnbound;
+    return Label{static_cast<uint16_t>(label_count_++)};
+  }
+
+  /**
+   * Place a label at the current position
+   */
+  constexpr auto bind(Label label) -> void
+  {
+    label_positions_[label.id] = static_cast<uint32_t>(position_);
+  }
+
+  /**
+   * Place a label at any offset of the buffer, also past what has been
+   * written so far (for example text in a separate data section)
+   */
+  constexpr auto bind_at(Label label, size_t position) -> void
+  {
+    if (position > buffer_.size()) {
+      throw std::runtime_error("Emitter label outside the buffer");
+    }
+    label_positions_[label.id] = static_cast<uint32_t>(position);
+  }
+
+  /**
+   * Copy raw bytes (for example the message text) into the code
+   */
+  constexpr auto emit_bytes(std::string_view bytes) -> void
+  {
+    reserve(bytes.size());
+    for (const auto character : bytes) {
+      buffer_[position_++] = static_cast<uint8_t>(character);
+    }
+  }
+
+  /**
+   * Pad with fill bytes up to a multiple of alignment (a power of two)
+   */
+  constexpr auto align(size_t alignment, uint8_t fill = 0) -> void
+  {
+    while ((position_ & (alignment - 1)) != 0) {
+      emit8(fill);
+    }
+  }
+
+  /**
+   * Add an 8-byte literal to the pool: aligns to 8 and binds literal (the
+   * label the PC-relative loads refer to) to it
+   */
+  constexpr auto emit_literal64(Label literal, uint64_t value) -> void
+  {
+    align(8);
+    bind(literal);
+    emit_le(value, 8);
+  }
+
+  /**
+   * Offset of the label in the buffer (the label must be bound)
+   */
+  [[nodiscard]] constexpr auto label_offset(Label label) const -> size_t
+  {
+    if (label_positions_[label.id] == kUnbound) {
+      throw std::runtime_error("Emitter label was never bound");
+    }
+    return label_positions_[label.id];
+  }
+
+  /**
+   * Every label reference recorded so far (the relocations of the code)
+   */
+  [[nodiscard]] constexpr auto fixups() const noexcept
+      -> std::span<const Fixup>
+  {
+    return std::span<const Fixup>{fixups_.data(), fixup_count_};
+  }
+
+  /**
+   * Number of bytes written so far
+   */
+  [[nodiscard]] constexpr auto size() const noexcept -> size_t
+  {
+    return position_;
+  }
+
+protected:
+  static constexpr uint32_t kUnbound = UINT32_MAX;
+
+  /**
+   * Make sure count more bytes fit in the buffer
+   */
+  constexpr auto reserve(size_t count) const -> void
+  {
+    if (count > buffer_.size() - position_) {
+      throw std::runtime_error("Emitter buffer is too small");
+    }
+  }
+
+  constexpr auto emit8(uint8_t value) -> void
+  {
+    reserve(1);
+    buffer_[position_++] = value;
+  }
+
+  /**
+   * Write a little-endian value of `bytes` bytes
+   */
+  constexpr auto emit_le(uint64_t value, size_t bytes) -> void
+  {
+    reserve(bytes);
+    for (size_t i = 0; i < bytes; ++i) {
+      buffer_[position_++] = static_cast<uint8_t>(value >> (8 * i));
+    }
+  }
+
+  constexpr auto add_fixup(Label label, FixupKind kind) -> void
+  {
+    if (fixup_count_ == kMaxFixups) {
+      throw std::runtime_error("Emitter ran out of fixups");
+    }
+    fixups_[fixup_count_++] =
+        Fixup{static_cast<uint32_t>(position_), label.id, kind};
+  }
+
+  [[nodiscard]] constexpr auto read_le(size_t position, size_t bytes) const
+      -> uint64_t
+  {
+    auto value = uint64_t{0};
+    for (size_t i = 0; i < bytes; ++i) {
+      value |= uint64_t{buffer_[position + i]} << (8 * i);
+    }
+    return value;
+  }
+
+  constexpr auto write_le(size_t position, uint64_t value, size_t bytes)
+      -> void
+  {
+    for (size_t i = 0; i < bytes; ++i) {
+      buffer_[position + i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+  }
+
+  std::span<uint8_t> buffer_;
+  size_t position_ = 0;
+  std::array<uint32_t, kMaxLabels> label_positions_{};
+  size_t label_count_ = 0;
+  std::array<Fixup, kMaxFixups> fixups_{};
+  size_t fixup_count_ = 0;
+};
+
+/**
+ * X86-64 EMITTER
+ *
+ * Only the handful of instructions MiJIT needs. Encodings:
+ * - mov_imm: xor r32,r32 / mov r32,imm32 / mov r64,simm32 / movabs r64,imm64
+ * - lea_rip: lea r64, [rip + disp32]
+ * - load_rip: mov r64, [rip + disp32] (loads a literal)
+ * - inc_mem / add_mem: add to [base + disp8], lock-prefixed if asked
+ *   (stub counters)
+ * - load / store / lea: [base + disp8/disp32], any base (SIB for rsp/r12)
+ * - load_sized / store_sized: 1, 2, 4 or 8 bytes (loads zero-extend)
+ * - vector_load / vector_store: movdqu (SSE2), vmovdqu xmm/ymm (VEX) or
+ *   vmovdqu64 zmm (EVEX) at [base + offset]; the caller checks the CPU
+ * - jmp / jz / jnz: to a label, always rel32
+ */
+class X86Emitter : public EmitterBase {
+public:
+  enum class Reg : uint8_t {
+    rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+    r8, r9, r10, r11, r12, r13, r14, r15,
+  };
+
+  using EmitterBase::EmitterBase;
+
+  /**
+   * reg = value, using the shortest encoding
+   */
+  constexpr auto mov_imm(Reg reg, uint64_t value) -> void
+  {
+    const auto r = static_cast<uint8_t>(reg);
+    if (value == 0) {
+      // xor r32, r32 (also clears the upper 32 bits) - 2 or 3 bytes
+      rex(false, r, r);
+      emit8(0x31);
+      emit8(modrm(3, r, r));
+    }
+    else if (value <= UINT32_MAX) {
+      // mov r32, imm32 (zero-extends to 64 bits) - 5 or 6 bytes
+      rex(false, 0, r);
+      emit8(static_cast<uint8_t>(0xB8 + (r & 7)));
+      emit_le(value, 4);
+    }
+    else if (static_cast<int64_t>(value) >= INT32_MIN &&
+             static_cast<int64_t>(value) < 0) {
+      // mov r64, simm32 (sign-extends) - 7 bytes
+      rex(true, 0, r);
+      emit8(0xC7);
+      emit8(modrm(3, 0, r));
+      emit_le(value, 4);
+    }
+    else {
+      // movabs r64, imm64 - 10 bytes
+      rex(true, 0, r);
+      emit8(static_cast<uint8_t>(0xB8 + (r & 7)));
+      emit_le(value, 8);
+    }
+  }
+
+  /**
+   * reg = address of label (RIP-relative)
+   */
+  constexpr auto lea_rip(Reg reg, Label target) -> void
+  {
+    const auto r = static_cast<uint8_t>(reg);
+    rex(true, r, 0);
+    emit8(0x8D);
+    emit8(modrm(0, r, 5)); // rm=101 with mod=00 means [rip + disp32]
+    add_fixup(target, FixupKind::kRel32);
+    emit_le(0, 4);
+  }
+
+  /**
+   * reg = the 8 bytes at label (RIP-relative load, e.g. from the literal
+   * pool)
+   */
+  constexpr auto load_rip(Reg reg, Label literal) -> void
+  {
+    const auto r = static_cast<uint8_t>(reg);
+    rex(true, r, 0);
+    emit8(0x8B);
+    emit8(modrm(0, r, 5)); // [rip + disp32]
+    add_fixup(literal, FixupKind::kRel32);
+    emit_le(0, 4);
+  }
+
+  constexpr auto syscall() -> void
+  {
+    emit8(0x0F);
+    emit8(0x05);
+  }
+
+  /**
+   * dst = src (64-bit)
+   */
+  constexpr auto mov_reg(Reg dst, Reg src) -> void
+  {
+    alu_reg(0x89, dst, src);
+  }
+
+  /**
+   * dst |= src (64-bit)
+   */
+  constexpr auto or_reg(Reg dst, Reg src) -> void
+  {
+    alu_reg(0x09, dst, src);
+  }
+
+  /**
+   * dst += src (64-bit)
+   */
+  constexpr auto add_reg(Reg dst, Reg src) -> void
+  {
+    alu_reg(0x01, dst, src);
+  }
+
+  /**
+   * dst -= src (64-bit)
+   */
+  constexpr auto sub_reg(Reg dst, Reg src) -> void
+  {
+    alu_reg(0x29, dst, src);
+  }
+
+  /**
+   * Flags from a & b (test a, b - zero flag set when they share no bits)
+   */
+  constexpr auto test_reg(Reg a, Reg b) -> void
+  {
+    alu_reg(0x85, a, b);
+  }
+
+  /**
+   * reg += value / reg -= value (64-bit, sign-extended immediate)
+   */
+  constexpr auto add_imm(Reg reg, int32_t value) -> void
+  {
+    alu_imm(0, reg, value);
+  }
+  constexpr auto sub_imm(Reg reg, int32_t value) -> void
+  {
+    alu_imm(5, reg, value);
+  }
+
+  /**
+   * dst = [base + offset] (64-bit)
+   */
+  constexpr auto load(Reg dst, Reg base, int32_t offset) -> void
+  {
+    const auto d = static_cast<uint8_t>(dst);
+    rex(true, d, static_cast<uint8_t>(base));
+    emit8(0x8B);
+    memory_operand(d, base, offset);
+  }
+
+  /**
+   * [base + offset] = src (64-bit)
+   */
+  constexpr auto store(Reg base, int32_t offset, Reg src) -> void
+  {
+    const auto s = static_cast<uint8_t>(src);
+    rex(true, s, static_cast<uint8_t>(base));
+    emit8(0x89);
+    memory_operand(s, base, offset);
+  }
+
+  /**
+   * dst = base + offset (lea, flags untouched)
+   */
+  constexpr auto lea(Reg dst, Reg base, int32_t offset) -> void
+  {
+    const auto d = static_cast<uint8_t>(dst);
+    rex(true, d, static_cast<uint8_t>(base));
+    emit8(0x8D);
+    memory_operand(d, base, offset);
+  }
+
+  /**
+   * dst = bytes (1, 2, 4 or 8) at [base + offset], zero-extended
+   */
+  constexpr auto load_sized(Reg dst, Reg base, int32_t offset, size_t bytes)
+      -> void
+  {
+    const auto d = static_cast<uint8_t>(dst);
+    rex(bytes == 8, d, static_cast<uint8_t>(base));
+    if (bytes <= 2) {
+      emit8(0x0F);
+      emit8(bytes == 1 ? 0xB6 : 0xB7); // movzx r32, r/m8 / r/m16
+    }
+    else {
+      emit8(0x8B);
+    }
+    memory_operand(d, base, offset);
+  }
+
+  /**
+   * bytes (1, 2, 4 or 8) at [base + offset] = the low bytes of src
+   */
+  constexpr auto store_sized(Reg base, int32_t offset, Reg src,
+                             size_t bytes) -> void
+  {
+    const auto s = static_cast<uint8_t>(src);
+    const auto b = static_cast<uint8_t>(base);
+    if (bytes == 2) {
+      emit8(0x66); // Operand size prefix: 16 bits
+    }
+    if (bytes == 1 && s >= 4 && s < 8 && ((s | b) & 8) == 0) {
+      emit8(0x40); // spl/bpl/sil/dil instead of ah/ch/dh/bh
+    }
+    rex(bytes == 8, s, b);
+    emit8(bytes == 1 ? 0x88 : 0x89);
+    memory_operand(s, base, offset);
+  }
+
+  /**
+   * vreg = bytes (16, 32 or 64) at [base + offset], unaligned
+   *
+   * 16 bytes is movdqu, or vmovdqu xmm with vex (no SSE/AVX transition
+   * stalls in code that also uses ymm); 32 bytes vmovdqu ymm; 64 bytes
+   * vmovdqu64 zmm.
+   */
+  constexpr auto vector_load(uint8_t vreg, Reg base, int32_t offset,
+                             size_t bytes, bool vex) -> void
+  {
+    vector_move(0x6F, vreg, base, offset, bytes, vex);
+  }
+
+  /**
+   * bytes (16, 32 or 64) at [base + offset] = vreg, unaligned
+   */
+  constexpr auto vector_store(Reg base, int32_t offset, uint8_t vreg,
+                              size_t bytes, bool vex) -> void
+  {
+    vector_move(0x7F, vreg, base, offset, bytes, vex);
+  }
+
+  /**
+   * Clear the upper halves of the ymm/zmm registers - before returning
+   * from code that used them, so SSE code after it runs at full speed
+   */
+  constexpr auto vzeroupper() -> void
+  {
+    emit8(0xC5);
+    emit8(0xF8);
+    emit8(0x77);
+  }
+
+  constexpr auto push(Reg reg) -> void
+  {
+    const auto r = static_cast<uint8_t>(reg);
+    rex(false, 0, r);
+    emit8(static_cast<uint8_t>(0x50 + (r & 7)));
+  }
+
+  constexpr auto pop(Reg reg) -> void
+  {
+    const auto r = static_cast<uint8_t>(reg);
+    rex(false, 0, r);
+    emit8(static_cast<uint8_t>(0x58 + (r & 7)));
+  }
+
+  /**
+   * Jump to label (jmp rel32)
+   */
+  constexpr auto jmp(Label target) -> void
+  {
+    emit8(0xE9);
+    add_fixup(target, FixupKind::kRel32);
+    emit_le(0, 4);
+  }
+
+  /**
+   * Jump to label if the zero flag is set / clear (jz / jnz rel32)
+   */
+  constexpr auto jz(Label target) -> void
+  {
+    jcc(0x84, target);
+  }
+  constexpr auto jnz(Label target) -> void
+  {
+    jcc(0x85, target);
+  }
+
+  /**
+   * reg <<= count (64-bit)
+   */
+  constexpr auto shl_imm(Reg reg, uint8_t count) -> void
+  {
+    const auto r = static_cast<uint8_t>(reg);
+    rex(true, 0, r);
+    emit8(0xC1);
+    emit8(modrm(3, 4, r)); // C1 /4 ib
+    emit8(count);
+  }
+
+  /**
+   * edx:eax = time stamp counter
+   */
+  constexpr auto rdtsc() -> void
+  {
+    emit8(0x0F);
+    emit8(0x31);
+  }
+
+  /**
+   * [lock] inc qword [base + offset]
+   */
+  constexpr auto inc_mem(Reg base, int8_t offset, bool lock) -> void
+  {
+    const auto b = memory_base(base);
+    if (lock) {
+      emit8(0xF0);
+    }
+    rex(true, 0, b);
+    emit8(0xFF);
+    emit8(modrm(1, 0, b)); // FF /0, [base + disp8]
+    emit8(static_cast<uint8_t>(offset));
+  }
+
+  /**
+   * [lock] add qword [base + offset], value
+   */
+  constexpr auto add_mem(Reg base, int8_t offset, Reg value, bool lock)
+      -> void
+  {
+    const auto b = memory_base(base);
+    const auto v = static_cast<uint8_t>(value);
+    if (lock) {
+      emit8(0xF0);
+    }
+    rex(true, v, b);
+    emit8(0x01);
+    emit8(modrm(1, v, b)); // 01 /r, [base + disp8]
+    emit8(static_cast<uint8_t>(offset));
+  }
+
+  /**
+   * jmp reg (indirect jump, used for tail calls into host code)
+   */
+  constexpr auto jmp_reg(Reg reg) -> void
+  {
+    const auto r = static_cast<uint8_t>(reg);
+    rex(false, 0, r);
+    emit8(0xFF);
+    emit8(modrm(3, 4, r)); // FF /4
+  }
+
+  /**
+   * call reg (indirect call into host code)
+   */
+  constexpr auto call_reg(Reg reg) -> void
+  {
+    const auto r = static_cast<uint8_t>(reg);
+    rex(false, 0, r);
+    emit8(0xFF);
+    emit8(modrm(3, 2, r)); // FF /2
+  }
+
+  constexpr auto ret() -> void
+  {
+    emit8(0xC3);
+  }
+
+  /**
+   * Patch every label reference and return the final code size
+   */
+  constexpr auto finish() -> size_t
+  {
+    for (size_t i = 0; i < fixup_count_; ++i) {
+      const auto& fixup = fixups_[i];
+      const auto target =
+          static_cast<int64_t>(label_offset(Label{fixup.label}));
+      const auto displacement =
+          target - static_cast<int64_t>(fixup.position + 4);
+      if (displacement < INT32_MIN || displacement > INT32_MAX) {
+        throw std::runtime_error("RIP-relative target out of range");
+      }
+      write_le(fixup.position, static_cast<uint64_t>(displacement), 4);
+    }
+    return position_;
+  }
+
+private:
+  [[nodiscard]] static constexpr auto modrm(uint8_t mod, uint8_t reg,
+                                            uint8_t rm) noexcept -> uint8_t
+  {
+    return static_cast<uint8_t>((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+  }
+
+  /**
+   * Register-to-register ALU instruction (opcode /r, 64-bit)
+   */
+  constexpr auto alu_reg(uint8_t opcode, Reg dst, Reg src) -> void
+  {
+    const auto d = static_cast<uint8_t>(dst);
+    const auto s = static_cast<uint8_t>(src);
+    rex(true, s, d);
+    emit8(opcode);
+    emit8(modrm(3, s, d));
+  }
+
+  /**
+   * ALU instruction with an immediate (81 /ext id, or 83 /ext ib when the
+   * value fits in a byte)
+   */
+  constexpr auto alu_imm(uint8_t extension, Reg reg, int32_t value) -> void
+  {
+    const auto r = static_cast<uint8_t>(reg);
+    rex(true, 0, r);
+    if (value >= INT8_MIN && value <= INT8_MAX) {
+      emit8(0x83);
+      emit8(modrm(3, extension, r));
+      emit8(static_cast<uint8_t>(value));
+    }
+    else {
+      emit8(0x81);
+      emit8(modrm(3, extension, r));
+      emit_le(static_cast<uint32_t>(value), 4);
+    }
+  }
+
+  /**
+   * ModRM (plus SIB) and displacement of [base + offset]: disp8 when it
+   * fits, disp32 otherwise; never mod=00, so rbp/r13 need no special case
+   *
+   * scale: what disp8 counts in (EVEX instructions multiply it by the
+   * operand size)
+   */
+  constexpr auto memory_operand(uint8_t reg, Reg base, int32_t offset,
+                                int32_t scale = 1) -> void
+  {
+    const auto b = static_cast<uint8_t>(base);
+    const auto units = offset / scale;
+    const auto small =
+        offset % scale == 0 && units >= INT8_MIN && units <= INT8_MAX;
+    emit8(modrm(small ? 1 : 2, reg, b));
+    if ((b & 7) == 4) {
+      emit8(0x24); // SIB: no index, base = rsp/r12
+    }
+    if (small) {
+      emit8(static_cast<uint8_t>(units));
+    }
+    else {
+      emit_le(static_cast<uint32_t>(offset), 4);
+    }
+  }
+
+  /**
+   * movdqu / vmovdqu / vmovdqu64 (opcode 6F loads, 7F stores)
+   *
+   * The VEX and EVEX prefixes hold inverted copies of the REX bits:
+   * R (0x80) extends vreg, B (0x20) extends base.
+   */
+  constexpr auto vector_move(uint8_t opcode, uint8_t vreg, Reg base,
+                             int32_t offset, size_t bytes, bool vex) -> void
+  {
+    const auto b = static_cast<uint8_t>(base);
+    const auto r_bit = static_cast<uint8_t>((vreg & 8) != 0 ? 0 : 0x80);
+    const auto b_bit = static_cast<uint8_t>((b & 8) != 0 ? 0 : 0x20);
+    if (bytes == 64) {
+      // EVEX.512.F3.0F.W1: 62, RXBR'00mm, Wvvvv1pp, zL'Lbv'aaa
+      emit8(0x62);
+      emit8(static_cast<uint8_t>(r_bit | 0x40 | b_bit | 0x10 | 0x01));
+      emit8(0xFE);
+      emit8(0x48);
+      emit8(opcode);
+      memory_operand(vreg, base, offset, 64);
+      return;
+    }
+    if (bytes != 16 && bytes != 32) {
+      throw std::runtime_error("Vector moves are 16, 32 or 64 bytes");
+    }
+    if (vex || bytes == 32) {
+      // VEX.L.F3.0F: vvvv = 1111 (unused), pp = 10 (F3)
+      const auto wvvvvlpp =
+          static_cast<uint8_t>(0x78 | (bytes == 32 ? 0x04 : 0) | 0x02);
+      if ((b & 8) != 0) {
+        emit8(0xC4); // 3-byte form: the only one with a B bit
+        emit8(static_cast<uint8_t>(r_bit | 0x40 | b_bit | 0x01));
+        emit8(wvvvvlpp);
+      }
+      else {
+        emit8(0xC5);
+        emit8(static_cast<uint8_t>(r_bit | wvvvvlpp));
+      }
+    }
+    else {
+      emit8(0xF3);
+      rex(false, vreg, b);
+      emit8(0x0F);
+    }
+    emit8(opcode);
+    memory_operand(vreg, base, offset);
+  }
+
+  constexpr auto jcc(uint8_t condition, Label target) -> void
+  {
+    emit8(0x0F);
+    emit8(condition);
+    add_fixup(target, FixupKind::kRel32);
+    emit_le(0, 4);
+  }
+
+  /**
+   * A base register [base + disp8] can use without a SIB byte
+   */
+  [[nodiscard]] static constexpr auto memory_base(Reg base) -> uint8_t
+  {
+    const auto b = static_cast<uint8_t>(base);
+    if ((b & 7) == 4) {
+      throw std::runtime_error("rsp and r12 need a SIB byte as base");
+    }
+    return b;
+  }
+
+  /**
+   * REX prefix, only written when needed (64-bit operand or r8-r15)
+   */
+  constexpr auto rex(bool wide, uint8_t reg, uint8_t rm) -> void
+  {
+    const auto prefix = static_cast<uint8_t>(
+        0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+    if (prefix != 0x40) {
+      emit8(prefix);
+    }
+  }
+};
+
+/**
+ * AARCH64 EMITTER
+ *
+ * Every instruction is 4 bytes. Encodings:
+ * - mov_imm: movz/movn followed by movk for each remaining 16-bit chunk, so
+ *   any 64-bit value fits (no silent truncation)
+ * - adr: address of a label within +/-1 MiB
+ * - ldr_literal: load 8 bytes at a label within +/-1 MiB (literal pool)
+ * - stadd (LSE) or an ldxr/stxr loop: atomic add to memory (stub counters)
+ * - ldr_imm / str_imm: [base + offset], offset a multiple of 8
+ * - b / cbz / cbnz: to a label (+/-128 MiB / +/-1 MiB)
+ * - ldr_sized / str_sized: 1, 2, 4 or 8 bytes, offset a multiple of that
+ * - ldp_q_post / stp_q_post / ldur_q / stur_q: 16-byte vector (NEON) moves
+ * - whilelo_b / ld1b / st1b / incb / uqdecb: the SVE copy loop; the caller
+ *   checks the CPU
+ *
+ * sp (31) is the stack pointer where an instruction allows it as a base or
+ * add/sub immediate operand; in the other places 31 means xzr.
+ */
+class A64Emitter : public EmitterBase {
+public:
+  enum class Reg : uint8_t {
+    x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15,
+    x16, x17, x18, x19, x20, x21, x22, x23, x24, x25, x26, x27, x28, x29,
+    x30, sp,
+  };
+
+  using EmitterBase::EmitterBase;
+
+  /**
+   * reg = value, using as few movz/movn/movk instructions as possible
+   */
+  constexpr auto mov_imm(Reg reg, uint64_t value) -> void
+  {
+    const auto rd = static_cast<uint32_t>(reg);
+    auto zero_chunks = 0;
+    auto ones_chunks = 0;
+    for (auto hw = 0; hw < 4; ++hw) {
+      const auto chunk = (value >> (16 * hw)) & 0xFFFF;
+      zero_chunks += chunk == 0 ? 1 : 0;
+      ones_chunks += chunk == 0xFFFF ? 1 : 0;
+    }
+
+    // movn starts from all ones, movz from all zeros - pick whichever leaves
+    // fewer chunks to fill in with movk
+    const auto use_movn = ones_chunks > zero_chunks;
+    const auto skip = use_movn ? uint64_t{0xFFFF} : uint64_t{0};
+    auto first = true;
+    for (auto hw = 0u; hw < 4; ++hw) {
+      const auto chunk = (value >> (16 * hw)) & 0xFFFF;
+      if (chunk == skip) {
+        continue;
+      }
+      if (first) {
+        const auto imm = use_movn ? (~chunk & 0xFFFF) : chunk;
+        emit32((use_movn ? 0x92800000u : 0xD2800000u) | (hw << 21) |
+               (static_cast<uint32_t>(imm) << 5) | rd);
+        first = false;
+      }
+      else {
+        emit32(0xF2800000u | (hw << 21) |
+               (static_cast<uint32_t>(chunk) << 5) | rd); // movk
+      }
+    }
+    if (first) {
+      // Every chunk was skipped: value is 0 or all ones
+      emit32((use_movn ? 0x92800000u : 0xD2800000u) | rd);
+    }
+  }
+
+  /**
+   * reg = address of label (PC-relative, +/-1 MiB)
+   */
+  constexpr auto adr(Reg reg, Label target) -> void
+  {
+    add_fixup(target, FixupKind::kAdr21);
+    emit32(0x10000000u | static_cast<uint32_t>(reg));
+  }
+
+  /**
+   * reg = the 8 bytes at label (ldr x, literal - label must be 4-byte
+   * aligned, which emit_literal64 guarantees)
+   */
+  constexpr auto ldr_literal(Reg reg, Label literal) -> void
+  {
+    add_fixup(literal, FixupKind::kLdr19);
+    emit32(0x58000000u | static_cast<uint32_t>(reg));
+  }
+
+  constexpr auto svc(uint16_t imm) -> void
+  {
+    emit32(0xD4000001u | (uint32_t{imm} << 5));
+  }
+
+  /**
+   * rd = rn + imm (imm below 4096)
+   */
+  constexpr auto add_imm(Reg rd, Reg rn, uint16_t imm) -> void
+  {
+    if (imm >= 4096) {
+      throw std::runtime_error("add immediate does not fit in 12 bits");
+    }
+    emit32(0x91000000u | (uint32_t{imm} << 10) | (reg_bits(rn) << 5) |
+           reg_bits(rd));
+  }
+
+  /**
+   * rd = rn - imm (imm below 4096)
+   */
+  constexpr auto sub_imm(Reg rd, Reg rn, uint16_t imm) -> void
+  {
+    if (imm >= 4096) {
+      throw std::runtime_error("sub immediate does not fit in 12 bits");
+    }
+    emit32(0xD1000000u | (uint32_t{imm} << 10) | (reg_bits(rn) << 5) |
+           reg_bits(rd));
+  }
+
+  /**
+   * rd = rm (orr rd, xzr, rm - not for sp)
+   */
+  constexpr auto mov_reg(Reg rd, Reg rm) -> void
+  {
+    emit32(0xAA0003E0u | (reg_bits(rm) << 16) | reg_bits(rd));
+  }
+
+  /**
+   * rd = rn + rm
+   */
+  constexpr auto add_reg(Reg rd, Reg rn, Reg rm) -> void
+  {
+    emit32(0x8B000000u | (reg_bits(rm) << 16) | (reg_bits(rn) << 5) |
+           reg_bits(rd));
+  }
+
+  /**
+   * rd = rn - rm
+   */
+  constexpr auto sub_reg(Reg rd, Reg rn, Reg rm) -> void
+  {
+    emit32(0xCB000000u | (reg_bits(rm) << 16) | (reg_bits(rn) << 5) |
+           reg_bits(rd));
+  }
+
+  /**
+   * rt = [base + offset] (64-bit, offset a multiple of 8 below 32 KiB)
+   */
+  constexpr auto ldr_imm(Reg rt, Reg base, uint32_t offset) -> void
+  {
+    emit32(0xF9400000u | scaled_offset(offset) | (reg_bits(base) << 5) |
+           reg_bits(rt));
+  }
+
+  /**
+   * [base + offset] = rt (64-bit, offset a multiple of 8 below 32 KiB)
+   */
+  constexpr auto str_imm(Reg rt, Reg base, uint32_t offset) -> void
+  {
+    emit32(0xF9000000u | scaled_offset(offset) | (reg_bits(base) << 5) |
+           reg_bits(rt));
+  }
+
+  /**
+   * rt = virtual counter (mrs rt, cntvct_el0)
+   */
+  constexpr auto mrs_cntvct(Reg rt) -> void
+  {
+    emit32(0xD53BE040u | reg_bits(rt));
+  }
+
+  /**
+   * [base] += value, atomically (stadd - needs the LSE atomics of ARMv8.1)
+   */
+  constexpr auto stadd(Reg value, Reg base) -> void
+  {
+    emit32(0xF820001Fu | (reg_bits(value) << 16) | (reg_bits(base) << 5));
+  }
+
+  /**
+   * rt = [base], exclusive (ldxr)
+   */
+  constexpr auto ldxr(Reg rt, Reg base) -> void
+  {
+    emit32(0xC85F7C00u | (reg_bits(base) << 5) | reg_bits(rt));
+  }
+
+  /**
+   * [base] = rt if still exclusive; status (w register) = 0 on success
+   */
+  constexpr auto stxr(Reg status, Reg rt, Reg base) -> void
+  {
+    emit32(0xC8007C00u | (reg_bits(status) << 16) | (reg_bits(base) << 5) |
+           reg_bits(rt));
+  }
+
+  /**
+   * Branch to label if the w register is not zero (+/-1 MiB)
+   */
+  constexpr auto cbnz_w(Reg rt, Label target) -> void
+  {
+    add_fixup(target, FixupKind::kLdr19); // Same imm19 field as ldr literal
+    emit32(0x35000000u | reg_bits(rt));
+  }
+
+  /**
+   * Branch to label if the x register is zero / not zero (+/-1 MiB)
+   */
+  constexpr auto cbz(Reg rt, Label target) -> void
+  {
+    add_fixup(target, FixupKind::kLdr19);
+    emit32(0xB4000000u | reg_bits(rt));
+  }
+  constexpr auto cbnz(Reg rt, Label target) -> void
+  {
+    add_fixup(target, FixupKind::kLdr19);
+    emit32(0xB5000000u | reg_bits(rt));
+  }
+
+  /**
+   * Branch to label (+/-128 MiB)
+   */
+  constexpr auto b(Label target) -> void
+  {
+    add_fixup(target, FixupKind::kBranch26);
+    emit32(0x14000000u);
+  }
+
+  /**
+   * stp first, second, [sp, #-16]! / ldp first, second, [sp], #16
+   */
+  constexpr auto push_pair(Reg first, Reg second) -> void
+  {
+    emit32(0xA9BF0000u | (reg_bits(second) << 10) | (31u << 5) |
+           reg_bits(first));
+  }
+  constexpr auto pop_pair(Reg first, Reg second) -> void
+  {
+    emit32(0xA8C10000u | (reg_bits(second) << 10) | (31u << 5) |
+           reg_bits(first));
+  }
+
+  /**
+   * rt = bytes (1, 2, 4 or 8) at [base + offset], zero-extended
+   * (ldrb / ldrh / ldr wt / ldr xt; offset a multiple of bytes)
+   */
+  constexpr auto ldr_sized(Reg rt, Reg base, uint32_t offset, size_t bytes)
+      -> void
+  {
+    emit32(0x39400000u | size_bits(bytes) |
+           scaled_offset(offset, static_cast<uint32_t>(bytes)) |
+           (reg_bits(base) << 5) | reg_bits(rt));
+  }
+
+  /**
+   * bytes (1, 2, 4 or 8) at [base + offset] = the low bytes of rt
+   */
+  constexpr auto str_sized(Reg rt, Reg base, uint32_t offset, size_t bytes)
+      -> void
+  {
+    emit32(0x39000000u | size_bits(bytes) |
+           scaled_offset(offset, static_cast<uint32_t>(bytes)) |
+           (reg_bits(base) << 5) | reg_bits(rt));
+  }
+
+  /**
+   * ldp q1, q2, [base], #32 / stp q1, q2, [base], #32 (base moves on)
+   */
+  constexpr auto ldp_q_post(uint8_t q1, uint8_t q2, Reg base) -> void
+  {
+    emit32(0xACC10000u | (uint32_t{q2} << 10) | (reg_bits(base) << 5) |
+           q1);
+  }
+  constexpr auto stp_q_post(uint8_t q1, uint8_t q2, Reg base) -> void
+  {
+    emit32(0xAC810000u | (uint32_t{q2} << 10) | (reg_bits(base) << 5) |
+           q1);
+  }
+
+  /**
+   * ldur q, [base, #offset] / stur q, [base, #offset] (offset -256..255)
+   */
+  constexpr auto ldur_q(uint8_t q, Reg base, int32_t offset) -> void
+  {
+    emit32(0x3CC00000u | unscaled_offset(offset) | (reg_bits(base) << 5) |
+           q);
+  }
+  constexpr auto stur_q(uint8_t q, Reg base, int32_t offset) -> void
+  {
+    emit32(0x3C800000u | unscaled_offset(offset) | (reg_bits(base) << 5) |
+           q);
+  }
+
+  /**
+   * SVE: whilelo pd.b, rn, rm - byte lanes i with rn + i < rm (unsigned)
+   */
+  constexpr auto whilelo_b(uint8_t pd, Reg rn, Reg rm) -> void
+  {
+    emit32(0x25201C00u | (reg_bits(rm) << 16) | (reg_bits(rn) << 5) | pd);
+  }
+
+  /**
+   * SVE: ld1b {zt.b}, pg/z, [base] / st1b {zt.b}, pg, [base]
+   */
+  constexpr auto ld1b(uint8_t zt, uint8_t pg, Reg base) -> void
+  {
+    emit32(0xA400A000u | (uint32_t{pg} << 10) | (reg_bits(base) << 5) | zt);
+  }
+  constexpr auto st1b(uint8_t zt, uint8_t pg, Reg base) -> void
+  {
+    emit32(0xE400E000u | (uint32_t{pg} << 10) | (reg_bits(base) << 5) | zt);
+  }
+
+  /**
+   * SVE: rd += vector length in bytes / rd -= it, stopping at 0 (uqdecb)
+   */
+  constexpr auto incb(Reg rd) -> void
+  {
+    emit32(0x0430E3E0u | reg_bits(rd));
+  }
+  constexpr auto uqdecb(Reg rd) -> void
+  {
+    emit32(0x0430FFE0u | reg_bits(rd));
+  }
+
+  constexpr auto ret() -> void
+  {
+    emit32(0xD65F03C0u); // ret x30
+  }
+
+  /**
+   * br reg (indirect jump, used for tail calls into host code)
+   */
+  constexpr auto br(Reg reg) -> void
+  {
+    emit32(0xD61F0000u | (static_cast<uint32_t>(reg) << 5));
+  }
+
+  /**
+   * blr reg (indirect call into host code)
+   */
+  constexpr auto blr(Reg reg) -> void
+  {
+    emit32(0xD63F0000u | (static_cast<uint32_t>(reg) << 5));
+  }
+
+  /**
+   * instruction (adr, ldr literal or a branch) with its PC-relative
+   * immediate set to offset (also used to re-target copies of finished code)
+   */
+  [[nodiscard]] static constexpr auto with_pc_offset(uint32_t instruction,
+                                                     FixupKind kind,
+                                                     int64_t offset)
+      -> uint32_t
+  {
+    const auto range = kind == FixupKind::kBranch26 ? int64_t{1} << 27
+                                                    : int64_t{1} << 20;
+    if (offset < -range || offset >= range) {
+      throw std::runtime_error("PC-relative target out of range");
+    }
+    if (kind == FixupKind::kBranch26) {
+      if ((offset & 3) != 0) {
+        throw std::runtime_error("Branch target is not 4-byte aligned");
+      }
+      const auto imm = static_cast<uint32_t>(offset >> 2) & 0x3FFFFFF;
+      return (instruction & ~0x3FFFFFFu) | imm;
+    }
+    if (kind == FixupKind::kLdr19) {
+      if ((offset & 3) != 0) {
+        throw std::runtime_error("Literal is not 4-byte aligned");
+      }
+      const auto imm = static_cast<uint32_t>(offset >> 2) & 0x7FFFF;
+      return (instruction & ~(0x7FFFFu << 5)) | (imm << 5);
+    }
+    const auto imm = static_cast<uint32_t>(offset) & 0x1FFFFF;
+    return (instruction & ~((3u << 29) | (0x7FFFFu << 5))) |
+           ((imm & 3) << 29) | ((imm >> 2) << 5);
+  }
+
+  /**
+   * Patch every label reference and return the final code size
+   */
+  constexpr auto finish() -> size_t
+  {
+    for (size_t i = 0; i < fixup_count_; ++i) {
+      const auto& fixup = fixups_[i];
+      const auto target =
+          static_cast<int64_t>(label_offset(Label{fixup.label}));
+      const auto offset = target - static_cast<int64_t>(fixup.position);
+      const auto instruction =
+          static_cast<uint32_t>(read_le(fixup.position, 4));
+      write_le(fixup.position,
+               with_pc_offset(instruction, fixup.kind, offset), 4);
+    }
+    return position_;
+  }
+
+private:
+  [[nodiscard]] static constexpr auto reg_bits(Reg reg) noexcept -> uint32_t
+  {
+    return static_cast<uint32_t>(reg);
+  }
+
+  /**
+   * imm12 field of an ldr/str (unsigned offset, scaled by the access size)
+   */
+  [[nodiscard]] static constexpr auto scaled_offset(uint32_t offset,
+                                                    uint32_t bytes = 8)
+      -> uint32_t
+  {
+    if (offset % bytes != 0 || offset / bytes >= 4096) {
+      throw std::runtime_error(
+          "ldr/str offset is not a small multiple of the access size");
+    }
+    return (offset / bytes) << 10;
+  }
+
+  /**
+   * imm9 field of an ldur/stur (signed byte offset)
+   */
+  [[nodiscard]] static constexpr auto unscaled_offset(int32_t offset)
+      -> uint32_t
+  {
+    if (offset < -256 || offset > 255) {
+      throw std::runtime_error("ldur/stur offset is out of range");
+    }
+    return (static_cast<uint32_t>(offset) & 0x1FF) << 12;
+  }
+
+  /**
+   * size field (bits 30-31) of an ldr/str of 1, 2, 4 or 8 bytes
+   */
+  [[nodiscard]] static constexpr auto size_bits(size_t bytes) -> uint32_t
+  {
+    switch (bytes) {
+    case 1:
+      return 0;
+    case 2:
+      return 1u << 30;
+    case 4:
+      return 2u << 30;
+    case 8:
+      return 3u << 30;
+    default:
+      throw std::runtime_error("ldr/str moves 1, 2, 4 or 8 bytes");
+    }
+  }
+
+  constexpr auto emit32(uint32_t instruction) -> void
+  {
+    emit_le(instruction, 4);
+  }
+};
+
+/**
+ * The emitter for the processor we are running on
+ */
+#if defined(__x86_64__)
+using NativeEmitter = X86Emitter;
+#elif defined(__aarch64__)
+using NativeEmitter = A64Emitter;
+#endif
+
+} // namespace mijit
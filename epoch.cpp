@@ -0,0 +1,79 @@
+/**
+ * @file epoch.cpp
+ * @brief Thread registration, pinning and epoch advance
+ */
+
+#include "epoch.hpp"
+
+#include <stdexcept>
+
+namespace mijit {
+
+EpochDomain::Participant::Participant(EpochDomain& domain)
+    : domain_{domain}, index_{kMaxThreads}
+{
+  for (size_t i = 0; i < kMaxThreads; ++i) {
+    auto expected = false;
+    if (domain_.slots_[i].claimed.compare_exchange_strong(
+            expected, true, std::memory_order_acq_rel)) {
+      index_ = i;
+      return;
+    }
+  }
+  throw std::runtime_error("Too many threads in the epoch domain");
+}
+
+EpochDomain::Participant::~Participant()
+{
+  domain_.slots_[index_].epoch.store(kIdle, std::memory_order_release);
+  domain_.slots_[index_].claimed.store(false, std::memory_order_release);
+}
+
+/**
+ * Publish the epoch we are in, then check it did not move meanwhile - if it
+ * did, the reclaimer may not have seen our pin, so pin the new one
+ *
+ * Already pinned: only count the new guard (the outer epoch is older, so
+ * keeping it protects everything the inner pin would)
+ */
+[[nodiscard]] auto EpochDomain::Participant::pin() noexcept -> Guard
+{
+  if (depth_++ != 0) {
+    return Guard{*this};
+  }
+  auto& slot = domain_.slots_[index_].epoch;
+  auto epoch = domain_.epoch_.load(std::memory_order_acquire);
+  while (true) {
+    slot.store(epoch, std::memory_order_seq_cst);
+    const auto now = domain_.epoch_.load(std::memory_order_seq_cst);
+    if (now == epoch) {
+      return Guard{*this};
+    }
+    epoch = now;
+  }
+}
+
+/**
+ * The outermost guard is gone: this thread runs no code of the domain
+ */
+auto EpochDomain::Participant::unpin() noexcept -> void
+{
+  if (--depth_ == 0) {
+    domain_.slots_[index_].epoch.store(kIdle, std::memory_order_release);
+  }
+}
+
+auto EpochDomain::try_advance() noexcept -> bool
+{
+  auto epoch = epoch_.load(std::memory_order_seq_cst);
+  for (const auto& slot : slots_) {
+    const auto pinned = slot.epoch.load(std::memory_order_seq_cst);
+    if (pinned != kIdle && pinned != epoch) {
+      return false; // Someone may still be running code from before
+    }
+  }
+  return epoch_.compare_exchange_strong(epoch, epoch + 1,
+                                        std::memory_order_seq_cst);
+}
+
+} // namespace mijit
@@ -0,0 +1,122 @@
+/**
+ * @file epoch.hpp
+ * @brief Epoch-based reclamation: know when no thread can still run old code
+ *
+ * HOW IT WORKS:
+ * 1. A thread that may call generated code "pins" the current epoch for
+ *    the duration of the call (one store, no lock)
+ * 2. Code that is no longer reachable is retired together with the epoch
+ *    it was retired in
+ * 3. The epoch only moves forward when every pinned thread has seen the
+ *    current one
+ * 4. Once the epoch is two steps past a retirement, no thread can still be
+ *    inside that code, so its memory may be reused
+ *
+ * WHY WE NEED THIS:
+ * - Freeing code (munmap, or reusing the slot) while another thread is
+ *   still executing it crashes that thread
+ * - Callers never wait: pinning is a couple of atomic operations, and only
+ *   the reclaiming thread ever checks the others
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace mijit {
+
+class EpochDomain {
+public:
+  static constexpr size_t kMaxThreads = 64;
+  static constexpr uint64_t kIdle = 0; // Slot value of an unpinned thread
+
+  class Participant;
+
+  /**
+   * RAII pin of the current epoch (see Participant::pin)
+   */
+  class Guard {
+  public:
+    explicit Guard(Participant& participant) noexcept
+        : participant_{&participant}
+    {
+    }
+    ~Guard();
+
+    Guard(const Guard&) = delete;
+    auto operator=(const Guard&) -> Guard& = delete;
+
+  private:
+    Participant* participant_;
+  };
+
+  /**
+   * One thread's registration with the domain (claims one of kMaxThreads
+   * slots; keep it for the life of the thread, e.g. thread_local)
+   */
+  class Participant {
+  public:
+    explicit Participant(EpochDomain& domain);
+    ~Participant();
+
+    Participant(const Participant&) = delete;
+    auto operator=(const Participant&) -> Participant& = delete;
+
+    /**
+     * Pin the current epoch: code retired from now on stays valid until the
+     * guard is destroyed
+     *
+     * Pins nest: a pin() while this thread already holds one keeps the
+     * outer epoch, and the thread only becomes idle when the outermost
+     * guard goes away.
+     */
+    [[nodiscard]] auto pin() noexcept -> Guard;
+
+  private:
+    friend class Guard;
+
+    auto unpin() noexcept -> void;
+
+    EpochDomain& domain_;
+    size_t index_;
+    size_t depth_ = 0; // Guards alive (only the owning thread touches it)
+  };
+
+  [[nodiscard]] auto current() const noexcept -> uint64_t
+  {
+    return epoch_.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Move to the next epoch if every pinned thread has seen the current one
+   * (called by the reclaiming thread; never blocks)
+   */
+  auto try_advance() noexcept -> bool;
+
+  /**
+   * Whether memory retired in retired_epoch can no longer be in use
+   */
+  [[nodiscard]] auto is_safe(uint64_t retired_epoch) const noexcept -> bool
+  {
+    return current() >= retired_epoch + 2;
+  }
+
+private:
+  struct alignas(64) Slot { // Own cache line: pins don't fight each other
+    std::atomic<uint64_t> epoch{kIdle};
+    std::atomic<bool> claimed{false};
+  };
+
+  std::array<Slot, kMaxThreads> slots_{};
+  std::atomic<uint64_t> epoch_{1};
+};
+
+inline EpochDomain::Guard::~Guard()
+{
+  participant_->unpin();
+}
+
+} // namespace mijit
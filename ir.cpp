@@ -0,0 +1,911 @@
+/**
+ * @file ir.cpp
+ * @brief Builder, optimization passes and linear-scan register allocation
+ */
+
+#include "ir.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+namespace mijit::ir {
+
+namespace {
+
+/**
+ * Writes merged by write coalescing at most (iovec entries of one writev)
+ */
+constexpr size_t kMaxCoalescedWrites = 64;
+constexpr uint32_t kIovecSize = 16; // struct iovec: base + length
+
+/**
+ * HELPER FUNCTION: Instructions that only compute their result
+ *
+ * NOTES:
+ * - Loads count as pure: a load whose result is never read is dropped
+ */
+[[nodiscard]] auto is_pure(Op op) noexcept -> bool
+{
+  switch (op) {
+  case Op::kParam:
+  case Op::kConst:
+  case Op::kData:
+  case Op::kFrame:
+  case Op::kMove:
+  case Op::kAdd:
+  case Op::kSub:
+  case Op::kLoad:
+    return true;
+  default:
+    return false;
+  }
+}
+
+[[nodiscard]] auto ends_block(Op op) noexcept -> bool
+{
+  return op == Op::kJump || op == Op::kBranchZero ||
+         op == Op::kBranchNonZero || op == Op::kReturn;
+}
+
+/**
+ * HELPER FUNCTION: How many instructions write / read each value
+ */
+[[nodiscard]] auto definition_counts(const Function& function)
+    -> std::vector<uint32_t>
+{
+  std::vector<uint32_t> counts(function.value_count());
+  for (const auto& instruction : function.instructions()) {
+    if (instruction.dst != kNoValue) {
+      ++counts[instruction.dst];
+    }
+  }
+  return counts;
+}
+
+[[nodiscard]] auto use_counts(const Function& function)
+    -> std::vector<uint32_t>
+{
+  std::vector<uint32_t> counts(function.value_count());
+  for (const auto& instruction : function.instructions()) {
+    for (const auto value : instruction.operands()) {
+      ++counts[value];
+    }
+  }
+  return counts;
+}
+
+/**
+ * HELPER FUNCTION: The instruction that writes value, if exactly one does
+ */
+[[nodiscard]] auto single_definitions(const Function& function)
+    -> std::vector<const Instruction*>
+{
+  const auto counts = definition_counts(function);
+  std::vector<const Instruction*> definitions(function.value_count());
+  for (const auto& instruction : function.instructions()) {
+    if (instruction.dst != kNoValue && counts[instruction.dst] == 1) {
+      definitions[instruction.dst] = &instruction;
+    }
+  }
+  return definitions;
+}
+
+[[nodiscard]] auto make(Op op, Value dst, std::initializer_list<Value> args,
+                        uint64_t imm = 0) -> Instruction
+{
+  auto instruction = Instruction{op, static_cast<uint8_t>(args.size()), dst,
+                                 {}, imm};
+  std::copy(args.begin(), args.end(), instruction.args.begin());
+  return instruction;
+}
+
+/**
+ * HELPER FUNCTION: Drop the kNop instructions passes left behind
+ */
+auto compact(Function& function) -> void
+{
+  auto& instructions = function.instructions();
+  std::erase_if(instructions, [](const Instruction& instruction) {
+    return instruction.op == Op::kNop;
+  });
+}
+
+/**
+ * A growable set of values (one bit each)
+ */
+class ValueSet {
+public:
+  explicit ValueSet(size_t values) : words_((values + 63) / 64) {}
+
+  [[nodiscard]] auto contains(Value value) const noexcept -> bool
+  {
+    return (words_[value / 64] >> (value % 64) & 1) != 0;
+  }
+  auto insert(Value value) noexcept -> void
+  {
+    words_[value / 64] |= uint64_t{1} << (value % 64);
+  }
+
+  /**
+   * this |= other, returns whether anything was added
+   */
+  auto merge(const ValueSet& other) noexcept -> bool
+  {
+    auto changed = false;
+    for (size_t i = 0; i < words_.size(); ++i) {
+      const auto merged = words_[i] | other.words_[i];
+      changed |= merged != words_[i];
+      words_[i] = merged;
+    }
+    return changed;
+  }
+
+  /**
+   * this |= (uses | (out & ~defs)), returns whether anything was added
+   */
+  auto merge_live(const ValueSet& uses, const ValueSet& out,
+                  const ValueSet& defs) noexcept -> bool
+  {
+    auto changed = false;
+    for (size_t i = 0; i < words_.size(); ++i) {
+      const auto merged =
+          words_[i] | uses.words_[i] | (out.words_[i] & ~defs.words_[i]);
+      changed |= merged != words_[i];
+      words_[i] = merged;
+    }
+    return changed;
+  }
+
+  template <typename F> auto for_each(F&& visit) const -> void
+  {
+    for (size_t i = 0; i < words_.size(); ++i) {
+      for (auto word = words_[i]; word != 0; word &= word - 1) {
+        visit(static_cast<Value>(i * 64 + std::countr_zero(word)));
+      }
+    }
+  }
+
+private:
+  std::vector<uint64_t> words_;
+};
+
+struct Block {
+  size_t first = 0; // Instruction indices, inclusive
+  size_t last = 0;
+  std::vector<size_t> successors;
+};
+
+/**
+ * HELPER FUNCTION: Split the instructions into basic blocks
+ *
+ * A block starts at every label and after every jump, branch and return.
+ */
+[[nodiscard]] auto basic_blocks(const Function& function) -> std::vector<Block>
+{
+  const auto& instructions = function.instructions();
+  std::vector<Block> blocks;
+  std::vector<size_t> target_blocks(function.target_count(), SIZE_MAX);
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    const auto& instruction = instructions[i];
+    if (blocks.empty() || instruction.op == Op::kLabel ||
+        ends_block(instructions[i - 1].op)) {
+      blocks.push_back(Block{i, i, {}});
+    }
+    blocks.back().last = i;
+    if (instruction.op == Op::kLabel) {
+      target_blocks[instruction.imm] = blocks.size() - 1;
+    }
+  }
+
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    const auto& last = instructions[blocks[b].last];
+    if (last.op == Op::kJump || last.op == Op::kBranchZero ||
+        last.op == Op::kBranchNonZero) {
+      if (target_blocks[last.imm] == SIZE_MAX) {
+        throw std::runtime_error("IR jumps to a target that is never bound");
+      }
+      blocks[b].successors.push_back(target_blocks[last.imm]);
+    }
+    if (last.op != Op::kJump && last.op != Op::kReturn &&
+        b + 1 < blocks.size()) {
+      blocks[b].successors.push_back(b + 1);
+    }
+  }
+  return blocks;
+}
+
+/**
+ * HELPER FUNCTION: The instruction range in which each value is live
+ *
+ * HOW IT WORKS:
+ * 1. Per block: values read before being written (uses) and written (defs)
+ * 2. Backwards dataflow until nothing changes:
+ *    live_out = union of the successors' live_in
+ *    live_in  = uses | (live_out & ~defs)
+ * 3. A value's interval covers its reads and writes, the start of every
+ *    block it is live into and the end of every block it is live out of
+ *
+ * NOTES:
+ * - One interval per value (no holes): values live around a loop's back
+ *   edge get the whole loop
+ */
+auto live_intervals(const Function& function, std::vector<size_t>& starts,
+                    std::vector<size_t>& ends) -> void
+{
+  const auto& instructions = function.instructions();
+  const auto values = function.value_count();
+  const auto blocks = basic_blocks(function);
+
+  std::vector<ValueSet> uses(blocks.size(), ValueSet{values});
+  std::vector<ValueSet> defs(blocks.size(), ValueSet{values});
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    for (auto i = blocks[b].first; i <= blocks[b].last; ++i) {
+      for (const auto value : instructions[i].operands()) {
+        if (!defs[b].contains(value)) {
+          uses[b].insert(value);
+        }
+      }
+      if (instructions[i].dst != kNoValue) {
+        defs[b].insert(instructions[i].dst);
+      }
+    }
+  }
+
+  std::vector<ValueSet> live_in(blocks.size(), ValueSet{values});
+  std::vector<ValueSet> live_out(blocks.size(), ValueSet{values});
+  for (auto changed = true; changed;) {
+    changed = false;
+    for (auto b = blocks.size(); b-- > 0;) {
+      for (const auto successor : blocks[b].successors) {
+        live_out[b].merge(live_in[successor]);
+      }
+      changed |= live_in[b].merge_live(uses[b], live_out[b], defs[b]);
+    }
+  }
+
+  starts.assign(values, SIZE_MAX);
+  ends.assign(values, 0);
+  const auto extend = [&](Value value, size_t position) {
+    starts[value] = std::min(starts[value], position);
+    ends[value] = std::max(ends[value], position);
+  };
+  // Parameters all arrive before the first instruction runs: they overlap
+  auto entry = size_t{0};
+  while (entry < instructions.size() &&
+         instructions[entry].op == Op::kParam) {
+    extend(instructions[entry++].dst, 0);
+  }
+  for (size_t i = 0; i < entry; ++i) {
+    extend(instructions[i].dst, entry - 1);
+  }
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    for (const auto value : instructions[i].operands()) {
+      extend(value, i);
+    }
+    if (instructions[i].dst != kNoValue) {
+      extend(instructions[i].dst, i);
+    }
+  }
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    live_in[b].for_each(
+        [&](Value value) { extend(value, blocks[b].first); });
+    live_out[b].for_each([&](Value value) { extend(value, blocks[b].last); });
+  }
+}
+
+} // namespace
+
+/**
+ * BUILDING FUNCTIONS
+ */
+
+auto Function::append(const Instruction& instruction) -> void
+{
+  for (const auto value : instruction.operands()) {
+    if (value >= value_count_) {
+      throw std::runtime_error("IR instruction reads an unknown value");
+    }
+  }
+  instructions_.push_back(instruction);
+}
+
+auto Function::define(Op op, std::initializer_list<Value> args, uint64_t imm)
+    -> Value
+{
+  if (args.size() > kMaxArgs) {
+    throw std::runtime_error("IR instruction has too many arguments");
+  }
+  auto instruction = make(op, kNoValue, args, imm);
+  for (const auto value : instruction.operands()) {
+    if (value >= value_count_) {
+      throw std::runtime_error("IR instruction reads an unknown value");
+    }
+  }
+  instruction.dst = new_value();
+  instructions_.push_back(instruction);
+  return instruction.dst;
+}
+
+auto Function::param(size_t index) -> Value
+{
+  if (index >= kMaxArgs) {
+    throw std::runtime_error("IR functions take at most 6 arguments");
+  }
+  if (std::any_of(instructions_.begin(), instructions_.end(),
+                  [](const Instruction& instruction) {
+                    return instruction.op != Op::kParam;
+                  })) {
+    throw std::runtime_error("IR parameters must come first");
+  }
+  param_count_ = std::max(param_count_, index + 1);
+  return define(Op::kParam, {}, index);
+}
+
+auto Function::constant(uint64_t value) -> Value
+{
+  return define(Op::kConst, {}, value);
+}
+
+auto Function::data(std::string_view bytes) -> Value
+{
+  if (data_.size() + bytes.size() > UINT32_MAX) {
+    throw std::runtime_error("IR data does not fit in 4 GiB");
+  }
+  blobs_.push_back(DataBlob{static_cast<uint32_t>(data_.size()),
+                            static_cast<uint32_t>(bytes.size())});
+  data_.append(bytes);
+  return define(Op::kData, {}, blobs_.size() - 1);
+}
+
+auto Function::frame(uint32_t size) -> Value
+{
+  if (size == 0 || size > 1024) {
+    throw std::runtime_error("IR frame areas hold 1 to 1024 bytes");
+  }
+  return define(Op::kFrame, {}, (uint64_t{size} + 7) & ~uint64_t{7});
+}
+
+auto Function::add(Value a, Value b) -> Value
+{
+  return define(Op::kAdd, {a, b});
+}
+
+auto Function::sub(Value a, Value b) -> Value
+{
+  return define(Op::kSub, {a, b});
+}
+
+auto Function::load(Value base, int32_t offset) -> Value
+{
+  return define(Op::kLoad, {base}, static_cast<uint64_t>(int64_t{offset}));
+}
+
+auto Function::store(Value base, Value value, int32_t offset) -> void
+{
+  append(make(Op::kStore, kNoValue, {base, value},
+              static_cast<uint64_t>(int64_t{offset})));
+}
+
+auto Function::copy(Value destination, Value source, uint32_t size) -> void
+{
+  if (size == 0 || size > kMaxCopySize) {
+    throw std::runtime_error("IR copies move 1 to 4096 bytes");
+  }
+  append(make(Op::kCopy, kNoValue, {destination, source}, size));
+}
+
+auto Function::variable() -> Value
+{
+  return new_value();
+}
+
+auto Function::assign(Value variable, Value value) -> void
+{
+  if (variable >= value_count_) {
+    throw std::runtime_error("IR assigns to an unknown value");
+  }
+  append(make(Op::kMove, variable, {value}));
+}
+
+auto Function::syscall(uint64_t number, std::initializer_list<Value> args)
+    -> Value
+{
+  return define(Op::kSyscall, args, number);
+}
+
+auto Function::call(const void* function, std::initializer_list<Value> args)
+    -> Value
+{
+  return define(Op::kCall, args, reinterpret_cast<uintptr_t>(function));
+}
+
+auto Function::write(int fd, std::string_view bytes) -> Value
+{
+  const auto file = constant(static_cast<uint64_t>(int64_t{fd}));
+  const auto buffer = data(bytes);
+  const auto length = constant(bytes.size());
+  return syscall(kSysWrite, {file, buffer, length});
+}
+
+auto Function::new_target() -> Target
+{
+  return Target{static_cast<uint32_t>(target_count_++)};
+}
+
+auto Function::bind(Target target) -> void
+{
+  if (target.id >= target_count_) {
+    throw std::runtime_error("IR binds an unknown target");
+  }
+  for (const auto& instruction : instructions_) {
+    if (instruction.op == Op::kLabel && instruction.imm == target.id) {
+      throw std::runtime_error("IR target is bound twice");
+    }
+  }
+  append(make(Op::kLabel, kNoValue, {}, target.id));
+}
+
+auto Function::jump(Target target) -> void
+{
+  append(make(Op::kJump, kNoValue, {}, target.id));
+}
+
+auto Function::branch_zero(Value condition, Target target) -> void
+{
+  append(make(Op::kBranchZero, kNoValue, {condition}, target.id));
+}
+
+auto Function::branch_non_zero(Value condition, Target target) -> void
+{
+  append(make(Op::kBranchNonZero, kNoValue, {condition}, target.id));
+}
+
+auto Function::ret() -> void
+{
+  append(make(Op::kReturn, kNoValue, {}));
+}
+
+auto Function::ret(Value value) -> void
+{
+  append(make(Op::kReturn, kNoValue, {value}));
+}
+
+auto greeting_function(MessagePieces pieces) -> Function
+{
+  auto function = Function{};
+  for (const auto piece : pieces) {
+    function.write(1, piece);
+  }
+  function.ret();
+  return function;
+}
+
+auto write_function() -> Function
+{
+  auto function = Function{};
+  const auto buffer = function.param(0);
+  const auto length = function.param(1);
+  const auto fd = function.param(2);
+#if defined(__APPLE__) && defined(__aarch64__)
+  function.ret(function.call(reinterpret_cast<const void*>(&::write),
+                             {fd, buffer, length}));
+#else
+  function.ret(function.syscall(kSysWrite, {fd, buffer, length}));
+#endif
+  return function;
+}
+
+auto copy_function(uint32_t size) -> Function
+{
+  auto function = Function{};
+  const auto destination = function.param(0);
+  const auto source = function.param(1);
+  function.copy(destination, source, size);
+  function.ret();
+  return function;
+}
+
+/**
+ * PASS: CONSTANT FOLDING
+ *
+ * HOW IT WORKS:
+ * 1. Values written once by a constant are known
+ * 2. add / sub / move of known values become constants (and are known
+ *    themselves when written once)
+ * 3. A branch on a known value becomes a jump or nothing; a jump to the
+ *    label right after it disappears
+ * 4. Instructions after a jump or return are dead up to the next label
+ */
+auto fold_constants(Function& function) -> size_t
+{
+  const auto counts = definition_counts(function);
+  auto& instructions = function.instructions();
+  std::vector<bool> known(function.value_count());
+  std::vector<uint64_t> values(function.value_count());
+  auto changed = size_t{0};
+
+  for (auto& instruction : instructions) {
+    const auto args = instruction.operands();
+    const auto all_known =
+        std::all_of(args.begin(), args.end(),
+                    [&](Value value) { return bool{known[value]}; });
+    switch (instruction.op) {
+    case Op::kAdd:
+    case Op::kSub:
+    case Op::kMove:
+      if (all_known) {
+        const auto a = values[args[0]];
+        const auto result = instruction.op == Op::kAdd   ? a + values[args[1]]
+                            : instruction.op == Op::kSub ? a - values[args[1]]
+                                                         : a;
+        instruction = make(Op::kConst, instruction.dst, {}, result);
+        ++changed;
+      }
+      break;
+    case Op::kBranchZero:
+    case Op::kBranchNonZero:
+      if (all_known) {
+        const auto taken =
+            (values[args[0]] == 0) == (instruction.op == Op::kBranchZero);
+        instruction = taken ? make(Op::kJump, kNoValue, {}, instruction.imm)
+                            : Instruction{};
+        ++changed;
+      }
+      break;
+    default:
+      break;
+    }
+    if (instruction.op == Op::kConst && counts[instruction.dst] == 1) {
+      known[instruction.dst] = true;
+      values[instruction.dst] = instruction.imm;
+    }
+  }
+
+  auto reachable = true;
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    auto& instruction = instructions[i];
+    if (instruction.op == Op::kLabel) {
+      reachable = true;
+    }
+    else if (!reachable && instruction.op != Op::kNop) {
+      instruction = Instruction{};
+      ++changed;
+      continue;
+    }
+    if (instruction.op == Op::kJump) {
+      auto next = i + 1;
+      while (next < instructions.size() && instructions[next].op == Op::kNop) {
+        ++next;
+      }
+      if (next < instructions.size() && instructions[next].op == Op::kLabel &&
+          instructions[next].imm == instruction.imm) {
+        instruction = Instruction{};
+        ++changed;
+        continue;
+      }
+    }
+    if (instruction.op == Op::kJump || instruction.op == Op::kReturn) {
+      reachable = false;
+    }
+  }
+  compact(function);
+  return changed;
+}
+
+/**
+ * PASS: WRITE COALESCING
+ *
+ * HOW IT WORKS:
+ * 1. Find runs of write(fd, buffer, length) system calls with the same
+ *    constant fd and unused results, with only constants and data
+ *    addresses (written once) between them
+ * 2. Adjacent pieces that are whole, consecutive data blobs merge into one
+ *    (the blobs are stored back to back)
+ * 3. One piece left: a single write; more: the iovec array goes in a new
+ *    frame area and one writev replaces the run
+ *
+ * NOTES:
+ * - Only the last write of the run moves (to after the instructions in
+ *   between), which is safe because those only define new constants
+ */
+auto coalesce_writes(Function& function) -> size_t
+{
+  const auto definitions = single_definitions(function);
+  const auto uses = use_counts(function);
+  const auto blobs = function.blobs();
+  const auto constant = [&](Value value) -> const Instruction* {
+    const auto* definition = definitions[value];
+    return definition != nullptr && definition->op == Op::kConst ? definition
+                                                                 : nullptr;
+  };
+  const auto is_write = [&](const Instruction& instruction) {
+    return instruction.op == Op::kSyscall && instruction.imm == kSysWrite &&
+           instruction.arg_count == 3 && uses[instruction.dst] == 0 &&
+           constant(instruction.args[0]) != nullptr;
+  };
+  const auto fd_of = [&](const Instruction& instruction) {
+    return constant(instruction.args[0])->imm;
+  };
+
+  struct Piece {
+    Value buffer = kNoValue;
+    Value length = kNoValue;
+    size_t first_blob = SIZE_MAX; // Whole blobs first_blob..last_blob
+    size_t last_blob = SIZE_MAX;
+  };
+  const auto whole_blob = [&](const Instruction& write) -> size_t {
+    const auto* buffer = definitions[write.args[1]];
+    const auto* length = constant(write.args[2]);
+    if (buffer == nullptr || buffer->op != Op::kData || length == nullptr ||
+        length->imm != blobs[buffer->imm].size) {
+      return SIZE_MAX;
+    }
+    return buffer->imm;
+  };
+
+  auto source = std::move(function.instructions());
+  auto& output = function.instructions();
+  output.clear();
+  auto saved = size_t{0};
+
+  for (size_t i = 0; i < source.size();) {
+    if (!is_write(source[i])) {
+      output.push_back(source[i++]);
+      continue;
+    }
+    std::vector<size_t> run{i};
+    auto end = i + 1;
+    for (auto j = i + 1;
+         j < source.size() && run.size() < kMaxCoalescedWrites; ++j) {
+      const auto& instruction = source[j];
+      if (is_write(instruction) && fd_of(instruction) == fd_of(source[i])) {
+        run.push_back(j);
+        end = j + 1;
+      }
+      else if (instruction.op != Op::kNop &&
+               !((instruction.op == Op::kConst ||
+                  instruction.op == Op::kData) &&
+                 definitions[instruction.dst] != nullptr)) {
+        break;
+      }
+    }
+    if (run.size() == 1) {
+      output.push_back(source[i++]);
+      continue;
+    }
+
+    std::vector<Piece> pieces;
+    for (const auto index : run) {
+      const auto& write = source[index];
+      const auto blob = whole_blob(write);
+      if (blob != SIZE_MAX && !pieces.empty() &&
+          pieces.back().last_blob != SIZE_MAX &&
+          pieces.back().last_blob + 1 == blob) {
+        pieces.back().last_blob = blob;
+        pieces.back().length = kNoValue; // Recomputed below
+        continue;
+      }
+      pieces.push_back(Piece{write.args[1], write.args[2], blob, blob});
+    }
+
+    // Everything between the writes stays, in order; the writes go
+    for (auto j = i; j < end; ++j) {
+      if (std::find(run.begin(), run.end(), j) == run.end()) {
+        output.push_back(source[j]);
+      }
+    }
+    for (auto& piece : pieces) {
+      if (piece.length == kNoValue) {
+        const auto& last = blobs[piece.last_blob];
+        const auto bytes =
+            last.offset + last.size - blobs[piece.first_blob].offset;
+        piece.length = function.new_value();
+        output.push_back(make(Op::kConst, piece.length, {}, bytes));
+      }
+    }
+    const auto file = source[i].args[0];
+    if (pieces.size() == 1) {
+      output.push_back(make(Op::kSyscall, function.new_value(),
+                            {file, pieces[0].buffer, pieces[0].length},
+                            kSysWrite));
+    }
+    else {
+      const auto iovecs = function.new_value();
+      output.push_back(
+          make(Op::kFrame, iovecs, {}, uint64_t{kIovecSize} * pieces.size()));
+      for (size_t p = 0; p < pieces.size(); ++p) {
+        const auto offset = uint64_t{kIovecSize} * p;
+        output.push_back(
+            make(Op::kStore, kNoValue, {iovecs, pieces[p].buffer}, offset));
+        output.push_back(make(Op::kStore, kNoValue,
+                              {iovecs, pieces[p].length}, offset + 8));
+      }
+      const auto count = function.new_value();
+      output.push_back(make(Op::kConst, count, {}, pieces.size()));
+      output.push_back(make(Op::kSyscall, function.new_value(),
+                            {file, iovecs, count}, kSysWritev));
+    }
+    saved += run.size() - 1;
+    i = end;
+  }
+  return saved;
+}
+
+/**
+ * PASS: DEAD CODE ELIMINATION
+ *
+ * Drops pure instructions whose result nobody reads, again and again
+ * (dropping one can make its operands dead too).
+ */
+auto eliminate_dead_code(Function& function) -> size_t
+{
+  auto removed = size_t{0};
+  for (auto changed = true; changed;) {
+    changed = false;
+    const auto uses = use_counts(function);
+    for (auto& instruction : function.instructions()) {
+      if (is_pure(instruction.op) && uses[instruction.dst] == 0) {
+        instruction = Instruction{};
+        ++removed;
+        changed = true;
+      }
+    }
+    compact(function);
+  }
+  return removed;
+}
+
+auto optimize(Function& function) -> OptimizeStats
+{
+  auto stats = OptimizeStats{};
+  stats.folded = fold_constants(function);
+  stats.coalesced = coalesce_writes(function);
+  stats.removed = eliminate_dead_code(function);
+  return stats;
+}
+
+/**
+ * REGISTER ALLOCATION: LINEAR SCAN
+ *
+ * HOW IT WORKS:
+ * 1. live_intervals() gives every value a [start, end] instruction range
+ * 2. Values live across a call or system call (start < call < end) may
+ *    only use preserved registers; the others try scratch ones first
+ * 3. Walk the intervals by start, freeing the registers of intervals that
+ *    have ended (an interval ending where another starts can pass its
+ *    register on: operands are read before the result is written)
+ * 4. No register free: whichever of the new interval and the active ones
+ *    (that could give it a register) ends last gets a stack slot
+ * 5. Frame areas go after the spill slots
+ */
+auto allocate_registers(const Function& function,
+                        const RegisterFile& registers) -> Allocation
+{
+  const auto& instructions = function.instructions();
+  const auto values = function.value_count();
+  std::vector<size_t> starts;
+  std::vector<size_t> ends;
+  live_intervals(function, starts, ends);
+
+  auto allocation = Allocation{};
+  allocation.locations.resize(values);
+  allocation.frame_offsets.resize(instructions.size());
+
+  // calls_before[i]: calls and system calls at positions below i
+  std::vector<size_t> calls_before(instructions.size() + 1);
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    const auto op = instructions[i].op;
+    calls_before[i + 1] =
+        calls_before[i] + (op == Op::kCall || op == Op::kSyscall ? 1 : 0);
+    allocation.has_calls |= op == Op::kCall;
+  }
+  const auto crosses_call = [&](Value value) {
+    return ends[value] > starts[value] + 1 &&
+           calls_before[ends[value]] > calls_before[starts[value] + 1];
+  };
+
+  std::vector<Value> order;
+  for (Value value = 0; value < values; ++value) {
+    if (starts[value] != SIZE_MAX) {
+      order.push_back(value);
+    }
+  }
+  std::sort(order.begin(), order.end(), [&](Value a, Value b) {
+    return starts[a] != starts[b] ? starts[a] < starts[b] : ends[a] < ends[b];
+  });
+
+  std::vector<bool> scratch_free(registers.scratch.size(), true);
+  std::vector<bool> preserved_free(registers.preserved.size(), true);
+  std::vector<bool> preserved_used(registers.preserved.size(), false);
+  // Active: (value, pool index, preserved?)
+  struct Active {
+    Value value;
+    size_t index;
+    bool preserved;
+  };
+  std::vector<Active> active;
+  auto spill_slots = uint32_t{0};
+  const auto spill = [&](Value value) {
+    allocation.locations[value] =
+        Location{Location::Kind::kStack, 0, 8 * spill_slots++};
+  };
+  const auto assign = [&](Value value, size_t index, bool preserved) {
+    (preserved ? preserved_free : scratch_free)[index] = false;
+    if (preserved) {
+      preserved_used[index] = true;
+    }
+    const auto reg =
+        (preserved ? registers.preserved : registers.scratch)[index];
+    allocation.locations[value] = Location{Location::Kind::kRegister, reg, 0};
+    active.push_back(Active{value, index, preserved});
+  };
+
+  for (const auto value : order) {
+    std::erase_if(active, [&](const Active& interval) {
+      if (ends[interval.value] > starts[value]) {
+        return false;
+      }
+      (interval.preserved ? preserved_free
+                          : scratch_free)[interval.index] = true;
+      return true;
+    });
+
+    const auto needs_preserved = crosses_call(value);
+    if (!needs_preserved) {
+      const auto free =
+          std::find(scratch_free.begin(), scratch_free.end(), true);
+      if (free != scratch_free.end()) {
+        assign(value, static_cast<size_t>(free - scratch_free.begin()), false);
+        continue;
+      }
+    }
+    const auto free =
+        std::find(preserved_free.begin(), preserved_free.end(), true);
+    if (free != preserved_free.end()) {
+      assign(value, static_cast<size_t>(free - preserved_free.begin()), true);
+      continue;
+    }
+
+    // Spill whichever interval (fitting the constraint) ends last
+    auto victim = active.end();
+    for (auto it = active.begin(); it != active.end(); ++it) {
+      if ((it->preserved || !needs_preserved) &&
+          (victim == active.end() || ends[it->value] > ends[victim->value])) {
+        victim = it;
+      }
+    }
+    if (victim != active.end() && ends[victim->value] > ends[value]) {
+      const auto taken = *victim;
+      active.erase(victim);
+      spill(taken.value);
+      assign(value, taken.index, taken.preserved);
+    }
+    else {
+      spill(value);
+    }
+  }
+
+  auto frame_size = 8 * spill_slots;
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    if (instructions[i].op == Op::kFrame) {
+      allocation.frame_offsets[i] = frame_size;
+      frame_size += static_cast<uint32_t>(instructions[i].imm);
+    }
+  }
+  allocation.frame_size = frame_size;
+  for (size_t i = 0; i < registers.preserved.size(); ++i) {
+    if (preserved_used[i]) {
+      allocation.preserved_used.push_back(registers.preserved[i]);
+    }
+  }
+  return allocation;
+}
+
+} // namespace mijit::ir
@@ -0,0 +1,347 @@
+/**
+ * @file ir.hpp
+ * @brief A small linear IR, its optimizer, and code generation for it
+ *
+ * HOW IT WORKS:
+ * 1. Build a Function: one call per instruction (constants, data, loads and
+ *    stores, system calls, host calls, branches); every instruction that
+ *    produces something returns a new Value (a virtual register)
+ * 2. optimize() runs the passes (see below)
+ * 3. allocate_registers() computes liveness and gives every Value a machine
+ *    register or a stack slot with linear scan
+ * 4. lower() turns each instruction into x86-64 or AArch64 code with the
+ *    emitters, data blobs go right after the code
+ *
+ * WHY WE NEED THIS:
+ * - The greeting stub is one fixed system call; anything more (several
+ *   writes, a host call for the dynamic part of a response, a loop) used to
+ *   mean hand-writing both instruction sets again
+ * - Programs written as a sequence of simple writes still compile to few
+ *   system calls: the optimizer merges them
+ *
+ * PASSES (optimize()):
+ * - Constant folding: add/sub of constants become a constant, branches on
+ *   a constant become a jump or disappear, code after a jump or return up
+ *   to the next label is dropped
+ * - Write coalescing: a run of write(fd, buffer, length) with the same
+ *   constant fd and unused results becomes ONE system call - a single
+ *   write when the buffers are adjacent data blobs, else one writev with
+ *   the iovec array in the stack frame
+ * - Dead code elimination: instructions without side effects whose result
+ *   nobody reads
+ *
+ * VALUES:
+ * - Most Values are defined once (SSA-like); variable() plus assign() make
+ *   a Value that is written several times, for loops
+ * - Every read of a Value must come after a write to it on every path
+ * - All Values are 64-bit integers (addresses included)
+ *
+ * NOTES:
+ * - Both lower() overloads are available on every host (like the
+ *   emitters), so code for the other architecture can be inspected;
+ *   compile_function() (compiler.hpp) uses the native one
+ * - copy() is lowered for the CPU features it is given (by default the
+ *   host's, see cpu_features.hpp): SSE2, AVX2 or AVX-512 moves on x86-64,
+ *   NEON moves or an SVE loop on AArch64
+ * - System call numbers are the host's (kSysWrite, kSysWritev); generated
+ *   AArch64 code on Apple Silicon makes no system calls, lower() throws
+ *   there - use call() into host code instead
+ * - A Function is a template for small programs: labels, data blobs and
+ *   address references share the emitter's fixed label and fixup tables
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "codegen.hpp"
+#include "cpu_features.hpp"
+#include "emitter.hpp"
+
+namespace mijit::ir {
+
+/**
+ * A virtual register (index into the function's values)
+ */
+using Value = uint32_t;
+inline constexpr Value kNoValue = UINT32_MAX;
+
+/**
+ * Arguments of a system call or host call
+ */
+inline constexpr size_t kMaxArgs = 6;
+
+/**
+ * Largest copy() (copies are unrolled on most CPUs)
+ */
+inline constexpr uint32_t kMaxCopySize = 4096;
+
+/**
+ * Host system call numbers of write and writev
+ */
+#if defined(__APPLE__)
+inline constexpr uint64_t kSysWrite = 0x2000004;
+inline constexpr uint64_t kSysWritev = 0x2000079;
+#elif defined(__aarch64__)
+inline constexpr uint64_t kSysWrite = 64;
+inline constexpr uint64_t kSysWritev = 66;
+#else
+inline constexpr uint64_t kSysWrite = 1;
+inline constexpr uint64_t kSysWritev = 20;
+#endif
+
+/**
+ * A place to jump to, created by new_target() and placed with bind()
+ */
+struct Target {
+  uint32_t id = 0;
+};
+
+enum class Op : uint8_t {
+  kParam,         // dst = argument imm of the function (leading only)
+  kConst,         // dst = imm
+  kData,          // dst = address of data blob imm
+  kFrame,         // dst = address of imm bytes of stack scratch space
+  kMove,          // dst = args[0]
+  kAdd,           // dst = args[0] + args[1]
+  kSub,           // dst = args[0] - args[1]
+  kLoad,          // dst = 8 bytes at args[0] + imm
+  kStore,         // 8 bytes at args[0] + imm = args[1]
+  kCopy,          // imm bytes at args[0] = imm bytes at args[1]
+  kSyscall,       // dst = system call imm (args)
+  kCall,          // dst = host function at address imm (args)
+  kLabel,         // target imm is here
+  kJump,          // go to target imm
+  kBranchZero,    // go to target imm if args[0] == 0
+  kBranchNonZero, // go to target imm if args[0] != 0
+  kReturn,        // return args[0] (or nothing, arg_count 0)
+  kNop,           // removed by a pass
+};
+
+struct Instruction {
+  Op op = Op::kNop;
+  uint8_t arg_count = 0;
+  Value dst = kNoValue;
+  std::array<Value, kMaxArgs> args{};
+  uint64_t imm = 0;
+
+  [[nodiscard]] auto operands() const noexcept -> std::span<const Value>
+  {
+    return std::span<const Value>{args.data(), arg_count};
+  }
+};
+
+/**
+ * Bytes the generated code refers to, placed after it
+ */
+struct DataBlob {
+  uint32_t offset = 0; // In Function::data()
+  uint32_t size = 0;
+};
+
+class Function {
+public:
+  /**
+   * ARGUMENTS: argument index of the C calling convention (System V /
+   * AAPCS64, integer and pointer arguments, index below kMaxArgs); all
+   * param() calls come before any other instruction
+   */
+  [[nodiscard]] auto param(size_t index) -> Value;
+
+  /**
+   * CONSTANTS AND ADDRESSES
+   */
+  [[nodiscard]] auto constant(uint64_t value) -> Value;
+  [[nodiscard]] auto data(std::string_view bytes) -> Value;
+  [[nodiscard]] auto frame(uint32_t size) -> Value;
+
+  /**
+   * ARITHMETIC AND MEMORY
+   */
+  [[nodiscard]] auto add(Value a, Value b) -> Value;
+  [[nodiscard]] auto sub(Value a, Value b) -> Value;
+  [[nodiscard]] auto load(Value base, int32_t offset = 0) -> Value;
+  auto store(Value base, Value value, int32_t offset = 0) -> void;
+
+  /**
+   * size bytes (1 to kMaxCopySize) from source to destination; the two
+   * must not overlap
+   */
+  auto copy(Value destination, Value source, uint32_t size) -> void;
+
+  /**
+   * VARIABLES: a Value that assign() may write any number of times
+   */
+  [[nodiscard]] auto variable() -> Value;
+  auto assign(Value variable, Value value) -> void;
+
+  /**
+   * CALLS (at most kMaxArgs arguments; the result is the return value)
+   */
+  auto syscall(uint64_t number, std::initializer_list<Value> args) -> Value;
+  auto call(const void* function, std::initializer_list<Value> args)
+      -> Value;
+
+  /**
+   * write(fd, bytes) with bytes as a data blob
+   */
+  auto write(int fd, std::string_view bytes) -> Value;
+
+  /**
+   * CONTROL FLOW
+   */
+  [[nodiscard]] auto new_target() -> Target;
+  auto bind(Target target) -> void;
+  auto jump(Target target) -> void;
+  auto branch_zero(Value condition, Target target) -> void;
+  auto branch_non_zero(Value condition, Target target) -> void;
+  auto ret() -> void;
+  auto ret(Value value) -> void;
+
+  /**
+   * FOR THE PASSES AND THE BACKENDS
+   */
+  [[nodiscard]] auto instructions() noexcept -> std::vector<Instruction>&
+  {
+    return instructions_;
+  }
+  [[nodiscard]] auto instructions() const noexcept
+      -> const std::vector<Instruction>&
+  {
+    return instructions_;
+  }
+  [[nodiscard]] auto value_count() const noexcept -> size_t
+  {
+    return value_count_;
+  }
+  [[nodiscard]] auto target_count() const noexcept -> size_t
+  {
+    return target_count_;
+  }
+  [[nodiscard]] auto param_count() const noexcept -> size_t
+  {
+    return param_count_;
+  }
+  [[nodiscard]] auto blobs() const noexcept -> std::span<const DataBlob>
+  {
+    return blobs_;
+  }
+  [[nodiscard]] auto data() const noexcept -> std::string_view
+  {
+    return data_;
+  }
+  [[nodiscard]] auto new_value() noexcept -> Value
+  {
+    return static_cast<Value>(value_count_++);
+  }
+  auto append(const Instruction& instruction) -> void;
+
+private:
+  auto define(Op op, std::initializer_list<Value> args, uint64_t imm = 0)
+      -> Value;
+
+  std::vector<Instruction> instructions_;
+  std::vector<DataBlob> blobs_;
+  std::string data_; // Blobs back to back, in creation order
+  size_t value_count_ = 0;
+  size_t target_count_ = 0;
+  size_t param_count_ = 0; // Highest argument index read + 1
+};
+
+/**
+ * A Function that writes the pieces one after the other and returns
+ * (optimize() turns it into the same single write as the greeting stub)
+ */
+[[nodiscard]] auto greeting_function(MessagePieces pieces) -> Function;
+
+/**
+ * int64_t f(const char* buffer, size_t length, int fd): writes the buffer
+ * to fd and returns the raw system call result (on Linux -errno on
+ * failure; on Apple Silicon it calls write() in the host, -1 on failure)
+ *
+ * One compiled copy serves every message: nothing is baked into the code.
+ */
+[[nodiscard]] auto write_function() -> Function;
+
+/**
+ * void f(char* destination, const char* source): copies size bytes with
+ * the fastest vector moves the CPU has
+ */
+[[nodiscard]] auto copy_function(uint32_t size) -> Function;
+
+struct OptimizeStats {
+  size_t folded = 0;    // Instructions constant folding changed or dropped
+  size_t coalesced = 0; // System calls saved by write coalescing
+  size_t removed = 0;   // Dead instructions removed
+};
+
+/**
+ * THE PASSES (each returns how much it changed; optimize() runs them all)
+ */
+auto fold_constants(Function& function) -> size_t;
+auto coalesce_writes(Function& function) -> size_t;
+auto eliminate_dead_code(Function& function) -> size_t;
+auto optimize(Function& function) -> OptimizeStats;
+
+/**
+ * REGISTER ALLOCATION
+ *
+ * registers: the machine registers values may use, by number
+ * - scratch:   clobbered by calls; only for values not live across one
+ * - preserved: kept by calls (saved in the prologue when used)
+ */
+struct RegisterFile {
+  std::span<const uint8_t> scratch;
+  std::span<const uint8_t> preserved;
+};
+
+struct Location {
+  enum class Kind : uint8_t {
+    kNone,     // Never used
+    kRegister, // In machine register reg
+    kStack,    // In the 8 bytes at offset in the frame
+  };
+
+  Kind kind = Kind::kNone;
+  uint8_t reg = 0;
+  uint32_t offset = 0;
+};
+
+struct Allocation {
+  std::vector<Location> locations;    // One per Value
+  std::vector<uint32_t> frame_offsets; // Per instruction (kFrame only)
+  std::vector<uint8_t> preserved_used; // Preserved registers handed out
+  uint32_t frame_size = 0;             // Spill slots + frame areas
+  bool has_calls = false;
+};
+
+[[nodiscard]] auto allocate_registers(const Function& function,
+                                      const RegisterFile& registers)
+    -> Allocation;
+
+/**
+ * CODE GENERATION
+ *
+ * Emit the function (entry point at the current position, its data blobs
+ * after the code) and finish the emitter; returns the total size.
+ * features picks the instruction variants (only those of the emitter's
+ * architecture matter).
+ */
+auto lower(X86Emitter& emitter, const Function& function,
+           const CpuFeatures& features = host_cpu_features()) -> size_t;
+auto lower(A64Emitter& emitter, const Function& function,
+           const CpuFeatures& features = host_cpu_features()) -> size_t;
+
+/**
+ * Bytes lower() can need at most, on either architecture
+ */
+[[nodiscard]] auto code_size_bound(const Function& function) -> size_t;
+
+} // namespace mijit::ir
@@ -0,0 +1,909 @@
+/**
+ * @file ir_codegen.cpp
+ * @brief Lowering IR functions to x86-64 and AArch64
+ */
+
+#include "ir.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "emitter.hpp"
+
+namespace mijit::ir {
+
+namespace {
+
+/**
+ * Code size bounds (bytes, the larger of the two architectures)
+ */
+constexpr size_t kMaxFrameCode = 256;       // Prologue + implicit return
+constexpr size_t kMaxInstructionCode = 48;  // Moves, spills, one operation
+constexpr size_t kMaxCallCode = 128;        // Argument moves + call / return
+constexpr size_t kCopyCodePerByte = 2;      // Unrolled vector moves
+
+using X86Reg = X86Emitter::Reg;
+using A64Reg = A64Emitter::Reg;
+
+template <typename Reg, size_t N>
+[[nodiscard]] constexpr auto numbers(const std::array<Reg, N>& regs) noexcept
+    -> std::array<uint8_t, N>
+{
+  std::array<uint8_t, N> result{};
+  for (size_t i = 0; i < N; ++i) {
+    result[i] = static_cast<uint8_t>(regs[i]);
+  }
+  return result;
+}
+
+/**
+ * X86-64 REGISTERS (System V)
+ * - rax: return value, system call number, temporary
+ * - r11: temporary (clobbered by syscall anyway), call target
+ * - rsp: frame; everything else is for values
+ */
+constexpr auto kX86Scratch = numbers(std::array{
+    X86Reg::rdi, X86Reg::rsi, X86Reg::rdx, X86Reg::rcx, X86Reg::r8,
+    X86Reg::r9, X86Reg::r10});
+constexpr auto kX86Preserved = numbers(std::array{
+    X86Reg::rbx, X86Reg::rbp, X86Reg::r12, X86Reg::r13, X86Reg::r14,
+    X86Reg::r15});
+constexpr auto kX86SyscallArgs = std::array{
+    X86Reg::rdi, X86Reg::rsi, X86Reg::rdx, X86Reg::r10, X86Reg::r8,
+    X86Reg::r9};
+constexpr auto kX86CallArgs = std::array{
+    X86Reg::rdi, X86Reg::rsi, X86Reg::rdx, X86Reg::rcx, X86Reg::r8,
+    X86Reg::r9};
+
+/**
+ * AARCH64 REGISTERS (AAPCS64)
+ * - x8: system call number, store address temporary
+ * - x16, x17: temporaries (x16 is also the call target)
+ * - x18 (platform), x29 / x30 (frame, link), sp: never used for values
+ */
+constexpr auto kA64Scratch = numbers(std::array{
+    A64Reg::x0, A64Reg::x1, A64Reg::x2, A64Reg::x3, A64Reg::x4, A64Reg::x5,
+    A64Reg::x6, A64Reg::x7, A64Reg::x9, A64Reg::x10, A64Reg::x11,
+    A64Reg::x12, A64Reg::x13, A64Reg::x14, A64Reg::x15});
+constexpr auto kA64Preserved = numbers(std::array{
+    A64Reg::x19, A64Reg::x20, A64Reg::x21, A64Reg::x22, A64Reg::x23,
+    A64Reg::x24, A64Reg::x25, A64Reg::x26, A64Reg::x27, A64Reg::x28});
+constexpr auto kA64Args = std::array{A64Reg::x0, A64Reg::x1, A64Reg::x2,
+                                     A64Reg::x3, A64Reg::x4, A64Reg::x5};
+
+struct Move {
+  uint8_t dst = 0;
+  uint8_t src = 0;
+};
+
+/**
+ * HELPER FUNCTION: Register moves that must happen all at once
+ *
+ * WHY WE NEED THIS:
+ * - Call arguments go to fixed registers, which may hold other arguments
+ *   (x in rsi going to rdi while y in rdi goes to rsi)
+ *
+ * HOW IT WORKS:
+ * 1. Emit any move whose destination no pending move still reads
+ * 2. Only cycles left: copy one destination to temp, and read temp instead
+ */
+template <typename EmitMove>
+auto resolve_moves(std::vector<Move> moves, uint8_t temp,
+                   const EmitMove& emit_move) -> void
+{
+  std::erase_if(moves, [](const Move& move) { return move.dst == move.src; });
+  while (!moves.empty()) {
+    const auto ready =
+        std::find_if(moves.begin(), moves.end(), [&](const Move& move) {
+          return std::none_of(
+              moves.begin(), moves.end(),
+              [&](const Move& other) { return other.src == move.dst; });
+        });
+    if (ready != moves.end()) {
+      emit_move(ready->dst, ready->src);
+      moves.erase(ready);
+      continue;
+    }
+    const auto blocked = moves.front().dst;
+    emit_move(temp, blocked);
+    for (auto& move : moves) {
+      move.src = move.src == blocked ? temp : move.src;
+    }
+  }
+}
+
+[[nodiscard]] auto falls_off_end(const Function& function) noexcept -> bool
+{
+  const auto& instructions = function.instructions();
+  return instructions.empty() || (instructions.back().op != Op::kReturn &&
+                                  instructions.back().op != Op::kJump);
+}
+
+/**
+ * X86-64 LOWERING
+ *
+ * FRAME: the used preserved registers are pushed, then rsp drops by the
+ * frame (spill slots and frame areas at [rsp + offset]), padded so rsp is
+ * 16-byte aligned at calls.
+ */
+class X86Lowering {
+public:
+  X86Lowering(X86Emitter& emitter, const Function& function,
+              const CpuFeatures& features)
+      : emitter_{emitter}, function_{function}, features_{features},
+        allocation_{allocate_registers(
+            function, RegisterFile{kX86Scratch, kX86Preserved})}
+  {
+  }
+
+  auto run() -> size_t
+  {
+    for (size_t i = 0; i < function_.target_count(); ++i) {
+      targets_.push_back(emitter_.new_label());
+    }
+    for (size_t i = 0; i < function_.blobs().size(); ++i) {
+      blobs_.push_back(emitter_.new_label());
+    }
+
+    // Entry rsp is 8 below a 16-byte boundary (the return address); host
+    // calls need it aligned
+    const auto pushes = allocation_.preserved_used.size();
+    frame_ = allocation_.frame_size;
+    if (allocation_.has_calls && (8 + 8 * pushes + frame_) % 16 != 0) {
+      frame_ += 8;
+    }
+    for (const auto reg : allocation_.preserved_used) {
+      emitter_.push(static_cast<X86Reg>(reg));
+    }
+    if (frame_ != 0) {
+      emitter_.sub_imm(X86Reg::rsp, static_cast<int32_t>(frame_));
+    }
+
+    parameters();
+    const auto& instructions = function_.instructions();
+    for (size_t i = 0; i < instructions.size(); ++i) {
+      lower(instructions[i], allocation_.frame_offsets[i]);
+    }
+    if (falls_off_end(function_)) {
+      epilogue();
+    }
+
+    for (size_t i = 0; i < blobs_.size(); ++i) {
+      const auto blob = function_.blobs()[i];
+      emitter_.bind(blobs_[i]);
+      emitter_.emit_bytes(function_.data().substr(blob.offset, blob.size));
+    }
+    return emitter_.finish();
+  }
+
+private:
+  auto lower(const Instruction& instruction, uint32_t frame_offset) -> void
+  {
+    const auto& args = instruction.args;
+    switch (instruction.op) {
+    case Op::kParam: // Placed by parameters()
+      break;
+    case Op::kConst: {
+      const auto dst = target(instruction.dst);
+      emitter_.mov_imm(dst, instruction.imm);
+      commit(instruction.dst, dst);
+      break;
+    }
+    case Op::kData: {
+      const auto dst = target(instruction.dst);
+      emitter_.lea_rip(dst, blobs_[instruction.imm]);
+      commit(instruction.dst, dst);
+      break;
+    }
+    case Op::kFrame: {
+      const auto dst = target(instruction.dst);
+      emitter_.lea(dst, X86Reg::rsp, static_cast<int32_t>(frame_offset));
+      commit(instruction.dst, dst);
+      break;
+    }
+    case Op::kMove: {
+      const auto src = read(args[0], X86Reg::rax);
+      const auto dst = target(instruction.dst);
+      if (dst != src) {
+        emitter_.mov_reg(dst, src);
+      }
+      commit(instruction.dst, dst);
+      break;
+    }
+    case Op::kAdd:
+    case Op::kSub:
+      arithmetic(instruction);
+      break;
+    case Op::kLoad: {
+      const auto base = read(args[0], X86Reg::rax);
+      const auto dst = target(instruction.dst);
+      emitter_.load(dst, base, offset(instruction));
+      commit(instruction.dst, dst);
+      break;
+    }
+    case Op::kStore: {
+      const auto base = read(args[0], X86Reg::rax);
+      const auto value = read(args[1], X86Reg::r11);
+      emitter_.store(base, offset(instruction), value);
+      break;
+    }
+    case Op::kCopy:
+      copy(instruction);
+      break;
+    case Op::kSyscall:
+    case Op::kCall:
+      call(instruction);
+      break;
+    case Op::kLabel:
+      emitter_.bind(targets_[instruction.imm]);
+      break;
+    case Op::kJump:
+      emitter_.jmp(targets_[instruction.imm]);
+      break;
+    case Op::kBranchZero:
+    case Op::kBranchNonZero: {
+      const auto condition = read(args[0], X86Reg::rax);
+      emitter_.test_reg(condition, condition);
+      if (instruction.op == Op::kBranchZero) {
+        emitter_.jz(targets_[instruction.imm]);
+      }
+      else {
+        emitter_.jnz(targets_[instruction.imm]);
+      }
+      break;
+    }
+    case Op::kReturn:
+      if (instruction.arg_count == 1) {
+        const auto value = read(args[0], X86Reg::rax);
+        if (value != X86Reg::rax) {
+          emitter_.mov_reg(X86Reg::rax, value);
+        }
+      }
+      epilogue();
+      break;
+    case Op::kNop:
+      break;
+    }
+  }
+
+  /**
+   * Arguments from their registers to where the allocator put them: stack
+   * slots first (that reads every argument register before any changes),
+   * then the register moves, all at once
+   */
+  auto parameters() -> void
+  {
+    std::vector<Move> moves;
+    for (const auto& instruction : function_.instructions()) {
+      if (instruction.op != Op::kParam) {
+        break;
+      }
+      const auto& location = allocation_.locations[instruction.dst];
+      const auto from = kX86CallArgs[instruction.imm];
+      if (location.kind == Location::Kind::kStack) {
+        emitter_.store(X86Reg::rsp, static_cast<int32_t>(location.offset),
+                       from);
+      }
+      else if (location.kind == Location::Kind::kRegister) {
+        moves.push_back(Move{location.reg, static_cast<uint8_t>(from)});
+      }
+    }
+    resolve_moves(moves, static_cast<uint8_t>(X86Reg::r11),
+                  [&](uint8_t dst, uint8_t src) {
+                    emitter_.mov_reg(static_cast<X86Reg>(dst),
+                                     static_cast<X86Reg>(src));
+                  });
+  }
+
+  /**
+   * add / sub: x86 only has dst op= src, so mind a result register that
+   * also holds the second operand
+   */
+  auto arithmetic(const Instruction& instruction) -> void
+  {
+    const auto a = read(instruction.args[0], X86Reg::rax);
+    const auto b = read(instruction.args[1], X86Reg::r11);
+    auto dst = target(instruction.dst);
+    const auto is_add = instruction.op == Op::kAdd;
+    if (dst == b && dst != a) {
+      if (is_add) {
+        emitter_.add_reg(dst, a);
+      }
+      else {
+        if (a != X86Reg::rax) {
+          emitter_.mov_reg(X86Reg::rax, a);
+        }
+        emitter_.sub_reg(X86Reg::rax, b);
+        emitter_.mov_reg(dst, X86Reg::rax);
+      }
+    }
+    else {
+      if (dst != a) {
+        emitter_.mov_reg(dst, a);
+      }
+      if (is_add) {
+        emitter_.add_reg(dst, b);
+      }
+      else {
+        emitter_.sub_reg(dst, b);
+      }
+    }
+    commit(instruction.dst, dst);
+  }
+
+  /**
+   * COPY: the widest vector moves the CPU has (zmm with AVX-512, ymm with
+   * AVX2, else xmm), unrolled; a tail shorter than a vector is one more
+   * move that overlaps the previous one. Under 16 bytes in all: 8/4/2/1
+   * bytes through a general register, saved on the stack for the copy
+   * (every other register may hold a value).
+   */
+  auto copy(const Instruction& instruction) -> void
+  {
+    const auto destination = read(instruction.args[0], X86Reg::rax);
+    const auto source = read(instruction.args[1], X86Reg::r11);
+    const auto size = static_cast<int32_t>(instruction.imm);
+
+    if (size < 16) {
+      auto data = X86Reg::rcx;
+      for (const auto reg : {X86Reg::rcx, X86Reg::rdx, X86Reg::rsi}) {
+        if (reg != destination && reg != source) {
+          data = reg;
+          break;
+        }
+      }
+      emitter_.push(data);
+      for (auto offset = 0; offset < size;) {
+        const auto bytes = size - offset >= 8   ? 8
+                           : size - offset >= 4 ? 4
+                           : size - offset >= 2 ? 2
+                                                : 1;
+        emitter_.load_sized(data, source, offset,
+                            static_cast<size_t>(bytes));
+        emitter_.store_sized(destination, offset, data,
+                             static_cast<size_t>(bytes));
+        offset += bytes;
+      }
+      emitter_.pop(data);
+      return;
+    }
+
+    const auto width = features_.avx512f && size >= 64 ? 64
+                       : features_.avx2 && size >= 32  ? 32
+                                                       : 16;
+    const auto vex = features_.avx2;
+    const auto move = [&](int32_t offset) {
+      emitter_.vector_load(0, source, offset, static_cast<size_t>(width),
+                           vex);
+      emitter_.vector_store(destination, offset, 0,
+                            static_cast<size_t>(width), vex);
+    };
+    auto offset = 0;
+    for (; offset + width <= size; offset += width) {
+      move(offset);
+    }
+    if (offset < size) {
+      move(size - width);
+    }
+    if (width > 16) {
+      emitter_.vzeroupper();
+    }
+  }
+
+  /**
+   * Arguments to their registers (all at once), then syscall / call r11;
+   * the result comes back in rax
+   */
+  auto call(const Instruction& instruction) -> void
+  {
+    const auto& arg_regs = instruction.op == Op::kSyscall ? kX86SyscallArgs
+                                                          : kX86CallArgs;
+    std::vector<Move> moves;
+    for (size_t i = 0; i < instruction.arg_count; ++i) {
+      const auto& location = allocation_.locations[instruction.args[i]];
+      if (location.kind == Location::Kind::kRegister) {
+        moves.push_back(
+            Move{static_cast<uint8_t>(arg_regs[i]), location.reg});
+      }
+    }
+    resolve_moves(moves, static_cast<uint8_t>(X86Reg::r11),
+                  [&](uint8_t dst, uint8_t src) {
+                    emitter_.mov_reg(static_cast<X86Reg>(dst),
+                                     static_cast<X86Reg>(src));
+                  });
+    for (size_t i = 0; i < instruction.arg_count; ++i) {
+      const auto& location = allocation_.locations[instruction.args[i]];
+      if (location.kind == Location::Kind::kStack) {
+        emitter_.load(arg_regs[i], X86Reg::rsp,
+                      static_cast<int32_t>(location.offset));
+      }
+    }
+
+    if (instruction.op == Op::kSyscall) {
+      emitter_.mov_imm(X86Reg::rax, instruction.imm);
+      emitter_.syscall();
+    }
+    else {
+      emitter_.mov_imm(X86Reg::r11, instruction.imm);
+      emitter_.call_reg(X86Reg::r11);
+    }
+    const auto dst = target(instruction.dst);
+    if (dst != X86Reg::rax) {
+      emitter_.mov_reg(dst, X86Reg::rax);
+    }
+    commit(instruction.dst, dst);
+  }
+
+  auto epilogue() -> void
+  {
+    if (frame_ != 0) {
+      emitter_.add_imm(X86Reg::rsp, static_cast<int32_t>(frame_));
+    }
+    const auto& saved = allocation_.preserved_used;
+    for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+      emitter_.pop(static_cast<X86Reg>(*it));
+    }
+    emitter_.ret();
+  }
+
+  /**
+   * The register holding value (loaded into temp if it lives on the stack)
+   */
+  auto read(Value value, X86Reg temp) -> X86Reg
+  {
+    const auto& location = allocation_.locations[value];
+    if (location.kind == Location::Kind::kRegister) {
+      return static_cast<X86Reg>(location.reg);
+    }
+    if (location.kind == Location::Kind::kStack) {
+      emitter_.load(temp, X86Reg::rsp, static_cast<int32_t>(location.offset));
+    }
+    return temp;
+  }
+
+  /**
+   * Where to compute value: its register, or rax before commit() stores it
+   */
+  [[nodiscard]] auto target(Value value) const -> X86Reg
+  {
+    const auto& location = allocation_.locations[value];
+    return location.kind == Location::Kind::kRegister
+               ? static_cast<X86Reg>(location.reg)
+               : X86Reg::rax;
+  }
+
+  auto commit(Value value, X86Reg reg) -> void
+  {
+    const auto& location = allocation_.locations[value];
+    if (location.kind == Location::Kind::kStack) {
+      emitter_.store(X86Reg::rsp, static_cast<int32_t>(location.offset), reg);
+    }
+  }
+
+  [[nodiscard]] static auto offset(const Instruction& instruction) -> int32_t
+  {
+    return static_cast<int32_t>(static_cast<int64_t>(instruction.imm));
+  }
+
+  X86Emitter& emitter_;
+  const Function& function_;
+  const CpuFeatures& features_;
+  Allocation allocation_;
+  std::vector<Label> targets_;
+  std::vector<Label> blobs_;
+  uint32_t frame_ = 0;
+};
+
+/**
+ * AARCH64 LOWERING
+ *
+ * FRAME (only when needed): stp x29, x30 and x29 = sp, then sp drops by the
+ * frame: spill slots and frame areas at [sp + offset], the used preserved
+ * registers above them, 16-byte aligned.
+ */
+class A64Lowering {
+public:
+  A64Lowering(A64Emitter& emitter, const Function& function,
+              const CpuFeatures& features)
+      : emitter_{emitter}, function_{function}, features_{features},
+        allocation_{allocate_registers(
+            function, RegisterFile{kA64Scratch, kA64Preserved})}
+  {
+  }
+
+  auto run() -> size_t
+  {
+    for (size_t i = 0; i < function_.target_count(); ++i) {
+      targets_.push_back(emitter_.new_label());
+    }
+    for (size_t i = 0; i < function_.blobs().size(); ++i) {
+      blobs_.push_back(emitter_.new_label());
+    }
+
+    const auto saved = static_cast<uint32_t>(
+        8 * allocation_.preserved_used.size());
+    frame_ = (allocation_.frame_size + saved + 15) & ~15u;
+    has_frame_ = allocation_.has_calls || frame_ != 0;
+    if (frame_ >= 4096) {
+      throw std::runtime_error("IR stack frame is too large");
+    }
+    if (has_frame_) {
+      emitter_.push_pair(A64Reg::x29, A64Reg::x30);
+      emitter_.add_imm(A64Reg::x29, A64Reg::sp, 0);
+      if (frame_ != 0) {
+        emitter_.sub_imm(A64Reg::sp, A64Reg::sp,
+                         static_cast<uint16_t>(frame_));
+      }
+      for_each_saved([&](A64Reg reg, uint32_t offset) {
+        emitter_.str_imm(reg, A64Reg::sp, offset);
+      });
+    }
+
+    parameters();
+    const auto& instructions = function_.instructions();
+    for (size_t i = 0; i < instructions.size(); ++i) {
+      lower(instructions[i], allocation_.frame_offsets[i]);
+    }
+    if (falls_off_end(function_)) {
+      epilogue();
+    }
+
+    for (size_t i = 0; i < blobs_.size(); ++i) {
+      const auto blob = function_.blobs()[i];
+      emitter_.bind(blobs_[i]);
+      emitter_.emit_bytes(function_.data().substr(blob.offset, blob.size));
+    }
+    return emitter_.finish();
+  }
+
+private:
+  auto lower(const Instruction& instruction, uint32_t frame_offset) -> void
+  {
+    const auto& args = instruction.args;
+    switch (instruction.op) {
+    case Op::kParam: // Placed by parameters()
+      break;
+    case Op::kConst: {
+      const auto dst = target(instruction.dst);
+      emitter_.mov_imm(dst, instruction.imm);
+      commit(instruction.dst, dst);
+      break;
+    }
+    case Op::kData: {
+      const auto dst = target(instruction.dst);
+      emitter_.adr(dst, blobs_[instruction.imm]);
+      commit(instruction.dst, dst);
+      break;
+    }
+    case Op::kFrame: {
+      const auto dst = target(instruction.dst);
+      emitter_.add_imm(dst, A64Reg::sp, static_cast<uint16_t>(frame_offset));
+      commit(instruction.dst, dst);
+      break;
+    }
+    case Op::kMove: {
+      const auto src = read(args[0], A64Reg::x16);
+      const auto dst = target(instruction.dst);
+      if (dst != src) {
+        emitter_.mov_reg(dst, src);
+      }
+      commit(instruction.dst, dst);
+      break;
+    }
+    case Op::kAdd:
+    case Op::kSub: {
+      const auto a = read(args[0], A64Reg::x16);
+      const auto b = read(args[1], A64Reg::x17);
+      const auto dst = target(instruction.dst);
+      if (instruction.op == Op::kAdd) {
+        emitter_.add_reg(dst, a, b);
+      }
+      else {
+        emitter_.sub_reg(dst, a, b);
+      }
+      commit(instruction.dst, dst);
+      break;
+    }
+    case Op::kLoad: {
+      const auto base = address(read(args[0], A64Reg::x16), instruction,
+                                A64Reg::x17);
+      const auto dst = target(instruction.dst);
+      emitter_.ldr_imm(dst, base.first, base.second);
+      commit(instruction.dst, dst);
+      break;
+    }
+    case Op::kStore: {
+      const auto value = read(args[1], A64Reg::x17);
+      const auto base = address(read(args[0], A64Reg::x16), instruction,
+                                A64Reg::x8);
+      emitter_.str_imm(value, base.first, base.second);
+      break;
+    }
+    case Op::kCopy:
+      copy(instruction);
+      break;
+    case Op::kSyscall:
+    case Op::kCall:
+      call(instruction);
+      break;
+    case Op::kLabel:
+      emitter_.bind(targets_[instruction.imm]);
+      break;
+    case Op::kJump:
+      emitter_.b(targets_[instruction.imm]);
+      break;
+    case Op::kBranchZero:
+    case Op::kBranchNonZero: {
+      const auto condition = read(args[0], A64Reg::x16);
+      if (instruction.op == Op::kBranchZero) {
+        emitter_.cbz(condition, targets_[instruction.imm]);
+      }
+      else {
+        emitter_.cbnz(condition, targets_[instruction.imm]);
+      }
+      break;
+    }
+    case Op::kReturn:
+      if (instruction.arg_count == 1) {
+        const auto value = read(args[0], A64Reg::x16);
+        if (value != A64Reg::x0) {
+          emitter_.mov_reg(A64Reg::x0, value);
+        }
+      }
+      epilogue();
+      break;
+    case Op::kNop:
+      break;
+    }
+  }
+
+  /**
+   * Arguments from x0-x5 to where the allocator put them (stack slots
+   * first, then the register moves all at once)
+   */
+  auto parameters() -> void
+  {
+    std::vector<Move> moves;
+    for (const auto& instruction : function_.instructions()) {
+      if (instruction.op != Op::kParam) {
+        break;
+      }
+      const auto& location = allocation_.locations[instruction.dst];
+      const auto from = kA64Args[instruction.imm];
+      if (location.kind == Location::Kind::kStack) {
+        emitter_.str_imm(from, A64Reg::sp, location.offset);
+      }
+      else if (location.kind == Location::Kind::kRegister) {
+        moves.push_back(Move{location.reg, static_cast<uint8_t>(from)});
+      }
+    }
+    resolve_moves(moves, static_cast<uint8_t>(A64Reg::x17),
+                  [&](uint8_t dst, uint8_t src) {
+                    emitter_.mov_reg(static_cast<A64Reg>(dst),
+                                     static_cast<A64Reg>(src));
+                  });
+  }
+
+  /**
+   * COPY: x16 = source, x17 = destination (both move on), x8 = data
+   *
+   * - SVE: one predicated loop for any size - whilelo covers the bytes
+   *   left, so the last (or only) round needs no separate tail
+   * - NEON: 32 bytes per ldp/stp pair, the tail as 16-byte moves
+   *   overlapping the bytes before it
+   * - Under 16 bytes without SVE: 8/4/2/1 bytes through x8
+   */
+  auto copy(const Instruction& instruction) -> void
+  {
+    const auto destination = read(instruction.args[0], A64Reg::x17);
+    const auto source = read(instruction.args[1], A64Reg::x16);
+    if (destination != A64Reg::x17) {
+      emitter_.mov_reg(A64Reg::x17, destination);
+    }
+    if (source != A64Reg::x16) {
+      emitter_.mov_reg(A64Reg::x16, source);
+    }
+    const auto size = static_cast<uint32_t>(instruction.imm);
+
+    if (features_.sve) {
+      const auto loop = emitter_.new_label();
+      emitter_.mov_imm(A64Reg::x8, size);
+      emitter_.bind(loop);
+      emitter_.whilelo_b(0, A64Reg::sp, A64Reg::x8); // sp here means xzr
+      emitter_.ld1b(0, 0, A64Reg::x16);
+      emitter_.st1b(0, 0, A64Reg::x17);
+      emitter_.incb(A64Reg::x16);
+      emitter_.incb(A64Reg::x17);
+      emitter_.uqdecb(A64Reg::x8);
+      emitter_.cbnz(A64Reg::x8, loop);
+      return;
+    }
+
+    if (size < 16) {
+      for (auto offset = uint32_t{0}; offset < size;) {
+        const auto bytes = size - offset >= 8   ? 8u
+                           : size - offset >= 4 ? 4u
+                           : size - offset >= 2 ? 2u
+                                                : 1u;
+        emitter_.ldr_sized(A64Reg::x8, A64Reg::x16, offset, bytes);
+        emitter_.str_sized(A64Reg::x8, A64Reg::x17, offset, bytes);
+        offset += bytes;
+      }
+      return;
+    }
+
+    for (auto pairs = size / 32; pairs > 0; --pairs) {
+      emitter_.ldp_q_post(0, 1, A64Reg::x16);
+      emitter_.stp_q_post(0, 1, A64Reg::x17);
+    }
+    const auto tail = static_cast<int32_t>(size % 32);
+    if (tail > 16) {
+      emitter_.ldur_q(0, A64Reg::x16, 0);
+      emitter_.stur_q(0, A64Reg::x17, 0);
+    }
+    if (tail > 0) {
+      emitter_.ldur_q(0, A64Reg::x16, tail - 16);
+      emitter_.stur_q(0, A64Reg::x17, tail - 16);
+    }
+  }
+
+  /**
+   * Arguments to x0-x5 (all at once), then svc / blr x16; the result comes
+   * back in x0
+   */
+  auto call(const Instruction& instruction) -> void
+  {
+#if defined(__APPLE__)
+    if (instruction.op == Op::kSyscall) {
+      throw std::runtime_error(
+          "Generated code makes no system calls on Apple Silicon");
+    }
+#endif
+    std::vector<Move> moves;
+    for (size_t i = 0; i < instruction.arg_count; ++i) {
+      const auto& location = allocation_.locations[instruction.args[i]];
+      if (location.kind == Location::Kind::kRegister) {
+        moves.push_back(
+            Move{static_cast<uint8_t>(kA64Args[i]), location.reg});
+      }
+    }
+    resolve_moves(moves, static_cast<uint8_t>(A64Reg::x17),
+                  [&](uint8_t dst, uint8_t src) {
+                    emitter_.mov_reg(static_cast<A64Reg>(dst),
+                                     static_cast<A64Reg>(src));
+                  });
+    for (size_t i = 0; i < instruction.arg_count; ++i) {
+      const auto& location = allocation_.locations[instruction.args[i]];
+      if (location.kind == Location::Kind::kStack) {
+        emitter_.ldr_imm(kA64Args[i], A64Reg::sp, location.offset);
+      }
+    }
+
+    if (instruction.op == Op::kSyscall) {
+      emitter_.mov_imm(A64Reg::x8, instruction.imm);
+      emitter_.svc(0);
+    }
+    else {
+      emitter_.mov_imm(A64Reg::x16, instruction.imm);
+      emitter_.blr(A64Reg::x16);
+    }
+    const auto dst = target(instruction.dst);
+    if (dst != A64Reg::x0) {
+      emitter_.mov_reg(dst, A64Reg::x0);
+    }
+    commit(instruction.dst, dst);
+  }
+
+  auto epilogue() -> void
+  {
+    if (has_frame_) {
+      for_each_saved([&](A64Reg reg, uint32_t offset) {
+        emitter_.ldr_imm(reg, A64Reg::sp, offset);
+      });
+      if (frame_ != 0) {
+        emitter_.add_imm(A64Reg::sp, A64Reg::sp,
+                         static_cast<uint16_t>(frame_));
+      }
+      emitter_.pop_pair(A64Reg::x29, A64Reg::x30);
+    }
+    emitter_.ret();
+  }
+
+  template <typename F> auto for_each_saved(const F& visit) const -> void
+  {
+    auto offset = allocation_.frame_size;
+    for (const auto reg : allocation_.preserved_used) {
+      visit(static_cast<A64Reg>(reg), offset);
+      offset += 8;
+    }
+  }
+
+  /**
+   * base + the instruction's offset as an ldr/str operand: the offset
+   * directly when it fits, else computed into temp
+   */
+  auto address(A64Reg base, const Instruction& instruction, A64Reg temp)
+      -> std::pair<A64Reg, uint32_t>
+  {
+    const auto offset = static_cast<int64_t>(instruction.imm);
+    if (offset >= 0 && offset < 32768 && (offset & 7) == 0) {
+      return {base, static_cast<uint32_t>(offset)};
+    }
+    emitter_.mov_imm(temp, instruction.imm);
+    emitter_.add_reg(temp, base, temp);
+    return {temp, 0};
+  }
+
+  auto read(Value value, A64Reg temp) -> A64Reg
+  {
+    const auto& location = allocation_.locations[value];
+    if (location.kind == Location::Kind::kRegister) {
+      return static_cast<A64Reg>(location.reg);
+    }
+    if (location.kind == Location::Kind::kStack) {
+      emitter_.ldr_imm(temp, A64Reg::sp, location.offset);
+    }
+    return temp;
+  }
+
+  [[nodiscard]] auto target(Value value) const -> A64Reg
+  {
+    const auto& location = allocation_.locations[value];
+    return location.kind == Location::Kind::kRegister
+               ? static_cast<A64Reg>(location.reg)
+               : A64Reg::x16;
+  }
+
+  auto commit(Value value, A64Reg reg) -> void
+  {
+    const auto& location = allocation_.locations[value];
+    if (location.kind == Location::Kind::kStack) {
+      emitter_.str_imm(reg, A64Reg::sp, location.offset);
+    }
+  }
+
+  A64Emitter& emitter_;
+  const Function& function_;
+  const CpuFeatures& features_;
+  Allocation allocation_;
+  std::vector<Label> targets_;
+  std::vector<Label> blobs_;
+  uint32_t frame_ = 0;
+  bool has_frame_ = false;
+};
+
+} // namespace
+
+auto lower(X86Emitter& emitter, const Function& function,
+           const CpuFeatures& features) -> size_t
+{
+  return X86Lowering{emitter, function, features}.run();
+}
+
+auto lower(A64Emitter& emitter, const Function& function,
+           const CpuFeatures& features) -> size_t
+{
+  return A64Lowering{emitter, function, features}.run();
+}
+
+auto code_size_bound(const Function& function) -> size_t
+{
+  auto size = kMaxFrameCode + function.data().size();
+  for (const auto& instruction : function.instructions()) {
+    const auto op = instruction.op;
+    size += op == Op::kCall || op == Op::kSyscall || op == Op::kReturn
+                ? kMaxCallCode
+                : kMaxInstructionCode;
+    if (op == Op::kCopy) {
+      size += kCopyCodePerByte * instruction.imm;
+    }
+  }
+  return size;
+}
+
+} // namespace mijit::ir
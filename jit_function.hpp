@@ -0,0 +1,133 @@
+/**
+ * @file jit_function.hpp
+ * @brief Typed handles for generated code that takes arguments
+ *
+ * HOW IT WORKS:
+ * - Generated code that follows the C calling convention of the platform
+ *   (System V on x86-64, AAPCS64 on ARM64) is an ordinary C function:
+ *   arguments arrive in rdi, rsi, rdx, rcx, r8, r9 / x0-x5, the result
+ *   goes back in rax / x0
+ * - JitFunction<R(Args...)> wraps such an entry point with its real type,
+ *   so calls are checked by the compiler instead of cast at every call site
+ * - compile_jit_function() compiles an ir::Function (whose param() values
+ *   are those arguments) into one
+ *
+ * WHY WE NEED THIS:
+ * - A greeting stub has its message baked into the code, so every distinct
+ *   input needs its own compile
+ * - A function that takes the input as arguments is compiled once and
+ *   serves every input (see compile_write_function())
+ *
+ * NOTES:
+ * - Only integer, enum and pointer arguments and results (at most
+ *   ir::kMaxArgs arguments): everything is passed in general registers
+ * - Like the stubs, the arena must be published before the first call
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+
+#include "compiler.hpp"
+#include "ir.hpp"
+#include "jit_memory.hpp"
+
+namespace mijit {
+
+/**
+ * Types passed in one general register
+ */
+template <typename T>
+inline constexpr bool kRegisterType =
+    std::is_integral_v<T> || std::is_enum_v<T> || std::is_pointer_v<T>;
+
+template <typename Signature>
+class JitFunction;
+
+template <typename R, typename... Args>
+class JitFunction<R(Args...)> {
+  static_assert(sizeof...(Args) <= ir::kMaxArgs,
+                "JIT functions take at most 6 arguments");
+  static_assert((kRegisterType<Args> && ...),
+                "JIT function arguments must be integers or pointers");
+  static_assert(std::is_void_v<R> || kRegisterType<R>,
+                "JIT functions return nothing, an integer or a pointer");
+
+public:
+  using Pointer = R (*)(Args...);
+  static constexpr size_t kArity = sizeof...(Args);
+
+  constexpr JitFunction() noexcept = default;
+
+  /**
+   * The function whose entry point is code (executable address)
+   */
+  explicit JitFunction(const uint8_t* code) noexcept
+      : pointer_{reinterpret_cast<Pointer>(code)}
+  {
+  }
+
+  auto operator()(Args... args) const -> R
+  {
+    return pointer_(args...);
+  }
+
+  [[nodiscard]] auto get() const noexcept -> Pointer
+  {
+    return pointer_;
+  }
+
+  explicit operator bool() const noexcept
+  {
+    return pointer_ != nullptr;
+  }
+
+private:
+  Pointer pointer_ = nullptr;
+};
+
+/**
+ * Compile an IR function as a Signature function (not published); throws
+ * if the function reads more arguments than Signature has
+ */
+template <typename Signature>
+[[nodiscard]] auto compile_jit_function(CodeArena& arena,
+                                        const ir::Function& function)
+    -> JitFunction<Signature>
+{
+  if (function.param_count() > JitFunction<Signature>::kArity) {
+    throw std::runtime_error(
+        "IR function reads more arguments than its signature has");
+  }
+  return JitFunction<Signature>{compile_function(arena, function).executable};
+}
+
+/**
+ * write(fd, buffer, length) as generated code - see ir::write_function()
+ */
+using WriteSignature = int64_t(const char* buffer, size_t length, int fd);
+using WriteFunction = JitFunction<WriteSignature>;
+
+[[nodiscard]] inline auto compile_write_function(CodeArena& arena)
+    -> WriteFunction
+{
+  return compile_jit_function<WriteSignature>(arena, ir::write_function());
+}
+
+/**
+ * A fixed-size copy as generated code - see ir::copy_function()
+ */
+using CopySignature = void(char* destination, const char* source);
+using CopyFunction = JitFunction<CopySignature>;
+
+[[nodiscard]] inline auto compile_copy_function(CodeArena& arena,
+                                                uint32_t size)
+    -> CopyFunction
+{
+  return compile_jit_function<CopySignature>(arena, ir::copy_function(size));
+}
+
+} // namespace mijit
@@ -0,0 +1,739 @@
+/**
+ * @file jit_memory.cpp
+ * @brief Page-size helpers and the CodeArena bump allocator
+ */
+
+#include "jit_memory.hpp"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__APPLE__) && defined(__aarch64__)
+#include <libkern/OSCacheControl.h>
+#include <pthread.h>
+#endif
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "jit_stats.hpp"
+
+namespace mijit {
+
+namespace {
+
+/**
+ * Ask the system for the huge page size (0 if it has none)
+ */
+[[nodiscard]] auto query_huge_page_size() noexcept -> size_t
+{
+#if defined(__linux__)
+  // Transparent huge page size, e.g. 2097152 on x86-64
+  if (auto* file = std::fopen(
+          "/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r")) {
+    auto size = 0UL;
+    const auto parsed = std::fscanf(file, "%lu", &size);
+    std::fclose(file);
+    if (parsed == 1 && size != 0 && (size & (size - 1)) == 0) {
+      return size;
+    }
+  }
+#endif
+  return 0;
+}
+
+[[nodiscard]] auto query_memory_info() noexcept -> JitMemoryInfo
+{
+  auto info = JitMemoryInfo{};
+  info.page_size = static_cast<size_t>(sysconf(_SC_PAGE_SIZE));
+  info.huge_page_size = query_huge_page_size();
+  return info;
+}
+
+#if defined(__aarch64__) && !defined(__APPLE__)
+/**
+ * Cache line sizes and coherence features from CTR_EL0 (readable from user
+ * space on Linux)
+ */
+struct CacheType {
+  size_t dcache_line = 64;
+  size_t icache_line = 64;
+  bool clean_not_needed = false;      // IDC: no DC CVAU needed
+  bool invalidate_not_needed = false; // DIC: no IC IVAU needed
+};
+
+[[nodiscard]] auto query_cache_type() noexcept -> CacheType
+{
+  uint64_t ctr = 0;
+  asm volatile("mrs %0, ctr_el0" : "=r"(ctr));
+  auto type = CacheType{};
+  type.dcache_line = size_t{4} << ((ctr >> 16) & 0xF); // DminLine (words)
+  type.icache_line = size_t{4} << (ctr & 0xF);         // IminLine (words)
+  type.clean_not_needed = ((ctr >> 28) & 1) != 0;
+  type.invalidate_not_needed = ((ctr >> 29) & 1) != 0;
+  return type;
+}
+#endif
+
+/**
+ * HELPER FUNCTION: Ask for transparent huge pages on a normal mapping
+ */
+auto advise_huge_pages([[maybe_unused]] void* memory,
+                       [[maybe_unused]] size_t size) noexcept -> void
+{
+#ifdef MADV_HUGEPAGE
+  madvise(memory, size, MADV_HUGEPAGE); // Only a hint - failure is fine
+#endif
+}
+
+#if defined(__linux__)
+constexpr unsigned kNodeMaskBits = 1024; // The kernel's largest MAX_NUMNODES
+
+/**
+ * HELPER FUNCTION: Prefer pages of node for [memory, memory + size)
+ *
+ * - mbind(MPOL_PREFERRED) as a raw system call: no libnuma needed
+ * - MPOL_MF_MOVE also moves pages already there, where the kernel can
+ * - Not counted here: the fork handler calls it too, where counting could
+ *   take the statistics lock
+ */
+[[nodiscard]] auto prefer_node(void* memory, size_t size,
+                               unsigned node) noexcept -> bool
+{
+  constexpr auto kWordBits = 8 * sizeof(unsigned long);
+  if (node >= kNodeMaskBits) {
+    return false;
+  }
+  unsigned long mask[kNodeMaskBits / kWordBits] = {};
+  mask[node / kWordBits] = 1UL << (node % kWordBits);
+  const auto result = syscall(SYS_mbind, memory, size, MPOL_PREFERRED, mask,
+                              kNodeMaskBits + 1, MPOL_MF_MOVE);
+  return result == 0;
+}
+#endif
+
+} // namespace
+
+[[nodiscard]] auto jit_memory_info() noexcept -> const JitMemoryInfo&
+{
+  static const auto info = query_memory_info(); // Asked once per process
+  return info;
+}
+
+/**
+ * Only the cache lines that hold the given bytes are touched, so flushing a
+ * batch of small stubs costs a handful of instructions, not a whole page
+ */
+auto flush_instruction_cache([[maybe_unused]] const uint8_t* writable,
+                             [[maybe_unused]] const uint8_t* executable,
+                             [[maybe_unused]] size_t size) noexcept -> void
+{
+  if (size == 0) {
+    return;
+  }
+  count_jit(JitCounter::kIcacheFlushes);
+  count_jit(JitCounter::kIcacheBytes, size);
+#if defined(__x86_64__)
+  // Coherent instruction cache: only stop the compiler reordering the writes
+  asm volatile("" : : : "memory");
+#elif defined(__APPLE__) && defined(__aarch64__)
+  sys_icache_invalidate(const_cast<uint8_t*>(executable), size);
+#elif defined(__aarch64__)
+  static const auto type = query_cache_type(); // Asked once per process
+
+  // STEP 1: Push the new bytes from the data cache to the point where
+  // instruction fetch can see them
+  if (!type.clean_not_needed) {
+    const auto mask = ~(static_cast<uintptr_t>(type.dcache_line) - 1);
+    const auto begin = reinterpret_cast<uintptr_t>(writable);
+    for (auto line = begin & mask; line < begin + size;
+         line += type.dcache_line) {
+      asm volatile("dc cvau, %0" : : "r"(line) : "memory");
+    }
+  }
+  asm volatile("dsb ish" : : : "memory"); // Cleans done on every core
+
+  // STEP 2: Drop stale copies from every core's instruction cache
+  if (!type.invalidate_not_needed) {
+    const auto mask = ~(static_cast<uintptr_t>(type.icache_line) - 1);
+    const auto begin = reinterpret_cast<uintptr_t>(executable);
+    for (auto line = begin & mask; line < begin + size;
+         line += type.icache_line) {
+      asm volatile("ic ivau, %0" : : "r"(line) : "memory");
+    }
+    asm volatile("dsb ish" : : : "memory");
+  }
+
+  // STEP 3: Refetch instructions on this core
+  asm volatile("isb" : : : "memory");
+#else
+  auto* begin = const_cast<char*>(reinterpret_cast<const char*>(executable));
+  __builtin___clear_cache(begin, begin + size);
+#endif
+#if defined(__aarch64__)
+  // STEP 4: Other threads see the new generation after the maintenance
+  // and run an ISB of their own before they call the code
+  code_generation.fetch_add(1, std::memory_order_release);
+#endif
+}
+
+#if defined(__linux__)
+/**
+ * A dual-mapped region: both views and the memfd behind them
+ */
+struct SharedRegion {
+  uint8_t* writable;
+  uint8_t* executable;
+  size_t size;
+  int fd;
+  unsigned int memfd_flags;
+  int node = -1; // Set by bind_to_node(), -1: wherever the kernel likes
+};
+
+/**
+ * Every dual-mapped region of the process, for the fork handler
+ */
+struct SharedRegions {
+  std::mutex mutex;
+  std::vector<SharedRegion> regions;
+};
+
+/**
+ * HELPER FUNCTION: Copy the pages of region that hold anything into copy
+ * (SEEK_DATA skips pages never written or given back with MADV_REMOVE;
+ * where the file system cannot tell, everything is copied)
+ */
+auto copy_written_pages(const SharedRegion& region, uint8_t* copy) noexcept
+    -> void
+{
+  const auto size = static_cast<off_t>(region.size);
+  for (auto offset = off_t{0}; offset < size;) {
+    const auto data = lseek(region.fd, offset, SEEK_DATA);
+    if (data == -1) {
+      if (errno != ENXIO) { // ENXIO: no data after offset
+        std::memcpy(copy + offset, region.writable + offset,
+                    static_cast<size_t>(size - offset));
+      }
+      return;
+    }
+    auto hole = lseek(region.fd, data, SEEK_HOLE);
+    hole = hole == -1 ? size : std::min(hole, size);
+    std::memcpy(copy + data, region.writable + data,
+                static_cast<size_t>(hole - data));
+    offset = hole;
+  }
+}
+
+/**
+ * HELPER FUNCTION: In a child after fork, give the region a memfd of its
+ * own at the same two addresses
+ *
+ * STEP BY STEP:
+ * 1. A new memfd of the same size, mapped read/write somewhere else (on
+ *    the region's NUMA node, if it was bound to one)
+ * 2. Copy the written pages into it
+ * 3. mremap the copy over the writable view, map the new memfd over the
+ *    executable view (MAP_FIXED: every pointer into the region stays valid)
+ *
+ * If any step fails the writable view becomes read-only: writing into the
+ * region then crashes this child instead of changing its siblings' code.
+ */
+auto make_private(SharedRegion& region) noexcept -> void
+{
+  const auto fail = [&] { mprotect(region.writable, region.size, PROT_READ); };
+  const int fd = memfd_create("mijit-code", region.memfd_flags);
+  if (fd == -1) {
+    return fail();
+  }
+  void* copy = ftruncate(fd, static_cast<off_t>(region.size)) == -1
+                   ? MAP_FAILED
+                   : mmap(nullptr, region.size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
+  if (copy == MAP_FAILED) {
+    close(fd);
+    return fail();
+  }
+  if (region.node >= 0) { // Before the copy touches any page
+    (void)prefer_node(copy, region.size, static_cast<unsigned>(region.node));
+  }
+  copy_written_pages(region, static_cast<uint8_t*>(copy));
+  if (mremap(copy, region.size, region.size, MREMAP_MAYMOVE | MREMAP_FIXED,
+             region.writable) == MAP_FAILED) {
+    munmap(copy, region.size);
+    close(fd);
+    return fail();
+  }
+  if (mmap(region.executable, region.size, PROT_READ | PROT_EXEC,
+           MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    close(fd);
+    return fail();
+  }
+  close(region.fd);
+  region.fd = fd;
+}
+
+/**
+ * The regions, with fork handlers installed on first use
+ *
+ * - prepare: hold the lock, so no region is half added or removed
+ * - child: make every region private, then let go of the lock
+ */
+[[nodiscard]] auto shared_regions() -> SharedRegions&
+{
+  static SharedRegions instance;
+  static const auto handlers = pthread_atfork(
+      [] { instance.mutex.lock(); }, [] { instance.mutex.unlock(); },
+      [] {
+        for (auto& region : instance.regions) {
+          make_private(region);
+        }
+        instance.mutex.unlock();
+      });
+  (void)handlers;
+  return instance;
+}
+#endif
+
+/**
+ * HELPER FUNCTION: Calculate memory size needed
+ *
+ * WHY WE NEED THIS:
+ * - Operating system memory allocation works in "pages" (usually 4096 bytes)
+ * - We must allocate memory in multiples of page size
+ * - This function finds the smallest page-multiple that fits our machine code
+ *   (a single round-up with the cached page size, never less than one page)
+ */
+[[nodiscard]] auto estimate_memory_size(size_t machine_code_size) noexcept
+    -> size_t
+{
+  return jit_memory_info().round_to_page(
+      machine_code_size == 0 ? 1 : machine_code_size);
+}
+
+/**
+ * Reserve the whole arena up front
+ *
+ * - MAP_NORESERVE: untouched pages cost no physical memory, so a big
+ *   capacity is cheap
+ * - Large regions may ask for huge pages (see HugePages)
+ */
+CodeArena::CodeArena(size_t capacity, ArenaBackend backend,
+                     HugePages huge_pages)
+    : capacity_{estimate_memory_size(capacity)},
+      granule_{jit_memory_info().page_size},
+      backend_{backend}
+{
+  if (!is_backend_supported(backend)) {
+    throw std::runtime_error("Code arena backend not supported here");
+  }
+  const auto huge = huge_pages == HugePages::kWhenLarge &&
+                    capacity_ >= kHugePageThreshold &&
+                    jit_memory_info().huge_page_size != 0;
+  if (backend == ArenaBackend::kDualMapped) {
+    map_dual(huge);
+  }
+  else {
+    map_single(huge);
+  }
+}
+
+/**
+ * kMprotect: one private mapping, read/write until seal()
+ *
+ * With huge pages: try MAP_HUGETLB first (needs pages reserved by the
+ * administrator); if that fails use normal pages with MADV_HUGEPAGE
+ */
+auto CodeArena::map_single(bool huge) -> void
+{
+  auto flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#ifdef MAP_JIT
+  flags |= MAP_JIT; // Special JIT flag on macOS if available
+#endif
+
+#ifdef MAP_HUGETLB
+  if (huge) {
+    // No MAP_NORESERVE here: unreserved huge pages would fault with SIGBUS
+    // when first touched, so make mmap fail up front instead
+    const auto huge_capacity = jit_memory_info().round_to_huge_page(capacity_);
+    void* memory =
+        mmap(nullptr, huge_capacity, PROT_READ | PROT_WRITE,
+             (flags & ~MAP_NORESERVE) | MAP_HUGETLB, -1, 0);
+    count_jit(JitCounter::kMmapCalls);
+    if (memory != MAP_FAILED) {
+      count_jit(JitCounter::kBytesMapped, huge_capacity);
+      base_ = static_cast<uint8_t*>(memory);
+      exec_base_ = base_;
+      capacity_ = huge_capacity;
+      granule_ = jit_memory_info().huge_page_size; // mprotect whole huge pages
+      return;
+    }
+  }
+#endif
+
+  void* memory =
+      mmap(nullptr, capacity_, PROT_READ | PROT_WRITE, flags, -1, 0);
+  count_jit(JitCounter::kMmapCalls);
+  if (memory == MAP_FAILED) {
+    throw std::runtime_error("Failed to allocate memory for machine code");
+  }
+  count_jit(JitCounter::kBytesMapped, capacity_);
+  base_ = static_cast<uint8_t*>(memory);
+  exec_base_ = base_;
+  if (huge) {
+    advise_huge_pages(base_, capacity_);
+  }
+}
+
+/**
+ * kDualMapped: the same physical pages seen through two addresses
+ *
+ * LINUX:
+ * - memfd_create gives us an anonymous in-memory file
+ * - Map it once read/write (we write code here) and once read/execute (the
+ *   CPU runs code from here) - no page ever changes permissions
+ * - With huge pages the file is created with MFD_HUGETLB when possible
+ *
+ * APPLE SILICON:
+ * - The kernel does not allow a second executable alias, but MAP_JIT pages
+ *   can be switched between writable and executable per thread with
+ *   pthread_jit_write_protect_np, which is just a register write (no syscall)
+ */
+auto CodeArena::map_dual([[maybe_unused]] bool huge) -> void
+{
+#if defined(__linux__)
+  if (huge) {
+    // The huge page pool may be empty - then fall back to normal pages
+    const auto huge_capacity = jit_memory_info().round_to_huge_page(capacity_);
+    if (map_memfd(MFD_CLOEXEC | MFD_HUGETLB, huge_capacity)) {
+      capacity_ = huge_capacity;
+      granule_ = jit_memory_info().huge_page_size;
+      return;
+    }
+  }
+  if (!map_memfd(MFD_CLOEXEC, capacity_)) {
+    throw std::runtime_error("Failed to allocate memory for machine code");
+  }
+  if (huge) {
+    advise_huge_pages(base_, capacity_);
+    advise_huge_pages(exec_base_, capacity_);
+  }
+#elif defined(__APPLE__) && defined(__aarch64__)
+  void* memory =
+      mmap(nullptr, capacity_, PROT_READ | PROT_WRITE | PROT_EXEC,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_JIT, -1, 0);
+  count_jit(JitCounter::kMmapCalls);
+  if (memory == MAP_FAILED) {
+    throw std::runtime_error("Failed to allocate memory for machine code");
+  }
+  count_jit(JitCounter::kBytesMapped, capacity_);
+  base_ = static_cast<uint8_t*>(memory);
+  exec_base_ = base_;
+#endif
+}
+
+#if defined(__linux__)
+/**
+ * Create a memfd of size bytes and map it twice (read/write and
+ * read/execute); returns false if any step fails
+ *
+ * The region is registered for the fork handler under the same lock,
+ * so a fork never sees it half made.
+ */
+auto CodeArena::map_memfd(unsigned int memfd_flags, size_t size) noexcept
+    -> bool
+{
+  void* writable = MAP_FAILED;
+  void* executable = MAP_FAILED;
+  {
+    auto& shared = shared_regions();
+    const std::lock_guard lock{shared.mutex};
+    const int fd = memfd_create("mijit-code", memfd_flags);
+    if (fd == -1) {
+      return false;
+    }
+    if (ftruncate(fd, static_cast<off_t>(size)) == -1) {
+      close(fd);
+      return false;
+    }
+    writable = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    executable =
+        mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    if (writable == MAP_FAILED || executable == MAP_FAILED) {
+      close(fd);
+    }
+    else {
+      // Kept open for fork: a child copies the region out of it (see
+      // make_private)
+      try {
+        shared.regions.push_back(SharedRegion{
+            static_cast<uint8_t*>(writable),
+            static_cast<uint8_t*>(executable), size, fd, memfd_flags});
+      } catch (const std::exception&) {
+        close(fd); // Out of memory: no fork support for this region
+      }
+    }
+  }
+
+  // Counted outside the lock (a first count may take the stats lock)
+  count_jit(JitCounter::kMmapCalls, 2);
+  if (writable == MAP_FAILED || executable == MAP_FAILED) {
+    if (writable != MAP_FAILED) {
+      munmap(writable, size);
+      count_jit(JitCounter::kMunmapCalls);
+    }
+    if (executable != MAP_FAILED) {
+      munmap(executable, size);
+      count_jit(JitCounter::kMunmapCalls);
+    }
+    return false;
+  }
+  count_jit(JitCounter::kBytesMapped, 2 * size);
+  base_ = static_cast<uint8_t*>(writable);
+  exec_base_ = static_cast<uint8_t*>(executable);
+  return true;
+}
+#endif
+
+CodeArena::~CodeArena()
+{
+  release();
+}
+
+CodeArena::CodeArena(CodeArena&& other) noexcept
+    : base_{std::exchange(other.base_, nullptr)},
+      exec_base_{std::exchange(other.exec_base_, nullptr)},
+      capacity_{std::exchange(other.capacity_, 0)},
+      top_{std::exchange(other.top_, 0)},
+      sealed_{std::exchange(other.sealed_, 0)},
+      granule_{other.granule_},
+      backend_{other.backend_},
+      owned_{other.owned_}
+{
+}
+
+/**
+ * Non-owning view used by slice()
+ */
+CodeArena::CodeArena(uint8_t* base, uint8_t* exec_base, size_t capacity,
+                     size_t granule, ArenaBackend backend) noexcept
+    : base_{base},
+      exec_base_{exec_base},
+      capacity_{capacity},
+      granule_{granule},
+      backend_{backend},
+      owned_{false}
+{
+}
+
+auto CodeArena::operator=(CodeArena&& other) noexcept -> CodeArena&
+{
+  if (this != &other) {
+    release();
+    base_ = std::exchange(other.base_, nullptr);
+    exec_base_ = std::exchange(other.exec_base_, nullptr);
+    capacity_ = std::exchange(other.capacity_, 0);
+    top_ = std::exchange(other.top_, 0);
+    sealed_ = std::exchange(other.sealed_, 0);
+    granule_ = other.granule_;
+    backend_ = other.backend_;
+    owned_ = other.owned_;
+  }
+  return *this;
+}
+
+auto CodeArena::release() noexcept -> void
+{
+  if (base_ != nullptr && owned_) {
+#if defined(__linux__)
+    if (backend_ == ArenaBackend::kDualMapped) {
+      auto& shared = shared_regions();
+      const std::lock_guard lock{shared.mutex};
+      const auto region = std::find_if(
+          shared.regions.begin(), shared.regions.end(),
+          [&](const SharedRegion& r) { return r.writable == base_; });
+      if (region != shared.regions.end()) {
+        close(region->fd);
+        shared.regions.erase(region);
+      }
+    }
+#endif
+    munmap(base_, capacity_); // One munmap for every function in the arena
+    count_jit(JitCounter::kMunmapCalls);
+    count_jit(JitCounter::kBytesUnmapped, capacity_);
+    if (exec_base_ != base_) {
+      munmap(exec_base_, capacity_); // Executable alias (dual mapping)
+      count_jit(JitCounter::kMunmapCalls);
+      count_jit(JitCounter::kBytesUnmapped, capacity_);
+    }
+  }
+  base_ = nullptr;
+  exec_base_ = nullptr;
+}
+
+[[nodiscard]] auto CodeArena::slice(size_t offset, size_t size) const
+    -> CodeArena
+{
+  if (((offset | size) & (granule_ - 1)) != 0 || offset > capacity_ ||
+      size > capacity_ - offset) {
+    throw std::runtime_error("Code arena slice out of range");
+  }
+  return CodeArena{base_ + offset, exec_base_ + offset, size, granule_,
+                   backend_};
+}
+
+[[nodiscard]] auto CodeArena::slot_at(size_t offset, size_t size) const
+    -> CodeSlot
+{
+  if (offset > capacity_ || size > capacity_ - offset) {
+    throw std::runtime_error("Code arena slot out of range");
+  }
+  return CodeSlot{std::span<uint8_t>{base_ + offset, size},
+                  exec_base_ + offset};
+}
+
+/**
+ * Hand out the next slot (alignment must be a power of two)
+ */
+[[nodiscard]] auto CodeArena::allocate(size_t size, size_t alignment)
+    -> CodeSlot
+{
+  const auto start = (top_ + alignment - 1) & ~(alignment - 1);
+  if (start > capacity_ || size > capacity_ - start) {
+    throw std::runtime_error("Code arena is out of memory");
+  }
+  count_jit(JitCounter::kBytesReserved, size);
+  count_jit(JitCounter::kBytesPadding, start - top_);
+  top_ = start + size;
+#if defined(__APPLE__) && defined(__aarch64__)
+  if (backend_ == ArenaBackend::kDualMapped) {
+    pthread_jit_write_protect_np(0); // MAP_JIT pages writable for this thread
+  }
+#endif
+  return CodeSlot{std::span<uint8_t>{base_ + start, size}, exec_base_ + start};
+}
+
+auto CodeArena::trim(CodeSlot& slot, size_t used) noexcept -> void
+{
+  if (used >= slot.writable.size()) {
+    return;
+  }
+  const auto end = static_cast<size_t>(slot.writable.data() - base_) +
+                   slot.writable.size();
+  const auto unused = slot.writable.size() - used;
+  count_jit(JitCounter::kBytesTrimmed, unused);
+  if (end == top_) {
+    top_ -= unused; // Still the last slot: shrink it
+  }
+  else {
+    count_jit(JitCounter::kBytesPadding, unused); // Stuck behind later slots
+  }
+  slot.writable = slot.writable.first(used);
+}
+
+/**
+ * Flip the pages written since the last seal to read/execute
+ *
+ * - Only one mprotect for the whole batch
+ * - The bump pointer moves to the next page, so sealed pages stay read-only
+ * - Dual-mapped arenas skip the mprotect: the code is already executable
+ *   through the second mapping
+ */
+auto CodeArena::seal() -> void
+{
+  if (top_ == sealed_) {
+    return; // Nothing new was written since the last seal
+  }
+  if (backend_ == ArenaBackend::kDualMapped) {
+#if defined(__APPLE__) && defined(__aarch64__)
+    pthread_jit_write_protect_np(1); // Back to executable for this thread
+#endif
+    sealed_ = top_;
+    return;
+  }
+  const auto end = (top_ + granule_ - 1) & ~(granule_ - 1); // Whole pages
+  count_jit(JitCounter::kMprotectCalls);
+  if (mprotect(base_ + sealed_, end - sealed_, PROT_READ | PROT_EXEC) == -1) {
+    throw std::runtime_error("Failed to make memory executable");
+  }
+  count_jit(JitCounter::kBytesPadding, end - top_);
+  top_ = end;
+  sealed_ = end;
+}
+
+/**
+ * One mprotect on the executable view (the writable view of a dual-mapped
+ * arena is never executable anyway)
+ */
+auto CodeArena::make_read_only(const uint8_t* executable, size_t size) -> void
+{
+  const auto offset = static_cast<size_t>(executable - exec_base_);
+  if (offset > sealed_ || size > sealed_ - offset ||
+      ((offset | size) & (granule_ - 1)) != 0) {
+    throw std::runtime_error("Read-only range is not whole sealed pages");
+  }
+  if (size == 0) {
+    return;
+  }
+  count_jit(JitCounter::kMprotectCalls);
+  if (mprotect(exec_base_ + offset, size, PROT_READ) == -1) {
+    throw std::runtime_error("Failed to make memory read-only");
+  }
+}
+
+/**
+ * STEP BY STEP:
+ * 1. mbind the writable view; for a memfd the policy belongs to the file,
+ *    so the executable view and every later page of it follow
+ * 2. Remember the node of a dual-mapped region, so the fork handler puts
+ *    a child's private copy on the same node
+ */
+auto CodeArena::bind_to_node([[maybe_unused]] unsigned node) noexcept -> bool
+{
+#if defined(__linux__)
+  if (base_ == nullptr) {
+    return false;
+  }
+  count_jit(JitCounter::kMbindCalls);
+  if (!prefer_node(base_, capacity_, node)) {
+    return false;
+  }
+  if (backend_ == ArenaBackend::kDualMapped && owned_) {
+    auto& shared = shared_regions();
+    const std::lock_guard lock{shared.mutex};
+    const auto region = std::find_if(
+        shared.regions.begin(), shared.regions.end(),
+        [&](const SharedRegion& r) { return r.writable == base_; });
+    if (region != shared.regions.end()) {
+      region->node = static_cast<int>(node);
+    }
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+/**
+ * Seal and flush only [last seal, top) - the bytes really written, not the
+ * padding up to the page boundary that seal() skips over
+ */
+auto CodeArena::publish() -> void
+{
+  const auto begin = sealed_;
+  const auto end = top_;
+  seal();
+  flush_instruction_cache(base_ + begin, exec_base_ + begin, end - begin);
+}
+
+} // namespace mijit
@@ -0,0 +1,359 @@
+/**
+ * @file jit_memory.hpp
+ * @brief Executable memory for generated machine code
+ *
+ * HOW IT WORKS:
+ * 1. Reserve one big region of memory up front (a single mmap)
+ * 2. Hand out small slots from it by bumping a pointer
+ * 3. Write machine code into the slots while the pages are writable
+ * 4. Flip every page written so far to executable with a single mprotect
+ * 5. Publish: make the CPU's instruction fetch see the new bytes (only
+ *    needs real work on ARM, where instruction and data caches are separate)
+ *
+ * WHY WE NEED THIS:
+ * - Calling mmap + mprotect + munmap for every function costs several system
+ *   calls and wastes a whole page on a few dozen bytes of code
+ * - With an arena, emitting a function is basically a memcpy
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace mijit {
+
+/**
+ * Page sizes of this machine, asked from the system only once
+ *
+ * - page_size:      normal page size (4 KiB on most x86-64, 16 KiB on Apple M)
+ * - huge_page_size: transparent/huge page size (usually 2 MiB), 0 if the
+ *                   system has none
+ */
+struct JitMemoryInfo {
+  size_t page_size = 4096;
+  size_t huge_page_size = 0;
+
+  /**
+   * Round size up to a multiple of page_size (one add and one mask - page
+   * sizes are powers of two)
+   */
+  [[nodiscard]] constexpr auto round_to_page(size_t size) const noexcept
+      -> size_t
+  {
+    return (size + page_size - 1) & ~(page_size - 1);
+  }
+
+  /**
+   * Round size up to a multiple of huge_page_size (or page_size without
+   * huge pages)
+   */
+  [[nodiscard]] constexpr auto round_to_huge_page(size_t size) const noexcept
+      -> size_t
+  {
+    const auto granule = huge_page_size != 0 ? huge_page_size : page_size;
+    return (size + granule - 1) & ~(granule - 1);
+  }
+};
+
+/**
+ * Page size information, queried on first use and cached for the process
+ */
+[[nodiscard]] auto jit_memory_info() noexcept -> const JitMemoryInfo&;
+
+/**
+ * Round a machine code size up to a whole number of memory pages
+ * (at least one page)
+ */
+[[nodiscard]] auto estimate_memory_size(size_t machine_code_size) noexcept
+    -> size_t;
+
+/**
+ * Whether an arena may be backed by huge pages
+ *
+ * - kNever:     always normal pages
+ * - kWhenLarge: regions of at least kHugePageThreshold bytes try explicit
+ *               huge pages (MAP_HUGETLB / MFD_HUGETLB) and fall back to
+ *               transparent huge pages (MADV_HUGEPAGE); fewer iTLB misses
+ *               when executing a lot of generated code
+ */
+enum class HugePages {
+  kNever,
+  kWhenLarge,
+};
+
+inline constexpr size_t kHugePageThreshold = size_t{4} << 20; // 4 MiB
+
+/**
+ * How the arena gets from "writable" to "executable"
+ *
+ * - kMprotect:   one mapping, flipped from read/write to read/execute by
+ *                seal() (W^X enforced by page permissions)
+ * - kDualMapped: the same memory is mapped twice, once read/write and once
+ *                read/execute, so installing code never changes page
+ *                permissions (Linux: memfd_create, Apple Silicon: MAP_JIT +
+ *                pthread_jit_write_protect_np)
+ *
+ * FORK: kMprotect arenas are private mappings, copied on write like the
+ * rest of the process. A kDualMapped region on Linux is a shared memfd, so
+ * a fork handler gives the child its own copy of it, at the same
+ * addresses; without that, code a child compiles would land in its
+ * parent's and siblings' arenas. Code meant to be shared by all workers
+ * belongs in a shared image instead (see prefork.hpp).
+ */
+enum class ArenaBackend {
+  kMprotect,
+  kDualMapped,
+};
+
+/**
+ * Check whether a backend can be used on this platform
+ */
+[[nodiscard]] constexpr auto is_backend_supported(
+    ArenaBackend backend) noexcept -> bool
+{
+#if defined(__linux__) || (defined(__APPLE__) && defined(__aarch64__))
+  (void)backend;
+  return true;
+#else
+  return backend == ArenaBackend::kMprotect;
+#endif
+}
+
+/**
+ * Make freshly written machine code visible to instruction fetch on every
+ * core
+ *
+ * - x86-64: nothing to do, instruction caches follow data writes
+ * - AArch64 Linux: clean the data cache lines (DC CVAU) of the writable
+ *   bytes, invalidate the instruction cache lines (IC IVAU) of the
+ *   executable bytes, with DSB ISH in between and ISB at the end; steps the
+ *   CPU says it does not need (CTR_EL0.IDC / DIC) are skipped
+ * - Apple Silicon: sys_icache_invalidate
+ *
+ * writable and executable are the two views of the same size bytes (equal
+ * unless the arena is dual-mapped).
+ */
+auto flush_instruction_cache(const uint8_t* writable,
+                             const uint8_t* executable, size_t size) noexcept
+    -> void;
+
+/**
+ * How many times code has been published (AArch64: bumped with a release
+ * increment at the end of every flush_instruction_cache(); stays 0 on
+ * x86-64, which needs no synchronization on the running core)
+ */
+inline std::atomic<uint64_t> code_generation{0};
+
+/**
+ * Make this core fetch code published since it last did so
+ *
+ * - AArch64: an ISB, but only when code_generation moved since this thread
+ *   last ran one; otherwise one load and a compare
+ * - Elsewhere: nothing
+ *
+ * Call it after loading (acquire) a pointer to code another thread
+ * published and before calling it; EntryPoint::load() does.
+ */
+inline auto sync_instruction_fetch() noexcept -> void
+{
+#if defined(__aarch64__)
+  thread_local auto seen = uint64_t{0};
+  const auto now = code_generation.load(std::memory_order_acquire);
+  if (now != seen) {
+    asm volatile("isb" : : : "memory");
+    seen = now;
+  }
+#endif
+}
+
+/**
+ * A piece of arena memory handed out for one generated function
+ *
+ * - writable:   where the machine code bytes must be written
+ * - executable: address to call once the arena has been sealed
+ */
+struct CodeSlot {
+  std::span<uint8_t> writable;
+  const uint8_t* executable = nullptr;
+};
+
+/**
+ * CODE ARENA: bump allocator over one big executable region
+ *
+ * RULES (W^X - memory is never writable and executable at the same time):
+ * - allocate() returns slots in pages that are still read/write
+ * - seal() makes every page written since the last seal read/execute with one
+ *   mprotect call, so a whole batch of functions pays for one system call
+ * - after seal() the next allocation starts on a fresh page, so sealed pages
+ *   are never made writable again
+ *
+ * With ArenaBackend::kDualMapped, seal() does no mprotect at all: the bytes
+ * are already visible through the executable alias.
+ *
+ * publish() = seal() + instruction cache maintenance over the bytes written
+ * since the last publish. Call it before running (or handing out) new code.
+ */
+class CodeArena {
+public:
+  static constexpr size_t kDefaultCapacity = size_t{64} << 20; // 64 MiB
+  static constexpr size_t kDefaultAlignment = 16; // Typical function alignment
+
+  explicit CodeArena(size_t capacity = kDefaultCapacity,
+                     ArenaBackend backend = ArenaBackend::kMprotect,
+                     HugePages huge_pages = HugePages::kNever);
+  ~CodeArena();
+
+  CodeArena(const CodeArena&) = delete;
+  auto operator=(const CodeArena&) -> CodeArena& = delete;
+  CodeArena(CodeArena&& other) noexcept;
+  auto operator=(CodeArena&& other) noexcept -> CodeArena&;
+
+  /**
+   * Reserve size bytes for machine code (throws when the arena is full)
+   */
+  [[nodiscard]] auto allocate(size_t size,
+                              size_t alignment = kDefaultAlignment)
+      -> CodeSlot;
+
+  /**
+   * Give back the unused tail of the most recent slot
+   *
+   * - Lets callers allocate an upper bound, emit in place, then keep only
+   *   the bytes that were really written
+   * - Does nothing if other slots were allocated after this one
+   */
+  auto trim(CodeSlot& slot, size_t used) noexcept -> void;
+
+  /**
+   * Make everything written since the last seal executable
+   */
+  auto seal() -> void;
+
+  /**
+   * Seal, then flush the instruction cache over just the bytes written
+   * since the last seal (one flush for a whole batch of stubs)
+   */
+  auto publish() -> void;
+
+  /**
+   * Make sealed pages read-only and NOT executable (for data placed in the
+   * arena next to the code that uses it); executable and size must cover
+   * whole granules
+   */
+  auto make_read_only(const uint8_t* executable, size_t size) -> void;
+
+  /**
+   * A second arena over [offset, offset + size) of this one, with its own
+   * bump pointer (offset and size must be multiples of granule())
+   *
+   * - Does not own the memory: this arena must outlive the slice
+   * - Only reads fields that never change, so threads may call it at the
+   *   same time (SlabPool hands out one slice per thread this way)
+   */
+  [[nodiscard]] auto slice(size_t offset, size_t size) const -> CodeArena;
+
+  /**
+   * Both views of [offset, offset + size), without moving the bump pointer
+   * (for allocators that manage the region themselves, see CodeHeap)
+   */
+  [[nodiscard]] auto slot_at(size_t offset, size_t size) const -> CodeSlot;
+
+  /**
+   * Ask for the arena's pages on one NUMA node (see numa.hpp); returns
+   * false where that is not possible (not Linux, no such node, or the
+   * system says no), and the pages then stay wherever the kernel puts them
+   *
+   * - A preference, not a rule: when the node is out of memory, pages come
+   *   from another node instead of failing
+   * - Call it before writing code: pages already touched stay where they
+   *   are (the kernel may move private ones, never shared memfd pages)
+   * - Both views of a dual-mapped arena follow, and so does the private
+   *   copy a forked child gets
+   */
+  auto bind_to_node(unsigned node) noexcept -> bool;
+
+  [[nodiscard]] auto capacity() const noexcept -> size_t
+  {
+    return capacity_;
+  }
+  [[nodiscard]] auto used() const noexcept -> size_t
+  {
+    return top_;
+  }
+  [[nodiscard]] auto backend() const noexcept -> ArenaBackend
+  {
+    return backend_;
+  }
+  /**
+   * Smallest unit seal() works in (page or huge page size)
+   */
+  [[nodiscard]] auto granule() const noexcept -> size_t
+  {
+    return granule_;
+  }
+  /**
+   * True when the region is backed by explicit huge pages (seal() then
+   * works in whole huge pages)
+   */
+  [[nodiscard]] auto uses_huge_pages() const noexcept -> bool
+  {
+    return granule_ != jit_memory_info().page_size;
+  }
+
+private:
+  CodeArena(uint8_t* base, uint8_t* exec_base, size_t capacity,
+            size_t granule, ArenaBackend backend) noexcept;
+
+  auto map_single(bool huge) -> void;
+  auto map_dual(bool huge) -> void;
+#if defined(__linux__)
+  auto map_memfd(unsigned int memfd_flags, size_t size) noexcept -> bool;
+#endif
+  auto release() noexcept -> void;
+
+  uint8_t* base_ = nullptr;      // Start of the reserved region (writable)
+  uint8_t* exec_base_ = nullptr; // Executable view (same as base_ unless dual)
+  size_t capacity_ = 0;          // Size of the region (page multiple)
+  size_t top_ = 0;               // Bump pointer: next free byte
+  size_t sealed_ = 0;            // Everything below this is executable
+  size_t granule_ = 0;           // Page size used by mprotect in seal()
+  ArenaBackend backend_ = ArenaBackend::kMprotect;
+  bool owned_ = true;            // False for a slice(): never unmapped
+};
+
+/**
+ * ENTRY POINT: hands a published function pointer to other threads
+ *
+ * - store() is a release store: a thread that loads the pointer also sees
+ *   the code bytes and the cache maintenance done before it
+ * - load() is an acquire load followed by sync_instruction_fetch(): on
+ *   AArch64 an ISB, so this core does not run instructions it fetched
+ *   before the code existed, but only the first time this thread loads a
+ *   pointer to code published since its last ISB. Loading the same
+ *   pointer again costs no ISB, so calling load() on every call is fine
+ */
+template <typename Function>
+class EntryPoint {
+public:
+  auto store(Function function) noexcept -> void
+  {
+    function_.store(function, std::memory_order_release);
+  }
+
+  [[nodiscard]] auto load() const noexcept -> Function
+  {
+    const auto function = function_.load(std::memory_order_acquire);
+    if (function != nullptr) {
+      sync_instruction_fetch();
+    }
+    return function;
+  }
+
+private:
+  std::atomic<Function> function_{nullptr};
+};
+
+} // namespace mijit
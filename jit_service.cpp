@@ -0,0 +1,182 @@
+/**
+ * @file jit_service.cpp
+ * @brief Worker threads, lock-free request queues and batched compilation
+ */
+
+#include "jit_service.hpp"
+
+#include <chrono>
+#include <exception>
+#include <iostream>
+
+#include "compiler.hpp"
+#include "jit_memory.hpp"
+
+namespace mijit {
+
+auto run_or_interpret(std::shared_future<StubFunction>& stub,
+                      std::string_view hello_name) -> bool
+{
+  if (stub.valid() &&
+      stub.wait_for(std::chrono::seconds{0}) == std::future_status::ready) {
+    const auto function = stub.get();
+    sync_instruction_fetch(); // Published by a worker on another core
+    std::cout.flush(); // Keep the order with earlier interpreted output
+    function();
+#if defined(__APPLE__) && defined(__aarch64__)
+    std::cout << hello_name; // Host prints on Apple Silicon (see main)
+#endif
+    return true;
+  }
+  std::cout << hello_name << std::flush;
+  return false;
+}
+
+[[nodiscard]] auto JitService::default_worker_count() noexcept -> size_t
+{
+  const auto threads = std::thread::hardware_concurrency();
+  return threads == 0 ? 1 : threads;
+}
+
+JitService::JitService(size_t workers, const CodegenOptions& options,
+                       size_t capacity)
+    : options_{options}, pool_{capacity}
+{
+  const auto count = workers == 0 ? size_t{1} : workers;
+  workers_.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    // The slab is taken here, so a pool too small for every worker throws
+    // to our caller instead of terminating a worker thread
+    workers_.push_back(std::make_unique<Worker>());
+    workers_.back()->arena.emplace(pool_);
+  }
+  try {
+    for (auto& worker : workers_) {
+      worker->thread =
+          std::thread{[this, queue = worker.get()] { run(*queue); }};
+    }
+  } catch (...) {
+    stop(); // A joinable std::thread must not be destroyed
+    throw;
+  }
+}
+
+JitService::~JitService()
+{
+  stop();
+}
+
+/**
+ * HELPER FUNCTION: Wake every worker to finish its queue and exit, then
+ * join the ones that were started
+ */
+auto JitService::stop() noexcept -> void
+{
+  stopping_.store(true, std::memory_order_release);
+  for (auto& worker : workers_) {
+    worker->signal.fetch_add(1, std::memory_order_release);
+    worker->signal.notify_one();
+  }
+  for (auto& worker : workers_) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+}
+
+/**
+ * Push a request onto a worker's stack (a compare-exchange loop, no lock)
+ */
+[[nodiscard]] auto JitService::submit(std::string hello_name)
+    -> std::shared_future<StubFunction>
+{
+  auto* request = new Request{std::move(hello_name), {}, nullptr};
+  auto future = request->promise.get_future().share();
+
+  const auto index =
+      next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+  auto& worker = *workers_[index];
+  request->next = worker.head.load(std::memory_order_relaxed);
+  while (!worker.head.compare_exchange_weak(request->next, request,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+  }
+  worker.signal.fetch_add(1, std::memory_order_release);
+  worker.signal.notify_one(); // Wake the worker if it sleeps
+  return future;
+}
+
+/**
+ * Worker loop: sleep until signalled, take everything queued, compile it
+ */
+auto JitService::run(Worker& worker) -> void
+{
+  auto& arena = *worker.arena;
+  auto seen = worker.signal.load(std::memory_order_acquire);
+  while (true) {
+    auto* batch = worker.head.exchange(nullptr, std::memory_order_acquire);
+    if (batch != nullptr) {
+      compile(arena, batch);
+      continue; // More may have arrived while compiling
+    }
+    if (stopping_.load(std::memory_order_acquire)) {
+      return; // Queue is empty and nothing new can rely on us
+    }
+    worker.signal.wait(seen, std::memory_order_acquire);
+    seen = worker.signal.load(std::memory_order_acquire);
+  }
+}
+
+/**
+ * Compile one batch: emit all, publish once, then fulfil every promise
+ * (after publishing, so no caller can see code that is not executable yet;
+ * set_value / get give the release/acquire handoff)
+ */
+auto JitService::compile(ThreadArena& arena, Request* batch) -> void
+{
+  // The stack is newest first: reverse it to compile in submission order
+  Request* ordered = nullptr;
+  while (batch != nullptr) {
+    auto* next = batch->next;
+    batch->next = ordered;
+    ordered = batch;
+    batch = next;
+  }
+
+  struct Done {
+    Request* request;
+    CodeSlot slot;
+    std::exception_ptr error;
+  };
+  std::vector<Done> done;
+  for (auto* request = ordered; request != nullptr; request = request->next) {
+    try {
+      done.push_back({request, compile_stub(arena, request->hello_name,
+                                            options_),
+                      nullptr});
+    } catch (...) {
+      done.push_back({request, {}, std::current_exception()});
+    }
+  }
+
+  std::exception_ptr seal_error;
+  try {
+    arena.publish(); // Seal + cache maintenance over the whole batch
+  } catch (...) {
+    seal_error = std::current_exception();
+  }
+  batches_.fetch_add(1, std::memory_order_relaxed);
+
+  for (auto& entry : done) {
+    const auto error = entry.error != nullptr ? entry.error : seal_error;
+    if (error != nullptr) {
+      entry.request->promise.set_exception(error);
+    }
+    else {
+      entry.request->promise.set_value(as_function(entry.slot.executable));
+    }
+    delete entry.request;
+  }
+}
+
+} // namespace mijit
@@ -0,0 +1,129 @@
+/**
+ * @file jit_service.hpp
+ * @brief Background compilation on a pool of worker threads
+ *
+ * HOW IT WORKS:
+ * 1. submit() puts a compile request on a worker's lock-free queue and
+ *    returns a std::future for the entry point right away
+ * 2. The worker wakes up, takes EVERY waiting request off its queue at once
+ *    and emits them into its own ThreadArena
+ * 3. One publish (seal + instruction cache flush) for the whole batch, then
+ *    every future is made ready
+ * 4. Until its future is ready a caller can run the interpreted fallback
+ *    (just printing the message - what the Apple Silicon path of main()
+ *    does anyway)
+ *
+ * WHY WE NEED THIS:
+ * - Compiling on the request path makes the first call of every new
+ *   message wait for code generation
+ * - With a fallback the request path never waits: the first calls are
+ *   interpreted, later ones use the compiled stub
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "codegen.hpp"
+#include "slab_pool.hpp"
+
+namespace mijit {
+
+/**
+ * Call the compiled stub if it is ready, otherwise interpret: print the
+ * message with std::cout (never blocks; get() is only called once ready,
+ * and followed by sync_instruction_fetch(), since a worker published the
+ * code on another core)
+ *
+ * Returns true if the compiled stub ran.
+ */
+auto run_or_interpret(std::shared_future<StubFunction>& stub,
+                      std::string_view hello_name) -> bool;
+
+class JitService {
+public:
+  /**
+   * Number of workers used when none is given (one per hardware thread)
+   */
+  [[nodiscard]] static auto default_worker_count() noexcept -> size_t;
+
+  /**
+   * Starts the workers, each with its first slab of the pool (throws here,
+   * not on a worker thread, when capacity has fewer slabs than workers)
+   */
+  explicit JitService(size_t workers = default_worker_count(),
+                      const CodegenOptions& options = {},
+                      size_t capacity = CodeArena::kDefaultCapacity);
+
+  /**
+   * Finishes every request already submitted, then stops the workers
+   */
+  ~JitService();
+
+  JitService(const JitService&) = delete;
+  auto operator=(const JitService&) -> JitService& = delete;
+
+  /**
+   * Queue a message for compilation (safe to call from any thread,
+   * lock-free; the future holds the exception if compiling failed)
+   */
+  [[nodiscard]] auto submit(std::string hello_name)
+      -> std::shared_future<StubFunction>;
+
+  [[nodiscard]] auto workers() const noexcept -> size_t
+  {
+    return workers_.size();
+  }
+  [[nodiscard]] auto options() const noexcept -> const CodegenOptions&
+  {
+    return options_;
+  }
+  /**
+   * Number of batches the workers compiled (one publish each)
+   */
+  [[nodiscard]] auto batches() const noexcept -> uint64_t
+  {
+    return batches_.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Request {
+    std::string hello_name;
+    std::promise<StubFunction> promise;
+    Request* next = nullptr;
+  };
+
+  /**
+   * Multi-producer single-consumer queue: producers push onto a lock-free
+   * stack, the one consumer takes the whole stack with a single exchange
+   */
+  struct alignas(64) Worker { // Own cache line: no false sharing
+    std::atomic<Request*> head{nullptr};
+    std::atomic<uint32_t> signal{0}; // Bumped on every push and on stop
+    // Made by the constructor, then only used by thread
+    std::optional<ThreadArena> arena;
+    std::thread thread;
+  };
+
+  auto stop() noexcept -> void;
+  auto run(Worker& worker) -> void;
+  auto compile(ThreadArena& arena, Request* batch) -> void;
+
+  CodegenOptions options_;
+  SlabPool pool_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<size_t> next_worker_{0}; // Round-robin over workers
+  std::atomic<bool> stopping_{false};
+  std::atomic<uint64_t> batches_{0};
+};
+
+} // namespace mijit
@@ -0,0 +1,267 @@
+/**
+ * @file jit_stats.cpp
+ * @brief Per-thread counter blocks, their registry and the snapshot
+ */
+
+#include "jit_stats.hpp"
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "jit_memory.hpp"
+#include "stub_profile.hpp"
+
+namespace mijit {
+
+namespace {
+
+/**
+ * One thread's counters, on cache lines of their own
+ *
+ * Atomics only so that jit_stats() may read them while the owner writes;
+ * the owner is the only writer, so it never needs a read-modify-write.
+ */
+struct alignas(64) ThreadBlock {
+  std::array<std::atomic<uint64_t>, kJitCounterCount> counters{};
+  std::array<std::atomic<uint64_t>, kCompileBuckets> compile_ticks{};
+};
+
+/**
+ * HELPER FUNCTION: Add amount to a counter only this thread writes
+ */
+auto bump(std::atomic<uint64_t>& counter, uint64_t amount) noexcept -> void
+{
+  counter.store(counter.load(std::memory_order_relaxed) + amount,
+                std::memory_order_relaxed);
+}
+
+/**
+ * HELPER FUNCTION: Add a block's counts into a snapshot
+ */
+auto add_block(JitStats& stats, const ThreadBlock& block) noexcept -> void
+{
+  for (size_t i = 0; i < kJitCounterCount; ++i) {
+    stats.counters[i] += block.counters[i].load(std::memory_order_relaxed);
+  }
+  for (size_t i = 0; i < kCompileBuckets; ++i) {
+    stats.compile_ticks[i] +=
+        block.compile_ticks[i].load(std::memory_order_relaxed);
+  }
+}
+
+/**
+ * Every live thread's block, and the totals of threads that have exited
+ */
+struct Registry {
+  std::mutex mutex;
+  std::vector<const ThreadBlock*> live;
+  JitStats exited;
+  // Counts made after a thread's block went away (from other thread_local
+  // destructors); shared, so a race may lose one, which is fine for stats
+  ThreadBlock late;
+};
+
+/**
+ * The registry, with fork handlers installed on first use: a fork while
+ * another thread holds the lock would leave it locked forever in the child
+ */
+[[nodiscard]] auto registry() -> Registry&
+{
+  static Registry instance;
+  static const auto handlers = pthread_atfork(
+      [] { instance.mutex.lock(); }, [] { instance.mutex.unlock(); },
+      [] { instance.mutex.unlock(); });
+  (void)handlers;
+  return instance;
+}
+
+thread_local ThreadBlock* this_thread = nullptr;
+
+/**
+ * A thread's block: registered on its first count, folded into the exited
+ * totals when the thread ends
+ */
+struct Registration {
+  ThreadBlock block;
+
+  Registration()
+  {
+    auto& all = registry();
+    const std::lock_guard lock{all.mutex};
+    all.live.push_back(&block);
+  }
+
+  ~Registration()
+  {
+    auto& all = registry();
+    const std::lock_guard lock{all.mutex};
+    add_block(all.exited, block);
+    std::erase(all.live, &block);
+    this_thread = &all.late;
+  }
+
+  Registration(const Registration&) = delete;
+  auto operator=(const Registration&) -> Registration& = delete;
+};
+
+/**
+ * HELPER FUNCTION: This thread's block (a thread_local pointer with no
+ * constructor, so the common case needs no initialization guard)
+ */
+[[nodiscard]] auto thread_block() noexcept -> ThreadBlock&
+{
+  if (this_thread == nullptr) [[unlikely]] {
+    thread_local Registration registration;
+    this_thread = &registration.block;
+  }
+  return *this_thread;
+}
+
+[[nodiscard]] auto ratio(uint64_t part, uint64_t whole) noexcept -> double
+{
+  return whole == 0 ? 0.0
+                    : static_cast<double>(part) / static_cast<double>(whole);
+}
+
+} // namespace
+
+auto count_jit(JitCounter counter, uint64_t amount) noexcept -> void
+{
+  bump(thread_block().counters[static_cast<size_t>(counter)], amount);
+}
+
+auto record_compile(uint64_t ticks) noexcept -> void
+{
+  auto& block = thread_block();
+  bump(block.counters[static_cast<size_t>(JitCounter::kCompiles)], 1);
+  bump(block.counters[static_cast<size_t>(JitCounter::kCompileTicks)], ticks);
+  const auto bucket = std::min<size_t>(
+      ticks == 0 ? 0 : static_cast<size_t>(std::bit_width(ticks)) - 1,
+      kCompileBuckets - 1);
+  bump(block.compile_ticks[bucket], 1);
+}
+
+[[nodiscard]] auto jit_stats() -> JitStats
+{
+  auto& all = registry();
+  const std::lock_guard lock{all.mutex};
+  auto stats = all.exited;
+  for (const auto* block : all.live) {
+    add_block(stats, *block);
+  }
+  add_block(stats, all.late);
+  return stats;
+}
+
+[[nodiscard]] auto JitStats::bytes_emitted() const noexcept -> uint64_t
+{
+  return (*this)[JitCounter::kBytesReserved] -
+         std::min((*this)[JitCounter::kBytesReserved],
+                  (*this)[JitCounter::kBytesTrimmed]);
+}
+
+[[nodiscard]] auto JitStats::pages_mapped() const noexcept -> uint64_t
+{
+  const auto mapped = (*this)[JitCounter::kBytesMapped];
+  const auto unmapped = (*this)[JitCounter::kBytesUnmapped];
+  return (mapped - std::min(mapped, unmapped)) /
+         jit_memory_info().page_size;
+}
+
+[[nodiscard]] auto JitStats::fragmentation() const noexcept -> double
+{
+  const auto padding = (*this)[JitCounter::kBytesPadding];
+  return ratio(padding, bytes_emitted() + padding);
+}
+
+[[nodiscard]] auto JitStats::cache_hit_rate() const noexcept -> double
+{
+  const auto hits = (*this)[JitCounter::kCacheHits];
+  return ratio(hits, hits + (*this)[JitCounter::kCacheMisses]);
+}
+
+[[nodiscard]] auto JitStats::compile_ticks_percentile(
+    double fraction) const noexcept -> uint64_t
+{
+  auto total = uint64_t{0};
+  for (const auto count : compile_ticks) {
+    total += count;
+  }
+  if (total == 0) {
+    return 0;
+  }
+  const auto wanted = std::max<uint64_t>(
+      1, static_cast<uint64_t>(
+             std::ceil(fraction * static_cast<double>(total))));
+  auto seen = uint64_t{0};
+  for (size_t i = 0; i < kCompileBuckets; ++i) {
+    seen += compile_ticks[i];
+    if (seen >= wanted) {
+      return uint64_t{2} << i;
+    }
+  }
+  return uint64_t{2} << (kCompileBuckets - 1);
+}
+
+[[nodiscard]] auto JitStats::operator-(const JitStats& before) const noexcept
+    -> JitStats
+{
+  auto delta = *this;
+  for (size_t i = 0; i < kJitCounterCount; ++i) {
+    delta.counters[i] -= before.counters[i];
+  }
+  for (size_t i = 0; i < kCompileBuckets; ++i) {
+    delta.compile_ticks[i] -= before.compile_ticks[i];
+  }
+  return delta;
+}
+
+/**
+ * NOTES:
+ * - Times are bucket upper bounds, so "p99 < 8.2 us" means the 99th
+ *   percentile compile took at most that long
+ * - The first call on x86-64 measures the TSC rate (10 ms)
+ */
+[[nodiscard]] auto describe_jit_stats(const JitStats& stats) -> std::string
+{
+  using enum JitCounter;
+  const auto micros = [&](uint64_t ticks) {
+    return static_cast<double>(ticks) * 1e6 / ticks_per_second();
+  };
+
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1);
+  out << "JIT memory:  " << stats[kMmapCalls] << " mmap, "
+      << stats[kMunmapCalls] << " munmap, " << stats[kMprotectCalls]
+      << " mprotect, " << stats[kMadviseCalls] << " madvise, "
+      << stats[kMbindCalls] << " mbind; "
+      << stats.pages_mapped() << " pages mapped\n";
+  out << "JIT code:    " << stats.bytes_emitted() << " bytes emitted, "
+      << stats.fragmentation() * 100 << "% fragmentation, "
+      << stats[kIcacheFlushes] << " icache flushes (" << stats[kIcacheBytes]
+      << " bytes)\n";
+  out << "JIT cache:   " << stats.cache_hit_rate() * 100 << "% hits ("
+      << stats[kCacheHits] << " hits, " << stats[kCacheMisses] << " misses, "
+      << stats[kCacheEvictions] << " evictions)\n";
+  out << "JIT compile: " << stats[kCompiles] << " compiles";
+  if (stats[kCompiles] != 0) {
+    out << std::setprecision(2) << ", mean "
+        << micros(stats[kCompileTicks]) /
+               static_cast<double>(stats[kCompiles])
+        << " us, p50 < " << micros(stats.compile_ticks_percentile(0.5))
+        << " us, p99 < " << micros(stats.compile_ticks_percentile(0.99))
+        << " us";
+  }
+  out << '\n';
+  return out.str();
+}
+
+} // namespace mijit
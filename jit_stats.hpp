@@ -0,0 +1,186 @@
+/**
+ * @file jit_stats.hpp
+ * @brief What the JIT has cost this process so far: memory, system calls,
+ *        cache behaviour and compile times
+ *
+ * HOW IT WORKS:
+ * 1. Every place that maps, protects, allocates, flushes or compiles calls
+ *    count_jit() (or record_compile()) right where it happens
+ * 2. Each thread counts into its own block: only that thread writes it, so
+ *    an update is a relaxed load and store to a cache line no other core
+ *    touches (no lock prefix, no contention)
+ * 3. jit_stats() adds up the blocks of every live thread plus what threads
+ *    that have exited left behind, and returns a plain snapshot
+ *
+ * WHY WE NEED THIS:
+ * - In production the question is rarely "how fast is one compile" but
+ *   "what is the JIT costing us": how much memory it holds, how many system
+ *   calls it makes, how often the cache misses
+ * - Counting must be cheap enough to leave on everywhere, or nobody has the
+ *   numbers when they are needed
+ *
+ * WHAT IS COUNTED (see JitCounter):
+ * - Mappings: mmap / munmap / mprotect / madvise / mbind calls and bytes,
+ *   from CodeArena, CodeHeap and CodeCacheFile
+ * - Code bytes: slots handed out, the part given back unused (trim), and
+ *   bytes lost to alignment, page rounding and size classes
+ * - Instruction cache flushes and the bytes they covered
+ * - StubCache hits, misses and evictions
+ * - Compiles, with a log2 histogram of their time in ticks
+ *
+ * NOTES:
+ * - A snapshot is not atomic across counters: taken while other threads
+ *   compile, it may see a miss without the compile it caused yet
+ * - Counts only grow; to measure a phase, take a snapshot before and after
+ *   and subtract (operator-)
+ * - Mapped bytes are address space: a dual-mapped arena counts both of its
+ *   views, and MAP_NORESERVE pages cost no memory until they are touched
+ * - A forked child starts from its parent's totals (fork handlers keep the
+ *   registry usable there)
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace mijit {
+
+enum class JitCounter : uint8_t {
+  kMmapCalls,
+  kMunmapCalls,
+  kMprotectCalls,
+  kMadviseCalls,
+  kMbindCalls,      // NUMA placement (CodeArena::bind_to_node)
+  kBytesMapped,     // Address space mapped
+  kBytesUnmapped,   // ... and unmapped again
+  kBytesReleased,   // Pages given back with madvise (CodeHeap)
+  kBytesReserved,   // Code slots handed out
+  kBytesTrimmed,    // Slot bytes the emitter did not need
+  kBytesPadding,    // Alignment, page rounding and size-class slack
+  kIcacheFlushes,
+  kIcacheBytes,
+  kCacheHits,       // StubCache
+  kCacheMisses,
+  kCacheEvictions,
+  kCompiles,        // compile_* calls (a batch is one)
+  kCompileTicks,
+  kCount
+};
+
+inline constexpr auto kJitCounterCount =
+    static_cast<size_t>(JitCounter::kCount);
+
+/**
+ * Compile time buckets: bucket i holds compiles of [2^i, 2^(i+1)) ticks,
+ * the last one everything longer
+ */
+inline constexpr size_t kCompileBuckets = 40;
+
+/**
+ * The process-wide totals at one moment
+ */
+struct JitStats {
+  std::array<uint64_t, kJitCounterCount> counters{};
+  std::array<uint64_t, kCompileBuckets> compile_ticks{};
+
+  [[nodiscard]] auto operator[](JitCounter counter) const noexcept
+      -> uint64_t
+  {
+    return counters[static_cast<size_t>(counter)];
+  }
+
+  /**
+   * Bytes of machine code and text in slots (reserved minus trimmed)
+   */
+  [[nodiscard]] auto bytes_emitted() const noexcept -> uint64_t;
+
+  /**
+   * Pages of address space mapped right now
+   */
+  [[nodiscard]] auto pages_mapped() const noexcept -> uint64_t;
+
+  /**
+   * Share of the used code memory that holds no code (padding and trimmed
+   * bytes that could not be given back), 0 to 1
+   */
+  [[nodiscard]] auto fragmentation() const noexcept -> double;
+
+  /**
+   * StubCache hits / (hits + misses), 0 when nothing was looked up
+   */
+  [[nodiscard]] auto cache_hit_rate() const noexcept -> double;
+
+  /**
+   * Upper bound, in ticks, of the bucket holding the given fraction
+   * (0.5: median) of all compiles; 0 when nothing was compiled
+   */
+  [[nodiscard]] auto compile_ticks_percentile(double fraction) const noexcept
+      -> uint64_t;
+
+  /**
+   * What happened between before and this snapshot
+   */
+  [[nodiscard]] auto operator-(const JitStats& before) const noexcept
+      -> JitStats;
+};
+
+/**
+ * The tick counter compile times are measured in (rdtsc / cntvct_el0, see
+ * ticks_per_second() for its rate)
+ */
+[[nodiscard]] inline auto read_ticks() noexcept -> uint64_t
+{
+#if defined(__x86_64__)
+  return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+  auto ticks = uint64_t{0};
+  asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Add amount to one counter of this thread
+ */
+auto count_jit(JitCounter counter, uint64_t amount = 1) noexcept -> void;
+
+/**
+ * Count one compile that took ticks (kCompiles, kCompileTicks and the
+ * histogram)
+ */
+auto record_compile(uint64_t ticks) noexcept -> void;
+
+/**
+ * Times a compile from construction to destruction
+ */
+class CompileTimer {
+public:
+  CompileTimer() noexcept : start_{read_ticks()} {}
+  ~CompileTimer()
+  {
+    record_compile(read_ticks() - start_);
+  }
+
+  CompileTimer(const CompileTimer&) = delete;
+  auto operator=(const CompileTimer&) -> CompileTimer& = delete;
+
+private:
+  uint64_t start_;
+};
+
+/**
+ * Totals of every thread, live or exited (takes a lock, not for hot paths)
+ */
+[[nodiscard]] auto jit_stats() -> JitStats;
+
+/**
+ * A few lines for people: memory, system calls, cache and compile times
+ */
+[[nodiscard]] auto describe_jit_stats(const JitStats& stats) -> std::string;
+
+} // namespace mijit
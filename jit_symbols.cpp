@@ -0,0 +1,458 @@
+/**
+ * @file jit_symbols.cpp
+ * @brief perf map, jitdump and GDB JIT interface writers
+ */
+
+#include "jit_symbols.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <utility>
+
+/**
+ * THE GDB JIT INTERFACE
+ *
+ * - The debugger puts a breakpoint on __jit_debug_register_code() and, when
+ *   it is hit, reads the entry __jit_debug_descriptor points at
+ * - These names and layouts are fixed by GDB (lldb reads them too); there
+ *   must be only one definition in the process
+ */
+extern "C" {
+
+struct jit_code_entry {
+  jit_code_entry* next_entry;
+  jit_code_entry* prev_entry;
+  const char* symfile_addr;
+  uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+  uint32_t version;
+  uint32_t action_flag; // 0 = nothing, 1 = register, 2 = unregister
+  jit_code_entry* relevant_entry;
+  jit_code_entry* first_entry;
+};
+
+[[gnu::noinline, gnu::used]] void __jit_debug_register_code()
+{
+  asm volatile("" ::: "memory"); // Must not be optimised away
+}
+
+[[gnu::used]] jit_descriptor __jit_debug_descriptor = {1, 0, nullptr,
+                                                      nullptr};
+
+} // extern "C"
+
+namespace mijit {
+
+namespace {
+
+std::mutex gdb_mutex; // The descriptor is shared by every JitSymbols
+
+constexpr uint32_t kJitdumpMagic = 0x4A695444; // "JiTD"
+constexpr uint32_t kJitCodeLoad = 0;
+constexpr uint32_t kJitCodeClose = 3;
+
+#if defined(__aarch64__)
+constexpr uint16_t kElfMachine = 183; // EM_AARCH64
+#else
+constexpr uint16_t kElfMachine = 62; // EM_X86_64
+#endif
+
+struct JitdumpHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+};
+
+struct JitdumpRecord {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+};
+
+struct JitdumpCodeLoad {
+  JitdumpRecord record;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+  // Followed by the name (NUL-terminated) and the code bytes
+};
+
+/**
+ * HELPER FUNCTION: CLOCK_MONOTONIC in nanoseconds (what perf record -k mono
+ * stamps its samples with)
+ */
+[[nodiscard]] auto monotonic_ns() noexcept -> uint64_t
+{
+  timespec now{};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000u +
+         static_cast<uint64_t>(now.tv_nsec);
+}
+
+[[nodiscard]] auto thread_id() noexcept -> uint32_t
+{
+#if defined(__linux__)
+  return static_cast<uint32_t>(syscall(SYS_gettid));
+#else
+  return static_cast<uint32_t>(getpid());
+#endif
+}
+
+/**
+ * HELPER FUNCTION: write(2) all of data (retrying short writes)
+ */
+auto write_all(int fd, const void* data, size_t size) -> void
+{
+  const auto* bytes = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    const auto written = ::write(fd, bytes, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Failed to write JIT symbols");
+    }
+    bytes += written;
+    size -= static_cast<size_t>(written);
+  }
+}
+
+/**
+ * ELF64 STRUCTURES (only what the in-memory image needs)
+ */
+struct ElfHeader {
+  uint8_t ident[16];
+  uint16_t type;
+  uint16_t machine;
+  uint32_t version;
+  uint64_t entry;
+  uint64_t phoff;
+  uint64_t shoff;
+  uint32_t flags;
+  uint16_t ehsize;
+  uint16_t phentsize;
+  uint16_t phnum;
+  uint16_t shentsize;
+  uint16_t shnum;
+  uint16_t shstrndx;
+};
+
+struct ElfSection {
+  uint32_t name;
+  uint32_t type;
+  uint64_t flags;
+  uint64_t addr;
+  uint64_t offset;
+  uint64_t size;
+  uint32_t link;
+  uint32_t info;
+  uint64_t addralign;
+  uint64_t entsize;
+};
+
+struct ElfSymbol {
+  uint32_t name;
+  uint8_t info;
+  uint8_t other;
+  uint16_t shndx;
+  uint64_t value;
+  uint64_t size;
+};
+
+static_assert(sizeof(ElfHeader) == 64 && sizeof(ElfSection) == 64 &&
+              sizeof(ElfSymbol) == 24);
+
+/**
+ * HELPER FUNCTION: Build the ELF image GDB reads for one stub
+ *
+ * LAYOUT:
+ * - ELF header (relocatable object, so the debugger places .text at its
+ *   sh_addr, the stub's address)
+ * - .shstrtab, .strtab, .symtab (null, file and function symbol)
+ * - Section headers: null, .text (NOBITS - the code stays where it is),
+ *   .symtab, .strtab, .shstrtab
+ */
+[[nodiscard]] auto build_elf_image(std::string_view name, const uint8_t* code,
+                                   size_t size) -> std::vector<uint8_t>
+{
+  constexpr char kSectionNames[] = "\0.text\0.symtab\0.strtab\0.shstrtab";
+  constexpr uint32_t kText = 1, kSymtab = 7, kStrtab = 15, kShstrtab = 23;
+
+  std::string strings{"\0mijit\0", 7};
+  const auto function_name = static_cast<uint32_t>(strings.size());
+  strings.append(name);
+  strings.push_back('\0');
+
+  const auto align8 = [](size_t value) { return (value + 7) & ~size_t{7}; };
+  const auto shstrtab_offset = sizeof(ElfHeader);
+  const auto strtab_offset = shstrtab_offset + sizeof(kSectionNames);
+  const auto symtab_offset = align8(strtab_offset + strings.size());
+  const auto sections_offset = symtab_offset + 3 * sizeof(ElfSymbol);
+  std::vector<uint8_t> image(sections_offset + 5 * sizeof(ElfSection));
+
+  auto header = ElfHeader{};
+  std::memcpy(header.ident, "\x7F" "ELF\x02\x01\x01", 7); // 64-bit, LE
+  header.type = 1;                                         // ET_REL
+  header.machine = kElfMachine;
+  header.version = 1;
+  header.shoff = sections_offset;
+  header.ehsize = sizeof(ElfHeader);
+  header.shentsize = sizeof(ElfSection);
+  header.shnum = 5;
+  header.shstrndx = 4;
+  std::memcpy(image.data(), &header, sizeof(header));
+  std::memcpy(image.data() + shstrtab_offset, kSectionNames,
+              sizeof(kSectionNames));
+  std::memcpy(image.data() + strtab_offset, strings.data(), strings.size());
+
+  const ElfSymbol symbols[3] = {
+      {},
+      {1, 0x04, 0, 0xFFF1, 0, 0}, // "mijit": STB_LOCAL STT_FILE, SHN_ABS
+      {function_name, 0x12, 0, 1, 0, size}, // STB_GLOBAL STT_FUNC in .text
+  };
+  std::memcpy(image.data() + symtab_offset, symbols, sizeof(symbols));
+
+  const ElfSection sections[5] = {
+      {},
+      {kText, 8, 0x6, reinterpret_cast<uintptr_t>(code), 0, size, 0, 0, 16,
+       0}, // SHT_NOBITS, SHF_ALLOC | SHF_EXECINSTR
+      {kSymtab, 2, 0, 0, symtab_offset, sizeof(symbols), 3, 2, 8,
+       sizeof(ElfSymbol)}, // SHT_SYMTAB, strings in 3, first global is 2
+      {kStrtab, 3, 0, 0, strtab_offset, strings.size(), 0, 0, 1, 0},
+      {kShstrtab, 3, 0, 0, shstrtab_offset, sizeof(kSectionNames), 0, 0, 1,
+       0},
+  };
+  std::memcpy(image.data() + sections_offset, sections, sizeof(sections));
+  return image;
+}
+
+} // namespace
+
+[[nodiscard]] auto parse_jit_symbol_options(std::string_view list)
+    -> JitSymbolOptions
+{
+  auto options = JitSymbolOptions{};
+  while (!list.empty()) {
+    const auto comma = list.find(',');
+    const auto sink = list.substr(0, comma);
+    if (sink == "perf") {
+      options.perf_map = true;
+    }
+    else if (sink == "jitdump") {
+      options.jitdump = true;
+    }
+    else if (sink == "gdb") {
+      options.gdb = true;
+    }
+    else if (!sink.empty()) {
+      throw std::runtime_error("Unknown JIT symbol sink: " +
+                               std::string{sink});
+    }
+    list = comma == std::string_view::npos ? std::string_view{}
+                                           : list.substr(comma + 1);
+  }
+  return options;
+}
+
+struct JitSymbols::GdbEntry {
+  jit_code_entry entry{};
+  std::vector<uint8_t> image;
+};
+
+JitSymbols::JitSymbols(const JitSymbolOptions& options) : gdb_{options.gdb}
+{
+  const auto pid = static_cast<int>(getpid());
+  if (options.perf_map) {
+    const auto path = "/tmp/perf-" + std::to_string(pid) + ".map";
+    perf_map_fd_ =
+        open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (perf_map_fd_ == -1) {
+      throw std::runtime_error("Failed to create the perf map");
+    }
+  }
+  if (options.jitdump) {
+    try {
+      open_jitdump(options.jitdump_directory + "/jit-" + std::to_string(pid) +
+                   ".dump");
+    } catch (...) {
+      if (perf_map_fd_ != -1) {
+        close(perf_map_fd_);
+      }
+      throw;
+    }
+  }
+}
+
+/**
+ * HELPER FUNCTION: Create the jitdump file, map it and write its header
+ *
+ * - perf record finds the file through an executable mapping of it, so
+ *   the first page stays mapped until the JitSymbols goes away
+ */
+auto JitSymbols::open_jitdump(const std::string& path) -> void
+{
+  const int fd =
+      open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    throw std::runtime_error("Failed to create the jitdump file");
+  }
+  const auto marker_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  auto* marker = mmap(nullptr, marker_size, PROT_READ | PROT_EXEC,
+                      MAP_PRIVATE, fd, 0);
+  if (marker == MAP_FAILED) {
+    close(fd);
+    throw std::runtime_error("Failed to map the jitdump file");
+  }
+  const auto header =
+      JitdumpHeader{kJitdumpMagic, 1, sizeof(JitdumpHeader), kElfMachine, 0,
+                    static_cast<uint32_t>(getpid()), monotonic_ns(), 0};
+  try {
+    write_all(fd, &header, sizeof(header));
+  } catch (...) {
+    munmap(marker, marker_size);
+    close(fd);
+    throw;
+  }
+  jitdump_fd_ = fd;
+  jitdump_marker_ = marker;
+  jitdump_marker_size_ = marker_size;
+}
+
+JitSymbols::~JitSymbols()
+{
+  if (jitdump_fd_ != -1) {
+    const auto close_record =
+        JitdumpRecord{kJitCodeClose, sizeof(JitdumpRecord), monotonic_ns()};
+    try {
+      write_all(jitdump_fd_, &close_record, sizeof(close_record));
+    } catch (const std::exception&) {
+      // Nothing to do: perf copes with a missing close record
+    }
+    munmap(jitdump_marker_, jitdump_marker_size_);
+    close(jitdump_fd_);
+  }
+  if (perf_map_fd_ != -1) {
+    close(perf_map_fd_); // The map stays: perf reads it after we exit
+  }
+  const std::lock_guard lock{gdb_mutex};
+  for (auto& gdb_entry : gdb_entries_) {
+    auto* entry = &gdb_entry->entry;
+    if (entry->prev_entry != nullptr) {
+      entry->prev_entry->next_entry = entry->next_entry;
+    }
+    else {
+      __jit_debug_descriptor.first_entry = entry->next_entry;
+    }
+    if (entry->next_entry != nullptr) {
+      entry->next_entry->prev_entry = entry->prev_entry;
+    }
+    __jit_debug_descriptor.relevant_entry = entry;
+    __jit_debug_descriptor.action_flag = 2; // JIT_UNREGISTER_FN
+    __jit_debug_register_code();
+  }
+}
+
+auto JitSymbols::add(std::string_view name, const uint8_t* code, size_t size)
+    -> void
+{
+  const std::lock_guard lock{mutex_};
+  if (perf_map_fd_ != -1) {
+    add_perf_map(name, code, size);
+  }
+  if (jitdump_fd_ != -1) {
+    add_jitdump(name, code, size);
+  }
+  if (gdb_) {
+    add_gdb(name, code, size);
+  }
+  ++count_;
+}
+
+/**
+ * HELPER FUNCTION: "<start> <size> <name>", both numbers in hex
+ */
+auto JitSymbols::add_perf_map(std::string_view name, const uint8_t* code,
+                              size_t size) -> void
+{
+  char numbers[48];
+  const auto length =
+      std::snprintf(numbers, sizeof(numbers), "%llx %zx ",
+                    static_cast<unsigned long long>(
+                        reinterpret_cast<uintptr_t>(code)),
+                    size);
+  auto line = std::string{numbers, static_cast<size_t>(length)};
+  line.append(name);
+  line.push_back('\n');
+  write_all(perf_map_fd_, line.data(), line.size()); // One append per line
+}
+
+/**
+ * HELPER FUNCTION: JIT_CODE_LOAD record: header, name, then the code itself
+ */
+auto JitSymbols::add_jitdump(std::string_view name, const uint8_t* code,
+                             size_t size) -> void
+{
+  const auto total = sizeof(JitdumpCodeLoad) + name.size() + 1 + size;
+  const auto address =
+      static_cast<uint64_t>(reinterpret_cast<uintptr_t>(code));
+  const auto load = JitdumpCodeLoad{
+      {kJitCodeLoad, static_cast<uint32_t>(total), monotonic_ns()},
+      static_cast<uint32_t>(getpid()),
+      thread_id(),
+      address,
+      address,
+      size,
+      count_};
+  std::vector<uint8_t> record(total);
+  std::memcpy(record.data(), &load, sizeof(load));
+  std::memcpy(record.data() + sizeof(load), name.data(), name.size());
+  std::memcpy(record.data() + sizeof(load) + name.size() + 1, code, size);
+  write_all(jitdump_fd_, record.data(), record.size());
+}
+
+/**
+ * HELPER FUNCTION: Link a new ELF image into the descriptor's list and call
+ * the function the debugger has a breakpoint on
+ */
+auto JitSymbols::add_gdb(std::string_view name, const uint8_t* code,
+                         size_t size) -> void
+{
+  auto gdb_entry = std::make_unique<GdbEntry>();
+  gdb_entry->image = build_elf_image(name, code, size);
+  const std::lock_guard lock{gdb_mutex};
+  auto* entry = &gdb_entry->entry;
+  entry->symfile_addr = reinterpret_cast<const char*>(gdb_entry->image.data());
+  entry->symfile_size = gdb_entry->image.size();
+  entry->next_entry = __jit_debug_descriptor.first_entry;
+  if (entry->next_entry != nullptr) {
+    entry->next_entry->prev_entry = entry;
+  }
+  __jit_debug_descriptor.first_entry = entry;
+  __jit_debug_descriptor.relevant_entry = entry;
+  __jit_debug_descriptor.action_flag = 1; // JIT_REGISTER_FN
+  __jit_debug_register_code();
+  gdb_entries_.push_back(std::move(gdb_entry));
+}
+
+} // namespace mijit
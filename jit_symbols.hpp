@@ -0,0 +1,107 @@
+/**
+ * @file jit_symbols.hpp
+ * @brief Tell profilers and debuggers what the generated code is
+ *
+ * HOW IT WORKS:
+ * - Every compiled stub is announced with add(name, code, size), and each
+ *   enabled sink gets it:
+ *   1. perf map:  one "start size name" line in /tmp/perf-<pid>.map - perf
+ *                 report, perf top and most flame graph tools read it
+ *   2. jitdump:   a JIT_CODE_LOAD record with the raw machine code in
+ *                 <directory>/jit-<pid>.dump - perf inject --jit turns it
+ *                 into real symbols and lets perf annotate the code
+ *   3. GDB:       a tiny in-memory ELF image (.text at the stub's address,
+ *                 one function symbol) registered through the GDB JIT
+ *                 interface, so gdb / lldb backtraces name the stub
+ *
+ * WHY WE NEED THIS:
+ * - Anonymous executable memory shows up as [unknown] frames: CPU time
+ *   spent in generated code cannot be attributed to anything
+ *
+ * USAGE WITH PERF:
+ *   perf record -k mono -g ./MiJIT          # jitdump needs -k mono
+ *   perf inject --jit -i perf.data -o perf.jit.data
+ *   perf report -i perf.jit.data
+ *
+ * NOTES:
+ * - add() is thread-safe (one mutex; it writes files, it is not for hot
+ *   paths); use one JitSymbols per process, the jitdump file is per pid
+ * - Code must stay readable for add(): it copies the bytes into the
+ *   jitdump record
+ * - Names of stubs whose memory is reused (CodeHeap) stay in the perf map;
+ *   perf uses the newest entry for an address
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mijit {
+
+struct JitSymbolOptions {
+  bool perf_map = false;
+  bool jitdump = false;
+  bool gdb = false;
+  std::string jitdump_directory = "/tmp"; // perf also looks in ~/.debug/jit
+};
+
+/**
+ * Sinks from a comma-separated list such as "perf,jitdump,gdb" (the
+ * MIJIT_SYMBOLS environment variable); throws on an unknown name
+ */
+[[nodiscard]] auto parse_jit_symbol_options(std::string_view list)
+    -> JitSymbolOptions;
+
+class JitSymbols {
+public:
+  /**
+   * Open the files of the enabled sinks (throws if one cannot be created)
+   */
+  explicit JitSymbols(const JitSymbolOptions& options);
+
+  /**
+   * Closes the jitdump (JIT_CODE_CLOSE) and unregisters every GDB image
+   */
+  ~JitSymbols();
+
+  JitSymbols(const JitSymbols&) = delete;
+  auto operator=(const JitSymbols&) -> JitSymbols& = delete;
+
+  /**
+   * Announce size bytes of generated code at code under name
+   */
+  auto add(std::string_view name, const uint8_t* code, size_t size) -> void;
+
+  [[nodiscard]] auto count() const noexcept -> size_t
+  {
+    return count_;
+  }
+
+private:
+  struct GdbEntry; // Node of the GDB JIT interface list
+
+  auto open_jitdump(const std::string& path) -> void;
+  auto add_perf_map(std::string_view name, const uint8_t* code, size_t size)
+      -> void;
+  auto add_jitdump(std::string_view name, const uint8_t* code, size_t size)
+      -> void;
+  auto add_gdb(std::string_view name, const uint8_t* code, size_t size)
+      -> void;
+
+  std::mutex mutex_;
+  int perf_map_fd_ = -1;
+  int jitdump_fd_ = -1;
+  void* jitdump_marker_ = nullptr; // The mapping perf record looks for
+  size_t jitdump_marker_size_ = 0;
+  bool gdb_ = false;
+  std::vector<std::unique_ptr<GdbEntry>> gdb_entries_;
+  size_t count_ = 0;
+};
+
+} // namespace mijit
@@ -0,0 +1,100 @@
+/**
+ * @file numa.cpp
+ * @brief Node discovery and the per-node arenas
+ */
+
+#include "numa.hpp"
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include <cstdio>
+
+namespace mijit {
+
+namespace {
+
+constexpr unsigned kMaxNodes = 64; // More than any machine we run on
+
+/**
+ * HELPER FUNCTION: Read the node count from sysfs
+ *
+ * /sys/devices/system/node/online is a list like "0", "0-1" or "0,2-3";
+ * the last number in it is the highest node
+ */
+[[nodiscard]] auto query_node_count() noexcept -> unsigned
+{
+#if defined(__linux__)
+  if (auto* file = std::fopen("/sys/devices/system/node/online", "r")) {
+    auto highest = 0U;
+    auto number = 0U;
+    auto digits = false;
+    for (int c = std::fgetc(file); c != EOF; c = std::fgetc(file)) {
+      if (c >= '0' && c <= '9') {
+        number = digits ? number * 10 + static_cast<unsigned>(c - '0')
+                        : static_cast<unsigned>(c - '0');
+        digits = true;
+      }
+      else if (digits) {
+        highest = number;
+        digits = false;
+      }
+    }
+    std::fclose(file);
+    if (digits) {
+      highest = number;
+    }
+    return highest < kMaxNodes ? highest + 1 : kMaxNodes;
+  }
+#endif
+  return 1;
+}
+
+} // namespace
+
+[[nodiscard]] auto numa_node_count() noexcept -> unsigned
+{
+  static const auto count = query_node_count(); // Asked once per process
+  return count;
+}
+
+/**
+ * getcpu() goes through the vDSO on x86-64 and AArch64 Linux: a few
+ * nanoseconds, cheap enough to ask on every call
+ */
+[[nodiscard]] auto current_numa_node() noexcept -> unsigned
+{
+#if defined(__linux__)
+  const auto count = numa_node_count();
+  if (count == 1) {
+    return 0;
+  }
+  auto cpu = 0U;
+  auto node = 0U;
+  if (getcpu(&cpu, &node) == 0 && node < count) {
+    return node;
+  }
+#endif
+  return 0;
+}
+
+/**
+ * STEP BY STEP:
+ * 1. Reserve an arena for every node
+ * 2. Bind it before anything is written into it, so its pages are
+ *    allocated on the node from the start (a single node needs no binding)
+ */
+NumaArenas::NumaArenas(size_t capacity, ArenaBackend backend)
+{
+  const auto count = numa_node_count();
+  arenas_.reserve(count);
+  for (auto node = 0U; node < count; ++node) {
+    auto& arena = arenas_.emplace_back(capacity, backend);
+    if (count > 1 && arena.bind_to_node(node)) {
+      ++bound_;
+    }
+  }
+}
+
+} // namespace mijit
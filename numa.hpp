@@ -0,0 +1,113 @@
+/**
+ * @file numa.hpp
+ * @brief Code arenas per NUMA node, so stubs run from memory on the
+ *        caller's own socket
+ *
+ * HOW IT WORKS:
+ * 1. numa_node_count() reads the nodes of this machine from sysfs, once
+ * 2. NumaArenas reserves one CodeArena per node and binds each one to its
+ *    node (mbind, see CodeArena::bind_to_node): whichever thread writes the
+ *    code, its pages come from that node's memory
+ * 3. current_numa_node() tells a thread which node it is running on
+ *    (getcpu, served by the vDSO: no system call), so it can call the copy
+ *    of a stub in its own node's arena
+ *
+ * WHY WE NEED THIS:
+ * - On a multi-socket machine a page lives in the memory of one socket.
+ *   Code written by a thread on socket 0 and run mostly on socket 1 takes
+ *   every instruction cache miss across the interconnect
+ * - A stub is a few dozen bytes: one copy per node costs next to nothing,
+ *   and keeps the hot ones local however the threads are spread out
+ *
+ * NODE-LOCAL STUBS: TieredRuntime with NumaPlacement::kNodeLocal does this
+ * for the functions that get hot (see tiered.hpp).
+ *
+ * NOTES:
+ * - On a machine with one node (and everywhere but Linux) there is one
+ *   arena, nothing is bound, and current_numa_node() is always 0
+ * - A thread can be moved to another node at any time: the node it got
+ *   only says where it ran a moment ago. Every copy runs the same code, so
+ *   calling the "wrong" one is only slower, never wrong
+ * - No libnuma needed: mbind and getcpu are plain system calls
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "jit_memory.hpp"
+
+namespace mijit {
+
+/**
+ * Where a runtime puts the code of its hot functions
+ *
+ * - kShared:    one copy, in one arena, for every thread
+ * - kNodeLocal: one copy per NUMA node that calls the function, each in an
+ *               arena bound to that node (the same as kShared on a machine
+ *               with one node)
+ */
+enum class NumaPlacement {
+  kShared,
+  kNodeLocal,
+};
+
+/**
+ * Nodes of this machine: one more than the highest online node number
+ * (asked once; 1 where there is no NUMA information)
+ */
+[[nodiscard]] auto numa_node_count() noexcept -> unsigned;
+
+/**
+ * The node the calling thread runs on right now, below numa_node_count()
+ */
+[[nodiscard]] auto current_numa_node() noexcept -> unsigned;
+
+/**
+ * One arena per NUMA node, each bound to its node
+ *
+ * - Like any CodeArena, an arena here is not thread-safe: callers lock
+ * - An arena whose node cannot be bound (a node number without memory,
+ *   or mbind not allowed) still works, with the kernel's default placement
+ */
+class NumaArenas {
+public:
+  explicit NumaArenas(size_t capacity = CodeArena::kDefaultCapacity,
+                      ArenaBackend backend = ArenaBackend::kMprotect);
+
+  [[nodiscard]] auto node_count() const noexcept -> unsigned
+  {
+    return static_cast<unsigned>(arenas_.size());
+  }
+
+  /**
+   * The arena of one node (node below node_count())
+   */
+  [[nodiscard]] auto arena(unsigned node) noexcept -> CodeArena&
+  {
+    return arenas_[node];
+  }
+
+  /**
+   * The arena of the node the calling thread runs on
+   */
+  [[nodiscard]] auto local() noexcept -> CodeArena&
+  {
+    return arenas_[current_numa_node()];
+  }
+
+  /**
+   * Arenas that really are bound to their node
+   */
+  [[nodiscard]] auto bound() const noexcept -> unsigned
+  {
+    return bound_;
+  }
+
+private:
+  std::vector<CodeArena> arenas_;
+  unsigned bound_ = 0;
+};
+
+} // namespace mijit
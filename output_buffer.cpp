@@ -0,0 +1,99 @@
+/**
+ * @file output_buffer.cpp
+ * @brief Coalescing output buffer for buffered stubs
+ */
+
+#include "output_buffer.hpp"
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace mijit {
+
+OutputBuffer::OutputBuffer(int fd, size_t capacity, size_t flush_threshold)
+    : fd_{fd},
+      data_{std::make_unique<char[]>(capacity)},
+      capacity_{capacity},
+      flush_threshold_{flush_threshold == 0 ? capacity : flush_threshold}
+{
+}
+
+OutputBuffer::~OutputBuffer()
+{
+  flush(); // Never lose buffered output
+}
+
+/**
+ * HELPER FUNCTION: write until everything is out (write may be partial;
+ * gives up on an error or a write of 0 bytes)
+ */
+auto OutputBuffer::write_all(const char* text, size_t size) noexcept -> void
+{
+  while (size > 0) {
+    const auto written = ::write(fd_, text, size);
+    ++write_calls_;
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      // An error, or a descriptor that takes nothing (0 would repeat
+      // forever): dropped, the same as the unbuffered stub does
+      return;
+    }
+    text += written;
+    size -= static_cast<size_t>(written);
+  }
+}
+
+auto OutputBuffer::flush() noexcept -> void
+{
+  if (size_ > 0) {
+    write_all(data_.get(), size_);
+    size_ = 0;
+  }
+}
+
+/**
+ * FAST PATH: memcpy into the buffer
+ * SLOW PATH: the text does not fit - send buffer + text with one writev
+ */
+auto OutputBuffer::append(const char* text, size_t size) noexcept -> void
+{
+  if (size <= capacity_ - size_) {
+    std::memcpy(data_.get() + size_, text, size);
+    size_ += size;
+    if (size_ >= flush_threshold_) {
+      flush();
+    }
+    return;
+  }
+
+  iovec parts[2] = {{data_.get(), size_}, {const_cast<char*>(text), size}};
+  const auto total = size_ + size;
+  const auto written = ::writev(fd_, parts, 2);
+  ++write_calls_;
+  const auto done = written < 0 ? size_t{0} : static_cast<size_t>(written);
+  if (done < total) {
+    // Partial writev: finish whatever is left with plain writes
+    if (done < size_) {
+      write_all(data_.get() + done, size_ - done);
+      write_all(text, size);
+    }
+    else {
+      write_all(text + (done - size_), total - done);
+    }
+  }
+  size_ = 0;
+}
+
+} // namespace mijit
+
+extern "C" auto mijit_output_append(mijit::OutputBuffer* buffer,
+                                    const char* text, size_t size) noexcept
+    -> void
+{
+  buffer->append(text, size);
+}
@@ -0,0 +1,95 @@
+/**
+ * @file output_buffer.hpp
+ * @brief Userspace output buffer that buffered stubs write into
+ *
+ * HOW IT WORKS:
+ * - A buffered stub does not call write itself; it jumps to
+ *   mijit_output_append() with (buffer, text, length)
+ * - The text is copied into the buffer (a memcpy, no system call)
+ * - Only when the buffer passes its flush threshold, or on flush(), is the
+ *   data written out with one write/writev system call
+ *
+ * WHY WE NEED THIS:
+ * - Calling an unbuffered stub a million times means a million system calls
+ * - Buffering turns that into a few hundred large writes
+ *
+ * WHY ONE BUFFER PER THREAD, NOT A SHARED RING:
+ * - The buffer's address is baked into every buffered stub, and append() is
+ *   a bounds check and a memcpy. A ring shared by all threads would add an
+ *   atomic reservation to every append, plus a consumer that waits for
+ *   slow producers before it can write a range out
+ * - A shared ring would not keep output in order across threads anyway.
+ *   Within one thread a plain buffer keeps it in order for free
+ * - The stream pipeline, the one place that buffers, runs its stubs on a
+ *   single thread, so a per-thread buffer already makes all of its output
+ *   leave in large writes
+ *
+ * NOTE: an OutputBuffer is not thread-safe; stubs running on several
+ * threads need one buffer per thread (compile each thread's stubs with its
+ * own CodegenOptions::buffer).
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace mijit {
+
+class OutputBuffer {
+public:
+  static constexpr size_t kDefaultCapacity = size_t{64} << 10; // 64 KiB
+
+  /**
+   * fd:              where the data finally goes (1 = stdout)
+   * capacity:        size of the buffer
+   * flush_threshold: write out as soon as this many bytes are buffered
+   *                  (0 means "when full")
+   */
+  explicit OutputBuffer(int fd = 1, size_t capacity = kDefaultCapacity,
+                        size_t flush_threshold = 0);
+  ~OutputBuffer();
+
+  OutputBuffer(const OutputBuffer&) = delete;
+  auto operator=(const OutputBuffer&) -> OutputBuffer& = delete;
+
+  /**
+   * Buffer text, writing out first if it does not fit
+   */
+  auto append(const char* text, size_t size) noexcept -> void;
+
+  /**
+   * Write out everything buffered so far
+   */
+  auto flush() noexcept -> void;
+
+  [[nodiscard]] auto buffered() const noexcept -> size_t
+  {
+    return size_;
+  }
+  [[nodiscard]] auto write_calls() const noexcept -> uint64_t
+  {
+    return write_calls_;
+  }
+
+private:
+  auto write_all(const char* text, size_t size) noexcept -> void;
+
+  int fd_;
+  std::unique_ptr<char[]> data_;
+  size_t capacity_;
+  size_t flush_threshold_;
+  size_t size_ = 0;
+  uint64_t write_calls_ = 0;
+};
+
+} // namespace mijit
+
+/**
+ * Entry point called by buffered stubs (plain C calling convention, so the
+ * generated code only has to load three argument registers and jump)
+ */
+extern "C" auto mijit_output_append(mijit::OutputBuffer* buffer,
+                                    const char* text, size_t size) noexcept
+    -> void;
@@ -0,0 +1,72 @@
+/**
+ * @file prefork.cpp
+ * @brief The sealed memfd behind a shared code image
+ */
+
+#include "prefork.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <stdexcept>
+
+namespace mijit {
+
+namespace {
+
+/**
+ * HELPER FUNCTION: An anonymous file to build the image in
+ */
+[[nodiscard]] auto create_image_file() -> int
+{
+#if defined(__linux__)
+  const int fd =
+      memfd_create("mijit-prefork", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+  char path[] = "/tmp/mijit-prefork-XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd != -1) {
+    unlink(path); // Lives as long as something has it open or mapped
+  }
+#endif
+  if (fd == -1) {
+    throw std::runtime_error("Failed to create the shared code image");
+  }
+  return fd;
+}
+
+} // namespace
+
+/**
+ * STEP BY STEP:
+ * 1. Write the image into an anonymous file
+ * 2. Seal it (Linux): from here on nobody can write, grow or shrink it, and
+ *    the seals themselves cannot be removed
+ * 3. Map it (CodeCacheFile checks it like any cache file) and close the
+ *    file: the mappings keep it alive, and children inherit them
+ */
+[[nodiscard]] auto make_shared_code_image(
+    std::span<const std::string_view> messages) -> CodeCacheFile
+{
+  const int fd = create_image_file();
+  try {
+    write_code_cache(fd, messages);
+#if defined(__linux__)
+    if (fcntl(fd, F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) ==
+        -1) {
+      throw std::runtime_error("Failed to seal the shared code image");
+    }
+#endif
+    auto image = CodeCacheFile{fd};
+    close(fd);
+    return image;
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+}
+
+} // namespace mijit
@@ -0,0 +1,51 @@
+/**
+ * @file prefork.hpp
+ * @brief Compile once in the parent, run the same pages in every worker
+ *
+ * HOW IT WORKS ("pre-warm, then fork"):
+ * 1. The parent calls make_shared_code_image() with the messages every
+ *    worker will need: they are compiled into a code cache image (the
+ *    format of code_cache_file.hpp) inside a memfd
+ * 2. The memfd is sealed (no more writes, no resizing) and mapped
+ *    read/execute; nothing can change the code from now on, in any process
+ * 3. The parent forks its workers. Each one inherits the mapping: the pages
+ *    belong to the memfd, are never written, and so are never copied - N
+ *    workers hold one physical copy of the code
+ * 4. A worker looks messages up with find(); anything else it compiles into
+ *    arenas of its own. Dual-mapped arenas the parent had are made private
+ *    to the child by a fork handler (see ArenaBackend), so a worker's new
+ *    code never lands in another process
+ *
+ * WHY WE NEED THIS:
+ * - Compiled in each worker, the same stubs would cost N times the code
+ *   generation and N copies in memory (an anonymous private mapping is
+ *   copied as soon as a worker writes to any byte of a page)
+ * - Sealing means a bug in one worker cannot patch code the others run
+ *
+ * NOTES:
+ * - Fork from a thread while no other thread is compiling: besides the
+ *   arenas and the JIT statistics (which have fork handlers), the JIT's
+ *   locks (JitService, TrampolineTable) and threads do not survive fork -
+ *   create a JitService in each worker, after fork
+ * - Only kUnbuffered stubs can be in an image (see code_cache_file.hpp)
+ * - Without memfd (not Linux), the image is an unlinked temporary file,
+ *   which is shared the same way through the page cache
+ */
+
+#pragma once
+
+#include <span>
+#include <string_view>
+
+#include "code_cache_file.hpp"
+
+namespace mijit {
+
+/**
+ * Compile messages into a sealed, shared, read/execute image (throws when
+ * the memfd or the mapping cannot be made)
+ */
+[[nodiscard]] auto make_shared_code_image(
+    std::span<const std::string_view> messages) -> CodeCacheFile;
+
+} // namespace mijit
@@ -0,0 +1,70 @@
+/**
+ * @file slab_pool.cpp
+ * @brief Lock-free slab refill for per-thread code arenas
+ */
+
+#include "slab_pool.hpp"
+
+#include <stdexcept>
+
+namespace mijit {
+
+SlabPool::SlabPool(size_t capacity, size_t slab_size, ArenaBackend backend,
+                   HugePages huge_pages)
+    : region_{capacity, backend, huge_pages},
+      slab_size_{(slab_size + region_.granule() - 1) &
+                 ~(region_.granule() - 1)}
+{
+  if (slab_size_ == 0 || slab_size_ > region_.capacity()) {
+    throw std::runtime_error("Slab size does not fit the code pool");
+  }
+}
+
+/**
+ * Hand out the next slab
+ *
+ * - fetch_add is the whole synchronization: each thread gets a different
+ *   range, and nothing else in the pool ever changes
+ * - relaxed is enough because the slab memory itself is not shared: the
+ *   thread that gets it is the only one writing to it
+ */
+[[nodiscard]] auto SlabPool::acquire(size_t min_size) -> CodeArena
+{
+  const auto granule = region_.granule();
+  const auto size = min_size <= slab_size_
+                        ? slab_size_
+                        : (min_size + granule - 1) & ~(granule - 1);
+  const auto offset = next_.fetch_add(size, std::memory_order_relaxed);
+  if (offset > region_.capacity() || size > region_.capacity() - offset) {
+    throw std::runtime_error("Code pool is out of memory");
+  }
+  return region_.slice(offset, size);
+}
+
+ThreadArena::ThreadArena(SlabPool& pool) : pool_{pool}, slab_{pool.acquire()}
+{
+}
+
+/**
+ * Keep using the current slab while it has room, otherwise publish it (its
+ * code stays callable) and continue in a new one
+ */
+[[nodiscard]] auto ThreadArena::reserve(size_t size, size_t alignment)
+    -> CodeArena&
+{
+  const auto start = (slab_.used() + alignment - 1) & ~(alignment - 1);
+  if (start <= slab_.capacity() && size <= slab_.capacity() - start) {
+    return slab_;
+  }
+  slab_.publish();
+  slab_ = pool_.acquire(size + alignment);
+  ++refills_;
+  return slab_;
+}
+
+auto ThreadArena::publish() -> void
+{
+  slab_.publish();
+}
+
+} // namespace mijit
@@ -0,0 +1,132 @@
+/**
+ * @file slab_pool.hpp
+ * @brief Per-thread code arenas carved out of one shared region
+ *
+ * HOW IT WORKS:
+ * 1. A SlabPool reserves one big region up front (one mmap for the process)
+ * 2. Each compiler thread owns a ThreadArena with its own bump pointer
+ * 3. A ThreadArena takes a whole slab (e.g. 256 KiB) from the pool at a
+ *    time, with ONE atomic fetch_add - no mutex, no system call
+ * 4. Inside its slab a thread allocates and seals exactly like a CodeArena
+ *
+ * WHY WE NEED THIS:
+ * - A single CodeArena is not thread-safe, and putting a mutex around it
+ *   makes every worker wait for the others on each stub
+ * - mmap and mprotect take the kernel's per-process mmap lock, so threads
+ *   calling them all the time end up waiting on each other in the kernel
+ * - With the default dual-mapped pool, installing code needs no system call
+ *   at all, so N threads emit close to N times as much code
+ *
+ * NOTE: a ThreadArena belongs to one thread. Code made by one thread and
+ * called from another must be published first and then handed over with
+ * release/acquire ordering (EntryPoint, a future, or a mutex).
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+#include "jit_memory.hpp"
+
+namespace mijit {
+
+/**
+ * SLAB POOL: hands out page-aligned slabs of one shared code region
+ *
+ * The pool only moves forward: slabs are never given back, they stay mapped
+ * (and their code callable) until the pool itself is destroyed.
+ */
+class SlabPool {
+public:
+  static constexpr size_t kDefaultSlabSize = size_t{256} << 10; // 256 KiB
+
+  /**
+   * kDualMapped by default where supported: sealing a slab then needs no
+   * mprotect, so threads never meet on the kernel's mmap lock
+   */
+  static constexpr ArenaBackend kDefaultBackend =
+      is_backend_supported(ArenaBackend::kDualMapped)
+          ? ArenaBackend::kDualMapped
+          : ArenaBackend::kMprotect;
+
+  explicit SlabPool(size_t capacity = CodeArena::kDefaultCapacity,
+                    size_t slab_size = kDefaultSlabSize,
+                    ArenaBackend backend = kDefaultBackend,
+                    HugePages huge_pages = HugePages::kNever);
+
+  SlabPool(const SlabPool&) = delete;
+  auto operator=(const SlabPool&) -> SlabPool& = delete;
+
+  /**
+   * Take a fresh slab of at least min_size bytes (lock-free, safe to call
+   * from any thread; throws when the pool is used up)
+   */
+  [[nodiscard]] auto acquire(size_t min_size = 0) -> CodeArena;
+
+  [[nodiscard]] auto slab_size() const noexcept -> size_t
+  {
+    return slab_size_;
+  }
+  [[nodiscard]] auto capacity() const noexcept -> size_t
+  {
+    return region_.capacity();
+  }
+  /**
+   * Bytes handed out so far (may be a little above capacity() after a
+   * failed acquire)
+   */
+  [[nodiscard]] auto reserved() const noexcept -> size_t
+  {
+    return next_.load(std::memory_order_relaxed);
+  }
+
+private:
+  CodeArena region_;
+  size_t slab_size_;
+  std::atomic<size_t> next_{0}; // Offset of the next free slab
+};
+
+/**
+ * THREAD ARENA: one thread's bump allocator, refilled from a SlabPool
+ *
+ * - reserve() makes sure the current slab has room, publishing it and
+ *   taking a new one when it is full
+ * - The returned CodeArena works with compile_stub() and compile_batch()
+ */
+class ThreadArena {
+public:
+  /**
+   * Takes the first slab from the pool right away
+   */
+  explicit ThreadArena(SlabPool& pool);
+
+  ThreadArena(const ThreadArena&) = delete;
+  auto operator=(const ThreadArena&) -> ThreadArena& = delete;
+
+  /**
+   * The current slab, swapped for a fresh one if fewer than size bytes
+   * (plus alignment) are left in it
+   */
+  [[nodiscard]] auto reserve(size_t size,
+                             size_t alignment = CodeArena::kDefaultAlignment)
+      -> CodeArena&;
+
+  /**
+   * Make everything this thread wrote so far executable (see
+   * CodeArena::publish)
+   */
+  auto publish() -> void;
+
+  [[nodiscard]] auto refills() const noexcept -> size_t
+  {
+    return refills_;
+  }
+
+private:
+  SlabPool& pool_;
+  CodeArena slab_;
+  size_t refills_ = 0;
+};
+
+} // namespace mijit
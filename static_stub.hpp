@@ -0,0 +1,129 @@
+/**
+ * @file static_stub.hpp
+ * @brief Greeting stubs built by the C++ compiler, linked into the binary
+ *
+ * HOW IT WORKS:
+ * 1. MIJIT_STATIC_STUB(kWorld, "Hello, World!\n"); declares a stub for a
+ *    message known at build time (at namespace scope)
+ * 2. build_static_stub() runs the same emitters (and the same
+ *    emit_write_call() as the runtime path) in a consteval function:
+ *    the result is an std::array holding the finished code and text, the
+ *    length and the RIP/PC-relative distance already patched in
+ * 3. The array is a constant placed in an executable section
+ *    (.text.mijit_stubs, or __TEXT,__mijit_stubs on macOS), so the loader
+ *    maps it with the rest of the program's code
+ * 4. as_function(kWorld.data()) is the entry point
+ *
+ * WHY WE NEED THIS:
+ * - Greetings known when the program is built need no code generation, no
+ *   arena, no mprotect and no instruction cache flush at run time: calling
+ *   one costs what calling any linked function costs
+ * - The runtime JIT stays for everything that is only known at run time
+ *
+ * NOTES:
+ * - The bytes are the same as emit_machine_code() produces for the message
+ *   with default options (uninstrumented, kUnbuffered)
+ * - A macro and not a variable template: GCC drops the section attribute
+ *   of template instantiations (they would end up in .rodata, which is not
+ *   executable)
+ * - The stub is an inline variable: one copy per program, however many
+ *   translation units include its declaration
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+#include "codegen.hpp"
+#include "emitter.hpp"
+
+#if defined(__APPLE__)
+#define MIJIT_STATIC_STUB_SECTION "__TEXT,__mijit_stubs"
+#else
+#define MIJIT_STATIC_STUB_SECTION ".text.mijit_stubs"
+#endif
+
+namespace mijit {
+
+/**
+ * A string literal as a template argument
+ */
+template <size_t N>
+struct FixedString {
+  char text[N]{};
+
+  consteval FixedString(const char (&literal)[N]) // NOLINT: implicit
+  {
+    for (size_t i = 0; i < N; ++i) {
+      text[i] = literal[i];
+    }
+  }
+
+  [[nodiscard]] static constexpr auto size() noexcept -> size_t
+  {
+    return N - 1; // Without the terminating zero
+  }
+  [[nodiscard]] constexpr auto view() const noexcept -> std::string_view
+  {
+    return std::string_view{text, N - 1};
+  }
+};
+
+/**
+ * Emit the whole greeting for text into destination; returns its size
+ */
+consteval auto emit_static_greeting(std::span<uint8_t> destination,
+                                    std::string_view text) -> size_t
+{
+  NativeEmitter emitter{destination};
+#if defined(__APPLE__) && defined(__aarch64__)
+  // APPLE SILICON: the stub only returns 0, the host prints (see main)
+  (void)text;
+  emitter.mov_imm(A64Emitter::Reg::x0, 0);
+  emitter.ret();
+#else
+  const auto label = emitter.new_label();
+  emit_write_call(emitter, text.size(), label);
+  emitter.ret();
+  emitter.bind(label);
+  emitter.emit_bytes(text);
+#endif
+  return emitter.finish();
+}
+
+/**
+ * Exact size of the stub for Message (first pass: emit into a buffer with
+ * room to spare, keep only the size)
+ */
+template <FixedString Message>
+consteval auto static_stub_size() -> size_t
+{
+  std::array<uint8_t, kMaxStubCodeSize + Message.size()> buffer{};
+  return emit_static_greeting(buffer, Message.view());
+}
+
+/**
+ * The finished stub for Message, exactly as big as it needs to be
+ */
+template <FixedString Message>
+consteval auto build_static_stub()
+    -> std::array<uint8_t, static_stub_size<Message>()>
+{
+  std::array<uint8_t, static_stub_size<Message>()> code{};
+  emit_static_greeting(code, Message.view());
+  return code;
+}
+
+} // namespace mijit
+
+/**
+ * Declare name as the finished stub of message (a string literal) in the
+ * executable section, 16-byte aligned like the stubs of a batch
+ */
+#define MIJIT_STATIC_STUB(name, message)                                     \
+  alignas(16) [[gnu::section(MIJIT_STATIC_STUB_SECTION), gnu::used]]         \
+  inline constexpr auto name = ::mijit::build_static_stub<message>()
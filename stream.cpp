@@ -0,0 +1,393 @@
+/**
+ * @file stream.cpp
+ * @brief The read / compile / run pipeline of streaming mode
+ */
+
+#include "stream.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "codegen.hpp"
+#include "jit_memory.hpp"
+#include "output_buffer.hpp"
+
+namespace mijit {
+
+namespace {
+
+/**
+ * Input bytes per batch (a batch ends at the last newline in it)
+ */
+constexpr size_t kBatchBytes = size_t{64} << 10;
+
+/**
+ * One batch of lines on its way through the pipeline
+ *
+ * storage owns the bytes of piped input (a vector, so moving the batch
+ * keeps the lines valid); mapped input leaves it empty and the lines
+ * point into the mapping.
+ */
+struct Batch {
+  std::vector<char> storage;
+  std::vector<std::string_view> lines;
+  std::vector<StubFunction> stubs; // Filled by the compile stage
+};
+
+/**
+ * Queue between two stages: push() blocks while it is full, pop() while it
+ * is empty; after close() push() refuses and pop() drains what is left
+ */
+class BatchQueue {
+public:
+  explicit BatchQueue(size_t capacity)
+      : capacity_{std::max<size_t>(1, capacity)}
+  {
+  }
+
+  /**
+   * Returns false (and drops the batch) once the queue is closed
+   */
+  auto push(Batch batch) -> bool
+  {
+    std::unique_lock lock{mutex_};
+    not_full_.wait(lock,
+                   [&] { return closed_ || batches_.size() < capacity_; });
+    if (closed_) {
+      return false;
+    }
+    batches_.push_back(std::move(batch));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  /**
+   * The next batch, or nothing once the queue is closed and empty
+   */
+  auto pop() -> std::optional<Batch>
+  {
+    std::unique_lock lock{mutex_};
+    not_empty_.wait(lock, [&] { return closed_ || !batches_.empty(); });
+    if (batches_.empty()) {
+      return std::nullopt;
+    }
+    auto batch = std::move(batches_.front());
+    batches_.pop_front();
+    not_full_.notify_one();
+    return batch;
+  }
+
+  auto close() -> void
+  {
+    const std::lock_guard lock{mutex_};
+    closed_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  std::deque<Batch> batches_;
+  size_t capacity_;
+  bool closed_ = false;
+};
+
+/**
+ * The input: an open file descriptor, memory-mapped when it is a regular
+ * file that is not empty
+ */
+class Input {
+public:
+  explicit Input(std::string_view path)
+  {
+    if (!path.empty() && path != "-") {
+      fd_ = ::open(std::string{path}.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd_ == -1) {
+        throw std::runtime_error("Failed to open " + std::string{path});
+      }
+      owns_fd_ = true;
+    }
+    struct stat info{};
+    if (fstat(fd_, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+      const auto size = static_cast<size_t>(info.st_size);
+      void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd_, 0);
+      if (data != MAP_FAILED) {
+        madvise(data, size, MADV_SEQUENTIAL);
+        mapped_ = std::string_view{static_cast<const char*>(data), size};
+      }
+    }
+  }
+
+  ~Input()
+  {
+    if (!mapped_.empty()) {
+      munmap(const_cast<char*>(mapped_.data()), mapped_.size());
+    }
+    if (owns_fd_) {
+      ::close(fd_);
+    }
+  }
+
+  Input(const Input&) = delete;
+  auto operator=(const Input&) -> Input& = delete;
+
+  [[nodiscard]] auto fd() const noexcept -> int
+  {
+    return fd_;
+  }
+  /**
+   * The whole file (empty when it is read instead)
+   */
+  [[nodiscard]] auto mapped() const noexcept -> std::string_view
+  {
+    return mapped_;
+  }
+
+private:
+  int fd_ = 0; // Standard input unless a path was given
+  bool owns_fd_ = false;
+  std::string_view mapped_;
+};
+
+/**
+ * HELPER FUNCTION: Cut text into lines, dropping a '\r' before each '\n'
+ */
+auto split_lines(std::string_view text, std::vector<std::string_view>& lines)
+    -> void
+{
+  while (!text.empty()) {
+    const auto newline = text.find('\n');
+    auto line = text.substr(0, newline);
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    lines.push_back(line);
+    text = newline == std::string_view::npos ? std::string_view{}
+                                             : text.substr(newline + 1);
+  }
+}
+
+/**
+ * STAGE 1, MAPPED: batches of about kBatchBytes, ending after a newline
+ */
+auto read_mapped(std::string_view text, BatchQueue& out) -> void
+{
+  while (!text.empty()) {
+    auto end = std::min(text.size(), kBatchBytes);
+    if (end < text.size()) {
+      const auto newline = text.find('\n', end - 1);
+      end = newline == std::string_view::npos ? text.size() : newline + 1;
+    }
+    auto batch = Batch{};
+    split_lines(text.substr(0, end), batch.lines);
+    if (!out.push(std::move(batch))) {
+      return;
+    }
+    text.remove_prefix(end);
+  }
+}
+
+/**
+ * STAGE 1, PIPED: read kBatchBytes at a time; the bytes after the last
+ * newline wait for the next read (a line longer than that just grows the
+ * buffer until its newline arrives)
+ */
+auto read_piped(int fd, BatchQueue& out) -> void
+{
+  auto buffer = std::vector<char>{};
+  for (auto eof = false; !eof;) {
+    const auto old_size = buffer.size();
+    buffer.resize(old_size + kBatchBytes);
+    auto got = ssize_t{0};
+    do {
+      got = ::read(fd, buffer.data() + old_size, kBatchBytes);
+    } while (got == -1 && errno == EINTR);
+    if (got == -1) {
+      throw std::runtime_error("Failed to read the input stream");
+    }
+    buffer.resize(old_size + static_cast<size_t>(got));
+    eof = got == 0;
+
+    const auto text = std::string_view{buffer.data(), buffer.size()};
+    const auto newline = text.rfind('\n');
+    if (!eof && newline == std::string_view::npos) {
+      continue; // No complete line yet (the buffer never keeps a newline)
+    }
+    const auto end = eof ? text.size() : newline + 1;
+
+    auto batch = Batch{};
+    batch.storage.assign(buffer.begin(),
+                         buffer.begin() + static_cast<ptrdiff_t>(end));
+    buffer.erase(buffer.begin(),
+                 buffer.begin() + static_cast<ptrdiff_t>(end));
+    split_lines(std::string_view{batch.storage.data(), batch.storage.size()},
+                batch.lines);
+    if (!batch.lines.empty() && !out.push(std::move(batch))) {
+      return;
+    }
+  }
+}
+
+/**
+ * HELPER FUNCTION: The greeting for a line, in a buffer reused per record
+ */
+auto greeting_text(std::string_view line, std::string& text)
+    -> std::string_view
+{
+  text.clear();
+  for (const auto piece : greeting_pieces(line)) {
+    text += piece;
+  }
+  return text;
+}
+
+/**
+ * HELPER FUNCTION: Run stage() on its own thread; whichever way it ends,
+ * close its output (so the next stage finishes) and its input (so the
+ * stage before it stops instead of blocking on a full queue)
+ */
+template <typename Stage>
+auto start_stage(BatchQueue* in, BatchQueue& out, std::exception_ptr& error,
+                 Stage stage) -> std::thread
+{
+  return std::thread{[in, &out, &error, stage = std::move(stage)]() mutable {
+    try {
+      stage();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    out.close();
+    if (in != nullptr) {
+      in->close();
+    }
+  }};
+}
+
+} // namespace
+
+auto run_stream(std::string_view path, const StreamOptions& options)
+    -> StreamStats
+{
+  auto stats = StreamStats{};
+  const Input input{path};
+  stats.mapped = !input.mapped().empty();
+
+  OutputBuffer output{1};
+  auto codegen = CodegenOptions{};
+  codegen.output = OutputMode::kBuffered;
+  codegen.buffer = &output;
+  // Dual-mapped: installing a stub needs no mprotect, and pages other
+  // threads are running keep their permissions
+  // An arena, not a CodeHeap: queued batches hold stub pointers without
+  // an epoch pin, so no stub may be freed before the stream ends
+  CodeArena arena{options.arena_capacity, ArenaBackend::kDualMapped};
+  StubCache cache{arena, codegen};
+
+  BatchQueue lines{options.queue_depth};
+  BatchQueue compiled{options.queue_depth};
+  std::exception_ptr read_error;
+  std::exception_ptr compile_error;
+
+  auto reader = start_stage(nullptr, lines, read_error, [&] {
+    if (!input.mapped().empty()) {
+      read_mapped(input.mapped(), lines);
+    }
+    else {
+      read_piped(input.fd(), lines);
+    }
+  });
+
+  // Counted on the compile thread, read after it is joined
+  auto compiled_count = uint64_t{0};
+  auto interpreted_count = uint64_t{0};
+  auto compiler = start_stage(&lines, compiled, compile_error, [&] {
+    auto text = std::string{};
+    while (auto batch = lines.pop()) {
+      batch->stubs.reserve(batch->lines.size());
+      for (const auto line : batch->lines) {
+        const auto greeting = greeting_text(line, text);
+        auto stub = cache.find(greeting);
+        const auto room = arena.capacity() - arena.used();
+        if (stub == nullptr &&
+            room >= machine_code_size_bound(greeting) +
+                        CodeArena::kDefaultAlignment) {
+          try {
+            stub = cache.get_or_compile(greeting);
+            ++compiled_count;
+          } catch (const std::runtime_error&) {
+            stub = nullptr; // Interpreted below, same output
+          }
+        }
+        interpreted_count += stub == nullptr ? 1 : 0;
+        batch->stubs.push_back(stub);
+      }
+      if (!compiled.push(std::move(*batch))) {
+        return;
+      }
+    }
+  });
+
+  // STAGE 3: run in input order, on this thread (the OutputBuffer is not
+  // thread-safe, and the order of the output must not change)
+  std::exception_ptr run_error;
+  try {
+    auto text = std::string{};
+    while (auto batch = compiled.pop()) {
+      // The stubs were published on the compile thread: the mutex of the
+      // queue orders the bytes, and this makes instruction fetch see them
+      // (an ISB on AArch64 when code changed, otherwise nothing)
+      sync_instruction_fetch();
+      ++stats.batches;
+      stats.records += batch->lines.size();
+      for (size_t i = 0; i < batch->lines.size(); ++i) {
+        const auto stub = batch->stubs[i];
+        if (stub != nullptr) {
+          stub();
+#if defined(__APPLE__) && defined(__aarch64__)
+          // APPLE SILICON: the stub only returns, the host prints
+          interpret_greeting(greeting_text(batch->lines[i], text), codegen);
+#endif
+        }
+        else {
+          interpret_greeting(greeting_text(batch->lines[i], text), codegen);
+        }
+      }
+    }
+  } catch (...) {
+    run_error = std::current_exception();
+  }
+  compiled.close(); // Stops the compile stage, which stops the reader
+  reader.join();
+  compiler.join();
+  output.flush();
+
+  for (const auto& error : {run_error, compile_error, read_error}) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+  stats.compiled = compiled_count;
+  stats.reused = stats.records - compiled_count - interpreted_count;
+  stats.interpreted = interpreted_count;
+  stats.write_calls = output.write_calls();
+  return stats;
+}
+
+} // namespace mijit
@@ -0,0 +1,66 @@
+/**
+ * @file stream.hpp
+ * @brief Greet every line of a stream, reading, compiling and running at
+ *        the same time
+ *
+ * HOW IT WORKS (three stages, batches of lines handed between them through
+ * bounded queues):
+ * 1. READ (its own thread): a regular file is memory-mapped and cut into
+ *    batches at line boundaries (no copy); a pipe or terminal is read in
+ *    large chunks
+ * 2. COMPILE (its own thread): each line's greeting is looked up in a
+ *    StubCache and compiled on a miss, into a dual-mapped arena, so
+ *    installing a stub costs no mprotect
+ * 3. RUN (the calling thread): the stubs are called in input order; they
+ *    are compiled in buffered mode, so a whole batch of greetings leaves in
+ *    a few large writes
+ *
+ * WHY WE NEED THIS:
+ * - One process per message pays process startup, arena setup and a first
+ *   compile every time; a stream pays them once for millions of records
+ * - While one batch runs, the next is being compiled and the one after
+ *   that read
+ *
+ * NOTES:
+ * - Output order is input order: only one thread runs stubs
+ * - Lines end at '\n' (a '\r' before it is dropped); a last line without
+ *   one still counts
+ * - When the arena is full, new messages are interpreted (same output,
+ *   host code), cached ones still run compiled
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "jit_memory.hpp"
+#include "stub_cache.hpp"
+
+namespace mijit {
+
+struct StreamOptions {
+  size_t queue_depth = 8; // Batches waiting between two stages, at most
+  // Code memory of the stream, and so also the limit of its StubCache
+  size_t arena_capacity = CodeArena::kDefaultCapacity;
+};
+
+struct StreamStats {
+  uint64_t records = 0;
+  uint64_t batches = 0;
+  uint64_t compiled = 0;    // Cache misses that were compiled
+  uint64_t reused = 0;      // Cache hits
+  uint64_t interpreted = 0; // Not compiled (arena full or compile failed)
+  uint64_t write_calls = 0; // write/writev system calls of the output
+  bool mapped = false;      // Input was memory-mapped
+};
+
+/**
+ * Greet every line of path ("-" or empty: standard input) on standard
+ * output; throws if the input cannot be read (after stopping every stage)
+ */
+auto run_stream(std::string_view path, const StreamOptions& options = {})
+    -> StreamStats;
+
+} // namespace mijit
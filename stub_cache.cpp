@@ -0,0 +1,137 @@
+/**
+ * @file stub_cache.cpp
+ * @brief LRU cache of compiled stubs
+ */
+
+#include "stub_cache.hpp"
+
+#include <iterator>
+
+#include "compiler.hpp"
+#include "jit_stats.hpp"
+
+namespace mijit {
+
+/**
+ * HELPER FUNCTION: Hash a message for the cache
+ *
+ * - FNV-1a is tiny and fast for short strings like greetings
+ * - Seeding with the platform tag means the key covers "message + platform"
+ */
+[[nodiscard]] auto stub_cache_key(std::string_view hello_name) noexcept
+    -> uint64_t
+{
+  auto hash = uint64_t{14695981039346656037ULL}; // FNV offset basis
+  hash = (hash ^ platform_tag()) * 1099511628211ULL;
+  for (const auto character : hello_name) {
+    hash ^= static_cast<uint8_t>(character);
+    hash *= 1099511628211ULL; // FNV prime
+  }
+  return hash;
+}
+
+StubCache::StubCache(CodeArena& arena, const CodegenOptions& options)
+    : arena_{&arena}, options_{options}, byte_budget_{arena.capacity()}
+{
+}
+
+StubCache::StubCache(CodeHeap& heap, size_t byte_budget,
+                     const CodegenOptions& options)
+    : heap_{&heap}, options_{options}, byte_budget_{byte_budget}
+{
+}
+
+/**
+ * Find an entry by key and confirm it really holds this message
+ */
+[[nodiscard]] auto StubCache::lookup(uint64_t key,
+                                     std::string_view hello_name) noexcept
+    -> Lru::iterator
+{
+  const auto found = index_.find(key);
+  if (found == index_.end() || found->second->message != hello_name) {
+    return lru_.end();
+  }
+  return found->second;
+}
+
+[[nodiscard]] auto StubCache::find(std::string_view hello_name) noexcept
+    -> StubFunction
+{
+  const auto entry = lookup(stub_cache_key(hello_name), hello_name);
+  if (entry == lru_.end()) {
+    return nullptr;
+  }
+  ++hits_;
+  count_jit(JitCounter::kCacheHits);
+  lru_.splice(lru_.begin(), lru_, entry); // Relink only, no allocation
+  return as_function(entry->slot.executable);
+}
+
+/**
+ * HELPER FUNCTION: Forget one stub; on a heap its slot is retired, and
+ * reused once no pinned thread can be running it
+ */
+auto StubCache::evict(Lru::iterator entry) -> void
+{
+  if (heap_ != nullptr) {
+    heap_->retire(entry->slot);
+  }
+  bytes_used_ -= entry->slot.writable.size();
+  index_.erase(entry->key);
+  lru_.erase(entry);
+  ++evictions_;
+  count_jit(JitCounter::kCacheEvictions);
+}
+
+/**
+ * Drop least recently used stubs until code_size more bytes fit the budget
+ * (never with an arena: it could not reuse their memory)
+ */
+auto StubCache::evict_until_fits(size_t code_size) -> void
+{
+  while (heap_ != nullptr && !lru_.empty() &&
+         bytes_used_ + code_size > byte_budget_) {
+    evict(std::prev(lru_.end()));
+  }
+}
+
+[[nodiscard]] auto StubCache::get_or_compile(std::string_view hello_name)
+    -> StubFunction
+{
+  if (const auto cached = find(hello_name); cached != nullptr) {
+    return cached;
+  }
+  ++misses_;
+  count_jit(JitCounter::kCacheMisses);
+
+  // MISS: emit the machine code straight into code memory (slots retired
+  // by earlier evictions first, once they are safe to reuse)
+  auto slot = CodeSlot{};
+  if (heap_ != nullptr) {
+    if (heap_->retired_slots() != 0) {
+      heap_->collect();
+    }
+    slot = compile_stub(*heap_, hello_name, options_);
+    heap_->publish(slot);
+  }
+  else {
+    slot = compile_stub(*arena_, hello_name, options_);
+    arena_->publish();
+  }
+  const auto code_size = slot.writable.size();
+
+  // A different message with the same hash gives up its place
+  const auto key = stub_cache_key(hello_name);
+  if (const auto collision = index_.find(key); collision != index_.end()) {
+    evict(collision->second);
+  }
+  evict_until_fits(code_size);
+
+  lru_.push_front(Entry{key, std::string{hello_name}, slot});
+  index_.emplace(key, lru_.begin());
+  bytes_used_ += code_size;
+  return as_function(slot.executable);
+}
+
+} // namespace mijit
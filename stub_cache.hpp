@@ -0,0 +1,136 @@
+/**
+ * @file stub_cache.hpp
+ * @brief Cache of finished executable stubs, keyed by message
+ *
+ * HOW IT WORKS:
+ * 1. Hash the message together with the platform tag
+ * 2. Look the hash up in a table of already compiled stubs
+ * 3. HIT:  move the entry to the front of the LRU list and return its
+ *          function pointer (no allocation, no system call)
+ * 4. MISS: build the machine code, copy it into code memory and remember
+ *          it; on a CodeHeap, the least recently used stubs are evicted
+ *          when over budget and their memory is reused
+ *
+ * WHY WE NEED THIS:
+ * - Real traffic repeats the same few thousand names over and over
+ * - Generating the same machine code again is wasted work
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "code_heap.hpp"
+#include "codegen.hpp"
+#include "jit_memory.hpp"
+
+namespace mijit {
+
+/**
+ * Content hash of a message (FNV-1a, seeded with the platform tag)
+ */
+[[nodiscard]] auto stub_cache_key(std::string_view hello_name) noexcept
+    -> uint64_t;
+
+/**
+ * STUB CACHE: message -> executable stub, with LRU eviction
+ *
+ * WHERE THE CODE LIVES:
+ * - CodeHeap: the byte budget counts machine code bytes of the stubs still
+ *   cached; an evicted stub is retired to the heap, which reuses its slot
+ *   once no pinned thread can still be running it
+ * - CodeArena: a bump arena cannot free single slots, so evicting would
+ *   only cost a second compile (into a new slot) when the message comes
+ *   back; nothing is evicted, the arena's capacity is the limit, and a
+ *   miss throws once it is full
+ *
+ * NOTES:
+ * - With a CodeHeap, pin the heap's EpochDomain before looking a stub up
+ *   and keep it pinned until the call returns: a pointer kept unpinned
+ *   may point at a reused slot after a later miss
+ * - Every miss publishes; give an arena ArenaBackend::kDualMapped so misses
+ *   don't each cost an mprotect and a fresh page
+ */
+class StubCache {
+public:
+  static constexpr size_t kDefaultByteBudget = size_t{1} << 20; // 1 MiB
+
+  /**
+   * Every stub in arena, none evicted (byte_budget() is the capacity)
+   */
+  explicit StubCache(CodeArena& arena, const CodegenOptions& options = {});
+
+  /**
+   * Stubs in heap, the least recently used evicted over byte_budget
+   */
+  explicit StubCache(CodeHeap& heap, size_t byte_budget = kDefaultByteBudget,
+                     const CodegenOptions& options = {});
+
+  /**
+   * Return the cached stub for a message, or nullptr on a miss
+   */
+  [[nodiscard]] auto find(std::string_view hello_name) noexcept
+      -> StubFunction;
+
+  /**
+   * Return the cached stub for a message, compiling it on a miss
+   */
+  [[nodiscard]] auto get_or_compile(std::string_view hello_name)
+      -> StubFunction;
+
+  [[nodiscard]] auto size() const noexcept -> size_t
+  {
+    return index_.size();
+  }
+  [[nodiscard]] auto bytes_used() const noexcept -> size_t
+  {
+    return bytes_used_;
+  }
+  [[nodiscard]] auto byte_budget() const noexcept -> size_t
+  {
+    return byte_budget_;
+  }
+  [[nodiscard]] auto hits() const noexcept -> uint64_t
+  {
+    return hits_;
+  }
+  [[nodiscard]] auto misses() const noexcept -> uint64_t
+  {
+    return misses_;
+  }
+  [[nodiscard]] auto evictions() const noexcept -> uint64_t
+  {
+    return evictions_;
+  }
+
+private:
+  struct Entry {
+    uint64_t key = 0;
+    std::string message; // Kept to tell hash collisions apart
+    CodeSlot slot;       // Given back to the heap on eviction
+  };
+  using Lru = std::list<Entry>; // Front = most recently used
+
+  [[nodiscard]] auto lookup(uint64_t key, std::string_view hello_name) noexcept
+      -> Lru::iterator;
+  auto evict(Lru::iterator entry) -> void;
+  auto evict_until_fits(size_t code_size) -> void;
+
+  CodeArena* arena_ = nullptr; // Exactly one of arena_ and heap_ is set
+  CodeHeap* heap_ = nullptr;
+  CodegenOptions options_; // Same for every stub in this cache
+  size_t byte_budget_;
+  size_t bytes_used_ = 0;
+  Lru lru_;
+  std::unordered_map<uint64_t, Lru::iterator> index_;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+  uint64_t evictions_ = 0;
+};
+
+} // namespace mijit
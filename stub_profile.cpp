@@ -0,0 +1,66 @@
+/**
+ * @file stub_profile.cpp
+ * @brief Counter array and tick rate
+ */
+
+#include "stub_profile.hpp"
+
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+namespace mijit {
+
+StubProfile::StubProfile(size_t stubs)
+    : counters_{std::make_unique<StubCounters[]>(stubs)}, size_{stubs}
+{
+}
+
+[[nodiscard]] auto StubProfile::at(size_t index) -> StubCounters&
+{
+  if (index >= size_) {
+    throw std::runtime_error("Stub profile index out of range");
+  }
+  return counters_[index];
+}
+
+auto StubProfile::reset() noexcept -> void
+{
+  for (size_t i = 0; i < size_; ++i) {
+    counters_[i].calls.store(0, std::memory_order_relaxed);
+    counters_[i].ticks.store(0, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * HELPER FUNCTION: The tick rate, worked out on first use
+ *
+ * - AArch64: the architecture tells us (cntfrq_el0)
+ * - x86-64: count TSC ticks over 10 ms of steady_clock
+ */
+[[nodiscard]] auto ticks_per_second() -> double
+{
+#if defined(__aarch64__)
+  auto frequency = uint64_t{0};
+  asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+  return static_cast<double>(frequency);
+#else
+  static const auto rate = [] {
+    using Clock = std::chrono::steady_clock;
+    const auto start = Clock::now();
+    const auto start_ticks = __rdtsc();
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    const auto ticks = __rdtsc() - start_ticks;
+    const auto seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    return static_cast<double>(ticks) / seconds;
+  }();
+  return rate;
+#endif
+}
+
+} // namespace mijit
@@ -0,0 +1,720 @@
+/**
+ * @file tests.cpp
+ * @brief Checks for the parts of the JIT that are easy to get wrong
+ *
+ * HOW IT WORKS:
+ * 1. Every MIJIT_TEST(name) registers one function at startup
+ * 2. main() runs them in order (or only those whose name contains the
+ *    first argument) and prints "ok" or the failed checks of each
+ * 3. CHECK() records a failure and carries on, so one run shows every
+ *    broken check; the exit code is 1 if any failed
+ *
+ * Tests are grouped by the part of the JIT they check. Emitter tests only
+ * compare bytes, so both instruction sets are checked on any host; the
+ * others run generated code on this machine.
+ *
+ * Usage: xmake run mijit_tests [name-filter]
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <initializer_list>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "call_site.hpp"
+#include "code_cache_file.hpp"
+#include "code_heap.hpp"
+#include "codegen.hpp"
+#include "compiler.hpp"
+#include "emitter.hpp"
+#include "epoch.hpp"
+#include "ir.hpp"
+#include "jit_memory.hpp"
+#include "jit_service.hpp"
+#include "jit_stats.hpp"
+#include "output_buffer.hpp"
+#include "slab_pool.hpp"
+#include "stream.hpp"
+#include "stub_cache.hpp"
+#include "uring_output.hpp"
+
+namespace {
+
+struct TestCase {
+  std::string_view name;
+  std::function<void()> run;
+};
+
+[[nodiscard]] auto test_cases() -> std::vector<TestCase>&
+{
+  static std::vector<TestCase> cases;
+  return cases;
+}
+
+struct Registration {
+  Registration(std::string_view name, std::function<void()> run)
+  {
+    test_cases().push_back(TestCase{name, std::move(run)});
+  }
+};
+
+auto failures = 0; // Failed checks of the running test
+
+auto check(bool passed, const char* expression, int line) -> void
+{
+  if (!passed) {
+    std::printf("  line %d: CHECK(%s) failed\n", line, expression);
+    ++failures;
+  }
+}
+
+} // namespace
+
+#define CHECK(expression) check(static_cast<bool>(expression), #expression, \
+                                __LINE__)
+#define MIJIT_TEST(name)                                                     \
+  static auto name() -> void;                                                \
+  static const Registration name##_registration{#name, name};                \
+  static auto name() -> void
+
+namespace {
+
+using namespace mijit;
+
+// STUB CACHE
+
+MIJIT_TEST(stub_cache_evicts_least_recently_used)
+{
+  EpochDomain epochs;
+  CodeHeap heap{epochs, size_t{1} << 20};
+  StubCache probe{heap};
+  (void)probe.get_or_compile("aaaa");
+  (void)probe.get_or_compile("bbbb");
+  const auto two_stubs = probe.bytes_used(); // Same length, same size
+
+  StubCache cache{heap, two_stubs};
+  const auto a = cache.get_or_compile("aaaa");
+  (void)cache.get_or_compile("bbbb");
+  CHECK(cache.find("aaaa") == a); // a is now the most recent
+  (void)cache.get_or_compile("cccc");
+  CHECK(cache.evictions() == 1);
+  CHECK(cache.find("bbbb") == nullptr);
+  CHECK(cache.find("aaaa") == a);
+  CHECK(cache.find("cccc") != nullptr);
+  CHECK(cache.bytes_used() <= cache.byte_budget());
+  CHECK(cache.hits() == 3 && cache.misses() == 3);
+}
+
+MIJIT_TEST(stub_cache_reuses_evicted_slots)
+{
+  EpochDomain epochs;
+  CodeHeap heap{epochs, size_t{1} << 20};
+  StubCache cache{heap, 256};
+  for (auto i = 0; i < 2000; ++i) {
+    (void)cache.get_or_compile("name" + std::to_string(i));
+  }
+  CHECK(cache.evictions() > 1900);
+  CHECK(heap.resident_pages() <= 2);
+}
+
+MIJIT_TEST(stub_cache_on_an_arena_never_evicts)
+{
+  CodeArena arena{size_t{1} << 16, ArenaBackend::kDualMapped};
+  StubCache cache{arena};
+  for (auto i = 0; i < 100; ++i) {
+    (void)cache.get_or_compile("name" + std::to_string(i));
+  }
+  CHECK(cache.size() == 100);
+  CHECK(cache.evictions() == 0);
+  CHECK(cache.byte_budget() == arena.capacity());
+}
+
+// EMITTERS
+
+/**
+ * HELPER FUNCTION: The emitted bytes equal the given ones
+ */
+[[nodiscard]] auto bytes_are(std::span<const uint8_t> code,
+                             std::initializer_list<uint8_t> expected) -> bool
+{
+  return code.size() == expected.size() &&
+         std::equal(code.begin(), code.end(), expected.begin());
+}
+
+/**
+ * HELPER FUNCTION: The little-endian 32-bit word at index
+ */
+[[nodiscard]] auto word_at(std::span<const uint8_t> code, size_t index)
+    -> uint32_t
+{
+  auto word = uint32_t{0};
+  std::memcpy(&word, code.data() + 4 * index, 4);
+  return word;
+}
+
+MIJIT_TEST(x86_mov_imm_picks_the_shortest_encoding)
+{
+  using Reg = X86Emitter::Reg;
+  const auto encode = [](Reg reg, uint64_t value) {
+    auto buffer = std::vector<uint8_t>(16);
+    X86Emitter emitter{buffer};
+    emitter.mov_imm(reg, value);
+    buffer.resize(emitter.finish());
+    return buffer;
+  };
+  CHECK(bytes_are(encode(Reg::rax, 0), {0x31, 0xC0}));
+  CHECK(bytes_are(encode(Reg::rdi, 1), {0xBF, 0x01, 0x00, 0x00, 0x00}));
+  CHECK(bytes_are(encode(Reg::r8, 1), {0x41, 0xB8, 0x01, 0x00, 0x00, 0x00}));
+  CHECK(bytes_are(encode(Reg::rax, UINT64_MAX),
+                  {0x48, 0xC7, 0xC0, 0xFF, 0xFF, 0xFF, 0xFF}));
+  CHECK(bytes_are(encode(Reg::rax, 0x1122334455667788),
+                  {0x48, 0xB8, 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22,
+                   0x11}));
+}
+
+MIJIT_TEST(x86_rip_relative_fixups)
+{
+  using Reg = X86Emitter::Reg;
+  auto buffer = std::vector<uint8_t>(32);
+  X86Emitter emitter{buffer};
+  const auto back = emitter.new_label();
+  const auto ahead = emitter.new_label();
+  emitter.bind(back);
+  emitter.lea_rip(Reg::rsi, ahead); // +0: 48 8D 35 rel32, ends at +7
+  emitter.ret();                    // +7
+  emitter.bind(ahead);              // +8
+  emitter.lea_rip(Reg::rdi, back);  // +8: 48 8D 3D rel32, ends at +15
+  emitter.syscall();                // +15
+  buffer.resize(emitter.finish());
+  CHECK(bytes_are(buffer, {0x48, 0x8D, 0x35, 0x01, 0x00, 0x00, 0x00, 0xC3,
+                           0x48, 0x8D, 0x3D, 0xF1, 0xFF, 0xFF, 0xFF,
+                           0x0F, 0x05}));
+}
+
+MIJIT_TEST(a64_adr_fixups)
+{
+  using Reg = A64Emitter::Reg;
+  auto buffer = std::vector<uint8_t>(32);
+  A64Emitter emitter{buffer};
+  const auto back = emitter.new_label();
+  const auto ahead = emitter.new_label();
+  emitter.bind(back);
+  emitter.adr(Reg::x1, ahead); // 0: two words ahead
+  emitter.svc(0);              // 1
+  emitter.bind(ahead);
+  emitter.adr(Reg::x2, back);  // 2: two words back
+  emitter.ret();               // 3
+  CHECK(emitter.finish() == 16);
+  CHECK(word_at(buffer, 0) == 0x10000041);
+  CHECK(word_at(buffer, 1) == 0xD4000001);
+  CHECK(word_at(buffer, 2) == 0x10FFFFC2);
+  CHECK(word_at(buffer, 3) == 0xD65F03C0);
+}
+
+MIJIT_TEST(a64_adr_out_of_range_throws)
+{
+  constexpr auto kRange = size_t{1} << 20; // adr reaches +/-1 MiB
+  auto buffer = std::vector<uint8_t>(kRange + 8);
+  A64Emitter emitter{buffer};
+  const auto far = emitter.new_label();
+  emitter.adr(A64Emitter::Reg::x1, far);
+  emitter.emit_bytes(std::string(kRange - 4, '\0'));
+  emitter.bind(far); // Exactly 1 MiB after the adr: one byte too far
+  auto threw = false;
+  try {
+    (void)emitter.finish();
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+MIJIT_TEST(x86_jumps_reach_their_labels)
+{
+  auto buffer = std::vector<uint8_t>(32);
+  X86Emitter emitter{buffer};
+  const auto back = emitter.new_label();
+  const auto ahead = emitter.new_label();
+  emitter.bind(back);
+  emitter.jmp(ahead);  // +0: E9 rel32, ends at +5
+  emitter.ret();       // +5
+  emitter.bind(ahead); // +6
+  emitter.jnz(back);   // +6: 0F 85 rel32, ends at +12
+  buffer.resize(emitter.finish());
+  CHECK(bytes_are(buffer, {0xE9, 0x01, 0x00, 0x00, 0x00, 0xC3,
+                           0x0F, 0x85, 0xF4, 0xFF, 0xFF, 0xFF}));
+}
+
+MIJIT_TEST(a64_branches_reach_their_labels)
+{
+  using Reg = A64Emitter::Reg;
+  auto buffer = std::vector<uint8_t>(32);
+  A64Emitter emitter{buffer};
+  const auto back = emitter.new_label();
+  const auto ahead = emitter.new_label();
+  emitter.bind(back);
+  emitter.b(ahead);                  // 0: two words ahead
+  emitter.svc(0);                    // 1
+  emitter.bind(ahead);
+  emitter.mov_reg(Reg::x1, Reg::x2); // 2
+  emitter.b(back);                   // 3: three words back
+  CHECK(emitter.finish() == 16);
+  CHECK(word_at(buffer, 0) == 0x14000002);
+  CHECK(word_at(buffer, 2) == 0xAA0203E1);
+  CHECK(word_at(buffer, 3) == 0x17FFFFFD);
+}
+
+MIJIT_TEST(a64_branch_out_of_range_throws)
+{
+  using Kind = EmitterBase::FixupKind;
+  constexpr auto kB = uint32_t{0x14000000};
+  constexpr auto kRange = int64_t{1} << 27; // b reaches +/-128 MiB
+  CHECK(A64Emitter::with_pc_offset(kB, Kind::kBranch26, -kRange) ==
+        0x16000000);
+  auto threw = false;
+  try {
+    (void)A64Emitter::with_pc_offset(kB, Kind::kBranch26, kRange);
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+// STUBS
+
+/**
+ * HELPER FUNCTION: Everything run() writes to standard output (stubs
+ * write to fd 1 with a system call, so the descriptor itself is swapped)
+ */
+[[nodiscard]] auto capture_stdout(const std::function<void()>& run)
+    -> std::string
+{
+  std::fflush(stdout);
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return {};
+  }
+  const int saved = dup(1);
+  dup2(fds[1], 1);
+  run();
+  dup2(saved, 1);
+  close(saved);
+  close(fds[1]);
+  auto text = std::string{};
+  char buffer[256];
+  for (auto n = read(fds[0], buffer, sizeof(buffer)); n > 0;
+       n = read(fds[0], buffer, sizeof(buffer))) {
+    text.append(buffer, static_cast<size_t>(n));
+  }
+  close(fds[0]);
+  return text;
+}
+
+#if !defined(__APPLE__) || !defined(__aarch64__) // Apple: stubs only return
+MIJIT_TEST(stub_prints_its_message)
+{
+  CodeArena arena{size_t{1} << 16, ArenaBackend::kDualMapped};
+  const auto slot = compile_stub(arena, greeting_pieces("Stub"));
+  arena.publish();
+  const auto stub = as_function(slot.executable);
+  CHECK(capture_stdout([&] { stub(); }) == "Hello, Stub!\n");
+}
+#endif
+
+// BATCHES
+
+#if !defined(__APPLE__) || !defined(__aarch64__)
+MIJIT_TEST(split_batch_publishes_earlier_stubs_too)
+{
+  CodeArena arena{size_t{1} << 20, ArenaBackend::kDualMapped};
+  const auto before = jit_stats();
+  const auto single = compile_stub(arena, "Hello, Single!\n"); // Unpublished
+  const std::string_view messages[] = {"Hello, One!\n", "Hello, Two!\n"};
+  const auto entries = compile_batch(arena, messages, {}, BatchLayout::kSplit);
+  const auto flushed = (jit_stats() - before)[JitCounter::kIcacheBytes];
+  CHECK(flushed == arena.used()); // The single stub and the whole batch
+  const auto text = capture_stdout([&] {
+    as_function(single.executable)();
+    entries[0]();
+    entries[1]();
+  });
+  CHECK(text == "Hello, Single!\nHello, One!\nHello, Two!\n");
+}
+#endif
+
+// OUTPUT
+
+MIJIT_TEST(output_buffer_keeps_order_across_flushes)
+{
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+  auto expected = std::string{};
+  {
+    OutputBuffer buffer{fds[1], 16};
+    for (auto i = 0; i < 20; ++i) {
+      const auto text = std::to_string(i) + ",";
+      buffer.append(text.data(), text.size());
+      expected += text;
+    }
+    const auto big = std::string(40, 'x'); // Bigger than the buffer
+    buffer.append(big.data(), big.size());
+    expected += big;
+    CHECK(buffer.write_calls() < 20);
+  } // Destructor flushes
+  close(fds[1]);
+  auto text = std::string{};
+  char chunk[128];
+  for (auto n = read(fds[0], chunk, sizeof(chunk)); n > 0;
+       n = read(fds[0], chunk, sizeof(chunk))) {
+    text.append(chunk, static_cast<size_t>(n));
+  }
+  close(fds[0]);
+  CHECK(text == expected);
+}
+
+MIJIT_TEST(uring_output_keeps_order_with_a_full_ring)
+{
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+  auto texts = std::vector<std::string>{}; // Must outlive the writes
+  auto expected = std::string{};
+  for (auto i = 0; i < 100; ++i) {
+    texts.push_back(std::to_string(i) + ",");
+    expected += texts.back();
+  }
+  {
+    UringOutput output{fds[1], 8}; // Fills up many times over
+    for (const auto& text : texts) {
+      output.write(text.data(), text.size());
+    }
+    output.flush();
+  }
+  close(fds[1]);
+  auto text = std::string{};
+  char chunk[128];
+  for (auto n = read(fds[0], chunk, sizeof(chunk)); n > 0;
+       n = read(fds[0], chunk, sizeof(chunk))) {
+    text.append(chunk, static_cast<size_t>(n));
+  }
+  close(fds[0]);
+  CHECK(text == expected);
+}
+
+// BACKGROUND COMPILATION
+
+#if !defined(__APPLE__) || !defined(__aarch64__)
+MIJIT_TEST(jit_service_runs_stubs_compiled_by_workers)
+{
+  JitService service{3};
+  CHECK(service.workers() == 3);
+  auto stubs = std::vector<std::shared_future<StubFunction>>{};
+  auto messages = std::vector<std::string>{};
+  for (auto i = 0; i < 10; ++i) {
+    messages.push_back("Hello, Worker " + std::to_string(i) + "!\n");
+    stubs.push_back(service.submit(messages.back()));
+  }
+  for (size_t i = 0; i < stubs.size(); ++i) {
+    stubs[i].wait();
+    auto ran = false;
+    const auto text = capture_stdout(
+        [&] { ran = run_or_interpret(stubs[i], messages[i]); });
+    CHECK(ran);
+    CHECK(text == messages[i]);
+  }
+}
+#endif
+
+MIJIT_TEST(jit_service_needs_a_slab_per_worker)
+{
+  auto threw = false;
+  try {
+    const JitService service{8, {}, 4 * SlabPool::kDefaultSlabSize};
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+// RECLAMATION
+
+MIJIT_TEST(epoch_waits_for_pinned_threads)
+{
+  EpochDomain epochs;
+  EpochDomain::Participant reader{epochs};
+  const auto retired = epochs.current();
+  {
+    const auto guard = reader.pin();
+    CHECK(epochs.try_advance());  // The reader has seen this epoch
+    CHECK(!epochs.try_advance()); // ... but not the next one
+    CHECK(!epochs.is_safe(retired));
+  }
+  CHECK(epochs.try_advance()); // Unpinned: nothing holds the epoch back
+  CHECK(epochs.is_safe(retired));
+}
+
+MIJIT_TEST(code_heap_reuses_slots_after_the_grace_period)
+{
+  EpochDomain epochs;
+  CodeHeap heap{epochs, size_t{1} << 20};
+  const auto first = heap.allocate(100);
+  heap.retire(first);
+  {
+    EpochDomain::Participant reader{epochs};
+    const auto guard = reader.pin();
+    (void)heap.collect();
+    (void)heap.collect();
+    CHECK(heap.retired_slots() == 1); // A pinned reader may still run it
+  }
+  (void)heap.collect();
+  (void)heap.collect();
+  CHECK(heap.retired_slots() == 0);
+  CHECK(heap.live_bytes() == 0);
+
+  // The emptied page is released and handed out again
+  const auto second = heap.allocate(100);
+  CHECK(second.executable == first.executable);
+
+  // Pages of a multi-page slot come back as single pages
+  const auto page = jit_memory_info().page_size;
+  const auto large = heap.allocate(2 * page);
+  heap.retire(large);
+  (void)heap.collect();
+  (void)heap.collect();
+  (void)heap.collect();
+  CHECK(heap.released_pages() >= 3);
+  const auto reused = heap.allocate(page);
+  CHECK(reused.executable >= large.executable &&
+        reused.executable < large.executable + 2 * page);
+}
+
+MIJIT_TEST(epoch_nested_pins_keep_the_outer_pin)
+{
+  EpochDomain epochs;
+  EpochDomain::Participant reader{epochs};
+  const auto outer = reader.pin();
+  {
+    const auto inner = reader.pin();
+  }
+  CHECK(epochs.try_advance());
+  CHECK(!epochs.try_advance()); // Still pinned by outer
+}
+
+// CODE CACHE FILES
+
+/**
+ * HELPER FUNCTION: A fresh temporary file name
+ */
+[[nodiscard]] auto temp_path() -> std::string
+{
+  char path[] = "/tmp/mijit-test-XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd != -1) {
+    close(fd);
+  }
+  return path;
+}
+
+/**
+ * HELPER FUNCTION: Change one byte of a file at offset
+ */
+auto patch_byte(const std::string& path, off_t offset) -> void
+{
+  const int fd = open(path.c_str(), O_RDWR);
+  auto byte = uint8_t{0};
+  if (pread(fd, &byte, 1, offset) == 1) {
+    byte ^= 0x5A;
+    (void)pwrite(fd, &byte, 1, offset);
+  }
+  close(fd);
+}
+
+MIJIT_TEST(code_cache_round_trip)
+{
+  const auto path = temp_path();
+  const std::string_view messages[] = {"Hello, One!\n", "Hello, Two!\n"};
+  write_code_cache(path, messages);
+  const auto cache = CodeCacheFile::try_open(path);
+  CHECK(cache.has_value());
+  if (cache) {
+    CHECK(cache->size() == 2);
+    CHECK(cache->find("Hello, One!\n") != nullptr);
+    CHECK(cache->find("Hello, Two!\n") != nullptr);
+    CHECK(cache->find("Hello, Three!\n") == nullptr);
+#if !defined(__APPLE__) || !defined(__aarch64__)
+    const auto stub = as_function(cache->find("Hello, Two!\n"));
+    CHECK(capture_stdout([&] { stub(); }) == "Hello, Two!\n");
+#endif
+  }
+  unlink(path.c_str());
+}
+
+MIJIT_TEST(code_cache_rejects_damaged_files)
+{
+  const std::string_view messages[] = {"Hello, Damaged!\n"};
+  const auto path = temp_path();
+
+  write_code_cache(path, messages);
+  patch_byte(path, 0); // Magic
+  CHECK(!CodeCacheFile::try_open(path).has_value());
+
+  write_code_cache(path, messages);
+  patch_byte(path, sizeof(CodeCacheHeader) + 1); // Covered by the hash
+  CHECK(!CodeCacheFile::try_open(path).has_value());
+
+  write_code_cache(path, messages);
+  CHECK(truncate(path.c_str(), sizeof(CodeCacheHeader) + 8) == 0);
+  CHECK(!CodeCacheFile::try_open(path).has_value());
+
+  unlink(path.c_str());
+  CHECK(!CodeCacheFile::try_open(path).has_value()); // Missing
+}
+
+// IR
+
+[[nodiscard]] auto count_ops(const ir::Function& function, ir::Op op)
+    -> size_t
+{
+  auto count = size_t{0};
+  for (const auto& instruction : function.instructions()) {
+    count += instruction.op == op ? 1 : 0;
+  }
+  return count;
+}
+
+MIJIT_TEST(ir_coalesces_adjacent_writes_into_one)
+{
+  const auto pieces = greeting_pieces("Tests");
+  auto function = ir::greeting_function(pieces);
+  CHECK(count_ops(function, ir::Op::kSyscall) == 3);
+  const auto stats = ir::optimize(function);
+  CHECK(stats.coalesced == 2);
+  CHECK(count_ops(function, ir::Op::kSyscall) == 1);
+}
+
+MIJIT_TEST(ir_folds_constants_and_branches)
+{
+  auto function = ir::Function{};
+  const auto skip = function.new_target();
+  const auto sum = function.add(function.constant(2), function.constant(3));
+  function.branch_non_zero(function.constant(1), skip);
+  function.ret(function.constant(99)); // Never reached
+  function.bind(skip);
+  function.ret(sum);
+  const auto stats = ir::optimize(function);
+  CHECK(stats.folded >= 2);
+  CHECK(count_ops(function, ir::Op::kAdd) == 0);
+  CHECK(count_ops(function, ir::Op::kBranchNonZero) == 0);
+
+  CodeArena arena{size_t{1} << 16};
+  const auto slot = compile_function(arena, function);
+  arena.publish();
+  const auto run = reinterpret_cast<int64_t (*)()>(slot.executable);
+  CHECK(run() == 5);
+}
+
+MIJIT_TEST(ir_write_function_round_trip)
+{
+  auto function = ir::write_function();
+  (void)ir::optimize(function);
+  CodeArena arena{size_t{1} << 16};
+  const auto slot = compile_function(arena, function);
+  arena.publish();
+  const auto write = reinterpret_cast<int64_t (*)(const char*, size_t, int)>(
+      slot.executable);
+
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+  constexpr auto kText = std::string_view{"written by generated code\n"};
+  CHECK(write(kText.data(), kText.size(), fds[1]) ==
+        static_cast<int64_t>(kText.size()));
+  close(fds[1]);
+  char buffer[64] = {};
+  const auto n = read(fds[0], buffer, sizeof(buffer));
+  close(fds[0]);
+  CHECK(std::string_view(buffer, n > 0 ? static_cast<size_t>(n) : 0) ==
+        kText);
+}
+
+// STREAMING
+
+MIJIT_TEST(stream_greets_every_line_in_order)
+{
+  const auto path = temp_path();
+  {
+    const int fd = open(path.c_str(), O_WRONLY | O_TRUNC);
+    constexpr auto kInput = std::string_view{"Ann\nBob\nAnn\r\nlast"};
+    CHECK(::write(fd, kInput.data(), kInput.size()) ==
+          static_cast<ssize_t>(kInput.size()));
+    close(fd);
+  }
+  auto stats = StreamStats{};
+  const auto text = capture_stdout([&] { stats = run_stream(path); });
+  CHECK(text == "Hello, Ann!\nHello, Bob!\nHello, Ann!\nHello, last!\n");
+  CHECK(stats.records == 4);
+  CHECK(stats.compiled + stats.interpreted == 3);
+  CHECK(stats.reused == 1);
+  unlink(path.c_str());
+}
+
+// CALL SITES
+
+auto return_one() -> int
+{
+  return 1;
+}
+auto return_two() -> int
+{
+  return 2;
+}
+
+MIJIT_TEST(call_site_retarget)
+{
+  TrampolineTable table{4};
+  auto site = table.add(reinterpret_cast<const void*>(&return_one));
+  const auto call = site.as<int (*)()>();
+  CHECK(call() == 1);
+  site.retarget(reinterpret_cast<const void*>(&return_two));
+  CHECK(call() == 2);
+  CHECK(site.target() == reinterpret_cast<const void*>(&return_two));
+  CHECK(site.entry() == reinterpret_cast<const uint8_t*>(call));
+}
+
+} // namespace
+
+auto main(int argc, char** argv) -> int
+{
+  const auto filter = argc > 1 ? std::string_view{argv[1]} : "";
+  auto run = 0;
+  auto failed = 0;
+  for (const auto& test : test_cases()) {
+    if (test.name.find(filter) == std::string_view::npos) {
+      continue;
+    }
+    failures = 0;
+    try {
+      test.run();
+    } catch (const std::exception& e) {
+      std::printf("  threw: %s\n", e.what());
+      ++failures;
+    }
+    std::printf("%s %.*s\n", failures == 0 ? "ok  " : "FAIL",
+                static_cast<int>(test.name.size()), test.name.data());
+    ++run;
+    failed += failures == 0 ? 0 : 1;
+  }
+  std::printf("%d tests, %d failed\n", run, failed);
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
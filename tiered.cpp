@@ -0,0 +1,307 @@
+/**
+ * @file tiered.cpp
+ * @brief Call counting, promotion and the switch to compiled code
+ */
+
+#include "tiered.hpp"
+
+#include <chrono>
+#include <exception>
+#include <type_traits>
+
+#include "compiler.hpp"
+#include "emitter.hpp"
+#include "jit_service.hpp"
+
+namespace mijit {
+
+namespace {
+
+using StubResult = std::invoke_result_t<StubFunction>;
+
+/**
+ * HELPER FUNCTION: Where every thunk goes - call() for the runtime and
+ * function the thunk passes in
+ */
+auto call_from_site(TieredRuntime* runtime, TieredFunction* function)
+    -> StubResult
+{
+  runtime->call(*function);
+  return StubResult(); // 0 where stubs return int (Apple Silicon)
+}
+
+/**
+ * HELPER FUNCTION: A thunk for one function: call_from_site(runtime,
+ * function) as a tail call (the thunk has no frame, so call_from_site
+ * returns straight to whoever called the call site)
+ */
+[[nodiscard]] auto emit_thunk(CodeArena& arena, TieredRuntime* runtime,
+                              TieredFunction* function) -> const uint8_t*
+{
+  auto slot = arena.allocate(kMaxStubCodeSize, kStubAlignment);
+  NativeEmitter emitter{slot.writable};
+  const auto target = reinterpret_cast<uint64_t>(&call_from_site);
+#if defined(__x86_64__)
+  using Reg = X86Emitter::Reg;
+  emitter.mov_imm(Reg::rdi, reinterpret_cast<uint64_t>(runtime));
+  emitter.mov_imm(Reg::rsi, reinterpret_cast<uint64_t>(function));
+  emitter.mov_imm(Reg::rax, target);
+  emitter.jmp_reg(Reg::rax);
+#elif defined(__aarch64__)
+  using Reg = A64Emitter::Reg;
+  emitter.mov_imm(Reg::x0, reinterpret_cast<uint64_t>(runtime));
+  emitter.mov_imm(Reg::x1, reinterpret_cast<uint64_t>(function));
+  emitter.mov_imm(Reg::x16, target);
+  emitter.br(Reg::x16);
+#endif
+  arena.trim(slot, emitter.finish());
+  arena.publish();
+  return slot.executable;
+}
+
+/**
+ * HELPER FUNCTION: Dual-mapped where possible (every promotion publishes)
+ */
+
+[[nodiscard]] auto arena_backend() noexcept -> ArenaBackend
+{
+  return is_backend_supported(ArenaBackend::kDualMapped)
+             ? ArenaBackend::kDualMapped
+             : ArenaBackend::kMprotect;
+}
+
+} // namespace
+
+TieredRuntime::TieredRuntime(uint64_t threshold, const CodegenOptions& options,
+                             JitService* service, size_t capacity,
+                             NumaPlacement placement)
+    : threshold_{threshold},
+      options_{service != nullptr ? service->options() : options},
+      service_{service},
+      capacity_{capacity},
+      node_local_{placement == NumaPlacement::kNodeLocal &&
+                  numa_node_count() > 1}
+{
+}
+
+[[nodiscard]] auto TieredRuntime::define(std::string hello_name)
+    -> TieredFunction&
+{
+  const std::lock_guard lock{mutex_};
+  auto& function = functions_.emplace_back(std::move(hello_name));
+  if (node_local_) {
+    function.local_ =
+        std::make_unique<EntryPoint<StubFunction>[]>(numa_node_count());
+  }
+  return function;
+}
+
+/**
+ * STEP BY STEP:
+ * 1. Tier 1 already: call the stub
+ * 2. Otherwise count the call; the call that reaches the threshold
+ *    promotes, later ones check whether a background compile finished
+ * 3. Interpret if there is still no stub
+ * 4. With node-local copies, swap in the copy of this thread's node
+ */
+auto TieredRuntime::call(TieredFunction& function) -> void
+{
+  auto native = function.native_.load();
+  if (native == nullptr) {
+    const auto calls =
+        function.calls_.fetch_add(1, std::memory_order_relaxed);
+    if (calls == threshold_) {
+      promote(function);
+    }
+    else if (calls > threshold_) {
+      poll(function);
+    }
+    native = function.native_.load();
+    if (native == nullptr) {
+      interpret_greeting(function.hello_name_, options_);
+      return;
+    }
+  }
+  if (function.local_ != nullptr) {
+    native = local_copy(function, native);
+  }
+  native();
+#if defined(__APPLE__) && defined(__aarch64__)
+  interpret_greeting(function.hello_name_, options_); // Host prints (main)
+#endif
+}
+
+/**
+ * HELPER FUNCTION: Compile a function that just got hot
+ *
+ * - With a JitService: submit and return at once (poll() picks the stub
+ *   up when it is ready)
+ * - Without: compile into the runtime's own arena (reserved now, on the
+ *   first promotion) and switch the entry point; node-local, that is the
+ *   arena of this thread's node, and the stub is also this node's copy
+ */
+auto TieredRuntime::promote(TieredFunction& function) -> void
+{
+  using State = TieredFunction::State;
+  if (service_ != nullptr) {
+    try {
+      function.pending_ = service_->submit(function.hello_name_);
+    } catch (const std::exception&) {
+      function.state_.store(State::kFailed, std::memory_order_relaxed);
+      return;
+    }
+    function.state_.store(State::kCompiling, std::memory_order_release);
+    return;
+  }
+
+  try {
+    const std::lock_guard lock{mutex_};
+    const auto node = current_numa_node();
+    auto& arena = node_local_ ? node_arena(node) : code_arena();
+    const auto slot = compile_stub(arena, function.hello_name_, options_);
+    arena.publish();
+    const auto native = as_function(slot.executable);
+    if (function.local_ != nullptr) {
+      function.local_[node].store(native);
+    }
+    function.native_.store(native);
+    function.state_.store(State::kPromoted, std::memory_order_relaxed);
+    retarget_site(function, native);
+  } catch (const std::exception&) {
+    function.state_.store(State::kFailed, std::memory_order_relaxed);
+    return;
+  }
+  promotions_.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * HELPER FUNCTION: Switch to the background-compiled stub once it is ready
+ * (never waits; of the threads that find it ready, the one that moves the
+ * state from kCompiling to kPromoted installs it, the others return)
+ */
+auto TieredRuntime::poll(TieredFunction& function) -> void
+{
+  using State = TieredFunction::State;
+  if (function.state_.load(std::memory_order_acquire) != State::kCompiling) {
+    return;
+  }
+  const auto& pending = function.pending_;
+  if (pending.wait_for(std::chrono::seconds{0}) !=
+      std::future_status::ready) {
+    return;
+  }
+  auto native = StubFunction{nullptr};
+  try {
+    native = pending.get();
+  } catch (const std::exception&) {
+    function.state_.store(State::kFailed, std::memory_order_relaxed);
+    return;
+  }
+  auto expected = State::kCompiling;
+  if (!function.state_.compare_exchange_strong(expected, State::kPromoted,
+                                               std::memory_order_acq_rel)) {
+    return; // Another thread installed it
+  }
+  function.native_.store(native);
+  promotions_.fetch_add(1, std::memory_order_relaxed);
+  const std::lock_guard lock{mutex_};
+  retarget_site(function, native);
+}
+
+[[nodiscard]] auto TieredRuntime::entry(TieredFunction& function)
+    -> StubFunction
+{
+  const std::lock_guard lock{mutex_};
+  if (!function.site_.valid()) {
+    if (!sites_) {
+      sites_.emplace();
+    }
+    const void* target = nullptr;
+#if !defined(__APPLE__) || !defined(__aarch64__)
+    target = reinterpret_cast<const void*>(function.native_.load());
+#endif
+    if (target == nullptr) { // Not promoted yet
+      target = emit_thunk(code_arena(), this, &function);
+    }
+    function.site_ = sites_->add(target);
+  }
+  return function.site_.as<StubFunction>();
+}
+
+/**
+ * HELPER FUNCTION: The code arena, reserved on first use (call with
+ * mutex_ held)
+ */
+[[nodiscard]] auto TieredRuntime::code_arena() -> CodeArena&
+{
+  if (!arena_) {
+    arena_.emplace(capacity_, arena_backend());
+  }
+  return *arena_;
+}
+
+/**
+ * HELPER FUNCTION: The arena bound to one NUMA node, all of them reserved
+ * on first use (call with mutex_ held)
+ */
+[[nodiscard]] auto TieredRuntime::node_arena(unsigned node) -> CodeArena&
+{
+  if (!node_arenas_) {
+    node_arenas_.emplace(capacity_, arena_backend());
+  }
+  return node_arenas_->arena(node);
+}
+
+/**
+ * HELPER FUNCTION: The copy of a promoted function for the node this
+ * thread runs on
+ *
+ * STEP BY STEP:
+ * 1. Already there: one acquire load (the common case)
+ * 2. First call from this node: compile the stub into the node's arena,
+ *    under the lock, and publish it for the other threads of the node
+ * 3. If that fails, the node keeps using native, the copy everyone had
+ */
+[[nodiscard]] auto TieredRuntime::local_copy(TieredFunction& function,
+                                             StubFunction native)
+    -> StubFunction
+{
+  const auto node = current_numa_node();
+  auto& local = function.local_[node];
+  if (const auto copy = local.load(); copy != nullptr) {
+    return copy;
+  }
+  const std::lock_guard lock{mutex_};
+  if (const auto copy = local.load(); copy != nullptr) {
+    return copy; // Another thread of this node was first
+  }
+  auto copy = native;
+  try {
+    auto& arena = node_arena(node);
+    const auto slot = compile_stub(arena, function.hello_name_, options_);
+    arena.publish();
+    copy = as_function(slot.executable);
+    replicas_.fetch_add(1, std::memory_order_relaxed);
+  } catch (const std::exception&) {
+    // Node arena full: this node keeps running the shared copy
+  }
+  local.store(copy);
+  return copy;
+}
+
+/**
+ * HELPER FUNCTION: Point a promoted function's call site, if it has one,
+ * at its stub (call with mutex_ held)
+ */
+auto TieredRuntime::retarget_site([[maybe_unused]] TieredFunction& function,
+                                  [[maybe_unused]] StubFunction native)
+    -> void
+{
+#if !defined(__APPLE__) || !defined(__aarch64__) // Apple: stays on the thunk
+  if (function.site_.valid()) {
+    function.site_.retarget(reinterpret_cast<const void*>(native));
+  }
+#endif
+}
+
+} // namespace mijit
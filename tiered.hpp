@@ -0,0 +1,212 @@
+/**
+ * @file tiered.hpp
+ * @brief Run functions in host code first, compile the ones that get hot
+ *
+ * HOW IT WORKS:
+ * 1. define() creates a TieredFunction for a message - nothing is compiled
+ * 2. Tier 0: call() runs interpret_greeting() (portable host code, the
+ *    same output as the stub) and counts the call
+ * 3. The call that reaches the threshold promotes the function: its stub
+ *    is compiled (right there, or by a JitService in the background)
+ * 4. Tier 1: the stub's address is stored in the function's EntryPoint (a
+ *    release store, so other threads switch over safely); from then on
+ *    call() only loads the entry point and calls the stub
+ *
+ * WHY WE NEED THIS:
+ * - Most messages are called once or a few times: compiling them costs
+ *   more (code generation, code memory, instruction cache flush) than it
+ *   ever saves
+ * - Hot messages still end up as native code
+ * - If nothing ever gets hot, no code memory is reserved at all
+ *
+ * CALL SITES: entry() gives a function a stable address in a
+ * TrampolineTable (call_site.hpp). It starts at a small thunk that does
+ * what call() does; on promotion the site is retargeted to the stub, so
+ * from then on callers of entry() branch straight into compiled code,
+ * without the load and indirect call of call().
+ *
+ * NUMA: with NumaPlacement::kNodeLocal on a machine with several nodes,
+ * a promoted function gets one copy of its stub per node, compiled into
+ * an arena bound to that node (numa.hpp) the first time a thread on that
+ * node calls it. call() runs the copy of the caller's node, so hot code
+ * is fetched from local memory however the threads are spread out.
+ *
+ * NOTES:
+ * - call() is thread-safe; exactly one caller promotes each function
+ * - Interpreted and compiled calls produce the same output, so a function
+ *   may switch tiers between two calls without anyone noticing
+ * - A function whose compile fails stays in tier 0
+ * - Call sites have one address for every thread, so they go to a single
+ *   copy (the first one compiled); node-local copies are for call()
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "call_site.hpp"
+#include "codegen.hpp"
+#include "jit_memory.hpp"
+#include "numa.hpp"
+
+namespace mijit {
+
+class JitService;
+
+class TieredFunction {
+public:
+  explicit TieredFunction(std::string hello_name)
+      : hello_name_{std::move(hello_name)}
+  {
+  }
+
+  [[nodiscard]] auto message() const noexcept -> std::string_view
+  {
+    return hello_name_;
+  }
+
+  /**
+   * 0 = interpreted, 1 = compiled
+   */
+  [[nodiscard]] auto tier() const noexcept -> int
+  {
+    return native_.load() != nullptr ? 1 : 0;
+  }
+
+  /**
+   * Calls made in tier 0
+   */
+  [[nodiscard]] auto interpreted_calls() const noexcept -> uint64_t
+  {
+    return calls_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * The compiled stub, or nullptr while in tier 0 (load it once and keep
+   * it to call a hot function in a loop)
+   */
+  [[nodiscard]] auto native() const noexcept -> StubFunction
+  {
+    return native_.load();
+  }
+
+private:
+  friend class TieredRuntime;
+
+  enum class State : uint8_t {
+    kInterpreted, // Counting
+    kCompiling,   // Submitted to the JitService, pending_ is set
+    kFailed,      // Compiling threw: stays in tier 0
+    kPromoted,    // native_ is set (by exactly one thread)
+  };
+
+  std::string hello_name_;
+  std::atomic<uint64_t> calls_{0};
+  std::atomic<State> state_{State::kInterpreted};
+  std::shared_future<StubFunction> pending_; // Written before kCompiling
+  EntryPoint<StubFunction> native_;
+  // One per NUMA node (kNodeLocal only, set by define()); a failed copy
+  // holds native_, so it is never compiled again
+  std::unique_ptr<EntryPoint<StubFunction>[]> local_;
+  CallSite site_; // Set by entry(), under the runtime's mutex
+};
+
+class TieredRuntime {
+public:
+  static constexpr uint64_t kDefaultThreshold = 1000;
+
+  /**
+   * threshold: interpreted calls before a function is compiled (0 means
+   *            compile on the first call)
+   * service:   compile promoted functions there, in the background, using
+   *            its CodegenOptions (tier 0 keeps running until the stub is
+   *            ready; the service must outlive the runtime); without it
+   *            they are compiled inline, with options
+   * placement: kNodeLocal keeps a copy of every promoted stub on each NUMA
+   *            node that calls it (capacity is then reserved once per
+   *            node)
+   */
+  explicit TieredRuntime(uint64_t threshold = kDefaultThreshold,
+                         const CodegenOptions& options = {},
+                         JitService* service = nullptr,
+                         size_t capacity = CodeArena::kDefaultCapacity,
+                         NumaPlacement placement = NumaPlacement::kShared);
+
+  TieredRuntime(const TieredRuntime&) = delete;
+  auto operator=(const TieredRuntime&) -> TieredRuntime& = delete;
+
+  /**
+   * A new function for a message (the reference stays valid as long as
+   * the runtime)
+   */
+  [[nodiscard]] auto define(std::string hello_name) -> TieredFunction&;
+
+  /**
+   * Run the function in its current tier
+   */
+  auto call(TieredFunction& function) -> void;
+
+  /**
+   * The function's call site: calling it is the same as call(function),
+   * and the address never changes (created on the first request, with the
+   * trampoline table and code arena if they do not exist yet)
+   *
+   * APPLE SILICON: stubs only return and the host prints, so the site
+   * stays on the thunk (which does both) instead of going to the stub.
+   */
+  [[nodiscard]] auto entry(TieredFunction& function) -> StubFunction;
+
+  /**
+   * Functions promoted to tier 1 so far
+   */
+  [[nodiscard]] auto promotions() const noexcept -> uint64_t
+  {
+    return promotions_.load(std::memory_order_relaxed);
+  }
+  [[nodiscard]] auto threshold() const noexcept -> uint64_t
+  {
+    return threshold_;
+  }
+  /**
+   * Node-local copies compiled so far (kNodeLocal; 0 with one node)
+   */
+  [[nodiscard]] auto replicas() const noexcept -> uint64_t
+  {
+    return replicas_.load(std::memory_order_relaxed);
+  }
+
+private:
+  auto promote(TieredFunction& function) -> void;
+  auto poll(TieredFunction& function) -> void;
+  [[nodiscard]] auto code_arena() -> CodeArena&;
+  [[nodiscard]] auto node_arena(unsigned node) -> CodeArena&;
+  [[nodiscard]] auto local_copy(TieredFunction& function, StubFunction native)
+      -> StubFunction;
+  auto retarget_site(TieredFunction& function, StubFunction native) -> void;
+
+  uint64_t threshold_;
+  CodegenOptions options_;
+  JitService* service_;
+  size_t capacity_;
+  bool node_local_; // kNodeLocal on a machine with more than one node
+  std::mutex mutex_; // Guards functions_, the arenas and sites_ (cold paths)
+  std::deque<TieredFunction> functions_;
+  std::optional<CodeArena> arena_; // Reserved on the first inline promotion
+                                   // or entry()
+  std::optional<TrampolineTable> sites_; // Reserved on the first entry()
+  std::optional<NumaArenas> node_arenas_; // Reserved on the first copy
+  std::atomic<uint64_t> promotions_{0};
+  std::atomic<uint64_t> replicas_{0};
+};
+
+} // namespace mijit
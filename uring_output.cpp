@@ -0,0 +1,332 @@
+/**
+ * @file uring_output.cpp
+ * @brief io_uring submission for uring stubs, with write(2) fallback
+ */
+
+#include "uring_output.hpp"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define MIJIT_HAVE_IO_URING 1
+#endif
+
+namespace mijit {
+
+namespace {
+
+[[nodiscard]] auto at_offset(void* base, uint32_t offset) noexcept -> uint32_t*
+{
+  return reinterpret_cast<uint32_t*>(static_cast<char*>(base) + offset);
+}
+
+[[nodiscard]] auto load_acquire(uint32_t* value) noexcept -> uint32_t
+{
+  return std::atomic_ref<uint32_t>{*value}.load(std::memory_order_acquire);
+}
+
+auto store_release(uint32_t* value, uint32_t new_value) noexcept -> void
+{
+  std::atomic_ref<uint32_t>{*value}.store(new_value, std::memory_order_release);
+}
+
+} // namespace
+
+UringOutput::UringOutput(int fd, unsigned entries) : fd_{fd}
+{
+  if (!setup(entries)) {
+    teardown(); // Fall back to write(2)
+  }
+}
+
+UringOutput::~UringOutput()
+{
+  flush();
+  teardown();
+}
+
+/**
+ * HELPER FUNCTION: Create the ring and map the shared queues
+ *
+ * - Submission queue (SQ): we write requests, the kernel reads them
+ * - Completion queue (CQ): the kernel writes results, we read them
+ */
+auto UringOutput::setup([[maybe_unused]] unsigned entries) noexcept -> bool
+{
+#if defined(MIJIT_HAVE_IO_URING)
+  io_uring_params params{};
+  const auto ring_fd =
+      static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  if (ring_fd < 0) {
+    return false; // No io_uring on this kernel (or not allowed)
+  }
+  ring_fd_ = ring_fd;
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const auto single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ =
+        sq_ring_size_ > cq_ring_size_ ? sq_ring_size_ : cq_ring_size_;
+  }
+
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    return false;
+  }
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  }
+  else {
+    cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = nullptr;
+      return false;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes_ == MAP_FAILED) {
+    sqes_ = nullptr;
+    return false;
+  }
+
+  sq_head_ = at_offset(sq_ring_, params.sq_off.head);
+  sq_tail_ = at_offset(sq_ring_, params.sq_off.tail);
+  sq_array_ = at_offset(sq_ring_, params.sq_off.array);
+  sq_mask_ = *at_offset(sq_ring_, params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  cq_head_ = at_offset(cq_ring_, params.cq_off.head);
+  cq_tail_ = at_offset(cq_ring_, params.cq_off.tail);
+  cq_mask_ = *at_offset(cq_ring_, params.cq_off.ring_mask);
+  cqes_ = static_cast<char*>(cq_ring_) + params.cq_off.cqes;
+
+  pending_.resize(sq_entries_); // The only allocation, done once
+  return true;
+#else
+  return false;
+#endif
+}
+
+auto UringOutput::teardown() noexcept -> void
+{
+#if defined(MIJIT_HAVE_IO_URING)
+  if (sqes_ != nullptr) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_ != nullptr) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+#endif
+  sqes_ = cq_ring_ = sq_ring_ = nullptr;
+  if (ring_fd_ != -1) {
+    close(ring_fd_);
+    ring_fd_ = -1;
+  }
+}
+
+/**
+ * HELPER FUNCTION: the plain write(2) path used as fallback
+ */
+auto UringOutput::write_direct(const char* text, size_t size) noexcept -> void
+{
+  ++fallback_writes_;
+  while (size > 0) {
+    const auto written = ::write(fd_, text, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      // An error, or a descriptor that takes nothing (0 would repeat
+      // forever): dropped, the same as the unbuffered stub does
+      return;
+    }
+    text += written;
+    size -= static_cast<size_t>(written);
+  }
+}
+
+auto UringOutput::write(const char* text, size_t size) noexcept -> void
+{
+#if defined(MIJIT_HAVE_IO_URING)
+  if (active() && size <= UINT32_MAX) {
+    if (queued_ + in_flight_ == sq_entries_) {
+      reap(); // Make room from finished writes first
+      if (queued_ + in_flight_ == sq_entries_) {
+        submit_and_wait(1); // Ring is full: submit and wait for one
+      }
+    }
+    if (active()) {
+      const auto tail = *sq_tail_; // Only we write the tail
+      const auto index = tail & sq_mask_;
+      auto* sqes = static_cast<io_uring_sqe*>(sqes_);
+      auto& sqe = sqes[index];
+      std::memset(&sqe, 0, sizeof(sqe));
+      sqe.opcode = IORING_OP_WRITE;
+      sqe.fd = fd_;
+      sqe.addr = reinterpret_cast<uintptr_t>(text);
+      sqe.len = static_cast<uint32_t>(size);
+      sqe.off = static_cast<uint64_t>(-1); // Current file position
+      sqe.user_data = next_id_;
+      if (queued_ == 0 && in_flight_ > 0) {
+        sqe.flags |= IOSQE_IO_DRAIN; // Start after the previous submission
+      }
+      if (queued_ > 0) {
+        sqes[(tail - 1) & sq_mask_].flags |= IOSQE_IO_LINK; // Keep order
+      }
+      pending_[next_id_ % sq_entries_] = Pending{text, size};
+      ++next_id_;
+      sq_array_[index] = index;
+      store_release(sq_tail_, tail + 1);
+      ++queued_;
+      return;
+    }
+  }
+#endif
+  flush(); // Keep the order of anything already queued
+  write_direct(text, size);
+}
+
+/**
+ * HELPER FUNCTION: io_uring_enter - submit and/or wait for completions
+ */
+auto UringOutput::enter([[maybe_unused]] unsigned to_submit,
+                        [[maybe_unused]] unsigned min_complete) noexcept
+    -> long
+{
+#if defined(MIJIT_HAVE_IO_URING)
+  const auto flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0U;
+  while (true) {
+    ++enter_calls_;
+    const auto result = syscall(__NR_io_uring_enter, ring_fd_, to_submit,
+                                min_complete, flags, nullptr, 0);
+    if (result >= 0 || errno != EINTR) {
+      return result;
+    }
+  }
+#else
+  return -1;
+#endif
+}
+
+/**
+ * HELPER FUNCTION: io_uring_enter failed - finish every write that has not
+ * completed directly and use the write(2) fallback from now on
+ *
+ * STEP BY STEP:
+ * 1. Reap the completions the kernel already posted
+ * 2. Writes still in flight: wait for them once more (a full completion
+ *    queue, for example, fails a submit but not a wait)
+ * 3. Every write without a completion, in flight or only queued, is
+ *    written directly, oldest first, so nothing submitted is lost
+ *
+ * NOTE: a write the kernel finishes after all (a wait that failed while it
+ * was still running) then comes out twice; repeated output is the price
+ * of never losing any.
+ */
+auto UringOutput::fail_over() noexcept -> void
+{
+  reap();
+  if (in_flight_ > 0 && enter(0, in_flight_) >= 0) {
+    reap();
+  }
+  const auto window = next_id_ < sq_entries_ ? next_id_ : sq_entries_;
+  for (auto id = next_id_ - window; id != next_id_; ++id) {
+    const auto& pending = pending_[id % sq_entries_];
+    if (!pending.done) {
+      write_direct(pending.text, pending.size);
+    }
+  }
+  queued_ = 0;
+  in_flight_ = 0;
+  teardown();
+}
+
+auto UringOutput::submit_and_wait(unsigned min_complete) noexcept -> void
+{
+  const auto submitted = queued_;
+  if (enter(submitted, min_complete) < 0) {
+    fail_over();
+    return;
+  }
+  in_flight_ += submitted;
+  queued_ = 0;
+  reap();
+}
+
+/**
+ * HELPER FUNCTION: Read completions and finish failed or short writes
+ *
+ * - If the kernel does not know IORING_OP_WRITE, every result is -EINVAL:
+ *   write the text directly and switch to the write(2) fallback for good
+ */
+auto UringOutput::reap() noexcept -> void
+{
+#if defined(MIJIT_HAVE_IO_URING)
+  auto head = *cq_head_;
+  const auto tail = load_acquire(cq_tail_);
+  auto unsupported = false;
+  const auto* cqes = static_cast<const io_uring_cqe*>(cqes_);
+  while (head != tail) {
+    const auto& cqe = cqes[head & cq_mask_];
+    auto& pending = pending_[cqe.user_data % sq_entries_];
+    if (cqe.res < 0) {
+      unsupported = unsupported || cqe.res == -EINVAL;
+      write_direct(pending.text, pending.size); // Failed or cancelled
+    }
+    else if (static_cast<size_t>(cqe.res) < pending.size) {
+      const auto done = static_cast<size_t>(cqe.res);
+      write_direct(pending.text + done, pending.size - done); // Short write
+    }
+    pending.done = true;
+    --in_flight_;
+    ++head;
+  }
+  store_release(cq_head_, head);
+  if (unsupported && queued_ == 0 && in_flight_ == 0) {
+    teardown();
+  }
+#endif
+}
+
+auto UringOutput::submit() noexcept -> void
+{
+  if (active() && queued_ > 0) {
+    submit_and_wait(0);
+  }
+}
+
+auto UringOutput::flush() noexcept -> void
+{
+  submit();
+  while (active() && in_flight_ > 0) {
+    if (enter(0, in_flight_) < 0) {
+      fail_over();
+      return;
+    }
+    reap();
+  }
+}
+
+} // namespace mijit
+
+extern "C" auto mijit_uring_write(mijit::UringOutput* output,
+                                  const char* text, size_t size) noexcept
+    -> void
+{
+  output->write(text, size);
+}
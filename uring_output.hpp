@@ -0,0 +1,125 @@
+/**
+ * @file uring_output.hpp
+ * @brief io_uring output backend for generated stubs
+ *
+ * HOW IT WORKS:
+ * - A uring stub tail-calls mijit_uring_write() with (output, text, length)
+ * - The write is only queued in the io_uring submission ring (no system
+ *   call, no copy - the text lives next to the stub in the code arena)
+ * - submit() hands everything queued to the kernel with ONE io_uring_enter;
+ *   the kernel does the writes while we keep generating code
+ * - flush() submits and waits until every queued write has completed
+ *
+ * ORDERING:
+ * - Writes of one submission are linked (IOSQE_IO_LINK), and a new
+ *   submission drains the previous one (IOSQE_IO_DRAIN), so output comes out
+ *   in the order the stubs were called
+ *
+ * FALLBACK:
+ * - Without io_uring (old kernel, non-Linux, blocked by seccomp) or without
+ *   IORING_OP_WRITE, the same calls fall back to plain write(2)
+ *
+ * NOTE: a UringOutput is not thread-safe; use one per thread.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mijit {
+
+class UringOutput {
+public:
+  static constexpr unsigned kDefaultEntries = 256;
+
+  explicit UringOutput(int fd = 1, unsigned entries = kDefaultEntries);
+  ~UringOutput();
+
+  UringOutput(const UringOutput&) = delete;
+  auto operator=(const UringOutput&) -> UringOutput& = delete;
+
+  /**
+   * Queue a write of text (text must stay valid until it completes, which
+   * stub text in the code arena always does)
+   */
+  auto write(const char* text, size_t size) noexcept -> void;
+
+  /**
+   * Give every queued write to the kernel (one system call, no waiting)
+   */
+  auto submit() noexcept -> void;
+
+  /**
+   * Submit and wait until every write has completed
+   */
+  auto flush() noexcept -> void;
+
+  /**
+   * False when io_uring could not be used and writes go through write(2)
+   */
+  [[nodiscard]] auto active() const noexcept -> bool
+  {
+    return ring_fd_ != -1;
+  }
+  [[nodiscard]] auto enter_calls() const noexcept -> uint64_t
+  {
+    return enter_calls_;
+  }
+  [[nodiscard]] auto fallback_writes() const noexcept -> uint64_t
+  {
+    return fallback_writes_;
+  }
+
+private:
+  struct Pending {
+    const char* text = nullptr;
+    size_t size = 0;
+    bool done = false; // Its completion has been reaped
+  };
+
+  auto setup(unsigned entries) noexcept -> bool;
+  auto teardown() noexcept -> void;
+  auto enter(unsigned to_submit, unsigned min_complete) noexcept -> long;
+  auto submit_and_wait(unsigned min_complete) noexcept -> void;
+  auto reap() noexcept -> void;
+  auto fail_over() noexcept -> void;
+  auto write_direct(const char* text, size_t size) noexcept -> void;
+
+  int fd_;
+  int ring_fd_ = -1;
+
+  // Shared with the kernel (see io_uring_setup(2))
+  void* sq_ring_ = nullptr;
+  void* cq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  void* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  uint32_t* sq_head_ = nullptr;
+  uint32_t* sq_tail_ = nullptr;
+  uint32_t* sq_array_ = nullptr;
+  uint32_t sq_mask_ = 0;
+  uint32_t sq_entries_ = 0;
+  uint32_t* cq_head_ = nullptr;
+  uint32_t* cq_tail_ = nullptr;
+  void* cqes_ = nullptr;
+  uint32_t cq_mask_ = 0;
+
+  std::vector<Pending> pending_; // Indexed by user_data % sq_entries_
+  uint64_t next_id_ = 0;
+  unsigned queued_ = 0;    // In the ring but not submitted yet
+  unsigned in_flight_ = 0; // Submitted but not completed yet
+  uint64_t enter_calls_ = 0;
+  uint64_t fallback_writes_ = 0;
+};
+
+} // namespace mijit
+
+/**
+ * Entry point called by uring stubs (plain C calling convention)
+ */
+extern "C" auto mijit_uring_write(mijit::UringOutput* output,
+                                  const char* text, size_t size) noexcept
+    -> void;
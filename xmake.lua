@@ -23,19 +23,45 @@ elseif is_plat("macosx") then
     end
 end
 
+set_warnings("all", "extra")
+add_cxxflags("-pedantic")
+
+-- Ensure modern C++ features are available (with fallback)
+if is_plat("linux", "macosx") then
+    -- Try C++23 first, fallback to C++20
+    add_cxxflags("-std=c++23", "-std=c++20", {force = false})
+end
+
+-- Link required libraries
+if is_plat("linux") then
+    add_syslinks("pthread") -- For threading support
+end
+
+-- The JIT itself: code arenas, emitters, codegen, cache, output backends
+target("mijit_core")
+    set_kind("static")
+    add_files("call_site.cpp", "code_cache_file.cpp", "code_heap.cpp",
+              "codegen.cpp", "compiler.cpp", "cpu_features.cpp", "epoch.cpp",
+              "ir.cpp", "ir_codegen.cpp", "jit_memory.cpp", "jit_service.cpp",
+              "jit_stats.cpp", "jit_symbols.cpp", "numa.cpp",
+              "output_buffer.cpp", "prefork.cpp", "slab_pool.cpp",
+              "stream.cpp", "stub_cache.cpp", "stub_profile.cpp",
+              "tiered.cpp", "uring_output.cpp")
+    add_includedirs(".", {public = true})
+
 target("MiJIT")
     set_kind("binary")
     add_files("main.cpp")
-    set_warnings("all", "extra")
-    add_cxxflags("-pedantic")
-    
-    -- Ensure modern C++ features are available (with fallback)
-    if is_plat("linux", "macosx") then
-        -- Try C++23 first, fallback to C++20, then C++17
-        add_cxxflags("-std=c++23", "-std=c++20", "-std=c++17", {force = false})
-    end
-    
-    -- Link required libraries
-    if is_plat("linux") then
-        add_syslinks("pthread") -- For threading support
-    end
+    add_deps("mijit_core")
+
+-- Benchmark of every JIT phase: xmake run mijit_bench [--json]
+target("mijit_bench")
+    set_kind("binary")
+    add_files("bench/bench.cpp")
+    add_deps("mijit_core")
+
+-- Checks of the JIT: xmake run mijit_tests [name-filter]
+target("mijit_tests")
+    set_kind("binary")
+    add_files("tests/tests.cpp")
+    add_deps("mijit_core")